@@ -25,6 +25,8 @@
   Global/shared:
     Font_FindFont
     Font_LoseFont (does nothing, for now)
+    Font_CacheAddr, Font_SetFontMax, Font_ReadFontMax (the glyph cache)
+    Font_CacheStats (new, glyph cache hits and misses)
 
   Task(Slot) specific:
     Font_Paint
@@ -65,6 +67,10 @@
 
   Recurse to paint the base and the accent, if present.
 
+  The fill path is rasterised into an alpha bitmap, which is kept in the
+  glyph cache (glyph_cache.h), so painting the same character again at the
+  same size and sub-pixel position only copies it to the screen.
+
   The passed in path arrays will contain the number of free words in the
   first word.
 
@@ -83,6 +89,8 @@ const unsigned module_flags = 3;
 
 #define MODULE_CHUNK "0x40080"
 #include "module.h"
+#include "glyph_cache.h"
+#include "glyph_raster.h"
 
 NO_start;
 //NO_init;
@@ -98,13 +106,13 @@ NO_messages_file;
 
 const char title[] = "FontManager";
 
-static void WriteSmallNum( uint32_t number, int min = 1 )
+static void WriteSmallNum( uint32_t number, int min )
 {
   char buf[8];
   char *p = &buf[7];
   int chars = 0;
   while (number != 0 || chars < min) {
-    char c = '0' + (number & 0xf)
+    char c = '0' + (number & 0xf);
     if (c > '9') c += ('a' - '0' - 10);
     number = number >> 4;
     *p-- = c;
@@ -131,22 +139,44 @@ struct FontHandle {
   uint16_t ysize;
 };
 
+// The default size of the glyph cache, Font_SetFontMax changes it
+#define GLYPH_CACHE_DEFAULT_LIMIT (256 * 1024)
+
 struct workspace {
   uint32_t lock;
 
   Font *fonts;
   FontHandle found[256];
+
+  // Shared by all tasks and cores, only used with the lock held
+  glyph_cache cache;
+  glyph_edge edges[1024];
+  uint16_t cells[GLYPH_MAX_PIXELS + 1];
 };
 
-static void *rma_claim( uint32_t bytes )
+// Tasks on other cores may be painting at the same time; the one holding
+// the lock may be on this core, so yield rather than spin.
+static void claim_workspace( struct workspace *workspace )
 {
-  // XOS_Module 6 Claim
-  register void *memory asm( "r2" );
-  register uint32_t code asm( "r0" ) = 6;
-  register uint32_t size asm( "r3" ) = bytes;
-  asm ( "svc 0x2001e" : "=r" (memory) : "r" (size), "r" (code) : "lr" );
+  uint32_t failed;
+  do {
+    uint32_t old;
+    asm volatile ( "ldrex %[old], [%[lock]]"
+               "\n  mov %[failed], #1"
+               "\n  teq %[old], #0"
+               "\n  strexeq %[failed], %[one], [%[lock]]"
+               : [old] "=&r" (old), [failed] "=&r" (failed)
+               : [lock] "r" (&workspace->lock), [one] "r" (1)
+               : "cc", "memory" );
+    if (failed) Yield();
+  } while (failed);
+  asm volatile ( "dmb sy" : : : "memory" );
+}
 
-  return memory;
+static void release_workspace( struct workspace *workspace )
+{
+  asm volatile ( "dmb sy" : : : "memory" );
+  workspace->lock = 0;
 }
 
 static int32_t int16_at( uint8_t const *p )
@@ -194,6 +224,8 @@ void init( uint32_t this_core, uint32_t number_of_cores )
     //the_font->Outlines0 = (void*) 0xfc169544;
 
     workspace->fonts = the_font;
+
+    glyph_cache_initialise( &workspace->cache, GLYPH_CACHE_DEFAULT_LIMIT );
   }
 
   if (first_entry) { Write0( "FontManager initially initialised" ); NewLine; }
@@ -941,16 +973,200 @@ static bool ReadInfo( struct workspace *workspace, SWI_regs *regs )
   return true;
 }
 
+// The advance is the width of the character's bounding box, in Draw units
+// FIXME: use the x offsets from the metrics, non-horizontal painting
+static int32_t CharAdvance( uint32_t fp_zoom, Font_BBox const *bbox )
+{
+  return 256 * (fp_zoom * bbox->width) / 0x10000;
+}
+
+// The fallback, for characters that aren't cached; painted with the
+// current graphics colour, the way all characters used to be.
+static int32_t PaintWithDraw( Font const *font, uint32_t ch, uint32_t fp_zoom, int32_t pen_x, int32_t pen_y )
+{
+  uint32_t fill_path[128];
+  uint32_t stroke_path[64];
+  fill_path[0] = sizeof( fill_path )/sizeof( fill_path[0] ) - 1;
+  stroke_path[0] = sizeof( stroke_path )/sizeof( stroke_path[0] ) - 1;
+  Font_BBox bbox = { 0 };
+
+  MakeCharPaths( font, ch, fill_path, stroke_path, &bbox );
+
+#ifdef DEBUG__SHOW_FONT_PATHS
+Write0( "Fill path" ); NewLine; DebugPrintPath( fill_path );
+Write0( "Stroke path" ); NewLine; DebugPrintPath( stroke_path );
+#endif
+
+  int32_t matrix[6] = { fp_zoom, 0, 0, fp_zoom, pen_x / 2, pen_y / 2 }; // Internal draw units FIXME
+
+  Font_Draw_Fill( fill_path, matrix );
+  if (stroke_path[0] != 0) Font_Draw_Stroke( stroke_path, matrix );
+
+  return CharAdvance( fp_zoom, &bbox );
+}
+
+// Rasterise a character into a new glyph, and add it to the cache.
+// Returns null if it can't be cached: it has hairline strokes (which are
+// left to the Draw module), it's too big or complicated, or there's no
+// memory.
+static glyph *NewGlyph( struct workspace *workspace, glyph_key const *key, uint32_t fp_zoom )
+{
+  uint32_t fill_path[128];
+  uint32_t stroke_path[64];
+  fill_path[0] = sizeof( fill_path )/sizeof( fill_path[0] ) - 1;
+  stroke_path[0] = sizeof( stroke_path )/sizeof( stroke_path[0] ) - 1;
+  Font_BBox bbox = { 0 };
+
+  MakeCharPaths( key->font, key->ch, fill_path, stroke_path, &bbox );
+
+  if (stroke_path[0] != 0) return 0;
+
+  int32_t matrix[6] = { key->transform[0], key->transform[1],
+                        key->transform[2], key->transform[3],
+                        key->sub_x << 4, key->sub_y << 4 };
+
+  glyph_outline outline = { .edges = workspace->edges, .max = number_of( workspace->edges ) };
+  glyph_box box;
+
+  if (!glyph_outline_from_path( &outline, fill_path, matrix )
+   || outline.overflowed
+   || !glyph_outline_box( &outline, &box )) return 0;
+
+  uint32_t bytes = glyph_bytes( box.width, box.height );
+
+  while (glyph_cache_full( &workspace->cache, bytes )) {
+    rma_free( glyph_cache_evict( &workspace->cache ) );
+  }
+
+  glyph *g = rma_claim( bytes );
+  if (g == 0) return 0;
+
+  g->key = *key;
+  g->bytes = bytes;
+  g->advance = CharAdvance( fp_zoom, &bbox );
+  g->left = box.left;
+  g->top = box.bottom + box.height;
+  g->width = box.width;
+  g->height = box.height;
+
+  glyph_rasterise( &outline, &box, workspace->cells, g->alpha, key->log2bpp >= 4 );
+
+  glyph_cache_insert( &workspace->cache, g );
+
+  return g;
+}
+
+// The VDU variables needed to paint directly to the screen, in the order
+// they're read.
+typedef struct {
+  uint32_t xeig;
+  uint32_t yeig;
+  uint32_t line_length;
+  uint32_t log2bpp;
+  uint32_t ywindlimit;
+  int32_t gwlcol;               // Graphics window, internal coordinates
+  int32_t gwbrow;
+  int32_t gwrcol;
+  int32_t gwtrow;
+  int32_t orgx;
+  int32_t orgy;
+  uint8_t *start;
+  uint32_t colour;              // Graphics foreground, as stored in the screen
+} Screen;
+
+static void ReadScreen( Screen *screen )
+{
+  static uint32_t const variables[] = { 4, 5, 6, 9, 12, 128, 129, 130, 131, 136, 137, 148, 153, -1 };
+  register uint32_t const *in asm( "r0" ) = variables;
+  register Screen *out asm( "r1" ) = screen;
+  asm volatile ( "svc %[swi]"
+      :
+      : [swi] "i" (Xbit | OS_ReadVduVariables)
+      , "r" (in)
+      , "r" (out)
+      : "lr", "cc", "memory" );
+}
+
+// Blend the colour into the pixel, alpha 0 to 255
+static inline uint32_t Blend32( uint32_t pixel, uint32_t colour, uint32_t alpha )
+{
+  uint32_t a = alpha + (alpha >> 7);  // 0 to 256
+  uint32_t rb = ((colour & 0xff00ff) * a + (pixel & 0xff00ff) * (256 - a)) >> 8;
+  uint32_t g = ((colour & 0x00ff00) * a + (pixel & 0x00ff00) * (256 - a)) >> 8;
+  return (pixel & 0xff000000) | (rb & 0xff00ff) | (g & 0x00ff00);
+}
+
+// 1:5:5:5
+static inline uint16_t Blend16( uint16_t pixel, uint32_t colour, uint32_t alpha )
+{
+  uint32_t a = (alpha + (alpha >> 7)) >> 3;  // 0 to 32
+  uint32_t rb = ((colour & 0x7c1f) * a + (pixel & 0x7c1f) * (32 - a)) >> 5;
+  uint32_t g = ((colour & 0x03e0) * a + (pixel & 0x03e0) * (32 - a)) >> 5;
+  return (pixel & 0x8000) | (rb & 0x7c1f) | (g & 0x03e0);
+}
+
+// x and y are the pen position, in pixels (internal coordinates)
+static void PaintGlyph( Screen const *screen, glyph const *g, int32_t x, int32_t y )
+{
+  int32_t left = x + g->left;
+  int32_t first = 0;
+  int32_t last = g->width;    // Exclusive
+
+  if (left + first < screen->gwlcol) first = screen->gwlcol - left;
+  if (left + last > screen->gwrcol + 1) last = screen->gwrcol + 1 - left;
+  if (first >= last) return;
+
+  for (uint32_t row = 0; row < g->height; row++) {
+    int32_t py = y + g->top - 1 - row;
+    if (py < screen->gwbrow || py > screen->gwtrow) continue;
+
+    uint8_t *line = screen->start + (screen->ywindlimit - py) * screen->line_length;
+    uint8_t const *alpha = g->alpha + row * g->width;
+
+    switch (screen->log2bpp) {
+    case 5:
+      {
+        uint32_t *p = ((uint32_t*) line) + left;
+        for (int32_t c = first; c < last; c++) {
+          if (alpha[c] != 0) p[c] = Blend32( p[c], screen->colour, alpha[c] );
+        }
+      }
+      break;
+    case 4:
+      {
+        uint16_t *p = ((uint16_t*) line) + left;
+        for (int32_t c = first; c < last; c++) {
+          if (alpha[c] != 0) p[c] = Blend16( p[c], screen->colour, alpha[c] );
+        }
+      }
+      break;
+    default:
+      {
+        // Not anti-aliased, every alpha is 0 or 255
+        uint32_t log2bpp = screen->log2bpp;
+        uint32_t mask = (1 << (1 << log2bpp)) - 1;
+        uint32_t *words = (uint32_t*) line;
+        for (int32_t c = first; c < last; c++) {
+          if (alpha[c] != 0) {
+            uint32_t bit = (left + c) << log2bpp;
+            uint32_t shift = bit & 31;
+            uint32_t *w = &words[bit >> 5];
+            *w = (*w & ~(mask << shift)) | ((screen->colour & mask) << shift);
+          }
+        }
+      }
+      break;
+    }
+  }
+}
+
 static bool Paint( struct workspace *workspace, SWI_regs *regs )
 {
   // One true font
   Font *font = workspace->fonts;
 
-  Write0( "Paint \"" ); Write0( regs->r[1] ); Write0( "\"" ); NewLine;
-
   char *p = (void*) regs->r[1];
   char ch;
-  //int32_t matrix[6] = { 0x2000, 0, 0, 0x2000, 0x1000, 0x4000 };
 
   // TODO: Put into a FoundFont structure
   uint32_t point_size = 12 * 16; // 1/16ths of a point
@@ -965,41 +1181,58 @@ static bool Paint( struct workspace *workspace, SWI_regs *regs )
 Write0( "FP Zoom: " ); WriteNum( fp_zoom ); NewLine;
 #endif
 
-  int32_t x = regs->r[3];
-  int32_t y = regs->r[4];
+  // The pen position, in Draw units (1/256 OS unit)
+  int32_t pen_x = regs->r[3];
+  int32_t pen_y = regs->r[4];
 
   if (0 == (regs->r[2] & (1 << 4))) {
     // Coordinates are in millipoints, not OS units
-    x = (x / 400);
-    y = (y / 400);
+    pen_x = pen_x * 16 / 25;
+    pen_y = pen_y * 16 / 25;
+  }
+  else {
+    pen_x = pen_x << 8;
+    pen_y = pen_y << 8;
   }
 
-  int32_t matrix[6] = { fp_zoom, 0, 0, fp_zoom, x * 256 / 2, y * 256 / 2 }; // Internal draw units FIXME
-  while ((ch = *p++) >= ' ') {
-    uint32_t fill_path[128];
-    uint32_t stroke_path[64];
-    fill_path[0] = sizeof( fill_path )/sizeof( fill_path[0] ) - 1;
-    stroke_path[0] = sizeof( stroke_path )/sizeof( stroke_path[0] ) - 1;
-    Font_BBox bbox;
+  Screen screen;
+  ReadScreen( &screen );
 
-    MakeCharPaths( font, ch, fill_path, stroke_path, &bbox );
+  // Design units << 8 (as in the paths) to pixels << 6
+  int32_t x_scale = fp_zoom >> (2 + screen.xeig);
+  int32_t y_scale = fp_zoom >> (2 + screen.yeig);
 
-#ifdef DEBUG__SHOW_FONT_PATHS
-Write0( "Fill path" ); NewLine; DebugPrintPath( fill_path );
-Write0( "Stroke path" ); NewLine; DebugPrintPath( stroke_path );
-#endif
-//Font_Draw_TransformPath( fill_path, matrix );
-//Font_Draw_TransformPath( stroke_path, matrix );
-
-    Font_Draw_Fill( fill_path, matrix );
-    Font_Draw_Stroke( stroke_path, matrix );
-    matrix[4] += 25600;
-    Font_Draw_Stroke( stroke_path, matrix );
-    matrix[4] -= 25600;
+  claim_workspace( workspace );
 
-    matrix[4] += 256 * (matrix[0] * bbox.width) / 0x10000; // x multiplier
-    // FIXME: non-horizontal drawing
+  while ((ch = *p++) >= ' ') {
+    // Pen position in quarter pixels, internal coordinates
+    int32_t qx = ((pen_x >> 6) + (screen.orgx << 2)) >> screen.xeig;
+    int32_t qy = ((pen_y >> 6) + (screen.orgy << 2)) >> screen.yeig;
+
+    glyph_key key = { .font = font,
+                      .size = point_size << 16 | point_size,
+                      .transform = { x_scale, 0, 0, y_scale },
+                      .ch = ch,
+                      .sub_x = qx & 3,
+                      .sub_y = qy & 3,
+                      .log2bpp = screen.log2bpp,
+                      .eig = screen.xeig | screen.yeig << 4 };
+
+    glyph *g = glyph_cache_find( &workspace->cache, &key );
+
+    if (g == 0) g = NewGlyph( workspace, &key, fp_zoom );
+
+    if (g != 0) {
+      PaintGlyph( &screen, g, qx >> 2, qy >> 2 );
+      pen_x += g->advance;
+    }
+    else {
+      pen_x += PaintWithDraw( font, ch, fp_zoom, pen_x, pen_y );
+    }
   }
+
+  release_workspace( workspace );
+
   return true;
 }
 
@@ -1059,11 +1292,73 @@ static bool FontScanString( struct workspace *workspace, SWI_regs *regs )
   return true;
 }
 
+static bool CacheAddr( struct workspace *workspace, SWI_regs *regs )
+{
+  regs->r[0] = 0; // Version number: not claiming the features of any particular version
+  regs->r[2] = workspace->cache.used;
+  regs->r[3] = workspace->cache.limit;
+  return true;
+}
+
+static bool SetFontMax( struct workspace *workspace, SWI_regs *regs )
+{
+  claim_workspace( workspace );
+
+  workspace->cache.limit = regs->r[0];
+  while (glyph_cache_full( &workspace->cache, 0 )) {
+    rma_free( glyph_cache_evict( &workspace->cache ) );
+  }
+
+  release_workspace( workspace );
+  return true;
+}
+
+static bool ReadFontMax( struct workspace *workspace, SWI_regs *regs )
+{
+  regs->r[0] = workspace->cache.limit;
+  regs->r[1] = 0;
+  regs->r[2] = 0;
+  regs->r[3] = 0;
+  regs->r[4] = 0;
+  regs->r[5] = 0;
+  return true;
+}
+
+// Font_CacheStats (not in the original FontManager)
+// On entry: r0 bit 0 set to reset the counters (after reading them)
+// On exit: r0 hits, r1 misses, r2 evictions, r3 glyphs in the cache,
+// r4 bytes used, r5 the limit
+static bool CacheStats( struct workspace *workspace, SWI_regs *regs )
+{
+  uint32_t flags = regs->r[0];
+
+  claim_workspace( workspace );
+
+  glyph_cache *cache = &workspace->cache;
+
+  regs->r[0] = cache->hits;
+  regs->r[1] = cache->misses;
+  regs->r[2] = cache->evictions;
+  regs->r[3] = cache->glyphs;
+  regs->r[4] = cache->used;
+  regs->r[5] = cache->limit;
+
+  if (0 != (flags & 1)) {
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+  }
+
+  release_workspace( workspace );
+  return true;
+}
+
 bool __attribute__(( noinline )) c_swi_handler( struct workspace *workspace, SWI_regs *regs )
 {
   NewLine; Write0( "Handling Font SWI " ); WriteNum( MODULE_CHUNK + regs->number ); NewLine;
 
   switch (regs->number) {
+  case 0x00: return CacheAddr( workspace, regs );
   case 0x01: return FindFont( workspace, regs );
   case 0x02: return LoseFont( workspace, regs );
   case 0x04: return ReadInfo( workspace, regs );
@@ -1074,9 +1369,12 @@ bool __attribute__(( noinline )) c_swi_handler( struct workspace *workspace, SWI
   case 0x0f: regs->r[1] = 400; regs->r[2] = 400; return true;
   case 0x12: return SetFontColours( workspace, regs );
   case 0x13: return SetPalette( workspace, regs );
+  case 0x1b: return SetFontMax( workspace, regs );
+  case 0x1c: return ReadFontMax( workspace, regs );
   case 0x1e: return SwitchOutputToBuffer( workspace, regs );
   case 0x21: return FontScanString( workspace, regs );
   case 0x22: return SetColourTable( workspace, regs );
+  case 0x29: return CacheStats( workspace, regs );
   default: WriteNum( regs->number );
   }
   static const error_block error = { 0x1e6, "FontManager SWI unsupported by C implementation (sorry)" };
@@ -1126,11 +1424,13 @@ char const swi_names[] = { "Font"
           "\0FindField"
           "\0ApplyFields"
           "\0LookupFont"
+          "\0CacheStats"
           "\0" };
 
 
 // The following is documentation of the assembler, it's not likely to be
-// correct!
+// correct! (Or to compile.)
+#if 0
 
 typedef struct {
   int32_t XX;
@@ -1545,3 +1845,4 @@ FindFont_res FindFont( worspace *ws,
 
   return Int_FindFont;
 }
+#endif
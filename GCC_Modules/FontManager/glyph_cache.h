@@ -0,0 +1,192 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A bounded cache of rasterised glyphs.
+//
+// Painting a character from its outline means building the paths,
+// flattening the curves and filling them; painting it from a bitmap is
+// just a copy. Text is repetitive, so the bitmaps are kept, up to a limit
+// on the memory they use, the least recently painted being discarded
+// first.
+//
+// A glyph's bitmap depends on everything that affects its pixels: the
+// font, the size, the transformation (including the pixel shape of the
+// mode), the position of the pen within the pixel (in quarter pixels),
+// and the depth of the screen (anti-aliased or not).
+//
+// The cache doesn't allocate or free memory; the caller allocates each
+// glyph (header and bitmap together), and frees those returned by
+// glyph_cache_evict.
+//
+// Not thread-safe, the caller must serialise access.
+
+typedef struct {
+  void const *font;
+  uint32_t size;                // x << 16 | y, sixteenths of a point
+  int32_t transform[4];         // 16.16, design units to pixels
+  uint32_t ch;
+  uint8_t sub_x;                // Quarter pixels
+  uint8_t sub_y;
+  uint8_t log2bpp;
+  uint8_t eig;                  // XEig | YEig << 4
+} glyph_key;
+
+typedef struct glyph glyph;
+
+struct glyph {
+  glyph *hash_next;
+  glyph *newer;
+  glyph *older;
+  glyph_key key;
+  uint32_t bytes;               // The whole allocation, for the budget
+  int32_t advance;              // In the caller's units
+  int16_t left;                 // Pixels from the pen to the bitmap's
+  int16_t top;                  // left column and above its top row
+  uint16_t width;
+  uint16_t height;
+  uint8_t alpha[];              // width * height, top row first
+};
+
+#define GLYPH_CACHE_BUCKETS 256
+
+typedef struct {
+  glyph *bucket[GLYPH_CACHE_BUCKETS];
+  glyph *newest;
+  glyph *oldest;
+  uint32_t used;                // Bytes
+  uint32_t limit;
+  uint32_t glyphs;
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+} glyph_cache;
+
+static inline uint32_t glyph_bytes( uint32_t width, uint32_t height )
+{
+  return (sizeof( glyph ) + width * height + 3) & ~3;
+}
+
+static inline uint32_t glyph_key_hash( glyph_key const *key )
+{
+  uint32_t h = (uint32_t) (size_t) key->font;
+  h = (h ^ key->size) * 0x01000193;
+  h = (h ^ key->transform[0]) * 0x01000193;
+  h = (h ^ key->transform[1]) * 0x01000193;
+  h = (h ^ key->transform[2]) * 0x01000193;
+  h = (h ^ key->transform[3]) * 0x01000193;
+  h = (h ^ key->ch) * 0x01000193;
+  h = (h ^ (key->sub_x | key->sub_y << 8 | key->log2bpp << 16 | key->eig << 24)) * 0x01000193;
+  return (h ^ (h >> 16)) % GLYPH_CACHE_BUCKETS;
+}
+
+static inline bool glyph_key_equal( glyph_key const *a, glyph_key const *b )
+{
+  return a->ch == b->ch
+      && a->font == b->font
+      && a->size == b->size
+      && a->sub_x == b->sub_x
+      && a->sub_y == b->sub_y
+      && a->log2bpp == b->log2bpp
+      && a->eig == b->eig
+      && a->transform[0] == b->transform[0]
+      && a->transform[1] == b->transform[1]
+      && a->transform[2] == b->transform[2]
+      && a->transform[3] == b->transform[3];
+}
+
+static inline void glyph_cache_initialise( glyph_cache *cache, uint32_t limit )
+{
+  memset( cache, 0, sizeof( *cache ) );
+  cache->limit = limit;
+}
+
+static inline void glyph_cache_unlink( glyph_cache *cache, glyph *g )
+{
+  if (g->newer == 0) cache->newest = g->older; else g->newer->older = g->older;
+  if (g->older == 0) cache->oldest = g->newer; else g->older->newer = g->newer;
+}
+
+static inline void glyph_cache_make_newest( glyph_cache *cache, glyph *g )
+{
+  g->newer = 0;
+  g->older = cache->newest;
+  if (cache->newest == 0) cache->oldest = g; else cache->newest->newer = g;
+  cache->newest = g;
+}
+
+// Returns the glyph, or null, counting a hit or a miss.
+static inline glyph *glyph_cache_find( glyph_cache *cache, glyph_key const *key )
+{
+  glyph *g = cache->bucket[glyph_key_hash( key )];
+
+  while (g != 0 && !glyph_key_equal( &g->key, key )) {
+    g = g->hash_next;
+  }
+
+  if (g == 0) {
+    cache->misses++;
+    return 0;
+  }
+
+  cache->hits++;
+
+  if (g != cache->newest) {
+    glyph_cache_unlink( cache, g );
+    glyph_cache_make_newest( cache, g );
+  }
+
+  return g;
+}
+
+// Would adding a glyph of this many bytes take the cache over its limit?
+// (If so, evict glyphs until it wouldn't.)
+static inline bool glyph_cache_full( glyph_cache const *cache, uint32_t bytes )
+{
+  return cache->oldest != 0 && cache->used + bytes > cache->limit;
+}
+
+// Removes and returns the least recently used glyph, for the caller to
+// free, or null if the cache is empty.
+static inline glyph *glyph_cache_evict( glyph_cache *cache )
+{
+  glyph *g = cache->oldest;
+
+  if (g == 0) return 0;
+
+  glyph **p = &cache->bucket[glyph_key_hash( &g->key )];
+  while (*p != g) p = &(*p)->hash_next;
+  *p = g->hash_next;
+
+  glyph_cache_unlink( cache, g );
+
+  cache->used -= g->bytes;
+  cache->glyphs--;
+  cache->evictions++;
+
+  return g;
+}
+
+// The glyph's key, size and bitmap must be filled in.
+static inline void glyph_cache_insert( glyph_cache *cache, glyph *g )
+{
+  glyph **bucket = &cache->bucket[glyph_key_hash( &g->key )];
+  g->hash_next = *bucket;
+  *bucket = g;
+
+  glyph_cache_make_newest( cache, g );
+
+  cache->used += g->bytes;
+  cache->glyphs++;
+}
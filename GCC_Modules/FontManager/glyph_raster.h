@@ -0,0 +1,281 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Rasterising a character's fill path into an alpha bitmap, for the
+// glyph cache.
+//
+// The Draw path (as made by MakeCharPaths, in design units << 8) is
+// transformed to pixels with 6 fractional bits, y upwards, the curves
+// flattened into straight edges. The edges are filled using the non-zero
+// winding rule, the same as Draw_Fill with the style the fonts use.
+//
+// Coverage is sampled on four sub-scanlines per row, with the exact
+// horizontal fraction of each pixel covered, giving 0 to 255 per pixel.
+// Without anti-aliasing (8 bits per pixel and fewer), a pixel is either
+// in (at least half covered) or out.
+
+typedef struct {
+  int32_t x0;
+  int32_t y0;
+  int32_t x1;
+  int32_t y1;
+} glyph_edge;
+
+typedef struct {
+  glyph_edge *edges;
+  uint32_t count;
+  uint32_t max;
+  bool overflowed;
+  int32_t xmin;
+  int32_t ymin;
+  int32_t xmax;
+  int32_t ymax;
+} glyph_outline;
+
+typedef struct {
+  int32_t left;                 // Pixels
+  int32_t bottom;
+  uint32_t width;
+  uint32_t height;
+} glyph_box;
+
+// Larger glyphs are not worth caching, and would overflow the
+// intermediate calculations.
+#define GLYPH_MAX_PIXELS 256
+
+// Per sub-scanline; glyphs have nothing like this many edges across one
+// line, any more are ignored.
+#define GLYPH_MAX_CROSSINGS 64
+
+static inline void glyph_point( int32_t const *matrix, int32_t x, int32_t y, int32_t *px, int32_t *py )
+{
+  *px = (int32_t) (((int64_t) matrix[0] * x + (int64_t) matrix[2] * y) >> 16) + matrix[4];
+  *py = (int32_t) (((int64_t) matrix[1] * x + (int64_t) matrix[3] * y) >> 16) + matrix[5];
+}
+
+static inline void glyph_add_edge( glyph_outline *o, int32_t x0, int32_t y0, int32_t x1, int32_t y1 )
+{
+  if (x1 < o->xmin) o->xmin = x1;
+  if (x1 > o->xmax) o->xmax = x1;
+  if (y1 < o->ymin) o->ymin = y1;
+  if (y1 > o->ymax) o->ymax = y1;
+
+  if (y0 == y1) return; // Never crosses a sub-scanline
+
+  if (o->count == o->max) {
+    o->overflowed = true;
+    return;
+  }
+
+  glyph_edge *e = &o->edges[o->count++];
+  e->x0 = x0; e->y0 = y0; e->x1 = x1; e->y1 = y1;
+}
+
+static inline int32_t glyph_abs( int32_t n )
+{
+  return n < 0 ? -n : n;
+}
+
+// Straight lines between points on the curve; enough of them that no
+// segment is more than about half a pixel long, up to 16.
+static inline void glyph_add_curve( glyph_outline *o, int32_t const *p )
+{
+  int32_t length = glyph_abs( p[2] - p[0] ) + glyph_abs( p[3] - p[1] )
+                 + glyph_abs( p[4] - p[2] ) + glyph_abs( p[5] - p[3] )
+                 + glyph_abs( p[6] - p[4] ) + glyph_abs( p[7] - p[5] );
+
+  uint32_t shift = 0;
+  while (shift < 4 && length > (32 << shift)) shift++;
+
+  int32_t n = 1 << shift;
+  int32_t x = p[0];
+  int32_t y = p[1];
+
+  for (int32_t i = 1; i <= n; i++) {
+    int32_t j = n - i;
+    // Bernstein polynomials, scaled by n^3
+    int32_t b0 = j * j * j;
+    int32_t b1 = 3 * j * j * i;
+    int32_t b2 = 3 * j * i * i;
+    int32_t b3 = i * i * i;
+    int32_t nx = (b0 * p[0] + b1 * p[2] + b2 * p[4] + b3 * p[6]) >> (3 * shift);
+    int32_t ny = (b0 * p[1] + b1 * p[3] + b2 * p[5] + b3 * p[7]) >> (3 * shift);
+    glyph_add_edge( o, x, y, nx, ny );
+    x = nx;
+    y = ny;
+  }
+}
+
+// Returns false if the path contains something other than moves, lines,
+// curves and closes. Every sub-path is closed, for filling.
+static inline bool glyph_outline_from_path( glyph_outline *o, uint32_t const *path, int32_t const *matrix )
+{
+  o->count = 0;
+  o->overflowed = false;
+  o->xmin = o->ymin = 0x7fffffff;
+  o->xmax = o->ymax = -0x7fffffff;
+
+  int32_t sx = 0, sy = 0;       // Start of sub-path
+  int32_t cx = 0, cy = 0;       // Current point
+  bool open = false;
+
+  for (;;) {
+    uint32_t code = *path++;
+    switch (code) {
+    case 0: // End
+      if (open) glyph_add_edge( o, cx, cy, sx, sy );
+      return true;
+    case 2: // Move
+    case 3: // Move, internal
+      if (open) glyph_add_edge( o, cx, cy, sx, sy );
+      glyph_point( matrix, path[0], path[1], &cx, &cy );
+      path += 2;
+      sx = cx; sy = cy;
+      glyph_add_edge( o, cx, cy, cx, cy ); // Bounds only
+      open = true;
+      break;
+    case 4: // Close with gap
+    case 5: // Close with line
+      if (open) glyph_add_edge( o, cx, cy, sx, sy );
+      cx = sx; cy = sy;
+      break;
+    case 6: // Curve
+      {
+        int32_t p[8] = { cx, cy };
+        glyph_point( matrix, path[0], path[1], &p[2], &p[3] );
+        glyph_point( matrix, path[2], path[3], &p[4], &p[5] );
+        glyph_point( matrix, path[4], path[5], &p[6], &p[7] );
+        path += 6;
+        glyph_add_curve( o, p );
+        cx = p[6]; cy = p[7];
+      }
+      break;
+    case 7: // Gap
+    case 8: // Line
+      {
+        int32_t nx, ny;
+        glyph_point( matrix, path[0], path[1], &nx, &ny );
+        path += 2;
+        glyph_add_edge( o, cx, cy, nx, ny );
+        cx = nx; cy = ny;
+      }
+      break;
+    default:
+      return false;
+    }
+  }
+}
+
+// The pixels touched by the outline. Returns false if it's too big.
+static inline bool glyph_outline_box( glyph_outline const *o, glyph_box *box )
+{
+  if (o->xmin > o->xmax) { // Nothing at all (a space)
+    box->left = box->bottom = 0;
+    box->width = box->height = 0;
+    return true;
+  }
+
+  int32_t right = (o->xmax + 63) >> 6;
+  int32_t top = (o->ymax + 63) >> 6;
+
+  box->left = o->xmin >> 6;
+  box->bottom = o->ymin >> 6;
+
+  if (right - box->left > GLYPH_MAX_PIXELS
+   || top - box->bottom > GLYPH_MAX_PIXELS) return false;
+
+  box->width = right - box->left;
+  box->height = top - box->bottom;
+
+  return true;
+}
+
+// Adds the coverage of [xa, xb) (sixty-fourths of a pixel from the left
+// of the box) to the cells
+static inline void glyph_cover( uint16_t *cells, int32_t xa, int32_t xb, int32_t limit )
+{
+  if (xa < 0) xa = 0;
+  if (xb > limit) xb = limit;
+  if (xa >= xb) return;
+
+  int32_t pa = xa >> 6;
+  int32_t pb = xb >> 6;
+
+  if (pa == pb) {
+    cells[pa] += xb - xa;
+    return;
+  }
+
+  cells[pa] += 64 - (xa & 63);
+  for (int32_t p = pa + 1; p < pb; p++) cells[p] += 64;
+  if ((xb & 63) != 0) cells[pb] += xb & 63;
+}
+
+// cells must have room for box->width + 1 entries, alpha for
+// box->width * box->height.
+static inline void glyph_rasterise( glyph_outline const *o, glyph_box const *box,
+                                    uint16_t *cells, uint8_t *alpha, bool anti_aliased )
+{
+  int32_t const left = box->left << 6;
+  int32_t const limit = box->width << 6;
+
+  for (uint32_t row = 0; row < box->height; row++) {
+    int32_t y = (box->bottom + box->height - 1 - row) << 6;
+
+    memset( cells, 0, (box->width + 1) * sizeof( cells[0] ) );
+
+    for (int32_t sub = 8; sub < 64; sub += 16) {
+      int32_t sy = y + sub;
+      int32_t x[GLYPH_MAX_CROSSINGS];
+      int8_t dir[GLYPH_MAX_CROSSINGS];
+      uint32_t n = 0;
+
+      for (uint32_t i = 0; i < o->count && n < GLYPH_MAX_CROSSINGS; i++) {
+        glyph_edge const *e = &o->edges[i];
+        int8_t d;
+        if (e->y0 <= sy && sy < e->y1) d = 1;
+        else if (e->y1 <= sy && sy < e->y0) d = -1;
+        else continue;
+
+        int32_t cx = e->x0 + ((sy - e->y0) * (e->x1 - e->x0)) / (e->y1 - e->y0) - left;
+
+        // Insertion sort, there are only a few
+        uint32_t j = n++;
+        while (j > 0 && x[j-1] > cx) {
+          x[j] = x[j-1];
+          dir[j] = dir[j-1];
+          j--;
+        }
+        x[j] = cx;
+        dir[j] = d;
+      }
+
+      int32_t winding = 0;
+      for (uint32_t i = 0; i + 1 < n; i++) {
+        winding += dir[i];
+        if (winding != 0) glyph_cover( cells, x[i], x[i+1], limit );
+      }
+    }
+
+    uint8_t *out = alpha + row * box->width;
+    for (uint32_t i = 0; i < box->width; i++) {
+      uint32_t c = cells[i];      // 0 to 256
+      if (anti_aliased)
+        out[i] = c > 255 ? 255 : c;
+      else
+        out[i] = c >= 128 ? 255 : 0;
+    }
+  }
+}
@@ -0,0 +1,206 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* *SWIStatistics [<count>]
+
+   Lists the SWIs that have taken the most cycles since the statistics
+   were started (OS_ThreadOp TaskOp_SWIStatistics, r1 = 1), busiest first,
+   added up over all the cores. See include/swi_statistics.h.
+*/
+
+const unsigned module_flags = 3;
+// Bit 0: 32-bit compatible
+// Bit 1: Multiprocessing
+
+#include "module.h"
+#include "include/swi_statistics.h"
+
+NO_start;
+NO_init;
+NO_finalise;
+NO_service_call;
+//NO_title;
+//NO_help;
+//NO_keywords;
+NO_swi_handler;
+NO_swi_names;
+NO_swi_decoder;
+NO_messages_file;
+
+const char title[] = "SWIStatistics";
+const char help[] = "SWIStatistics\t0.01";
+
+const char command_help[] =
+  "*SWIStatistics lists the SWIs that have taken the most cycles since "
+  "SWI statistics were started, and how long callers waited to run them.\r";
+const char command_syntax[] =
+  "Syntax: *SWIStatistics [<count>]";
+
+static void write0( char const *s )
+{
+  register char const *string asm( "r0" ) = s;
+  asm volatile ( "svc %[swi]"
+      :
+      : [swi] "i" (OS_Write0 | Xbit)
+      , "r" (string)
+      : "lr", "cc", "memory" );
+}
+
+static void writec( char c )
+{
+  register char ch asm( "r0" ) = c;
+  asm volatile ( "svc %[swi]"
+      :
+      : [swi] "i" (OS_WriteC | Xbit)
+      , "r" (ch)
+      : "lr", "cc", "memory" );
+}
+
+static void newline()
+{
+  asm volatile ( "svc %[swi]"
+      :
+      : [swi] "i" (OS_NewLine | Xbit)
+      : "r0", "lr", "cc", "memory" );
+}
+
+// Right aligned in width characters, followed by a space
+static void write_number( uint32_t n, int width )
+{
+  char buffer[12];
+  char *c = &buffer[sizeof( buffer ) - 1];
+  *c = '\0';
+  do {
+    *--c = '0' + (n % 10);
+    n = n / 10;
+  } while (n > 0);
+
+  for (int i = (&buffer[sizeof( buffer ) - 1] - c); i < width; i++) writec( ' ' );
+  write0( c );
+  writec( ' ' );
+}
+
+// Left aligned in width characters, followed by a space
+static void write_swi_name( uint32_t swi, int width )
+{
+  char name[32];
+  register uint32_t number asm( "r0" ) = swi;
+  register char *buffer asm( "r1" ) = name;
+  register uint32_t size asm( "r2" ) = sizeof( name );
+  asm volatile ( "svc %[swi]"
+      : "+r" (size)
+      : [swi] "i" (OS_SWINumberToString | Xbit)
+      , "r" (number)
+      , "r" (buffer)
+      : "lr", "cc", "memory" );
+  name[sizeof( name ) - 1] = '\0';
+
+  write0( name );
+
+  int length = 0;
+  while (name[length] != '\0') length++;
+  for (int i = length; i <= width; i++) writec( ' ' );
+}
+
+// Returns the number of entries copied into top, busiest first
+static uint32_t read_swi_statistics( swi_statistics *top, uint32_t max )
+{
+  register uint32_t request asm ( "r0" ) = TaskOp_SWIStatistics;
+  register uint32_t reason asm ( "r1" ) = 2; // Read
+  register swi_statistics *buffer asm ( "r2" ) = top;
+  register uint32_t count asm ( "r3" ) = max;
+
+  asm volatile ( "svc %[swi]"
+            "\n  movvs %[count], #0"
+      : [count] "+r" (count)
+      , "+r" (request)
+      : [swi] "i" (OS_ThreadOp | Xbit)
+      , "r" (reason)
+      , "r" (buffer)
+      : "lr", "cc", "memory" );
+
+  return count;
+}
+
+error_block *c_swi_statistics_command( char const *tail, uint32_t parameters )
+{
+  uint32_t max = 0;
+  while (*tail == ' ') tail++;
+  while (*tail >= '0' && *tail <= '9') max = max * 10 + (*tail++ - '0');
+
+  if (parameters == 0 || max == 0) max = 10;
+  if (max > SWI_STATISTICS_SIZE) max = SWI_STATISTICS_SIZE;
+
+  swi_statistics *top = rma_claim( max * sizeof( swi_statistics ) );
+  if (top == 0) {
+    static error_block error = { 0x888, "Not enough memory for SWI statistics" };
+    return &error;
+  }
+
+  uint32_t count = read_swi_statistics( top, max );
+
+  write0( "SWI                            Calls      Cycles     Longest <  Waits      Waited" );
+  newline();
+
+  for (int i = 0; i < count; i++) {
+    swi_statistics *entry = &top[i];
+
+    write_swi_name( entry->key & ~SWI_STATISTICS_USED, 30 );
+
+    uint32_t longest = number_of( entry->histogram ) - 1;
+    while (longest > 0 && entry->histogram[longest] == 0) longest--;
+
+    write_number( entry->calls, 10 );
+    write_number( (uint32_t) entry->cycles, 10 );
+    if (longest == number_of( entry->histogram ) - 1)
+      write0( "    longer " );
+    else
+      write_number( 1 << longest, 10 );
+    write_number( entry->waits, 10 );
+    write_number( (uint32_t) entry->wait_ticks, 10 );
+    newline();
+  }
+
+  rma_free( top );
+
+  return 0;
+}
+
+void __attribute__(( naked )) swi_statistics_command()
+{
+  // r0 = command tail, r1 = number of parameters
+  asm ( "push { r1-r3, r12, lr }"
+    "\n  bl c_swi_statistics_command"
+    "\n  cmp r0, #0 // Never sets V"
+    "\n  msrne cpsr_f, #(1 << 28) // Error: set V"
+    "\n  pop { r1-r3, r12, pc }" );
+}
+
+void __attribute__(( naked, section( ".text.init" ) )) in_text_init_section()
+{
+// If this assembler is at the top level, it gets placed before file_start,
+// screwing up the module header.
+  asm (
+   "\nkeywords:"
+   "\n  .asciz \"SWIStatistics\""
+   "\n  .align"
+   "\n  .word swi_statistics_command - header"
+   "\n  .word 0x00010000" // 0 to 1 parameters
+   "\n  .word command_syntax - header"
+   "\n  .word command_help - header"
+
+   // End of list
+   "\n  .word 0" );
+}
@@ -1096,7 +1096,7 @@ static inline uint64_t timer_now()
   return now;
 }
 
-static inline uint32_t timer_interrupt_time()
+static inline uint64_t timer_interrupt_time()
 {
   uint32_t hi, lo;
 
@@ -1122,13 +1122,6 @@ static void timer_set_countdown( int32_t timer )
   asm volatile ( "mcr p15, 0, %[config], c14, c2, 1" : : [config] "r" (1) );
 }
 
-static int32_t timer_get_countdown()
-{
-  int32_t timer;
-  asm volatile ( "mrc p15, 0, %[t], c14, c2, 0" : [t] "=r" (timer) );
-  return timer;
-}
-
 static uint32_t timer_status()
 {
   uint32_t bits;
@@ -1243,6 +1236,29 @@ static int __attribute__(( noinline )) C_IrqV_handler( struct core_workspace *wo
   }
 }
 
+// Called by the kernel, with interrupts disabled, to find all the sources
+// that are interrupting this core at once. Sources 0-63 are the GPU's,
+// 64-75 the ARM's, as in C_IrqV_handler; the kernel chooses between them.
+static void pending_sources( struct core_workspace *workspace, uint32_t *bitmap )
+{
+  QA7 volatile *qa7 = workspace->shared->qa7;
+
+  memory_read_barrier();
+
+  uint32_t source = qa7->Core_IRQ_Source[core( workspace )];
+
+  memory_read_barrier();
+
+  if (0 != (source & (1 << 8))) {
+    GPU *gpu = workspace->shared->gpu;
+    bitmap[0] = gpu->pending1;
+    bitmap[1] = gpu->pending2;
+  }
+
+  // 64-75, not 72, which is the GPU's, covered by 0-63
+  bitmap[2] = source & 0xeff;
+}
+
 static void __attribute__(( naked )) IrqV_handler()
 {
   // IrqV contains no information in the registers on entry, except r12
@@ -1302,6 +1318,24 @@ static void wait_until_woken()
       : "lr" );
 }
 
+// Wakes any Tasks on this core that have slept long enough, returns when
+// the next one is due to wake.
+static uint64_t wake_sleepers()
+{
+  register uint32_t request asm ( "r0" ) = TaskOp_WakeSleepers;
+  register uint32_t lo asm ( "r0" );
+  register uint32_t hi asm ( "r1" );
+
+  asm volatile ( "svc %[swi]"
+      : "=r" (lo)
+      , "=r" (hi)
+      : [swi] "i" (OS_ThreadOp)
+      , "0" (request)
+      : "lr", "memory" );
+
+  return (((uint64_t) hi) << 32) | lo;
+}
+
 static void resume_task( uint32_t handle )
 {
   register uint32_t request asm ( "r0" ) = TaskOp_Resume;
@@ -1401,22 +1435,29 @@ WriteS( "Timer interrupt task" ); NewLine;
 
   memory_write_barrier(); // Maybe needed?
 
+  // The interrupt is at the next tick or when the kernel next needs to
+  // wake a sleeping task, whichever is sooner. (The kernel may bring it
+  // forward itself, when a task goes to sleep.)
+  uint64_t next_tick = timer_interrupt_time();
+
   const uint32_t tick_divider = 10;
   uint32_t ticks = 0;
 
   do {
     wait_for_interrupt( device );
 
-    int32_t timer = timer_get_countdown();
+    uint64_t now = timer_now();
     uint32_t missed_ticks = 0;
 
-    while (timer < 0) {
-      timer += ticks_per_interval;
+    while (next_tick <= now) {
+      next_tick += ticks_per_interval;
       missed_ticks++;
     }
     // TODO: Report missed ticks?
 
-    timer_set_countdown( timer );
+    uint64_t wake = wake_sleepers();
+
+    timer_interrupt_at( wake < next_tick ? wake : next_tick );
 
     {
     GPU volatile *gpu = shared->gpu;
@@ -1662,6 +1703,15 @@ show_word( this_core * (1920/4), 48, (uint32_t) &qa7->Core_write_clear[this_core
     asm ( "svc %[swi]" : : [swi] "i" (OS_Claim | Xbit), "r" (vector), "r" (routine), "r" (handler_workspace) : "lr" );
   }
 
+  {
+    // Quicker than IrqV, which the kernel then has no need to call
+    void *handler = pending_sources;
+    register uint32_t request asm( "r0" ) = TaskOp_PendingSourcesHandler;
+    register void *routine asm( "r1" ) = handler;
+    register struct core_workspace *handler_workspace asm( "r2" ) = &workspace->core_specific[this_core];
+    asm ( "svc %[swi]" : : [swi] "i" (OS_ThreadOp | Xbit), "r" (request), "r" (routine), "r" (handler_workspace) : "lr" );
+  }
+
   {
     void *handler = WrchV_handler;
     register uint32_t vector asm( "r0" ) = 3;
@@ -156,6 +156,23 @@ typedef union {
   };
 } arm32_ptr;
 
+// The pool of level 2 tables grows a page at a time, pages added by other
+// cores may not be in this core's table for the top MiB yet. Copy the entry
+// rather than take a data abort, possibly in a data abort handler.
+static void make_pool_page_visible( Level_two_translation_table *l2tt )
+{
+  arm32_ptr pointer = { .rawp = l2tt };
+  l2tt_entry *local = &workspace.mmu.kernel_l2tt->entry[pointer.page];
+
+  if (local->type == 0) {
+    l2tt_entry global = shared.mmu.kernel_l2tt->entry[pointer.page];
+    assert( global.type != 0 );
+    *local = global;
+    // A faulting entry will not have been cached in the TLB
+    asm ( "dsb sy\n  isb" );
+  }
+}
+
 static Level_two_translation_table *find_table_from_l1tt_entry( l1tt_entry l1 )
 {
   assert( l1.type == 1 );
@@ -176,7 +193,11 @@ static Level_two_translation_table *find_table_from_l1tt_entry( l1tt_entry l1 )
   i -= l2start;
 
   // Four tables per page
-  return l2tt + (i << 2) + (l1.table.page_table_base & 3);
+  Level_two_translation_table *result = l2tt + (i << 2) + (l1.table.page_table_base & 3);
+
+  make_pool_page_visible( result );
+
+  return result;
 }
 
 static bool fault_on_existing_section( uint32_t address, uint32_t type )
@@ -241,11 +262,24 @@ static uint32_t physical_address( void *p )
   return -1;
 }
 
+// Tables from the pool are mapped in the global table for the top MiB,
+// even if this core hasn't accessed them yet.
+static uint32_t pool_table_physical_address( Level_two_translation_table *l2tt )
+{
+  arm32_ptr pointer = { .rawp = l2tt };
+
+  l2tt_entry page = shared.mmu.kernel_l2tt->entry[pointer.page];
+
+  assert( page.type != 0 );
+
+  return (page.page_base << 12) + pointer.offset;
+}
+
 static void map_l2tt_at_section_local( Level_two_translation_table *l2tt, uint32_t section )
 {
   l1tt_entry MiB = { .table.type1 = 1, .table.NS = 1, .table.Domain = 0 };
 
-  MiB.raw |= physical_address( l2tt );
+  MiB.raw |= pool_table_physical_address( l2tt );
 
   Local_L1TT->entry[section] = MiB;
 }
@@ -374,6 +408,64 @@ static bool just_allocated( uint32_t address, uint32_t type )
   return false;
 }
 
+static bool extending_l2tt_pool( uint32_t address, uint32_t type )
+{
+  // Marker, will not be called (because it won't be in an active L2TT
+  asm ( "bkpt %[line]" : : [line] "i" (__LINE__) );
+  return false;
+}
+
+// The last table in the pool is kept free, the first core to need it maps
+// another page of tables (up to tt_limit) beyond it, first.
+static void extend_l2tt_pool( Level_two_translation_table *last )
+{
+  extern int tt_limit;
+
+  l2tt_entry last_entry = { .handler = last_free_l2tt_table };
+  l2tt_entry extending_entry = { .handler = extending_l2tt_pool };
+  l2tt_entry free_entry = { .handler = free_l2tt_table };
+
+  l2tt_entry old;
+  old.raw = change_word_if_equal( &last->entry[0].raw, last_entry.raw, extending_entry.raw );
+  if (old.raw != last_entry.raw) {
+    // Another core is extending the pool; wait for it
+    uint32_t volatile *marker = &last->entry[0].raw;
+    while (*marker == extending_entry.raw) {}
+    return;
+  }
+
+  Level_two_translation_table *next = last + 1;
+
+  assert( (((uint32_t) next) & 0xfff) == 0 );
+
+  if ((uint32_t) next >= (uint32_t) &tt_limit) {
+    // No more virtual space for tables. FIXME release tables of idle slots
+    asm ( "bkpt %[line]" : : [line] "i" (__LINE__) );
+  }
+
+  uint32_t page = Kernel_allocate_pages( 4096, 4096 );
+  assert( page != 0xffffffff ); // FIXME
+
+  arm32_ptr pointer = { .rawp = next };
+  l2tt_entry entry = l2_prw;
+  entry.page_base = page >> 12;
+
+  shared.mmu.kernel_l2tt->entry[pointer.page] = entry;
+  workspace.mmu.kernel_l2tt->entry[pointer.page] = entry;
+  asm ( "dsb sy\n  isb" );
+
+  for (int i = 0; i < 3; i++) {
+    next[i].entry[0] = free_entry;
+  }
+  next[3].entry[0] = last_entry;
+
+  // The new tables (and the mapping) must be visible before the old last
+  // table stops marking the end of the pool.
+  asm ( "dmb sy" );
+
+  last->entry[0] = free_entry;
+}
+
 static Level_two_translation_table *find_free_table()
 {
   Level_two_translation_table *l2tt = l2_translation_tables;
@@ -383,11 +475,15 @@ static Level_two_translation_table *find_free_table()
 
   do {
     while (l2tt->entry[0].handler != free_l2tt_table
-     && l2tt->entry[0].handler != last_free_l2tt_table) { // FIXME: no more available?
+        && l2tt->entry[0].handler != last_free_l2tt_table
+        && l2tt->entry[0].handler != extending_l2tt_pool) {
       l2tt++;
+      if ((((uint32_t) l2tt) & 0xfff) == 0) make_pool_page_visible( l2tt );
     }
 
-if (l2tt->entry[0].handler == last_free_l2tt_table) { asm ( "bkpt 4" ); }
+    if (l2tt->entry[0].handler != free_l2tt_table) {
+      extend_l2tt_pool( l2tt );
+    }
 
     old_value.raw = change_word_if_equal( &l2tt->entry[0].raw, free_entry.raw, just_allocated_entry.raw );
   } while (old_value.handler != free_entry.handler);
@@ -395,6 +491,11 @@ if (l2tt->entry[0].handler == last_free_l2tt_table) { asm ( "bkpt 4" ); }
   return l2tt;
 }
 
+static void free_table( Level_two_translation_table *l2tt )
+{
+  l2tt->entry[0].handler = free_l2tt_table;
+}
+
 static bool never_happens( uint32_t address, uint32_t type )
 {
   // Marker, will not be called (because it won't be in an active L2TT
@@ -402,14 +503,33 @@ static bool never_happens( uint32_t address, uint32_t type )
   return false;
 }
 
-static void map_block( physical_memory_block block )
+static bool stack_underflow( uint32_t address, uint32_t type );
+static bool stack_overflow( uint32_t address, uint32_t type );
+static bool check_task_slot_l2( uint32_t address, uint32_t type );
+
+// Slot memory may be accessed by several cores at once, the tables are
+// updated by whichever core takes the fault.
+static void write_slot_entries( Level_two_translation_table *l2tt, uint32_t first, uint32_t count, l2tt_entry entry )
+{
+  for (uint32_t p = first; p < first + count; p++) {
+    l2tt->entry[p] = entry;
+    entry.page_base++;
+  }
+
+  // Clean the entries out to where the other cores' table walks will see them
+  for (uint32_t p = first & ~7; p < first + count; p += 8) {
+    flush_location( &l2tt->entry[p] );
+  }
+}
+
+static void map_block( physical_memory_block block, uint32_t address )
 {
   // All RISC OS memory is RWX.
   // FIXME: Even the stuff that isn't meant to be at the moment... Lowest common denominator
   // All lazily mapped memory is shared (task slots, and the associated storage in the kernel)
   l2tt_entry entry = { .XN = 0, .small_page = 1, .TEX = 0b101, .C = 0, .B = 1, .unprivileged_access = 1, .AF = 1, .S = 1, .nG = 1 };
 
-  arm32_ptr pointer = { .raw = block.virtual_base };
+  arm32_ptr pointer = { .raw = address };
 
   l1tt_entry section = Local_L1TT->entry[pointer.section];
 
@@ -417,27 +537,119 @@ static void map_block( physical_memory_block block )
 
   Level_two_translation_table *l2tt = find_table_from_l1tt_entry( section );
 
+  // Only the part of the block in this section, the rest will be mapped
+  // when (if) it's accessed, possibly in another table.
+  uint32_t section_base = address & ~0xfffff;
+  uint32_t start = block.virtual_base;
+  uint32_t end = block.virtual_base + block.size;
+  if (start < section_base) start = section_base;
+  if (end - section_base > (1 << 20)) end = section_base + (1 << 20);
+
+  uint32_t first = (start >> 12) & 0xff;
+  uint32_t count = (end - start) >> 12;
+
+  entry.page_base = (block.physical_base + (start - block.virtual_base)) >> 12;
+
   about_to_remap_memory();
 
-  // WriteS( "Mapping" ); NewLine;
-  uint32_t base = (block.virtual_base >> 12) & 0xff;
-  entry.page_base = block.physical_base >> 12;
+  write_slot_entries( l2tt, first, count, entry );
 
-  // FIXME: What if block overruns the end of the table?
+  if (pointer.section == 0) {
+    assert( workspace.mmu.slot != 0 );
 
-  for (uint32_t b = 0; b < block.size >> 12; b++) {
-    // WriteS( "Page " ); WriteNum( (b+base) << 12 ); WriteS( " > " ); WriteNum( entry.page_base << 12 ); NewLine;
-    l2tt->entry[base + b] = entry;
-    entry.page_base++;
+    // The core's own table, keep a copy with the slot, for next time
+    struct MMU_slot *tables = TaskSlot_mmu( workspace.mmu.slot );
+
+    if (tables->bottom_MiB == 0) {
+      Level_two_translation_table *copy = find_free_table();
+      for (int i = 0; i < number_of( copy->entry ); i++) {
+        copy->entry[i].handler = check_task_slot_l2;
+      }
+      tables->bottom_MiB = copy;
+    }
+
+    write_slot_entries( tables->bottom_MiB, first, count, entry );
+
+    if (tables->bottom_pages < first + count) tables->bottom_pages = first + count;
+    if (workspace.mmu.bottom_pages < first + count) workspace.mmu.bottom_pages = first + count;
   }
 
   memory_remapped();
 }
 
+static Level_two_translation_table *slot_table( struct MMU_slot *tables, uint32_t section )
+{
+  for (int i = 0; i < tables->count; i++) {
+    if (tables->table[i].section == section) return tables->table[i].l2tt;
+  }
+  return 0;
+}
+
+// The level 1 entry for a section of slot-specific memory (application
+// space, pipes, the svc stack) that the slot mapped into this core doesn't
+// have a table for, yet.
 static bool check_task_slot_l1( uint32_t address, uint32_t type )
 {
-  WriteS( "Check task slot L1: " ); WriteNum( address ); NewLine;
-  asm ( "bkpt %[line]" : : [line] "i" (__LINE__) );
+  arm32_ptr pointer = { .raw = address };
+
+  if (workspace.mmu.slot == 0) {
+    WriteS( "Check task slot L1, no slot: " ); WriteNum( address ); NewLine;
+    return false;
+  }
+
+  struct MMU_slot *tables = TaskSlot_mmu( workspace.mmu.slot );
+
+  bool reclaimed = claim_lock( &shared.mmu.lock );
+  assert( !reclaimed ); // IDK, seems sus.
+
+  // Another core running the same slot may have created it
+  Level_two_translation_table *l2tt = slot_table( tables, pointer.section );
+
+  if (l2tt == 0) {
+    if (tables->count == number_of( tables->table )) {
+      // The slot has used all its sections, the access fails (and the
+      // abort is passed to the Task, see Task_data_abort).
+      if (!reclaimed) release_lock( &shared.mmu.lock );
+      WriteS( "Slot out of sections: " ); WriteNum( address ); NewLine;
+      return false;
+    }
+
+    l2tt = find_free_table();
+
+    for (int i = 0; i < number_of( l2tt->entry ); i++) {
+      l2tt->entry[i].handler = check_task_slot_l2;
+    }
+
+    extern uint32_t svc_stack_top;
+    arm32_ptr top_ptr = { .rawp = &svc_stack_top };
+
+    if (pointer.section == top_ptr.section) {
+      // Tried to pop too much, or possibly just a random address?
+      l2tt->entry[top_ptr.page].handler = stack_underflow;
+
+      // The guard page below each of the slot's svc stacks
+      for (int i = 1; i <= TASK_SVC_STACKS; i++) {
+        l2tt->entry[top_ptr.page - i * (TASK_SVC_STACK_PAGES + 1)].handler = stack_overflow;
+      }
+    }
+
+    // Walks of this table by other cores must not see the old contents
+    for (int i = 0; i < number_of( l2tt->entry ); i += 8) {
+      flush_location( &l2tt->entry[i] );
+    }
+
+    tables->table[tables->count].section = pointer.section;
+    tables->table[tables->count].l2tt = l2tt;
+    tables->count++;
+  }
+
+  if (!reclaimed) release_lock( &shared.mmu.lock );
+
+  assert( workspace.mmu.mapped < number_of( workspace.mmu.sections ) );
+
+  map_l2tt_at_section_local( l2tt, pointer.section );
+  workspace.mmu.sections[workspace.mmu.mapped++] = pointer.section;
+
   return true;
 }
 
@@ -485,15 +697,15 @@ static bool check_task_slot_l2( uint32_t address, uint32_t type )
   assert( !reclaimed ); // IDK, seems sus.
 
   physical_memory_block block = Kernel_physical_address( address );
-  if (!reclaimed) release_lock( &shared.mmu.lock );
 
   if (block.size != 0) {
-    map_block( block );
-    return true;
+    map_block( block, address );
   }
 
-  asm ( "bkpt %[line]" : : [line] "i" (__LINE__) );
-  return false;
+  if (!reclaimed) release_lock( &shared.mmu.lock );
+
+  // Nothing at that address, the abort is passed to the Task
+  return (block.size != 0);
 }
 
 static bool allocate_core_specific_zero_page_ram( uint32_t address, uint32_t type )
@@ -599,11 +811,17 @@ static bool check_global_l2tt( uint32_t address, uint32_t type )
 
 static l1tt_entry default_l1tt_entry( int section )
 {
+  extern char pipes_base;
+  extern char pipes_top;
+
   l1tt_entry result;
   if (section == 0)
     result.handler = allocate_core_specific_zero_section;
   else if (section < (((uint32_t)&app_memory_limit) >> 20))
     result.handler = check_task_slot_l1;
+  else if (section >= (((uint32_t)&pipes_base) >> 20)
+        && section < (((uint32_t)&pipes_top) >> 20))
+    result.handler = check_task_slot_l1;
   else if (section == 0xfa6)
     result.handler = random_legacy_kernel_workspace_l1;
     // 0xfa600000 is used by the IF command. =GeneralMOSBuffer
@@ -799,8 +1017,6 @@ static void setup_stack_pages( uint32_t *top, uint32_t *lim )
   }
 }
 
-static void clear_svc_stack_area();
-
 void Initialise_privileged_mode_stacks()
 {
   extern uint32_t stack_limit; // Not really a pointer!
@@ -810,28 +1026,17 @@ void Initialise_privileged_mode_stacks()
   extern uint32_t irq_stack_top;
   extern uint32_t fiq_stack_top;
 
-  // These require the l2tt tables to be directly mapped locally, there's no 
-  // abort stack set up yet.
-  // The SVC stack is slot-specific
+  // The SVC stack is slot-specific, its table belongs to the slot and is
+  // mapped in by MMU_switch_to or check_task_slot_l1.
   {
-    Level_two_translation_table *l2tt;
-
-    l2tt = find_free_table();
-
-    l1tt_entry MiB = { .table.type1 = 1, .table.NS = 1, .table.Domain = 0 };
-
-    MiB.raw |= physical_address( l2tt );
-
     arm32_ptr top_ptr = { .rawp = &svc_stack_top };
 
-    Local_L1TT->entry[top_ptr.section] = MiB;
-
-    // Tried to pop too much, or possibly just a random address?
-    l2tt->entry[top_ptr.page].handler = stack_underflow;
-
-    clear_svc_stack_area();
+    Local_L1TT->entry[top_ptr.section].handler = check_task_slot_l1;
   }
 
+  // These require the l2tt tables to be directly mapped locally, there's no 
+  // abort stack set up yet.
+
   // FIXME: These can all be made very small...
   // These modes will simply store the task state and tell another task
   // to deal with the problem.
@@ -1042,6 +1247,18 @@ void __attribute__(( naked, optimize( 0 ), noreturn )) Kernel_default_data_abort
       );
 
   if (!handle_data_abort()) {
+    // Application code accessing memory that isn't there (or can't be
+    // mapped) gets its data abort handler called, the core carries on.
+    asm volatile ( "push { r4-r11 }"
+               "\n  mov r0, sp"
+               "\n  bl Task_data_abort"
+               "\n  pop { r4-r11 }"
+               "\n  cmp r0, #0"
+               "\n  beq 0f"
+               "\n  pop { "C_CLOBBERED" }"
+               "\n  rfeia sp!"
+               "\n0:" );
+
 register uint32_t *sp asm ( "r13" );
 uint32_t *stack = sp;
 show_word( workspace.core_number * 100+ 960, 20, stack[6], Blue );
@@ -1065,101 +1282,184 @@ show_word( workspace.core_number * 100+ 960, 40, ss[-2], Yellow );
   __builtin_unreachable();
 }
 
-static void clear_app_area()
+// Invalidate any TLB entries for the ASID, on this core only, or on all
+static inline void invalidate_asid( uint32_t asid )
 {
-  Level_two_translation_table *l2tt;
+  asm ( "mcr p15, 0, %[asid], c8, c7, 2 // TLBIASID" : : [asid] "r" (asid) );
+}
+
+static inline void invalidate_asid_all_cores( uint32_t asid )
+{
+  asm ( "mcr p15, 0, %[asid], c8, c3, 2 // TLBIASIDIS" : : [asid] "r" (asid) );
+}
+
+// Invalidate any cached walks through the level 1 entry for the section,
+// for all ASIDs, on this core.
+static inline void invalidate_section_walk( uint32_t section )
+{
+  asm ( "mcr p15, 0, %[va], c8, c7, 3 // TLBIMVAA" : : [va] "r" (section << 20) );
+}
+
+// The application space, pipes and svc stack belong to the slot. Each
+// slot keeps its own tables for them, so a switch only has to replace the
+// level 1 entries that referred to the previous slot's tables with the
+// new slot's. The pages are all non-Global, tagged with the slot's ASID,
+// so TLB entries from the last time the slot ran on this core remain valid.
+void MMU_switch_to( TaskSlot *slot )
+{
+  struct MMU_slot *tables = TaskSlot_mmu( slot );
+  uint32_t asid = TaskSlot_asid( slot );
+
+  bool reclaimed = claim_lock( &shared.mmu.lock );
+  assert( !reclaimed ); // IDK, seems sus, fix it if it happens!
+
+  // Write0( "Switching to slot " ); WriteNum( slot ); Space; WriteNum( asid ); NewLine;
+
+  if (workspace.mmu.slot == slot && workspace.mmu.incarnation == tables->incarnation) {
+    // Nothing from another slot has run on this core since, the tables
+    // and CONTEXTIDR are still correct.
+    if (!reclaimed) release_lock( &shared.mmu.lock );
+    return;
+  }
 
-  if (Local_L1TT->entry[0].type == 1) {
-    l2tt = find_table_from_l1tt_entry( Local_L1TT->entry[0] );
+  trace_event( Trace_MMUSwitch, slot, 0 );
 
-    for (int i = 0x8000 >> 12; i < 0x100000 >> 12; i++) {
+  about_to_remap_memory();
+
+  // Until CONTEXTIDR holds the new ASID, nothing of the new slot may be
+  // visible to a table walk, or it could be cached under the old ASID and
+  // used when the old slot next runs on this core. So, first remove every
+  // trace of the old slot, then change ASID, then install the new slot.
+
+  for (int i = 0; i < workspace.mmu.mapped; i++) {
+    uint32_t section = workspace.mmu.sections[i];
+    Local_L1TT->entry[section].handler = check_task_slot_l1;
+  }
+
+  // The bottom MiB has the core's zero page in it, the slot's pages are
+  // copied in below.
+  Level_two_translation_table *l2tt = workspace.mmu.zero_page_l2tt;
+  uint32_t first = 0x8000 >> 12;
+
+  if (l2tt != 0) {
+    for (int i = first; i < workspace.mmu.bottom_pages; i++) {
       l2tt->entry[i].handler = check_task_slot_l2;
     }
+    workspace.mmu.bottom_pages = first;
   }
 
-  for (int i = 1; i < (((uint32_t)&app_memory_limit) >> 20); i++) {
-    if (Local_L1TT->entry[i].type == 1) {
-      asm ( "bkpt %[line]" : : [line] "i" (__LINE__) ); // Free the l2tt.
-    }
+  flush_internal_write_queue();
 
-    Local_L1TT->entry[i].handler = check_task_slot_l1;
+  for (int i = 0; i < workspace.mmu.mapped; i++) {
+    invalidate_section_walk( workspace.mmu.sections[i] );
   }
-}
 
-static void clear_pipes_area()
-{
-  extern char pipes_base;
-  extern char pipes_top;
-  uint32_t base = (uint32_t) &pipes_base;
-  uint32_t top = (uint32_t) &pipes_top;
+  workspace.mmu.mapped = 0;
 
-  for (int i = base >> 20; i < top >> 20; i++) {
-    if (Local_L1TT->entry[i].type == 1) {
-      asm ( "bkpt %[line]" : : [line] "i" (__LINE__) ); // Free the l2tt.
-    }
+  if (workspace.mmu.slot == slot) {
+    // Same slot, but released and re-allocated since this core last used
+    // it; this core may still have TLB entries for the old tables.
+    invalidate_asid( asid );
+  }
+
+  flush_internal_write_queue();
+
+  // Set CONTEXTIDR
+  asm ( "mcr p15, 0, %[asid], c13, c0, 1" : : [asid] "r" (asid) );
+
+  pause_speculative_execution();
 
-    Local_L1TT->entry[i].handler = check_task_slot_l1;
+  for (int i = 0; i < tables->count; i++) {
+    map_l2tt_at_section_local( tables->table[i].l2tt, tables->table[i].section );
+    workspace.mmu.sections[i] = tables->table[i].section;
   }
+  workspace.mmu.mapped = tables->count;
+
+  if (l2tt != 0 && tables->bottom_MiB != 0) {
+    make_pool_page_visible( tables->bottom_MiB );
+    uint32_t pages = tables->bottom_pages;
+    for (int i = first; i < pages; i++) {
+      l2tt->entry[i] = tables->bottom_MiB->entry[i];
+    }
+    workspace.mmu.bottom_pages = pages;
+  }
+
+  workspace.mmu.slot = slot;
+  workspace.mmu.incarnation = tables->incarnation;
+
+  flush_internal_write_queue();
+
+  pause_speculative_execution();
+
+  if (!reclaimed) release_lock( &shared.mmu.lock );
 }
 
-static void clear_svc_stack_area()
+void MMU_release_slot( TaskSlot *slot )
 {
-  Level_two_translation_table *l2tt;
+  struct MMU_slot *tables = TaskSlot_mmu( slot );
 
-  extern uint32_t svc_stack_top;
-  arm32_ptr top_ptr = { .rawp = &svc_stack_top };
+  bool reclaimed = claim_lock( &shared.mmu.lock );
 
-  assert( Local_L1TT->entry[top_ptr.section].type == 1 );
+  bool used = (tables->count != 0 || tables->bottom_MiB != 0);
 
-  // This will always have been previously initialised
-  l2tt = find_table_from_l1tt_entry( Local_L1TT->entry[top_ptr.section] );
+  for (int i = 0; i < tables->count; i++) {
+    free_table( tables->table[i].l2tt );
+  }
+  tables->count = 0;
 
-  uint32_t entry = top_ptr.page;
-  while (entry > 0 && l2tt->entry[--entry].handler != check_task_slot_l2) {
-    l2tt->entry[entry].handler = check_task_slot_l2;
+  if (tables->bottom_MiB != 0) {
+    free_table( tables->bottom_MiB );
+    tables->bottom_MiB = 0;
   }
-  entry = 0; // SharedCLibrary workspace (yuk!)
-  while (entry < top_ptr.page && l2tt->entry[entry].handler != check_task_slot_l2) {
-    l2tt->entry[entry++].handler = check_task_slot_l2;
+  tables->bottom_pages = 0;
+
+  // Any core that still has the slot's tables mapped will replace them
+  // at its next switch, even to a new slot at the same address.
+  tables->incarnation++;
+
+  if (used) {
+    flush_internal_write_queue();
+    invalidate_asid_all_cores( TaskSlot_asid( slot ) );
+    flush_internal_write_queue();
   }
+
+  if (!reclaimed) release_lock( &shared.mmu.lock );
 }
 
-void MMU_switch_to( TaskSlot *slot )
+// The slot will no longer use the pages at that address (a pipe passed
+// to a task in another slot, say). The entries revert to faulting, so the
+// virtual addresses can be re-used for something else.
+void MMU_unmap_slot_range( TaskSlot *slot, uint32_t va, uint32_t size )
 {
+  assert( (va & 0xfff) == 0 && (size & 0xfff) == 0 );
+  assert( va >= natural_alignment ); // Not the bottom MiB, it's copied
+
+  struct MMU_slot *tables = TaskSlot_mmu( slot );
+
   bool reclaimed = claim_lock( &shared.mmu.lock );
-  assert( !reclaimed ); // IDK, seems sus, fix it if it happens!
 
-  // Write0( "Switching to slot " ); WriteNum( slot ); Space; WriteNum( TaskSlot_asid( slot ) ); NewLine;
-  // FIXME Only clear what's used
-  // FIXME deal with slots that go over the first MiB
-  // Note: My idea is to try to keep memory as contiguous as possible, and have
-  // two or possibly three sub-MiB translation tables for the first MiB (bottom_MiB_tt)
-  // and the slot's top MiB (and possibly the one below it, in case a task regularly
-  // modifies its memory by small amounts above and below a MiB boundary).
-
-  // TODO record which slot was last active, configure all translation table
-  // walks to cause an exception, then only clear the table if the slot is
-  // not the last active one.
-  //   asm ( "mcr p15, 0, %[ttbcr], c2, c0, 2" : : [ttbcr] "r" (0x10) );
-  // (Set bit PD0) - get a fault on TLB miss
-
-  // Note: remember which slot most recently updated the slot-specific areas
-  // of the translation tables, so switching away and back can be done without
-  // doing anything as long as there's no TLB miss in the meantime. TODO
-
-  // These are the areas that TaskSlots are known to update with non-Global
-  // entries.
-  clear_app_area();
-  clear_pipes_area();
-  clear_svc_stack_area();
-  
+  bool used = false;
 
-  // Set CONTEXTIDR
-  asm ( "mcr p15, 0, %[asid], c13, c0, 1" : : [asid] "r" (TaskSlot_asid( slot )) );
+  for (uint32_t a = va; a < va + size; a += 4096) {
+    arm32_ptr pointer = { .raw = a };
+    Level_two_translation_table *l2tt = slot_table( tables, pointer.section );
 
-  if (!reclaimed) release_lock( &shared.mmu.lock );
+    if (l2tt != 0) {
+      l2tt->entry[pointer.page].handler = check_task_slot_l2;
+      if (a == va || (pointer.page & 7) == 0) {
+        flush_location( &l2tt->entry[pointer.page] );
+      }
+      used = true;
+    }
+  }
+
+  if (used) {
+    flush_internal_write_queue();
+    invalidate_asid_all_cores( TaskSlot_asid( slot ) );
+    flush_internal_write_queue();
+  }
 
-  clean_cache_to_PoC();
+  if (!reclaimed) release_lock( &shared.mmu.lock );
 }
 
 static void map_at( void *va, uint32_t pa, uint32_t size, bool shared ) 
@@ -1192,6 +1492,11 @@ static void map_at( void *va, uint32_t pa, uint32_t size, bool shared )
     uint32_t p = (uint32_t) &debug_pipe;
     if (kernel_memory && (v >= p && v < p + 16*1024)) kernel_memory = false;
 
+    // Only the kernel writes to the trace pipe (see include/trace.h)
+    extern uint32_t trace_pipe;
+    uint32_t t = (uint32_t) &trace_pipe;
+    if (v >= t && v < t + natural_alignment) kernel_memory = true;
+
     l2tt_entry entry = kernel_memory ? l2_prw : l2_urwx;
 
     entry.S = shared ? 1 : 0;
@@ -52,10 +52,38 @@ static inline bool naturally_aligned( uint32_t location )
   return ((natural_alignment - 1) & location) == 0;
 }
 
+// The level 2 translation tables belonging to a TaskSlot. They are kept
+// for as long as the slot exists, so switching back to a slot only means
+// changing a few level 1 entries, not faulting all its memory in again.
+// An instance is in each TaskSlot, only the MMU code looks inside.
+// Accesses to slot memory in more sections than that fail, as if there
+// were nothing there.
+#define MMU_SLOT_TABLES 16
+
+struct MMU_slot {
+  uint32_t incarnation; // Changes each time the slot is released
+  // The bottom MiB also holds each core's zero page, so the slot's pages
+  // are copied into the core's table, rather than the table switched.
+  struct Level_two_translation_table *bottom_MiB;
+  uint32_t bottom_pages; // Entries of bottom_MiB that may have been mapped
+  uint32_t count;
+  struct {
+    uint32_t section;
+    struct Level_two_translation_table *l2tt;
+  } table[MMU_SLOT_TABLES];
+};
+
 // An instance of this struct will be in the core workspace, called mmu:
 struct MMU_workspace {
   struct Level_two_translation_table *zero_page_l2tt;
   struct Level_two_translation_table *kernel_l2tt;
+
+  // The slot whose tables this core's level 1 table refers to
+  TaskSlot *slot;
+  uint32_t incarnation;
+  uint32_t bottom_pages; // Entries of zero_page_l2tt copied from the slot
+  uint32_t mapped;
+  uint32_t sections[MMU_SLOT_TABLES];
 };
 
 struct MMU_shared_workspace {
@@ -76,23 +104,26 @@ physical_memory_block Kernel_physical_address( uint32_t va );
 TaskSlot *MMU_new_slot();
 void TaskSlot_add( TaskSlot *slot, physical_memory_block memory );
 uint32_t TaskSlot_asid( TaskSlot *slot );
+struct MMU_slot *TaskSlot_mmu( TaskSlot *slot );
 
 void MMU_switch_to( TaskSlot *slot );
 
+// Frees the slot's translation tables and invalidates any TLB entries
+// for its ASID, before it is re-used.
+void MMU_release_slot( TaskSlot *slot );
+
+// Reverts the slot's pages in the range to faulting, on all cores.
+void MMU_unmap_slot_range( TaskSlot *slot, uint32_t va, uint32_t size );
+
 // Kernel memory mapping routines
 void MMU_map_at( void *va, uint32_t pa, uint32_t size );
 void MMU_map_shared_at( void *va, uint32_t pa, uint32_t size );
 void MMU_map_device_at( void *va, uint32_t pa, uint32_t size ); // Devices always shared
 
-// Map the block twice into virtual memory (where? who decides?)
-// The reason is that that allows the readers and writers to see
-// contiguous memory, even for data that overruns the end of the
-// memory and starts again at the beginning.
-// Does it have to be the full double, or just the configured
-// maximum block size?
-// Note: this memory can be in top bit set address range, since
-// only new code will use it.
-//void MMU_map_pipe( uint32_t phys, uint32_t size, uint32_t over );
+// Pipes are mapped twice into virtual memory, back to back, so that
+// readers and writers see contiguous memory, even for data that overruns
+// the end of the memory and starts again at the beginning. That is done
+// lazily, by Kernel_physical_address, in the slot's pipes window.
 
 void BOOT_finished_allocating( uint32_t core, volatile startup *startup );
 void Initialise_privileged_mode_stacks(); // Must be called before any exceptions
@@ -32,6 +32,7 @@
 
 typedef struct handler handler;
 typedef struct os_pipe os_pipe;
+typedef struct vfp_context vfp_context;
 
 struct handler {
   void (* code)();
@@ -40,16 +41,17 @@ struct handler {
 };
 
 struct TaskSlot {
-  // FIXME Locks the slot to a single core (at a time)?
-  // Is that so terrible?
-  uint32_t *svc_sp_when_unmapped;
-  Task *svc_stack_owner;
-  Task *waiting_for_slot_stack;
+  bool allocated; // Set by get_task_slot
+
+  // Leased for the duration of a SWI, see svc_stack_top_of
+  Task *svc_stack_owner[TASK_SVC_STACKS];
+  Task *waiting_for_slot_stack; // For one of them to be released
 
   transient_callback *transient_callbacks;
 
   uint32_t lock;
   physical_memory_block blocks[50];
+  struct MMU_slot mmu; // Survives the slot being released
   handler handlers[17];
   Task *creator; // creator's slot is parent slot
   char const *command;
@@ -73,6 +75,14 @@ struct __attribute__(( packed, aligned( 4 ) )) Task {
   TaskSlot *slot;
   Task *next; // Doubly-linked list. Neither next or prev shall be zero,
   Task *prev; // Tasks not in a list will be a list of 1.
+  bool pinned; // Only runs on the core it was created on (idle and interrupt tasks)
+  uint32_t affinity; // Bit per core it may be scheduled on, see TaskOp_SetAffinity
+  uint32_t legacy_held; // Bit per legacy_class owned
+  uint32_t legacy_core; // 1 + the core whose VDU state the Task has used, or 0
+  uint32_t swi_queued_at; // Generic timer, when queued to retry a SWI, or 0
+  vfp_context *vfp; // Allocated when the Task first uses VFP or NEON
+  uint32_t svc_stack; // 1 + index of the slot's svc stack it's leasing, or 0
+  uint32_t *svc_sp_when_unmapped; // In that stack, when not running
 };
 
 // Declare functions like dll_attach_Task and mpsafe_detach_Task_head
@@ -80,6 +90,10 @@ MPSAFE_DLL_TYPE( Task );
 
 extern svc_registers svc_stack_top;
 
+// See vfp.c
+void Task_vfp_save( Task *task );
+void Task_vfp_free( Task *task );
+
 static inline bool in_slot_svc_stack( void *p )
 {
   // This will stop working if the stack top is redefined to be above
@@ -88,6 +102,13 @@ static inline bool in_slot_svc_stack( void *p )
   return (((uint32_t)p) >> 20) == ((uint32_t) &(svc_stack_top) >> 20);
 }
 
+// The top of one of the slot's svc stacks (the first is svc_stack_top)
+static inline svc_registers *svc_stack_top_of( uint32_t index )
+{
+  return (svc_registers *) (((uint32_t) &svc_stack_top)
+                          - index * (TASK_SVC_STACK_PAGES + 1) * 4096);
+}
+
 static inline void *core_svc_stack_top()
 {
   return (&workspace.kernel.svc_stack + 1);
@@ -120,9 +141,15 @@ static inline bool usr32_caller( svc_registers *regs )
   return (regs->spsr & 0xf) == 0;
 }
 
+// Leasing one of its slot's svc stacks
 static inline bool owner_of_slot_svc_stack( Task *task )
 {
-  return task->slot->svc_stack_owner == task;
+  return task->svc_stack != 0;
+}
+
+static inline svc_registers *task_svc_stack_top( Task *task )
+{
+  return svc_stack_top_of( task->svc_stack - 1 );
 }
 
 static inline Task *task_from_handle( uint32_t handle )
@@ -149,22 +176,28 @@ static inline
 #endif
 void save_task_context( Task *task, svc_registers const *regs )
 {
-  TaskSlot *slot = task->slot;
-
   task->regs = *regs;
 
   if (owner_of_slot_svc_stack( task )) {
-    slot->svc_sp_when_unmapped = (uint32_t*) (regs+1);
+    task->svc_sp_when_unmapped = (uint32_t*) (regs+1);
   }
 
-  // TODO floating point context, etc.; these should be done
-  // in a lazy way, trapping the next use of FP and storing
-  // and restoring its state then, if necessary.
-  // Each task should have its own state, but only if FP used.
+  // The floating point registers are restored lazily, trapping the
+  // Task's next use of VFP or NEON (see vfp.c), but they're saved now,
+  // if the Task has used them, in case it resumes on another core.
+  if (task == workspace.task_slot.vfp_owner) {
+    Task_vfp_save( task );
+  }
 }
 
+// For a blocked Task that's being woken: returns true if its affinity
+// excludes this core, in which case it has been queued for a core it may
+// run on, instead of being attached to this core's running list.
+bool send_to_allowed_core( Task *task );
+
 void kick_debug_handler_thread();
 bool this_is_debug_receiver();
+void kick_trace_pipe();
 
 static inline bool is_a_task( Task *t )
 {
@@ -25,10 +25,21 @@ static inline uint32_t handle_from_pipe( os_pipe *pipe )
   return (uint32_t) pipe;
 }
 
-/* Initial implementation of pipes:
- *  4KiB each
- *  Located at top of bottom MiB (really needs fixing next!)
+/* Pipes:
+ *  The capacity is a power of two, at least 4KiB and at least the maximum
+ *  block size, in physically contiguous memory.
+ *  Each end of a pipe is given a virtual window of twice the capacity, in
+ *  the slot-specific area above pipes_base (see pipe_windows_size), aligned
+ *  to its size. The memory is mapped into both halves, so the data or space
+ *  returned by WaitForData or WaitForSpace is always contiguous, even when
+ *  it wraps around the end of the buffer.
+ *  The windows are mapped lazily, by the data abort handler, see
+ *  Pipe_physical_address.
  *  debug pipe a special case, mapped in top MiB
+ *  All the mappings are Normal, write-back and shareable, so the cores'
+ *  data caches keep the ends coherent without any maintenance.
+ *  trace pipes are written by the kernel, through a mapping at trace_pipe
+ *  (see include/trace.h), and read by an ordinary task.
  */
 
 struct os_pipe {
@@ -41,11 +52,14 @@ struct os_pipe {
   uint32_t receiver_va; // Zero if not allocated
 
   uint32_t physical;
+  uint32_t capacity; // Power of two, the virtual windows are twice this
   uint32_t allocated_mem;
   uint32_t max_block_size;
   uint32_t max_data;
   uint32_t write_index;
   uint32_t read_index;
+
+  bool written_by_kernel; // A trace pipe, no task may send to it
 };
 
 bool this_is_debug_receiver()
@@ -64,9 +78,9 @@ static uint32_t debug_pipe_sender_va()
 {
   extern uint32_t debug_pipe; // Ensure the size and the linker script match
   os_pipe *pipe = (void*) workspace.kernel.debug_pipe;
-  uint32_t va = 2 * pipe->max_block_size + (uint32_t) &debug_pipe;
-  MMU_map_at( (void*) va, pipe->physical, pipe->max_block_size );
-  MMU_map_at( (void*) (va + pipe->max_block_size), pipe->physical, pipe->max_block_size );
+  uint32_t va = 2 * pipe->capacity + (uint32_t) &debug_pipe;
+  MMU_map_shared_at( (void*) va, pipe->physical, pipe->capacity );
+  MMU_map_shared_at( (void*) (va + pipe->capacity), pipe->physical, pipe->capacity );
   return va;
 }
 
@@ -76,38 +90,56 @@ static uint32_t debug_pipe_receiver_va()
   uint32_t va = (uint32_t) &debug_pipe;
   os_pipe *pipe = (void*) workspace.kernel.debug_pipe;
   // FIXME: map read-only
-  MMU_map_at( (void*) va, pipe->physical, pipe->max_block_size );
-  MMU_map_at( (void*) (va + pipe->max_block_size), pipe->physical, pipe->max_block_size );
+  MMU_map_shared_at( (void*) va, pipe->physical, pipe->capacity );
+  MMU_map_shared_at( (void*) (va + pipe->capacity), pipe->physical, pipe->capacity );
   return va;
 }
 
+// The virtual windows of the ends of the pipe in the slot, or zero.
+// The debug pipe is mapped into kernel memory, not a slot's window.
 static uint32_t local_sender_va( TaskSlot *slot, os_pipe *pipe )
 {
-#if 0
-WriteS( "local_sender_va " ); WriteNum( pipe->sender );
-if (pipe->sender != 0) {
-  WriteNum( pipe->sender->slot ); WriteNum( slot );
-}
-NewLine;
-#endif
-  if ((uint32_t) pipe == workspace.kernel.debug_pipe) {
-    return debug_pipe_sender_va();
-  }
-  asm ( "bkpt 64" );
+  if ((uint32_t) pipe == workspace.kernel.debug_pipe) return 0;
   if (pipe->sender == 0 || pipe->sender->slot != slot) return 0;
   return pipe->sender_va;
 }
 
 static uint32_t local_receiver_va( TaskSlot *slot, os_pipe *pipe )
 {
-  if ((uint32_t) pipe == workspace.kernel.debug_pipe) {
-    return debug_pipe_receiver_va();
-  }
-  asm ( "bkpt 64" );
+  if ((uint32_t) pipe == workspace.kernel.debug_pipe) return 0;
   if (pipe->receiver == 0 || pipe->receiver->slot != slot) return 0;
   return pipe->receiver_va;
 }
 
+// The part of the pipe's memory that appears at va, in the window at
+// local_va. Large pipes are mapped a piece at a time (a block's size must
+// fit in 20 bits, and only one MiB is mapped at a time, anyway).
+static physical_memory_block pipe_memory( os_pipe *pipe, uint32_t local_va, uint32_t va )
+{
+  static const uint32_t piece = (1 << 19);
+
+  physical_memory_block result;
+
+  result.virtual_base = local_va;
+  result.physical_base = pipe->physical;
+
+  if (!in_range( va, local_va, pipe->capacity )) {
+    result.virtual_base += pipe->capacity; // The second mapping
+  }
+
+  if (pipe->capacity <= piece) {
+    result.size = pipe->capacity;
+  }
+  else {
+    uint32_t offset = (va - result.virtual_base) & ~(piece - 1);
+    result.virtual_base += offset;
+    result.physical_base += offset;
+    result.size = piece;
+  }
+
+  return result;
+}
+
 physical_memory_block Pipe_physical_address( TaskSlot *slot, uint32_t va )
 {
   // Note to self: parameters are actually &result, slot, va, in r0, r1, r2.
@@ -115,15 +147,6 @@ physical_memory_block Pipe_physical_address( TaskSlot *slot, uint32_t va )
   // Slot is locked.
   physical_memory_block result = { 0, 0, 0 }; // Fail
 
-  // FIXME This implementation is trivial and will break almost immediately!
-  // Allocates the pipe virtual memory at the top of the first MiB of memory.
-  // Only works with 4KiB pages, something smaller (and larger) might be useful.
-
-  // It will do for proof of concept, though.
-  // (I would recommend allocating virtual addresses in the top GiB, since
-  // all tasks using pipes will be aware they have a bit more than 64M to play
-  // with.)
-
   // One list of pipes shared between all slots and cores. To be fixed? TODO
 
   bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
@@ -133,23 +156,13 @@ physical_memory_block Pipe_physical_address( TaskSlot *slot, uint32_t va )
   while (this_pipe != 0 && result.size == 0) {
     uint32_t local_va;
     local_va = local_sender_va( slot, this_pipe );
-    if (local_va != 0 && in_range( va, local_va, 2 * this_pipe->max_block_size)) {
-      result.size = this_pipe->max_block_size;
-      result.physical_base = this_pipe->physical;
-      result.virtual_base = local_va;
-      if (!in_range( va, local_va, this_pipe->max_block_size)) {
-        result.virtual_base += this_pipe->max_block_size;
-      }
+    if (local_va != 0 && in_range( va, local_va, 2 * this_pipe->capacity )) {
+      result = pipe_memory( this_pipe, local_va, va );
     }
     local_va = local_receiver_va( slot, this_pipe );
-    if (local_va != 0 && in_range( va, local_va, 2 * this_pipe->max_block_size)) {
+    if (local_va != 0 && in_range( va, local_va, 2 * this_pipe->capacity )) {
       // TODO Map read-only
-      result.size = this_pipe->max_block_size;
-      result.physical_base = this_pipe->physical;
-      result.virtual_base = local_va;
-      if (!in_range( va, local_va, this_pipe->max_block_size)) {
-        result.virtual_base += this_pipe->max_block_size;
-      }
+      result = pipe_memory( this_pipe, local_va, va );
     }
     this_pipe = this_pipe->next;
   }
@@ -201,6 +214,23 @@ static bool PipeOp_CreationProblem( svc_registers *regs )
   return false;
 }
 
+static bool PipeOp_BlockTooLarge( svc_registers *regs )
+{
+  static error_block error = { 0x888, "Pipe block size exceeded" };
+  regs->r[0] = (uint32_t) &error;
+  return false;
+}
+
+// A slot has level 2 tables for at most MMU_SLOT_TABLES sections of its
+// memory. Its pipe windows are kept to the bottom of the pipes area, so
+// they never need more than a quarter of them, leaving the rest for
+// application memory and the svc stacks.
+static const uint32_t pipe_windows_size = (MMU_SLOT_TABLES / 4) << 20;
+
+// The largest pipe; each end of a pipe needs a window of twice the
+// capacity, and both ends may be in the same slot.
+static const uint32_t max_pipe_capacity = ((MMU_SLOT_TABLES / 4) << 20) / 4;
+
 static bool PipeCreate( svc_registers *regs )
 {
   uint32_t max_block_size = regs->r[2];
@@ -215,16 +245,28 @@ static bool PipeCreate( svc_registers *regs )
     // FIXME
     return Kernel_Error_UnimplementedSWI( regs );
   }
-  else if (max_block_size == 0) {
+  else if (max_block_size == 0 || max_block_size > max_pipe_capacity) {
     return PipeOp_CreationError( regs );
   }
 
+  uint32_t capacity = 4096;
+  while (capacity < max_block_size) capacity = capacity << 1;
+
   os_pipe *pipe = rma_allocate( sizeof( os_pipe ) );
 
   if (pipe == 0) {
     return PipeOp_CreationProblem( regs );
   }
 
+  pipe->physical = Kernel_allocate_pages( capacity, 4096 );
+  // Now debug output uses PipeOp, PipeOp can't do debug output
+  // WriteS( "Physical memory: " ); WriteNum( pipe->physical ); NewLine;
+
+  if (pipe->physical == 0xffffffff) {
+    rma_free( pipe );
+    return PipeOp_CreationProblem( regs );
+  }
+
   // At the moment, the running task is the only one that knows about it.
   // If it goes away, the resource should be cleaned up.
   pipe->sender = pipe->receiver = workspace.task_slot.running;
@@ -233,9 +275,7 @@ static bool PipeCreate( svc_registers *regs )
   pipe->max_block_size = max_block_size;
   pipe->max_data = max_data;
   pipe->allocated_mem = allocated_mem;
-  pipe->physical = Kernel_allocate_pages( 4096, 4096 );
-  // Now debug output uses PipeOp, PipeOp can't do debug output
-  // WriteS( "Physical memory: " ); WriteNum( pipe->physical ); NewLine;
+  pipe->capacity = capacity;
 
   // The following will be updated on the first blocking calls
   // to WaitForSpace and WaitForData, respectively.
@@ -245,6 +285,8 @@ static bool PipeCreate( svc_registers *regs )
   pipe->write_index = allocated_mem & 0xfff;
   pipe->read_index = allocated_mem & 0xfff;
 
+  pipe->written_by_kernel = false;
+
   bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
 
   pipe->next = shared.kernel.pipes;
@@ -257,34 +299,53 @@ static bool PipeCreate( svc_registers *regs )
   return true;
 }
 
+extern uint32_t pipes_base;
 extern uint32_t pipes_top;
 
-static uint32_t allocate_virtual_address( TaskSlot *slot, os_pipe *pipe )
+// If the window at local_va (of the other pipe) overlaps the one at va,
+// returns the next possible address for the window, otherwise va.
+static uint32_t past_window( uint32_t va, uint32_t size, uint32_t local_va, os_pipe *other )
 {
-  // Proof of concept locates pipes at the top of the first megabyte of
-  // virtual RAM
-  // This is, of course, ridiculous.
-  // Fix that in rool.script and data abort handler
-  // Doesn't cope with removing pipes FIXME
+  uint32_t end = local_va + 2 * other->capacity;
 
-  asm ( "bkpt 64" );
+  if (local_va == 0 || local_va >= va + size || end <= va) return va;
 
-  uint32_t va = (uint32_t) &pipes_top;
+  return (end + size - 1) & ~(size - 1);
+}
+
+// Lowest free window in the slot's pipes area, aligned to its size, or
+// zero if there isn't room (within pipe_windows_size). Called with the
+// pipes lock held.
+static uint32_t allocate_virtual_address( TaskSlot *slot, os_pipe *pipe )
+{
+  uint32_t size = 2 * pipe->capacity;
+  uint32_t va = (uint32_t) &pipes_base;
+  uint32_t top = (uint32_t) &pipes_base + pipe_windows_size;
+
+  assert( top <= (uint32_t) &pipes_top );
 
   os_pipe *this_pipe = shared.kernel.pipes;
 
-  while (this_pipe != 0) {
-    uint32_t local_va;
-    local_va = local_sender_va( slot, this_pipe );
-    if (local_va != 0 && local_va < va) va = local_va;
-    local_va = local_receiver_va( slot, this_pipe );
-    if (local_va != 0 && local_va < va) va = local_va;
-    this_pipe = this_pipe->next;
+  while (this_pipe != 0 && va + size <= top) {
+    uint32_t moved;
+    moved = past_window( va, size, local_sender_va( slot, this_pipe ), this_pipe );
+    moved = past_window( moved, size, local_receiver_va( slot, this_pipe ), this_pipe );
+
+    if (moved != va) {
+      // Check all the pipes again, from the new address
+      va = moved;
+      this_pipe = shared.kernel.pipes;
+    }
+    else {
+      this_pipe = this_pipe->next;
+    }
   }
 
-  // WriteS( "Allocated pipe VA " ); WriteNum( va - 2 * pipe->max_block_size ); NewLine;
+  if (va + size > top) return 0;
 
-  return va - 2 * pipe->max_block_size;
+  // WriteS( "Allocated pipe VA " ); WriteNum( va ); NewLine;
+
+  return va;
 }
 
 static uint32_t data_in_pipe( os_pipe *pipe )
@@ -294,17 +355,55 @@ static uint32_t data_in_pipe( os_pipe *pipe )
 
 static uint32_t space_in_pipe( os_pipe *pipe )
 {
-  return pipe->max_block_size - data_in_pipe( pipe );
+  return pipe->capacity - data_in_pipe( pipe );
 }
 
+// Because of the double mapping, all the data (or space) is contiguous
+// from these locations.
 static uint32_t read_location( os_pipe *pipe, TaskSlot *slot )
 {
-  return pipe->receiver_va + (pipe->read_index % pipe->max_block_size);
+  return pipe->receiver_va + (pipe->read_index & (pipe->capacity - 1));
 }
 
 static uint32_t write_location( os_pipe *pipe, TaskSlot *slot )
 {
-  return pipe->sender_va + (pipe->write_index % pipe->max_block_size);
+  return pipe->sender_va + (pipe->write_index & (pipe->capacity - 1));
+}
+
+// Hands the records written to this core's trace pipe since the last time
+// over to the receiver, waking it if it's waiting for them, and updates
+// the space for more. Called with the pipes lock held, interrupts disabled.
+static void publish_trace( os_pipe *pipe )
+{
+  trace_buffer *trace = &workspace.kernel.trace;
+
+  uint32_t written = trace->written;
+
+  if (written != 0) {
+    pipe->write_index += written;
+    trace->written = 0;
+  }
+
+  trace->location = (void*) write_location( pipe, 0 );
+  trace->available = space_in_pipe( pipe );
+
+  Task *receiver = pipe->receiver;
+
+  if (pipe->receiver_waiting_for > 0
+   && pipe->receiver_waiting_for <= data_in_pipe( pipe )) {
+    pipe->receiver_waiting_for = 0;
+
+    receiver->regs.r[2] = data_in_pipe( pipe );
+    receiver->regs.r[3] = read_location( pipe, 0 );
+
+    trace_event( Trace_PipeUnblocked, pipe, receiver );
+
+    if (!send_to_allowed_core( receiver )) {
+      // Ready to run, after the running task
+      dll_attach_Task( receiver, &workspace.task_slot.running );
+      workspace.task_slot.running = workspace.task_slot.running->next;
+    }
+  }
 }
 
 #ifdef NOT_DEBUGGING
@@ -319,12 +418,17 @@ bool PipeWaitForSpace( svc_registers *regs, os_pipe *pipe )
   Task *next = running->next;
   TaskSlot *slot = running->slot;
 
-  if (pipe->sender != running
-   && pipe->sender != 0
-   && (uint32_t) pipe != workspace.kernel.debug_pipe) {
+  if (pipe->written_by_kernel
+   || (pipe->sender != running
+    && pipe->sender != 0
+    && (uint32_t) pipe != workspace.kernel.debug_pipe)) {
     return PipeOp_NotYourPipe( regs );
   }
 
+  if (amount > pipe->capacity) {
+    return PipeOp_BlockTooLarge( regs );
+  }
+
   bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
 
   if (pipe->sender == 0) {
@@ -333,9 +437,14 @@ bool PipeWaitForSpace( svc_registers *regs, os_pipe *pipe )
 
   if (pipe->sender_va == 0) {
     if ((uint32_t) pipe == workspace.kernel.debug_pipe)
-      pipe->sender_va = debug_pipe_sender_va( slot, pipe );
+      pipe->sender_va = debug_pipe_sender_va();
     else
       pipe->sender_va = allocate_virtual_address( slot, pipe );
+
+    if (pipe->sender_va == 0) {
+      if (!reclaimed) release_lock( &shared.kernel.pipes_lock );
+      return PipeOp_CreationProblem( regs );
+    }
   }
 
   uint32_t available = space_in_pipe( pipe );
@@ -357,6 +466,8 @@ bool PipeWaitForSpace( svc_registers *regs, os_pipe *pipe )
     workspace.task_slot.running = next;
     regs->r[2] = 0xb00b00b0;
 
+    trace_event( Trace_PipeBlocked, pipe, running );
+
     // Blocked, waiting for data.
     dll_detach_Task( running );
   }
@@ -381,18 +492,14 @@ bool PipeSpaceFilled( svc_registers *regs, os_pipe *pipe )
 
   assert( running != ((os_pipe*) workspace.kernel.debug_pipe)->receiver );
 
-  if (pipe->sender != running
-   && (uint32_t) pipe != workspace.kernel.debug_pipe) {
+  if (pipe->written_by_kernel
+   || (pipe->sender != running
+    && (uint32_t) pipe != workspace.kernel.debug_pipe)) {
     // No setting of sender, here, if the task hasn't already checked for
     // space, how is it going to have written to the pipe?
     return PipeOp_NotYourPipe( regs );
   }
 
-  // TODO: Flush only that area, and only as far as necessary (are the two
-  // slots only single core and running on the same core?)
-  // TEST TEST TEST restore the following line!
-  ///asm ( "svc %[swi]" : : [swi] "i" (OS_FlushCache) : "lr" ); // Flush whole cache FIXME
-
   bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
 
   uint32_t available = space_in_pipe( pipe );
@@ -433,17 +540,21 @@ bool PipeSpaceFilled( svc_registers *regs, os_pipe *pipe )
       receiver->regs.r[2] = data_in_pipe( pipe );
       receiver->regs.r[3] = read_location( pipe, slot );
 
-      // Make the receiver ready to run when the sender blocks (likely when
-      // the pipe is full).
-      dll_attach_Task( receiver, &workspace.task_slot.running );
-      workspace.task_slot.running = workspace.task_slot.running->next;
+      trace_event( Trace_PipeUnblocked, pipe, receiver );
 
-      assert( workspace.task_slot.running == running );
-      // At least two runnble tasks, now
-      assert( workspace.task_slot.running->next != workspace.task_slot.running );
+      if (!send_to_allowed_core( receiver )) {
+        // Make the receiver ready to run when the sender blocks (likely
+        // when the pipe is full).
+        dll_attach_Task( receiver, &workspace.task_slot.running );
+        workspace.task_slot.running = workspace.task_slot.running->next;
 
-      assert( receiver->next = running );
-      assert( running->prev == receiver );
+        assert( workspace.task_slot.running == running );
+        // At least two runnble tasks, now
+        assert( workspace.task_slot.running->next != workspace.task_slot.running );
+
+        assert( receiver->next = running );
+        assert( running->prev == receiver );
+      }
     }
   }
 
@@ -452,13 +563,43 @@ bool PipeSpaceFilled( svc_registers *regs, os_pipe *pipe )
   return error == 0;
 }
 
+// An end of the pipe is being passed from one task to another; if the new
+// task is in a different slot, the old slot's window is unmapped and may
+// be re-used. The unmapping is done before the window is released, without
+// the pipes lock (the MMU lock is claimed before the pipes lock when
+// handling a data abort), so no other pipe can be mapped there until the
+// old mappings are gone.
+static void release_window( os_pipe *pipe, Task *old, Task *new, uint32_t *va )
+{
+  if (*va == 0
+   || (uint32_t) pipe == workspace.kernel.debug_pipe
+   || (old != 0 && new != 0 && old->slot == new->slot)) return;
+
+  if (old != 0) {
+    MMU_unmap_slot_range( old->slot, *va, 2 * pipe->capacity );
+  }
+
+  bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
+
+  *va = 0;
+
+  if (!reclaimed) release_lock( &shared.kernel.pipes_lock );
+}
+
 #ifdef NOT_DEBUGGING
 static inline
 #endif
 bool PipePassingOver( svc_registers *regs, os_pipe *pipe )
 {
-  pipe->sender = task_from_handle( regs->r[2] );
-  pipe->sender_va = 0; // FIXME unmap and free the virtual area for re-use
+  if (pipe->written_by_kernel) {
+    return PipeOp_NotYourPipe( regs );
+  }
+
+  Task *sender = task_from_handle( regs->r[2] );
+
+  release_window( pipe, pipe->sender, sender, &pipe->sender_va );
+
+  pipe->sender = sender;
 
   return true;
 }
@@ -500,6 +641,10 @@ bool PipeWaitForData( svc_registers *regs, os_pipe *pipe )
     return PipeOp_NotYourPipe( regs );
   }
 
+  if (amount > pipe->capacity) {
+    return PipeOp_BlockTooLarge( regs );
+  }
+
   bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
 
   if (pipe->receiver == 0) {
@@ -508,11 +653,21 @@ bool PipeWaitForData( svc_registers *regs, os_pipe *pipe )
 
   assert( pipe->receiver == running );
 
+  if ((uint32_t) pipe == workspace.kernel.trace.pipe) {
+    // Don't wait for the next SWI to return before seeing the latest
+    publish_trace( pipe );
+  }
+
   if (pipe->receiver_va == 0) {
     if ((uint32_t) pipe == workspace.kernel.debug_pipe)
-      pipe->receiver_va = debug_pipe_receiver_va( slot, pipe );
+      pipe->receiver_va = debug_pipe_receiver_va();
     else
       pipe->receiver_va = allocate_virtual_address( slot, pipe );
+
+    if (pipe->receiver_va == 0) {
+      if (!reclaimed) release_lock( &shared.kernel.pipes_lock );
+      return PipeOp_CreationProblem( regs );
+    }
   }
 
   uint32_t available = data_in_pipe( pipe );
@@ -520,9 +675,6 @@ bool PipeWaitForData( svc_registers *regs, os_pipe *pipe )
   if (available >= amount) {
     regs->r[2] = available;
     regs->r[3] = read_location( pipe, slot );
-
-    asm ( "svc 0xff" : : : "lr" ); // Flush whole cache FIXME flush less (by ASID of the sender?)
-    assert( (regs->spsr & VF) == 0 );
   }
   else {
     pipe->receiver_waiting_for = amount;
@@ -535,6 +687,8 @@ bool PipeWaitForData( svc_registers *regs, os_pipe *pipe )
 
     assert( workspace.task_slot.running != running );
 
+    trace_event( Trace_PipeBlocked, pipe, running );
+
     // Blocked, waiting for data.
     dll_detach_Task( running );
 
@@ -587,14 +741,15 @@ bool PipeDataConsumed( svc_registers *regs, os_pipe *pipe )
       // WriteS( "Space finally available: " ); WriteNum( pipe->sender_waiting_for ); WriteS( ", remaining: " ); WriteNum( space_in_pipe( pipe ) ); WriteS( ", at " ); WriteNum( write_location( pipe, slot ) ); NewLine;
 #endif
 
-      asm ( "svc 0xff" : : : "lr" ); // Flush whole cache FIXME Invalidate cache for updated area, only if sender on a different core
       pipe->sender_waiting_for = 0;
 
       sender->regs.r[2] = space_in_pipe( pipe );
       sender->regs.r[3] = write_location( pipe, slot );
 
+      trace_event( Trace_PipeUnblocked, pipe, sender );
+
       // "Returns" from SWI next time scheduled
-      if (sender != running) {
+      if (sender != running && !send_to_allowed_core( sender )) {
         Task *tail = running->next;
         dll_attach_Task( sender, &tail );
       }
@@ -615,10 +770,11 @@ static inline
 #endif
 bool PipePassingOff( svc_registers *regs, os_pipe *pipe )
 {
-  pipe->receiver = task_from_handle( regs->r[2] );
-  pipe->receiver_va = 0; // FIXME unmap and free the virtual area for re-use
+  Task *receiver = task_from_handle( regs->r[2] );
 
-  // TODO Unmap from virtual memory (if new receiver not in same slot)
+  release_window( pipe, pipe->receiver, receiver, &pipe->receiver_va );
+
+  pipe->receiver = receiver;
 
   return true;
 }
@@ -850,3 +1006,50 @@ void kick_debug_handler_thread( svc_registers *regs )
   }
 }
 
+// Called on the way out of SWIs, like kick_debug_handler_thread.
+void kick_trace_pipe()
+{
+  trace_buffer *trace = &workspace.kernel.trace;
+
+  // Nothing to hand over, nothing lost for lack of space
+  if (trace->pipe == 0 || (trace->written == 0 && trace->dropped == 0)) return;
+
+  bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
+
+  publish_trace( pipe_from_handle( trace->pipe ) );
+
+  if (!reclaimed) release_lock( &shared.kernel.pipes_lock );
+}
+
+// Makes a new pipe this core's trace pipe. The kernel's end is mapped at
+// trace_pipe (in the core's kernel memory, not a slot's window), the
+// first task to wait for data from it becomes the receiver.
+void setup_trace_pipe( uint32_t handle )
+{
+  extern uint32_t trace_pipe;
+  uint32_t va = (uint32_t) &trace_pipe;
+
+  os_pipe *pipe = pipe_from_handle( handle );
+
+  // Shareable, like the receiver's mapping, so the caches keep the two
+  // ends coherent, whichever cores they run on.
+  MMU_map_shared_at( (void*) va, pipe->physical, pipe->capacity );
+  MMU_map_shared_at( (void*) (va + pipe->capacity), pipe->physical, pipe->capacity );
+
+  bool reclaimed = claim_lock( &shared.kernel.pipes_lock );
+
+  pipe->written_by_kernel = true;
+  pipe->sender = 0;
+  pipe->sender_va = va;
+  pipe->receiver = 0;
+
+  trace_buffer *trace = &workspace.kernel.trace;
+  trace->written = 0;
+  trace->dropped = 0;
+  publish_trace( pipe );
+  trace->pipe = handle;
+
+  shared.kernel.trace_pipes[workspace.core_number] = handle;
+
+  if (!reclaimed) release_lock( &shared.kernel.pipes_lock );
+}
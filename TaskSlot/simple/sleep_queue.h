@@ -0,0 +1,94 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Sleeping Tasks, one queue per core, soonest to wake first.
+//
+// A binary min-heap, ordered by the generic timer count at which each
+// Task is to be woken. Adding a sleeper or taking the next one to wake
+// takes O(log n) comparisons, and the next time to wake is always at the
+// top, so the timer interrupt can be programmed for it.
+//
+// The storage is provided (and grown) by the caller.
+
+typedef struct {
+  uint64_t wake_at;
+  Task *task;
+} sleeper;
+
+typedef struct {
+  sleeper *heap;
+  uint32_t count;
+  uint32_t capacity;
+} sleep_queue;
+
+static inline bool sleep_queue_full( sleep_queue const *q )
+{
+  return q->count == q->capacity;
+}
+
+// Returns ~0 if nothing is sleeping
+static inline uint64_t sleep_queue_next( sleep_queue const *q )
+{
+  return (q->count == 0) ? ~0ull : q->heap[0].wake_at;
+}
+
+static inline void sleep_queue_add( sleep_queue *q, Task *task, uint64_t wake_at )
+{
+  uint32_t i = q->count++;
+
+  // Move parents that wake later down, until there's a place for it
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (q->heap[parent].wake_at <= wake_at) break;
+    q->heap[i] = q->heap[parent];
+    i = parent;
+  }
+
+  q->heap[i].wake_at = wake_at;
+  q->heap[i].task = task;
+}
+
+// Returns a Task due to wake at or before now, or 0
+static inline Task *sleep_queue_take_due( sleep_queue *q, uint64_t now )
+{
+  if (q->count == 0 || q->heap[0].wake_at > now) return 0;
+
+  Task *result = q->heap[0].task;
+
+  sleeper last = q->heap[--q->count];
+  uint32_t i = 0;
+
+  // Move the sooner child up, until last fits
+  for (;;) {
+    uint32_t child = 2 * i + 1;
+    if (child >= q->count) break;
+    if (child + 1 < q->count && q->heap[child + 1].wake_at < q->heap[child].wake_at) child++;
+    if (last.wake_at <= q->heap[child].wake_at) break;
+    q->heap[i] = q->heap[child];
+    i = child;
+  }
+
+  if (q->count != 0) q->heap[i] = last;
+
+  return result;
+}
+
+static inline bool sleep_queue_contains( sleep_queue const *q, Task *task )
+{
+  for (uint32_t i = 0; i < q->count; i++) {
+    if (q->heap[i].task == task) return true;
+  }
+  return false;
+}
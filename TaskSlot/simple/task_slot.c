@@ -50,7 +50,7 @@ static inline void show_task_state( Task *t, uint32_t colour )
   }
 
   uint32_t info = 0;
-  if (t->slot->svc_stack_owner == t)    info |= 0x10000000;
+  if (owner_of_slot_svc_stack( t ))      info |= 0x10000000;
   if (t->next == t)                     info |= 0x01000000; // In a queue of 1
   if (is_irq_task( t ))                 info |= 0x00100000; // Is IRQ task
 
@@ -59,6 +59,16 @@ static inline void show_task_state( Task *t, uint32_t colour )
 
 static void __attribute__(( noinline, noreturn )) resume_task( Task *resume, TaskSlot *loaded );
 static void __attribute__(( noinline )) release_task_waiting_for_stack( Task *task );
+static bool claim_svc_stack( TaskSlot *slot, Task *caller );
+static void __attribute__(( noinline )) hand_over_free_svc_stacks( TaskSlot *slot );
+static void release_legacy_locks( Task *task );
+static error_block *TaskOpLegacyLockStatistics( svc_registers *regs );
+static error_block *TaskOpInterruptLatency( svc_registers *regs );
+static error_block *TaskOpLockStatistics( svc_registers *regs );
+static error_block *TaskOpTrace( svc_registers *regs );
+static error_block *TaskOpSWIStatistics( svc_registers *regs );
+static error_block *TaskOpSetAffinity( svc_registers *regs );
+static error_block *TaskOpGetAffinity( svc_registers *regs );
 
 static bool is_in_list( Task *task, Task **list )
 {
@@ -78,7 +88,7 @@ static bool is_running( Task *task )
 
 static bool is_sleeping( Task *task )
 {
-  return is_in_list( task, &workspace.task_slot.sleeping );
+  return sleep_queue_contains( &workspace.task_slot.sleeping, task );
 }
 
 static bool is_waiting_for_stack( Task *task )
@@ -96,7 +106,7 @@ bool show_tasks_state()
       if (is_irq_task( t )) colour = Blue;
       if (is_sleeping( t )) colour = Yellow;
       if (is_waiting_for_stack( t )) colour = Magenta;
-      if (t->slot->svc_stack_owner == t) colour = Grey;
+      if (owner_of_slot_svc_stack( t )) colour = Grey;
       show_task_state( t, colour );
     }
   }
@@ -129,6 +139,11 @@ static inline void retry_from_swi( svc_registers const *regs, Task *caller, Task
 
   caller->regs.lr -= 4; // Resume at the SVC instruction, not after it
 
+  if (shared.kernel.swi_statistics_enabled) {
+    // Never zero, see c_execute_swi
+    caller->swi_queued_at = ((uint32_t) generic_timer_now()) | 1;
+  }
+
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION
   WriteS( "L< " ); WriteNum( caller ); WriteS( " @ " ); WriteNum( caller->regs.lr ); NewLine;
 #endif
@@ -325,13 +340,22 @@ found:
 
 static void free_task( Task *task )
 {
+  if (task->vfp != 0) Task_vfp_free( task );
   task->regs.lr = 1; // Never a valid pc, so unallocated
 
 }
 
 static void free_task_slot( TaskSlot *slot )
 {
-  slot->svc_sp_when_unmapped = 0;
+  MMU_release_slot( slot );
+
+  // Nothing can still be using the memory, now the TLBs have been cleared
+  for (int i = 0; i < number_of( slot->blocks ) && slot->blocks[i].size != 0; i++) {
+    Kernel_free_pages( slot->blocks[i].physical_base, slot->blocks[i].size );
+    slot->blocks[i].size = 0;
+  }
+
+  slot->allocated = false;
 }
 
 static void binary_to_decimal( int number, char *buffer, int size )
@@ -443,11 +467,26 @@ void __attribute__(( naked )) unset_handler()
   asm ( "bkpt 1" );
 }
 
+static void __attribute__(( naked )) DataAbortHandler()
+{
+  // Entered in usr32 mode, see Task_data_abort. The usr stack may be
+  // the memory that's missing, so get off it before doing anything.
+  register uint32_t *regs;
+  asm volatile ( "svc %[enter]"
+             "\n  push { r0-r12 }"
+             "\n  mov %[regs], sp"
+             : [regs] "=r" (regs)
+             : [enter] "i" (OS_EnterOS)
+             : "lr" );
+  WriteS( "Abort on data transfer" ); NewLine;
+  do_Exit( regs );
+}
+
 static const handler default_handlers[17] = {
   { 0, 0, 0 },                   // RAM Limit for program (0x8000 + amount of RAM)
   { unset_handler, 0, 0 },       // Undefined instruction
   { unset_handler, 0, 0 },       // Prefetch abort
-  { unset_handler, 0, 0 },       // Data abort
+  { DataAbortHandler, 0, 0 },    // Data abort
   { unset_handler, 0, 0 },       // Address exception
   { unset_handler, 0, 0 },       // Other exceptions
   { ErrorHandler, 0, 0 },        // Error
@@ -465,6 +504,41 @@ static const handler default_handlers[17] = {
   { ignore_upcall, 0, 0 }        // UpCall handler
 };
 
+bool Task_data_abort( uint32_t *regs )
+{
+  Task *running = workspace.task_slot.running;
+  uint32_t spsr = regs[14];
+
+  // The kernel making a bad access on behalf of a Task is not the Task's
+  // problem.
+  if (running == 0 || running->slot == 0 || (spsr & 0x1f) != 0x10) return false;
+
+  TaskSlot *slot = running->slot;
+
+  handler *dump = &slot->handlers[13];
+
+  if (dump->code != unset_handler) {
+    // Note: Since ARM7, the buffer is 17 words
+    uint32_t *buffer = (void*) dump->code;
+    for (int i = 0; i < 4; i++) {
+      buffer[i] = regs[8 + i];
+    }
+    for (int i = 4; i < 12; i++) {
+      buffer[i] = regs[i - 4];
+    }
+    buffer[12] = regs[12];
+    asm ( "mrs %[sp], sp_usr" : [sp] "=r" (buffer[13]) );
+    asm ( "mrs %[lr], lr_usr" : [lr] "=r" (buffer[14]) );
+    buffer[15] = regs[13] + 8; // The aborting instruction, as the pc reads
+    buffer[16] = spsr;
+  }
+
+  regs[13] = (uint32_t) slot->handlers[3].code;
+  regs[14] = spsr & ~(1 << 5); // ARM state, still usr32
+
+  return true;
+}
+
 bool do_OS_ReadDefaultHandler( svc_registers *regs )
 {
   int env = regs->r[0];
@@ -550,19 +624,18 @@ static TaskSlot *get_task_slot()
 
   if (!workspace.task_slot.memory_mapped) allocate_taskslot_memory();
 
-  // Unallocated slots have svc_sp_when_unmapped == 0
-
-  TaskSlot new_slot = { .svc_sp_when_unmapped = core_svc_stack_top() };
-  uint32_t top = (uint32_t) new_slot.svc_sp_when_unmapped;
+  TaskSlot new_slot = { .allocated = true };
 
   // FIXME: make this a linked list of free objects
   // FIXME: no need for lock if change_word_if_equal used?
   for (int i = 0; i < INITIAL_MEMORY_FOR_TASKS_AND_SLOTS/sizeof( TaskSlot ) && result == 0; i++) {
     TaskSlot *slot = &task_slots[i];
-    if (0 == change_word_if_equal( (uint32_t*) &slot->svc_sp_when_unmapped, 0, top )) {
+    if (0 == change_word_if_equal( (uint32_t*) &slot->allocated, false, true )) {
       result = slot;
 
+      struct MMU_slot mmu = result->mmu;
       *result = new_slot; // Clear all other fields
+      result->mmu = mmu;
 
 #ifdef DEBUG__WATCH_TASK_SLOTS
 WriteS( "Allocated TaskSlot " ); WriteNum( i ); WriteS( " (" ); WriteNum( result ); WriteS( ")" ); NewLine;
@@ -581,8 +654,7 @@ WriteS( "Allocated TaskSlot " ); WriteNum( i ); WriteS( " (" ); WriteNum( result
 
 static void standard_svc_stack( TaskSlot *slot )
 {
-  uint32_t initial_size = 4096 * 40; // FIXME make smaller, allocate on demand
-  // uint32_t initial_size = 8192;
+  uint32_t size = 4096 * TASK_SVC_STACK_PAGES; // FIXME allocate on demand
   uint32_t top = ((uint32_t) &svc_stack_top);
 
   // TODO: more flexible structure for physical memory blocks.
@@ -593,10 +665,10 @@ static void standard_svc_stack( TaskSlot *slot )
     add_memory_to_slot( slot, phys, (top & ~0xfffff), 4096 );
   }
 
-  // SVC stack
-  {
-    uint32_t phys = Kernel_allocate_pages( initial_size, 4096 );
-    add_memory_to_slot( slot, phys, top - initial_size, initial_size );
+  // SVC stacks, the guard pages between them are left unmapped
+  for (int i = 0; i < TASK_SVC_STACKS; i++) {
+    uint32_t phys = Kernel_allocate_pages( size, 4096 );
+    add_memory_to_slot( slot, phys, ((uint32_t) svc_stack_top_of( i )) - size, size );
   }
 }
 
@@ -709,11 +781,9 @@ TaskSlot *TaskSlot_first()
 
   workspace.task_slot.running = new_task;
 
-  // Has to either be new_task and &svc_stack_top or 0 and core_svc_stack_top
-  // Choose the latter, in case the slot never makes a legacy SWI call (so
-  // no extendible stack required).
-  slot->svc_stack_owner = 0;
-  slot->svc_sp_when_unmapped = (void*) core_svc_stack_top();
+  // The new task doesn't need one of the slot's svc stacks until it
+  // makes a SWI that might block.
+  assert( !owner_of_slot_svc_stack( new_task ) );
 
   assert( workspace.task_slot.running != 0 );
   assert( workspace.task_slot.running == new_task );
@@ -790,8 +860,10 @@ void TaskSlot_detach_from_creator( TaskSlot *slot )
   slot->creator = 0;
   creator->regs.r[0] = 0xbad0bad0; // Not yet implemented handles
 
-  Task *tail = workspace.task_slot.running->next;
-  dll_attach_Task( creator, &tail );
+  if (!send_to_allowed_core( creator )) {
+    Task *tail = workspace.task_slot.running->next;
+    dll_attach_Task( creator, &tail );
+  }
 }
 
 void TaskSlot_new_application( char const *command, char const *args )
@@ -821,10 +893,7 @@ workspace.task_slot.svc_stack_resets++;
 assert( !owner_of_slot_svc_stack( running ) );
 
   // This SWI never returns, so swi_completed is never called...
-  if (shared.task_slot.legacy_caller == running) {
-    shared.task_slot.legacy_depth = 1;
-    Task_kernel_release();
-  }
+  release_legacy_locks( running );
 
   register void *private asm ( "r12" ) = private_word;
   asm ( "isb"
@@ -877,6 +946,14 @@ Task *Task_new( TaskSlot *slot )
 
   result->slot = slot;
   result->resumes = 0;
+  result->pinned = false;
+  result->affinity = (1 << processor.number_of_cores) - 1;
+  result->legacy_held = 0;
+  result->legacy_core = 0;
+  result->swi_queued_at = 0;
+  result->vfp = 0;
+  result->svc_stack = 0;
+  result->svc_sp_when_unmapped = 0;
   dll_new_Task( result );
 
   //WriteS( "New Task: " ); WriteNum( result ); NewLine;
@@ -909,6 +986,7 @@ void TaskSlot_adjust_app_memory( TaskSlot *slot, uint32_t new_limit )
     i++;
   }
   // slots->blocks[i] is the first block after any low page blocks.
+  int first_app_block = i;
   int above = i; // Will be the entry above the last app block
   uint32_t top = (uint32_t) &app_memory_base; // Whether or not there's an app block
 
@@ -926,7 +1004,34 @@ void TaskSlot_adjust_app_memory( TaskSlot *slot, uint32_t new_limit )
   assert( first_unused_block < number_of( slot->blocks ) ); // FIXME get rid of hard limit
 
   if (top > new_limit) {
-    // Ignore shrinking, for now FIXME
+    // Give the pages above the new limit back. Not those in the bottom
+    // MiB, though; they're copied into the tables of every core running
+    // the slot (see MMU_switch_to), so they stay until the slot is freed.
+    uint32_t keep = new_limit < natural_alignment ? natural_alignment : new_limit;
+
+    for (int j = above - 1; j >= first_app_block; j--) {
+      physical_memory_block *block = &slot->blocks[j];
+      uint32_t end = block->virtual_base + block->size;
+
+      if (end <= keep) break;
+
+      uint32_t from = block->virtual_base < keep ? keep : block->virtual_base;
+
+      // No core can still be using the pages after this
+      MMU_unmap_slot_range( slot, from, end - from );
+      Kernel_free_pages( block->physical_base + (from - block->virtual_base), end - from );
+
+      if (from == block->virtual_base) {
+        for (int k = j; k < first_unused_block - 1; k++) {
+          slot->blocks[k] = slot->blocks[k+1];
+        }
+        first_unused_block--;
+        slot->blocks[first_unused_block].size = 0;
+      }
+      else {
+        block->size = from - block->virtual_base;
+      }
+    }
   }
   else if (top < new_limit) {
     for (int j = first_unused_block; j > above; j--) {
@@ -953,6 +1058,11 @@ void TaskSlot_adjust_app_memory( TaskSlot *slot, uint32_t new_limit )
   if (!reclaimed) release_lock( &shared.mmu.lock );
 }
 
+struct MMU_slot *TaskSlot_mmu( TaskSlot *slot )
+{
+  return &slot->mmu;
+}
+
 uint32_t TaskSlot_asid( TaskSlot *slot )
 {
   uint32_t result = (slot - task_slots);
@@ -1054,57 +1164,45 @@ void __attribute__(( noinline )) do_FSControl( uint32_t *regs )
   }
 }
 
-static void __attribute__(( noinline )) c_default_ticker()
+// Wake the Tasks on this core that are due to wake by now. Called with
+// interrupts disabled, from an interrupt task, the woken tasks can safely
+// be placed as running->next, since running is the irq_task, and the
+// sleeping tasks will resume after the SWI they called.
+static void wake_sleepers( uint64_t now )
 {
-  workspace.vectors.zp.MetroGnome++;
-
-  // Interrupts disabled, core-specific
-  if (workspace.task_slot.sleeping != 0) {
-    if (0 == --workspace.task_slot.sleeping->regs.r[1]) {
-      // Called from an interrupt task, can safely be placed as running->next,
-      // since running is the irq_task, and the sleeping task will resume
-      // after the SWI it called (or possibly re-try the SWI, in some cases).
-
-      Task *first = workspace.task_slot.sleeping;
-      Task *still_sleeping = first;
-      Task *last_resume = first;
-
-      // r[1] contains the number of ticks left to sleep for
-      // Find all the tasks to be woken (this one, and all the following with
-      // r[1] == 0).
-#ifdef DEBUG__SHOW_SLEEPS
-      WriteS( "Waking " );
-#endif
-      do {
-#ifdef DEBUG__SHOW_SLEEPS
-        WriteNum( last_resume ); Space;
-#endif
-        last_resume = still_sleeping;
-        still_sleeping = still_sleeping->next;
-      } while (still_sleeping != workspace.task_slot.sleeping
-            && still_sleeping->regs.r[1] == 0);
+  Task *woken = 0;
+  Task *task;
 
+  while (0 != (task = sleep_queue_take_due( &workspace.task_slot.sleeping, now ))) {
 #ifdef DEBUG__SHOW_SLEEPS
-      NewLine;
+    WriteS( "Waking " ); WriteNum( task ); NewLine;
 #endif
+    if (!send_to_allowed_core( task )) {
+      // At the tail, so they run in the order they were due
+      dll_attach_Task( task, &woken );
+      woken = woken->next;
+    }
+  }
 
-      assert( still_sleeping == workspace.task_slot.sleeping
-          || still_sleeping->regs.r[1] != 0 );
-      assert( last_resume != 0 );
-
-      // Some (maybe all) have woken...
-      dll_detach_Tasks_until( &workspace.task_slot.sleeping, last_resume );
+  if (woken != 0) {
+    Task *tail = workspace.task_slot.running->next;
+    // It's possible (likely!) that there's only one running thread,
+    // the idle thread. Using the local variable as the "head" of the
+    // list means the real head isn't changed, regardless.
+    dll_insert_Task_list_at_head( woken, &tail );
+//show_tasks_state();
+  }
+}
 
-      assert( workspace.task_slot.sleeping == still_sleeping
-           || still_sleeping == first );
+static void __attribute__(( noinline )) c_default_ticker()
+{
+  workspace.vectors.zp.MetroGnome++;
 
-      Task *tail = workspace.task_slot.running->next;
-      // It's possible (likely!) that there's only one running thread,
-      // the idle thread. Using the local variable as the "head" of the
-      // list means the real head isn't changed, regardless.
-      dll_insert_Task_list_at_head( first, &tail );
-//show_tasks_state();
-    }
+  // Interrupts disabled, core-specific
+  // The HAL wakes sleepers on time, using TaskOp_WakeSleepers, this
+  // catches them if it doesn't.
+  if (workspace.task_slot.sleeping.count != 0) {
+    wake_sleepers( generic_timer_now() );
   }
 }
 
@@ -1172,9 +1270,11 @@ void __attribute__(( naked )) default_ticker()
   if (waiting->resumes == 0) {
     // Is waiting, detached from the running list
     // Don't replace head, place at head of tail
-    Task *tail = running->next;
-    assert( tail != running );
-    dll_attach_Task( waiting, &tail );
+    if (!send_to_allowed_core( waiting )) {
+      Task *tail = running->next;
+      assert( tail != running );
+      dll_attach_Task( waiting, &tail );
+    }
   }
 
   return 0;
@@ -1363,8 +1463,52 @@ void __attribute__(( naked )) task_exit()
   asm ( "bkpt 2" );
 }
 
+// Bitmaps from the HAL's pending sources handler have space for this many
+#define MAX_INTERRUPT_SOURCES 256
+
+static inline int lowest_set_bit( uint32_t bits )
+{
+  // bits & -bits leaves just the lowest set bit
+  return 31 - __builtin_clz( bits & -bits );
+}
+
+// The first source pending in the range [from, to), or -1
+static int first_pending( uint32_t const *bitmap, uint32_t from, uint32_t to )
+{
+  for (uint32_t w = from >> 5; (w << 5) < to; w++) {
+    uint32_t bits = bitmap[w];
+    if (w == (from >> 5)) bits &= ~0u << (from & 31);
+    if (bits != 0) {
+      uint32_t irq = (w << 5) + lowest_set_bit( bits );
+      return (irq < to) ? irq : -1;
+    }
+  }
+  return -1;
+}
+
+static int next_pending_source()
+{
+  uint32_t bitmap[MAX_INTERRUPT_SOURCES / 32] = { 0 };
+  uint32_t sources = shared.task_slot.number_of_interrupt_sources;
+
+  workspace.task_slot.pending_sources( workspace.task_slot.pending_sources_private, bitmap );
+
+  // Each pending source gets a turn, starting after the last one reported
+  uint32_t last = workspace.task_slot.last_irq;
+  int irq = first_pending( bitmap, last + 1, sources );
+  if (irq < 0) irq = first_pending( bitmap, 0, last + 1 );
+
+  if (irq >= 0) workspace.task_slot.last_irq = irq;
+
+  return irq;
+}
+
 static int next_interrupt_source()
 {
+  if (workspace.task_slot.pending_sources != 0) {
+    return next_pending_source();
+  }
+
 #ifdef DEBUG__IRQV
   register uint32_t device asm( "r0" ); // Device ID returned by HAL
 
@@ -1375,7 +1519,10 @@ static int next_interrupt_source()
 
   // It is expected that the HAL will have claimed this vector and will return
   // the number of the device the interrupt is for.
-  register vector *v asm( "r10" ) = workspace.kernel.vectors[2]; // IrqV - resurrected!
+  // The interrupt is handled before anything else runs on this core, so
+  // the chain can't be freed underneath it.
+  register vector_handler const *h asm( "r10" ) =
+      vector_chain_handlers( workspace.kernel.vectors[2], &workspace.kernel.default_vectors[2] ); // IrqV - resurrected!
 
   register uint32_t device asm( "r0" ); // Device ID returned by HAL
 
@@ -1385,19 +1532,16 @@ static int next_interrupt_source()
       "\n  mov r0, #0"
       "\n  mov r1, #2"
       "\n0:"
-      "\n  ldr r14, [%[v], %[code]]"
-      "\n  ldr r12, [%[v], %[private]]"
+      "\n  ldr r12, [%[h], %[private]]"
+      "\n  ldr r14, [%[h]], %[size]"
       "\n  blx r14"
-      "\n  ldr %[v], [%[v], %[next]]"
       "\n  b 0b"
       "\n1:"
       : "=r" (device)
+      , [h] "+r" (h) // Updated by code
 
-      : [v] "r" (v)
-
-      , [next] "i" ((char*) &((vector*) 0)->next)
-      , [private] "i" ((char*) &((vector*) 0)->private_word)
-      , [code] "i" ((char*) &((vector*) 0)->code) );
+      : [size] "i" (sizeof( vector_handler ))
+      , [private] "i" ((char*) &((vector_handler*) 0)->private_word) );
 #endif
 
   return device;
@@ -1460,6 +1604,9 @@ assert( (handler->regs.spsr & 0x80) != 0 || (handler == workspace.task_slot.runn
 
   Task *running = workspace.task_slot.running;
 
+  // Interrupts for this device are delivered to this core.
+  running->pinned = true;
+
   // Allocate the array if this is the first interrupt task for this core
   // This entry is zeroed on interrupt (and first initialisation)
   assert( workspace.task_slot.irq_tasks[device] == 0 );
@@ -1478,6 +1625,7 @@ assert( (handler->regs.spsr & 0x80) != 0 || (handler == workspace.task_slot.runn
   regs->spsr |= 0x80;
 
   // Any interrupts outstanding, maybe even this one again?
+  // (Not counted in irq_latency, there's no telling when they arrived.)
   Task *irq_task = next_irq_task();
 
   if (irq_task != 0) {
@@ -1558,6 +1706,11 @@ WriteS( "TaskOpStart separate" ); NewLine;
 
   Task *new_task = Task_new( slot );
 
+  if (0 != (regs->r[0] & 0x200)) {
+    // Never to be run on another core (e.g. the idle task)
+    new_task->pinned = true;
+  }
+
 show_task_state( new_task, Yellow );
   assert( new_task->slot == slot );
 
@@ -1599,12 +1752,280 @@ show_task_state( new_task, Blue );
   return 0;
 }
 
+// Only Tasks in usr32 mode with interrupts enabled, that aren't holding
+// on to anything core-specific, may be run on another core.
+// The owner of the slot's svc stack is not in usr32 mode, as far as its
+// SWI is concerned, even if it has been interrupted there.
+// Each core has its own zero page, and the legacy VDU variables in it
+// (cursor, colours, windows, a partly received VDU sequence). A Task that
+// has used them stays with that core's set, see Task_kernel_in_use.
+static inline bool may_run_on_any_core( Task *task )
+{
+  return !task->pinned
+      && usr32_caller( &task->regs )
+      && 0 == (task->regs.spsr & 0x80)
+      && !owner_of_slot_svc_stack( task )
+      && task->legacy_held == 0
+      && task->legacy_core == 0;
+}
+
+static inline bool may_run_on_core( Task *task, uint32_t core )
+{
+  return 0 != (task->affinity & (1 << core))
+      && (task->legacy_core == 0 || task->legacy_core == core + 1);
+}
+
+// The task must not be in any list, and its context must be saved; it
+// may be resumed by another core before this routine returns.
+// It goes into this core's queue or, if it may not run here, the queue
+// of the core with its VDU state or the first core its affinity allows.
+static void share_task( Task *task )
+{
+  assert( task->next == task && task->prev == task );
+  assert( task->affinity != 0 );
+
+  uint32_t core = workspace.core_number;
+  if (!may_run_on_core( task, core )) {
+    if (task->legacy_core != 0)
+      core = task->legacy_core - 1;
+    else
+      core = __builtin_ctz( task->affinity );
+    workspace.task_slot.tasks_migrated++;
+  }
+
+  assert( core < number_of( shared.task_slot.runnable ) );
+
+  mpsafe_insert_Task_at_tail( &shared.task_slot.runnable[core], task );
+
+  workspace.task_slot.tasks_shared++;
+
+  asm volatile ( "dsb sy\n  sev" ); // Wake any idle cores
+}
+
+bool send_to_allowed_core( Task *task )
+{
+  if (may_run_on_core( task, workspace.core_number )) return false;
+
+  share_task( task );
+
+  return true;
+}
+
+// Called with the list locked, see mpsafe_manipulate_Task_list
+static Task *detach_task_for_this_core( Task **head, void *unused )
+{
+  Task *task = *head;
+
+  if (task == 0) return 0;
+
+  do {
+    if (may_run_on_core( task, workspace.core_number )) {
+      if (*head == task) *head = task->next;
+      if (*head == task) *head = 0; // Only item in list
+      else dll_detach_Task( task );
+      return task;
+    }
+    task = task->next;
+  } while (task != *head);
+
+  return 0;
+}
+
+// Take a task from this core's runnable queue or, failing that, from
+// the queue of another core, skipping any whose affinity excludes this
+// core. Returns 0 if there's nothing to be had.
+static Task *find_shared_task()
+{
+  uint32_t cores = processor.number_of_cores;
+  uint32_t core = workspace.core_number;
+
+  for (int i = 0; i < cores; i++) {
+    // Look before claiming the queue, most of the time they'll be empty.
+    if (shared.task_slot.runnable[core] != 0) {
+      Task *task = mpsafe_manipulate_Task_list_returning_item(
+                        &shared.task_slot.runnable[core],
+                        detach_task_for_this_core, 0 );
+      if (task != 0) {
+        if (core == workspace.core_number)
+          workspace.task_slot.tasks_taken++;
+        else
+          workspace.task_slot.tasks_stolen++;
+
+        return task;
+      }
+    }
+
+    if (++core == cores) core = 0;
+  }
+
+  return 0;
+}
+
+// Generic timer counts per microsecond, in 20.12 fixed point, avoiding
+// 64-bit division (__aeabi_uldivmod).
+static uint32_t counts_per_us()
+{
+  if (workspace.task_slot.counts_per_us == 0) {
+    uint32_t frequency = generic_timer_frequency();
+    workspace.task_slot.counts_per_us = ((frequency / 1000000) << 12)
+                                      + (((frequency % 1000000) << 12) / 1000000);
+  }
+  return workspace.task_slot.counts_per_us;
+}
+
+static uint64_t wake_time( svc_registers *regs )
+{
+  uint64_t delay;
+  if ((regs->r[0] & 0xff) == TaskOp_SleepMicroseconds)
+    delay = ((uint64_t) regs->r[1] * counts_per_us()) >> 12;
+  else
+    delay = (uint64_t) regs->r[1] * (generic_timer_frequency() / 100);
+  return generic_timer_now() + delay;
+}
+
+static bool room_to_sleep()
+{
+  sleep_queue *q = &workspace.task_slot.sleeping;
+
+  if (sleep_queue_full( q )) {
+    uint32_t capacity = (q->capacity == 0) ? 32 : 2 * q->capacity;
+    sleeper *heap = rma_allocate( capacity * sizeof( sleeper ) );
+    if (heap == 0) return false;
+    if (q->heap != 0) {
+      memcpy( heap, q->heap, q->count * sizeof( sleeper ) );
+      rma_free( q->heap );
+    }
+    q->heap = heap;
+    q->capacity = capacity;
+  }
+
+  return true;
+}
+
+// Returns the time the next sleeping Task is due to wake, in r0 (low
+// word) and r1 (high word), all ones if none are sleeping. Called by the
+// HAL's timer interrupt task, which should interrupt this core no later
+// than that.
+/* static */ error_block *TaskOpWakeSleepers( svc_registers *regs )
+{
+  wake_sleepers( generic_timer_now() );
+
+  uint64_t next = sleep_queue_next( &workspace.task_slot.sleeping );
+  regs->r[0] = next & 0xffffffff;
+  regs->r[1] = next >> 32;
+
+  return 0;
+}
+
+static Task *affinity_task( svc_registers *regs )
+{
+  if (regs->r[1] == 0) return workspace.task_slot.running;
+
+  Task *task = task_from_handle( regs->r[1] );
+  return is_a_task( task ) ? task : 0;
+}
+
+// r1: Task handle, or 0 for the caller
+// r2: Bit per core the Task may run on, 0 for all of them
+// Returns the previous mask in r2.
+// The caller is moved straight away if it may no longer run on this
+// core, other Tasks when they are next woken or yield. Pinned Tasks (idle
+// and interrupt tasks) stay where they are, as does a caller that can't
+// be moved (one with interrupts disabled or holding a legacy lock); that
+// is an error. So is a mask without the core whose VDU state the Task
+// has used.
+static error_block *TaskOpSetAffinity( svc_registers *regs )
+{
+  Task *running = workspace.task_slot.running;
+  Task *task = affinity_task( regs );
+
+  uint32_t all_cores = (1 << processor.number_of_cores) - 1;
+  uint32_t mask = (regs->r[2] == 0) ? all_cores : (regs->r[2] & all_cores);
+
+  if (task == 0) {
+    static error_block error = { 0x888, "Invalid Task handle" };
+    return &error;
+  }
+
+  if (mask == 0) {
+    static error_block error = { 0x888, "Affinity excludes every core" };
+    return &error;
+  }
+
+  if (task->pinned) {
+    static error_block error = { 0x888, "Task is pinned to its core" };
+    return &error;
+  }
+
+  if (task->legacy_core != 0
+   && 0 == (mask & (1 << (task->legacy_core - 1)))) {
+    static error_block error = { 0x888, "Task uses the VDU state of a core not in the mask" };
+    return &error;
+  }
+
+  uint32_t old = task->affinity;
+
+  if (task == running
+   && 0 == (mask & (1 << workspace.core_number))) {
+    Task *resume = running->next;
+
+    // The idle task is always in the list, and pinned, so the caller
+    // won't be the only Task on this core.
+    assert( resume != running );
+
+    regs->r[2] = old;
+    save_task_context( running, regs );
+
+    if (!may_run_on_any_core( running )) {
+      static error_block error = { 0x888, "Task cannot leave this core at the moment" };
+      return &error;
+    }
+
+    running->affinity = mask;
+
+    // The target core will pick it up when it next looks for work,
+    // straight away if it's idle; share_task wakes it.
+    workspace.task_slot.running = resume;
+    dll_detach_Task( running );
+    share_task( running );
+
+    return 0;
+  }
+
+  regs->r[2] = old;
+  task->affinity = mask;
+
+  return 0;
+}
+
+// r1: Task handle, or 0 for the caller
+// Returns the mask in r2, the number of cores in r3
+static error_block *TaskOpGetAffinity( svc_registers *regs )
+{
+  Task *task = affinity_task( regs );
+
+  if (task == 0) {
+    static error_block error = { 0x888, "Invalid Task handle" };
+    return &error;
+  }
+
+  regs->r[2] = task->affinity;
+  regs->r[3] = processor.number_of_cores;
+
+  return 0;
+}
+
 /* static */ error_block *TaskOpSleep( svc_registers *regs )
 {
   Task *running = workspace.task_slot.running;
 
   assert( is_a_task( running ) );
 
+  if (regs->r[1] != 0 && !room_to_sleep()) {
+    static error_block error = { 0x888, "No memory for sleeping task" };
+    return &error;
+  }
+
   Task *resume = running->next;
 
   assert( is_a_task( resume ) );
@@ -1628,6 +2049,25 @@ WriteS( "Yielding " ); WriteNum( running ); WriteS( ", waking " ); WriteNum( res
       regs->spsr |= CF;
     else
       regs->spsr &= ~CF;
+
+    if (resume == running) {
+      // Nothing else for this core to do (normally, this is the idle
+      // task yielding), look for a Task that can run on any core.
+      Task *task = find_shared_task();
+      if (task != 0) {
+        assert( is_a_task( task ) );
+        dll_attach_Task( task, &workspace.task_slot.running );
+        regs->spsr |= CF;
+      }
+    }
+    else if (may_run_on_any_core( running )) {
+      // There's other work for this core, let an idle core run this
+      // Task, if there is one. Otherwise this core will pick it up again
+      // when it runs out of other Tasks (unless its affinity has changed
+      // since it was put in this core's running list).
+      dll_detach_Task( running );
+      share_task( running );
+    }
   }
   else {
     // This comparison is multiprocessor safe because the result
@@ -1635,8 +2075,8 @@ WriteS( "Yielding " ); WriteNum( running ); WriteS( ", waking " ); WriteNum( res
     // to change the value, or false, in which case we don't care
     // if it's changing elsewhere, no other task will change it
     // to be true.
-    if (running->slot->svc_stack_owner == running) {
-      if (regs+1 == &svc_stack_top) {
+    if (owner_of_slot_svc_stack( running )) {
+      if (regs+1 == task_svc_stack_top( running )) {
         release_task_waiting_for_stack( running );
       }
       else {
@@ -1645,7 +2085,7 @@ WriteS( "Yielding " ); WriteNum( running ); WriteS( ", waking " ); WriteNum( res
       }
     }
 
-    Task *sleeper = workspace.task_slot.sleeping;
+    uint64_t wake_at = wake_time( regs );
 
 #ifdef DEBUG__SHOW_TASK_SWITCHES
 WriteS( "Sleeping " ); WriteNum( running ); WriteS( ", waking " ); WriteNum( resume ); NewLine;
@@ -1655,45 +2095,12 @@ WriteS( "Sleeping " ); WriteNum( running ); WriteS( ", waking " ); WriteNum( res
 
     dll_detach_Task( running );
 
-    if (sleeper == 0) {
-      workspace.task_slot.sleeping = running;
-    }
-    else {
-      // Subtract the times of the tasks that will be woken before this one
-      Task *insert_before = 0;
-      do {
-        if (regs->r[1] > sleeper->regs.r[1]) {
-          regs->r[1] -= sleeper->regs.r[1];
-          assert( (int32_t) regs->r[1] >= 0 );
-          sleeper = sleeper->next;
-        }
-        else {
-          insert_before = sleeper;
-        }
-      } while (sleeper != workspace.task_slot.sleeping
-            && insert_before == 0);
-
-      assert ( sleeper == workspace.task_slot.sleeping || regs->r[1] > sleeper->regs.r[1] );
-
-      // Subtract the remaining time for this task from the next to be
-      // woken (if any)
-      if (insert_before != 0) {
-        insert_before->regs.r[1] -= regs->r[1];
-        assert( (int32_t) insert_before->regs.r[1] >= 0 );
+    sleep_queue_add( &workspace.task_slot.sleeping, running, wake_at );
 
-        Task **list = &insert_before;
-        if (insert_before == workspace.task_slot.sleeping) {
-          // Insert before head of list has to update the head of the list
-          list = &workspace.task_slot.sleeping;
-        }
-
-        dll_attach_Task( running, list );
-      }
-      else {
-        // Insert at tail.
-        dll_attach_Task( running, &workspace.task_slot.sleeping );
-        workspace.task_slot.sleeping = workspace.task_slot.sleeping->next;
-      }
+    // The HAL's timer interrupt may be set for its next tick, bring it
+    // forward if this Task is to wake sooner.
+    if (wake_at < generic_timer_interrupt_time()) {
+      generic_timer_interrupt_at( wake_at );
     }
   }
 
@@ -1764,12 +2171,33 @@ asm ( "bkpt 99" );
     return true;
   }
 
+  if (regs->r[0] == TaskOp_PendingSourcesHandler) {
+    // Allowed from any mode, once per core, after the number of sources
+    // is known.
+    if (shared.task_slot.number_of_interrupt_sources > MAX_INTERRUPT_SOURCES) {
+      static error_block error = { 0x888, "Too many interrupt sources for a pending sources handler" };
+      regs->r[0] = (uint32_t) &error;
+      return false;
+    }
+    workspace.task_slot.pending_sources_private = regs->r[2];
+    workspace.task_slot.pending_sources = (void*) regs->r[1];
+    return true;
+  }
+
   if ((regs->spsr & 0x1f) != 0x10                       // Not usr32 mode
    && (0xff & regs->r[0]) != TaskOp_Start                        // Start user task
    && (0xff & regs->r[0]) != TaskOp_CoreNumber                   // Returns the current core number as a string
+   && (0xff & regs->r[0]) != TaskOp_LegacyLockStatistics
+   && (0xff & regs->r[0]) != TaskOp_LockStatistics
+   && (0xff & regs->r[0]) != TaskOp_SWIStatistics
+   && (0xff & regs->r[0]) != TaskOp_GetAffinity
+   && (0xff & regs->r[0]) != TaskOp_Trace
    && (0xff & regs->r[0]) != TaskOp_DebugString
    && (0xff & regs->r[0]) != TaskOp_DebugNumber
-   && !(regs->r[0] == TaskOp_Sleep && regs->r[1] == 0)) { // yield
+   && (0xff & regs->r[0]) != TaskOp_WakeSleepers
+   && (0xff & regs->r[0]) != TaskOp_InterruptLatency
+   && !(regs->r[0] == TaskOp_Sleep && regs->r[1] == 0)  // yield
+   && !(regs->r[0] == TaskOp_SleepMicroseconds && regs->r[1] == 0)) {
     WriteNum( regs->lr ); Space; WriteNum( regs->spsr ); NewLine;
     static error_block error = { 0x888, "Blocking OS_ThreadOp only supported from usr mode." };
     regs->r[0] = (uint32_t) &error;
@@ -1790,23 +2218,37 @@ asm ( "bkpt 99" );
   assert ( slot != 0 );
   bool reclaimed = claim_lock( &slot->lock );
 
+  // Errors that are just bad input, not worth stopping for
+  bool expected_error = false;
+
   // Start a new thread
   // Exit a thread (last one out turns out the lights for the slot)
   // Wait until woken
-  // Sleep (microseconds)
+  // Sleep (centiseconds or microseconds)
   // Wake thread (setting registers?)
   // Get the handle of the current thread
   // Set interrupt handler (not strictly thread related)
   switch (regs->r[0] & 0xff) { // Allow up to 24 flags
   case TaskOp_Start: error = TaskOpStart( regs ); break;
   case TaskOp_Sleep: error = TaskOpSleep( regs ); break;
+  case TaskOp_SleepMicroseconds: error = TaskOpSleep( regs ); break;
   case TaskOp_WaitUntilWoken: TaskOpWaitUntilWoken( regs ); break;
   case TaskOp_Resume: TaskOpResume( regs ); break;
+  case TaskOp_SetAffinity:
+    error = TaskOpSetAffinity( regs );
+    expected_error = true;
+    break;
+  case TaskOp_GetAffinity:
+    error = TaskOpGetAffinity( regs );
+    expected_error = true;
+    break;
   case TaskOp_LockClaim: TaskOpLockClaim( regs ); break;
   case TaskOp_LockRelease: TaskOpLockRelease( regs ); break;
   case TaskOp_WaitForInterrupt: TaskOpWaitForInterrupt( regs ); break;
   case TaskOp_InterruptIsOff: TaskOpInterruptIsOff( regs );
     break;
+  case TaskOp_WakeSleepers: error = TaskOpWakeSleepers( regs ); break;
+  case TaskOp_InterruptLatency: error = TaskOpInterruptLatency( regs ); break;
 
   case TaskOp_DebugString:
     WriteN( (char const*) regs->r[1], regs->r[2] );
@@ -1816,6 +2258,22 @@ asm ( "bkpt 99" );
     WriteNum( regs->r[1] );
     break;
 
+  case TaskOp_LegacyLockStatistics:
+    error = TaskOpLegacyLockStatistics( regs );
+    break;
+
+  case TaskOp_LockStatistics:
+    error = TaskOpLockStatistics( regs );
+    break;
+
+  case TaskOp_Trace:
+    error = TaskOpTrace( regs );
+    break;
+
+  case TaskOp_SWIStatistics:
+    error = TaskOpSWIStatistics( regs );
+    break;
+
   case TaskOp_CoreNumber:
     if (workspace.task_slot.core_number_string[0] == '\0') {
       binary_to_decimal( workspace.core_number,
@@ -1836,7 +2294,10 @@ asm ( "bkpt 99" );
 
   if (!reclaimed) release_lock( &slot->lock );
 
-  if (error != 0) { asm( "bkpt %[line]" : : [line] "i" (__LINE__) ); regs->r[0] = (uint32_t) error; }
+  if (error != 0) {
+    if (!expected_error) asm( "bkpt %[line]" : : [line] "i" (__LINE__) );
+    regs->r[0] = (uint32_t) error;
+  }
 
   return error == 0;
 }
@@ -1870,6 +2331,16 @@ void __attribute__(( naked, noreturn )) ResumeAfterCallBack()
 
 Task *__attribute__(( noinline )) c_run_irq_tasks( Task *running );
 
+// From the interrupt's arrival (as near as Kernel_default_irq can tell)
+// to the Task handling it resuming, see irq_latency.
+static void record_irq_latency()
+{
+  uint32_t latency = generic_timer_now() - workspace.task_slot.irq_entered;
+  int bucket = (latency == 0) ? 0 : 32 - __builtin_clz( latency );
+  if (bucket > 15) bucket = 15;
+  shared.task_slot.irq_latency[workspace.core_number][bucket]++;
+}
+
 #define PROVE_OFFSET( o, t, n ) \
   while (((uint32_t) &((t *) 0)->o) != (n)) \
     asm ( "  .error \"Code assumes offset of " #o " in " #t " is " #n "\"" );
@@ -1912,6 +2383,9 @@ void __attribute__(( naked, noreturn )) Kernel_default_irq()
   // it's still pointing to workspace.task_slot.running, I beg you!)
   }
 
+  // The first moment the registers are free to read the timer
+  workspace.task_slot.irq_entered = generic_timer_now();
+
   svc_registers *regs = &interrupted_task->regs;
   uint32_t interrupted_mode = regs->spsr & 0x1f;
 
@@ -1940,7 +2414,7 @@ void __attribute__(( naked, noreturn )) Kernel_default_irq()
        "\n  .word 0xffffffff"
                "\n  msr sp_svc, %[resume_sp]"
                : "=r" (resume)
-               , [resume_sp] "=r" (interrupted_task->slot->svc_sp_when_unmapped)
+               , [resume_sp] "=r" (interrupted_task->svc_sp_when_unmapped)
                : "r" (resume)
                : "r1", "memory" );
 
@@ -1995,6 +2469,8 @@ void __attribute__(( naked, noreturn )) Kernel_default_irq()
     assert( owner_of_slot_svc_stack( workspace.task_slot.running )
          == in_slot_svc_stack( sp ) );
     }
+
+    record_irq_latency();
   }
 
   register svc_registers *lr asm ( "lr" ) = &irq_task->regs;
@@ -2037,49 +2513,118 @@ static inline void Sleep( int delay )
       : "lr", "memory" );
 }
 
-// TODO: Multiple levels of blocking: System, Core, Slot, None?
-bool Task_kernel_in_use( svc_registers *regs )
+static char const *const legacy_class_names[Legacy_Classes] = {
+  "None", "Modules", "FileSystem", "General", "VDU", "SysVars", "Heap" };
+
+// Called when the lock appears to be free, to make sure that a Task that
+// queued itself while the lock was being released is not left waiting
+// for ever. The first waiting Task becomes the owner, with a depth of
+// zero until it re-tries its SWI.
+// While the lock is being handed over, its owner is 1.
+static void wake_legacy_waiter( legacy_lock *lock )
+{
+  while (lock->waiting != 0
+      && 0 == change_word_if_equal( (uint32_t*) &lock->owner, 0, 1 )) {
+    Task *next = mpsafe_detach_Task_at_head( &lock->waiting );
+
+    lock->depth = 0;
+    asm volatile ( "dmb sy" );
+    lock->owner = next; // Zero, if another core got there first
+
+    if (next != 0) {
+#ifdef DEBUG__SHOW_LEGACY_PROTECTION
+      WriteS( "L> " ); WriteNum( next ); WriteS( " @ " ); WriteNum( next->regs.lr ); NewLine;
+#endif
+      // Run it next on this core, rather than sharing it with the
+      // other cores; anyone else wanting this class is waiting for it.
+      // Unless its affinity excludes this core.
+      if (!send_to_allowed_core( next )) {
+        mpsafe_insert_Task_after_head( &workspace.task_slot.running, next );
+      }
+      return;
+    }
+  }
+}
+
+void Task_using_vdu_state()
 {
   Task *running = workspace.task_slot.running;
-  TaskSlot *slot = running->slot;
-  Task *next = running->next;
 
-  assert( next != 0 ); // There's always a next, idle tasks don't sleep.
-  assert( next != running ); // There's always a next, idle tasks don't sleep.
+  if (running->legacy_core == 0) {
+    // From now on, the Task's output depends on this core's VDU variables
+    // (and any partly sent VDU sequence in them), it must not be moved
+    // to another core's set.
+    running->legacy_core = workspace.core_number + 1;
+  }
+}
+
+// The innermost class held by the Task, or Legacy_None
+static inline legacy_class innermost_legacy_class( Task *task )
+{
+  if (task->legacy_held == 0) return Legacy_None;
+  return 31 - __builtin_clz( task->legacy_held );
+}
 
-  if (shared.task_slot.legacy_caller == running) {
-    // As the legacy_caller, we're the only Task allowed to change the value
+// Classes are only waited for in order, from the outermost to the
+// innermost, so no two Tasks can each be waiting for the other. A Task
+// that holds a class and calls a SWI in an outer class may only take it
+// if it's free; if it isn't, the SWI is refused with an error rather
+// than risk a deadlock (or two Tasks in the same non-reentrant code).
+bool Task_kernel_in_use( svc_registers *regs, legacy_class c, error_block **refused )
+{
+  Task *running = workspace.task_slot.running;
+  legacy_lock *lock = &shared.task_slot.legacy[c];
+  uint32_t bit = 1 << c;
+
+  assert( c != Legacy_None && c < Legacy_Classes );
+  assert( running->next != 0 ); // There's always a next, idle tasks don't sleep.
+  assert( running->next != running ); // There's always a next, idle tasks don't sleep.
+
+  if (c == Legacy_VDU) Task_using_vdu_state();
+
+  if (lock->owner == running) {
+    // As the owner, we're the only Task allowed to change the value
     // so it acts as a simple lock.
     // Similarly, when it comes to passing control to the next waiting task,
     // this will be the only task allowed to do so. (See Task_kernel_release.)
-    // Already the caller
-    assert( shared.task_slot.legacy_depth > 0 );
-    shared.task_slot.legacy_depth++;
+    // The depth will be zero if the lock has just been handed to this
+    // Task, and it is re-trying its SWI.
+    if (lock->depth++ == 0) lock->claims++;
+    running->legacy_held |= bit;
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION_EXTRA
-    WriteS( "L+ " ); WriteNum( running ); WriteS( " @ " ); WriteNum( regs->lr ); WriteS( ", " ); WriteNum( shared.task_slot.legacy_depth ); NewLine;
+    WriteS( "L+ " ); Write0( legacy_class_names[c] ); Space; WriteNum( running ); WriteS( " @ " ); WriteNum( regs->lr ); WriteS( ", " ); WriteNum( lock->depth ); NewLine;
 #endif
     return false;
   }
 
+  bool out_of_order = (innermost_legacy_class( running ) > c);
+
+  if (out_of_order) {
+    // Holding a class further in than this one; if the owner of this
+    // class is, or will be, waiting for one of those, waiting for it
+    // would deadlock.
+    lock->out_of_order++;
+  }
+
   uint32_t attempt;
   do {
     uint32_t n = (uint32_t) running;
-    uint32_t *lock = (uint32_t*) &shared.task_slot.legacy_caller;
-    attempt = change_word_if_equal( lock, 0, n );
+    attempt = change_word_if_equal( (uint32_t*) &lock->owner, 0, n );
 
     assert( attempt != n );
 
     if (attempt == 0) {
-      // I'm the new legacy caller!
+      // I'm the new owner!
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION
-      WriteS( "L! " ); WriteNum( running ); WriteS( " @ " ); WriteNum( regs->lr );  NewLine;
+      WriteS( "L! " ); Write0( legacy_class_names[c] ); Space; WriteNum( running ); WriteS( " @ " ); WriteNum( regs->lr );  NewLine;
 #endif
-      assert( shared.task_slot.legacy_depth == 0 );
-      shared.task_slot.legacy_depth = 1;
+      lock->depth = 1;
+      lock->claims++;
+      running->legacy_held |= bit;
     }
     else if (attempt == 1) {
-      // Another core is taking control, but it still has
-      // to remove its Task from the legacy_callers list.
+      // Another core is handing the lock over, but it still has to
+      // remove its Task from the waiting list.
       // Try again momentarily, it won't take long.
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION
       WriteS( "L spin blocked " ); WriteNum( n ); NewLine;
@@ -2088,26 +2633,23 @@ bool Task_kernel_in_use( svc_registers *regs )
     else {
       // Another task has it.
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION
-      WriteS( "L? " ); WriteNum( n ); WriteS( " : " ); WriteNum( attempt ); NewLine;
+      WriteS( "L? " ); Write0( legacy_class_names[c] ); Space; WriteNum( n ); WriteS( " : " ); WriteNum( attempt ); NewLine;
 #endif
-      retry_from_swi( regs, running, &shared.task_slot.legacy_callers );
-
-      // In case the legacy_caller finished before we registered our interest by
-      // adding ourselves to the list, check if there is still a legacy_caller
-      if (0 == change_word_if_equal( (uint32_t*) &shared.task_slot.legacy_caller, 0, n )) {
-        // We're the only legacy caller at the moment after all, so remove ourselves from
-        // the waiting queue and continue as if we'd got permission immediately.
-asm( "bkpt 7" );
-        mpsafe_detach_Task( &slot->waiting_for_slot_stack, running );
-        assert( shared.task_slot.legacy_depth == 0 );
-        shared.task_slot.legacy_depth = 1;
-        // continue in this task as the owner
-        // (regs->lr has not been modified by retry_from_swi, so the return point is
-        // after the SVC instruction.)
-        dll_attach_Task( running, &workspace.task_slot.running );
-        assert( running == workspace.task_slot.running );
+      if (out_of_order) {
+        static error_block error = { 0x888, "Legacy SWI class in use by another Task, called out of order" };
+        lock->refused++;
+        *refused = &error;
+        return false;
       }
 
+      lock->blocked++;
+
+      retry_from_swi( regs, running, &lock->waiting );
+
+      // In case the owner finished before we registered our interest by
+      // adding ourselves to the list.
+      wake_legacy_waiter( lock );
+
       return true;
     }
   } while (attempt == 1);
@@ -2115,33 +2657,350 @@ asm( "bkpt 7" );
   return false;
 }
 
-void Task_kernel_release()
+void Task_kernel_release( legacy_class c )
 {
   Task *running = workspace.task_slot.running;
-  assert( running == shared.task_slot.legacy_caller );
+  legacy_lock *lock = &shared.task_slot.legacy[c];
+
+  assert( running == lock->owner );
+  assert( lock->depth > 0 );
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION_EXTRA
-  WriteS( "L- " ); WriteNum( running ); WriteS( ", " ); WriteNum( shared.task_slot.legacy_depth ); NewLine;
-#endif
-  if (0 == --shared.task_slot.legacy_depth) {
-    shared.task_slot.legacy_caller = mpsafe_detach_Task_at_head( &shared.task_slot.legacy_callers );
-    if (shared.task_slot.legacy_caller != 0) {
-      // That task is still blocked, so cannot affect legacy_depth yet
-      shared.task_slot.legacy_depth = 1;
-#ifdef DEBUG__SHOW_LEGACY_PROTECTION
-      WriteS( "L> " ); WriteNum( shared.task_slot.legacy_caller ); WriteS( " @ " ); WriteNum( shared.task_slot.legacy_caller->regs.lr ); NewLine;
+  WriteS( "L- " ); Write0( legacy_class_names[c] ); Space; WriteNum( running ); WriteS( ", " ); WriteNum( lock->depth ); NewLine;
 #endif
-      // TODO mpsafe_insert_Task_at_head( &shared.task_slot.runnable, shared.task_slot.legacy_caller );
-      mpsafe_insert_Task_after_head( &workspace.task_slot.running, shared.task_slot.legacy_caller );
-      // We should assume it's running on another core right now
-    }
+  if (0 == --lock->depth) {
+    running->legacy_held &= ~(1 << c);
+
+    // Ensure that any changes made while holding the lock are visible
+    // before the lock is seen to have been released
+    asm volatile ( "dmb sy" );
+    lock->owner = 0;
+    asm volatile ( "dmb sy" );
+
+    wake_legacy_waiter( lock );
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION
-    else {
+    if (lock->owner == 0) {
       WriteS( "L=" ); WriteNum( running ); WriteS( " @ " ); WriteNum( running->regs.lr ); NewLine; // No other task waiting...
     }
 #endif
   }
 }
 
+// For SWIs that never return, so swi_completed is never called.
+static void release_legacy_locks( Task *task )
+{
+  for (legacy_class c = Legacy_None + 1; c < Legacy_Classes; c++) {
+    legacy_lock *lock = &shared.task_slot.legacy[c];
+    if (lock->owner == task) {
+      lock->depth = 1;
+      Task_kernel_release( c );
+    }
+  }
+}
+
+// r1 = core, r2 = 0 or 16 words for the latency histogram (see
+// irq_latency), if r3 is non-zero, the histogram is cleared after reading.
+// Returns the generic timer frequency in r0.
+static error_block *TaskOpInterruptLatency( svc_registers *regs )
+{
+  uint32_t core = regs->r[1];
+
+  if (core >= processor.number_of_cores) {
+    static error_block error = { 0x888, "No such core" };
+    return &error;
+  }
+
+  uint32_t *histogram = shared.task_slot.irq_latency[core];
+  uint32_t *result = (void*) regs->r[2];
+
+  for (int i = 0; i < number_of( shared.task_slot.irq_latency[0] ); i++) {
+    if (result != 0) result[i] = histogram[i];
+    if (regs->r[3] != 0) histogram[i] = 0;
+  }
+
+  regs->r[0] = generic_timer_frequency();
+
+  return 0;
+}
+
+static error_block *TaskOpLegacyLockStatistics( svc_registers *regs )
+{
+  legacy_class c = regs->r[1];
+
+  if (c <= Legacy_None || c >= Legacy_Classes) {
+    static error_block error = { 0x888, "No such legacy lock class" };
+    return &error;
+  }
+
+  legacy_lock *lock = &shared.task_slot.legacy[c];
+
+  regs->r[0] = (uint32_t) legacy_class_names[c];
+  regs->r[2] = lock->claims;
+  regs->r[3] = lock->blocked;
+  regs->r[4] = lock->out_of_order;
+  regs->r[5] = lock->refused;
+
+  return 0;
+}
+
+// Statistics of the kernel's spinlocks (claim_lock), by lock address; the
+// return address of the latest claim shows where a lock is used.
+// r1 = 0: stop collecting
+//      1: clear, and start collecting
+//      2: read entry r2 (0 to LOCK_STATISTICS_SIZE - 1), returning:
+//         r0 = the lock (0 if the entry is unused), r2 = acquisitions,
+//         r3 = contended acquisitions, r4 = longest wait, r5, r6 = total
+//         wait (low, high word), r7 = return address of the latest claim.
+//      3: write the statistics of every lock seen to the debug output
+// Waits are in generic timer ticks.
+static error_block *TaskOpLockStatistics( svc_registers *regs )
+{
+  lock_statistics *table = shared.kernel.lock_statistics;
+
+  switch (regs->r[1]) {
+  case 0:
+    shared.kernel.lock_statistics_enabled = false;
+    break;
+  case 1:
+    shared.kernel.lock_statistics_enabled = false;
+    memset( table, 0, sizeof( shared.kernel.lock_statistics ) );
+    shared.kernel.lock_statistics_enabled = true;
+    break;
+  case 2:
+    {
+      if (regs->r[2] >= LOCK_STATISTICS_SIZE) {
+        static error_block error = { 0x888, "No such lock statistics entry" };
+        return &error;
+      }
+      lock_statistics *entry = &table[regs->r[2]];
+      regs->r[0] = (uint32_t) entry->lock;
+      regs->r[2] = entry->acquisitions;
+      regs->r[3] = entry->contended;
+      regs->r[4] = entry->max_wait;
+      regs->r[5] = (uint32_t) entry->total_wait;
+      regs->r[6] = (uint32_t) (entry->total_wait >> 32);
+      regs->r[7] = entry->holder;
+    }
+    break;
+  case 3:
+    WriteS( "Lock       Claims     Waited     Longest    Total      Claimed by" ); NewLine;
+    for (int i = 0; i < LOCK_STATISTICS_SIZE; i++) {
+      lock_statistics *entry = &table[i];
+      if (entry->lock != 0) {
+        WriteNum( (uint32_t) entry->lock ); Space;
+        WriteNum( entry->acquisitions ); Space;
+        WriteNum( entry->contended ); Space;
+        WriteNum( entry->max_wait ); Space;
+        WriteNum( (uint32_t) entry->total_wait ); Space;
+        WriteNum( entry->holder ); NewLine;
+      }
+    }
+    break;
+  default:
+    {
+      static error_block error = { 0x888, "Unknown lock statistics reason" };
+      return &error;
+    }
+  }
+
+  return 0;
+}
+
+// The kernel event trace, see include/trace.h
+// r1 = the events to record, on every core (1 << Trace_..., 0 to stop)
+// r2 = core
+// Returns the core's trace pipe in r1 (zero if it doesn't have one), for
+// the caller to read with OS_PipeOp WaitForData and DataConsumed.
+static error_block *TaskOpTrace( svc_registers *regs )
+{
+  uint32_t core = regs->r[2];
+
+  if (core >= processor.number_of_cores) {
+    static error_block error = { 0x888, "No such core" };
+    return &error;
+  }
+
+  if (regs->r[1] >= (1 << Trace_Events)) {
+    static error_block error = { 0x888, "Unknown trace event" };
+    return &error;
+  }
+
+  shared.kernel.trace_mask = regs->r[1];
+  regs->r[1] = shared.kernel.trace_pipes[core];
+
+  return 0;
+}
+
+// The SWI statistics, see include/swi_statistics.h
+
+static swi_statistics *this_cores_swi_statistics( uint32_t swi )
+{
+  swi_statistics_table *table = shared.kernel.swi_statistics[workspace.core_number];
+  if (table == 0) return 0;
+
+  uint32_t generation = shared.kernel.swi_statistics_generation;
+  if (table->generation != generation) {
+    memset( table->entries, 0, sizeof( table->entries ) );
+    asm ( "dmb sy" ); // Cleared before readers can see it's current
+    table->generation = generation;
+  }
+
+  return swi_statistics_entry( table, swi );
+}
+
+// Interrupts are disabled while the entry is updated, in case another
+// Task calls a SWI on this core in the meantime.
+static void record_swi_call( uint32_t swi, uint32_t cycles )
+{
+  uint32_t cpsr = trace_interrupts_off();
+  swi_statistics *entry = this_cores_swi_statistics( swi );
+  if (entry != 0) swi_statistics_call( entry, cycles );
+  trace_interrupts_restore( cpsr );
+}
+
+static void record_swi_wait( uint32_t swi, uint32_t ticks )
+{
+  uint32_t cpsr = trace_interrupts_off();
+  swi_statistics *entry = this_cores_swi_statistics( swi );
+  if (entry != 0) swi_statistics_wait( entry, ticks );
+  trace_interrupts_restore( cpsr );
+}
+
+static swi_statistics_table *new_swi_statistics_table()
+{
+  swi_statistics_table *table = rma_allocate( sizeof( swi_statistics_table ) );
+  if (table != 0) memset( table, 0, sizeof( swi_statistics_table ) );
+  return table;
+}
+
+// Tables are allocated the first time collection is started, and kept.
+static error_block *start_swi_statistics()
+{
+  static error_block no_memory = { 0x888, "No memory for SWI statistics" };
+  error_block *error = 0;
+
+  bool reclaimed = claim_lock( &shared.kernel.swi_statistics_lock );
+
+  if (shared.kernel.swi_statistics_total == 0) {
+    shared.kernel.swi_statistics_total = new_swi_statistics_table();
+  }
+  if (shared.kernel.swi_statistics_total == 0) error = &no_memory;
+
+  for (int core = 0; core < processor.number_of_cores; core++) {
+    if (shared.kernel.swi_statistics[core] == 0) {
+      shared.kernel.swi_statistics[core] = new_swi_statistics_table();
+    }
+    if (shared.kernel.swi_statistics[core] == 0) error = &no_memory;
+  }
+
+  if (error == 0) {
+    shared.kernel.swi_statistics_generation++;
+    shared.kernel.swi_statistics_enabled = true;
+  }
+
+  if (!reclaimed) release_lock( &shared.kernel.swi_statistics_lock );
+
+  return error;
+}
+
+// Adds up the tables of all the cores, and copies the entries with the
+// most cycles to top, returning the number copied.
+static uint32_t read_swi_statistics( swi_statistics *top, uint32_t max, bool clear )
+{
+  swi_statistics_table *total = shared.kernel.swi_statistics_total;
+  if (total == 0) return 0;
+
+  bool reclaimed = claim_lock( &shared.kernel.swi_statistics_lock );
+
+  uint32_t generation = shared.kernel.swi_statistics_generation;
+
+  memset( total->entries, 0, sizeof( total->entries ) );
+
+  for (int core = 0; core < processor.number_of_cores; core++) {
+    swi_statistics_table *table = shared.kernel.swi_statistics[core];
+    // A table from an earlier generation hasn't been cleared yet
+    if (table != 0 && table->generation == generation) {
+      swi_statistics_add( total, table );
+    }
+  }
+
+  uint32_t count = swi_statistics_top( total, top, max );
+
+  if (clear) shared.kernel.swi_statistics_generation++;
+
+  if (!reclaimed) release_lock( &shared.kernel.swi_statistics_lock );
+
+  return count;
+}
+
+void swi_statistics_show( uint32_t max )
+{
+  if (max == 0) return;
+  if (max > SWI_STATISTICS_SIZE) max = SWI_STATISTICS_SIZE;
+
+  swi_statistics *top = rma_allocate( max * sizeof( swi_statistics ) );
+  if (top == 0) return;
+
+  uint32_t count = read_swi_statistics( top, max, false );
+
+  WriteS( "SWI                            Calls      Cycles     Longest <  Waits      Waited" ); NewLine;
+  for (int i = 0; i < count; i++) {
+    swi_statistics *entry = &top[i];
+
+    char name[32];
+    svc_registers name_regs = { .r = { entry->key & ~SWI_STATISTICS_USED, (uint32_t) name, sizeof( name ) - 1 } };
+    do_OS_SWINumberToString( &name_regs );
+    WriteN( name, name_regs.r[2] );
+    for (int c = name_regs.r[2]; c < 31; c++) Space;
+
+    uint32_t longest = number_of( entry->histogram ) - 1;
+    while (longest > 0 && entry->histogram[longest] == 0) longest--;
+
+    WriteNum( entry->calls ); Space;
+    WriteNum( (uint32_t) entry->cycles ); Space;
+    WriteNum( longest == number_of( entry->histogram ) - 1 ? 0xffffffff : (1 << longest) ); Space;
+    WriteNum( entry->waits ); Space;
+    WriteNum( (uint32_t) entry->wait_ticks ); NewLine;
+  }
+
+  rma_free( top );
+}
+
+// Statistics of SWI calls, by SWI number (without the X bit)
+// r1 = 0: stop collecting
+//      1: clear, and start collecting
+//      2: read; r2 = buffer for r3 swi_statistics entries (see
+//         include/swi_statistics.h). The entries with the most cycles,
+//         added up over all the cores, are copied to the buffer, most
+//         first. Returns the number copied in r3, and the frequency of
+//         the generic timer (the units of wait_ticks) in r0.
+//      3: read, as 2, then clear
+//      4: write the r2 entries with the most cycles to the debug output
+static error_block *TaskOpSWIStatistics( svc_registers *regs )
+{
+  switch (regs->r[1]) {
+  case 0:
+    shared.kernel.swi_statistics_enabled = false;
+    break;
+  case 1:
+    return start_swi_statistics();
+  case 2:
+  case 3:
+    regs->r[3] = read_swi_statistics( (void*) regs->r[2], regs->r[3], regs->r[1] == 3 );
+    regs->r[0] = generic_timer_frequency();
+    break;
+  case 4:
+    swi_statistics_show( regs->r[2] );
+    break;
+  default:
+    {
+      static error_block error = { 0x888, "Unknown SWI statistics reason" };
+      return &error;
+    }
+  }
+
+  return 0;
+}
+
 bool do_OS_File( svc_registers *regs )
 {
 Write0( __func__ ); WriteS( " " ); WriteNum( regs->r[0] ); WriteS( " " ); WriteNum( regs->r[1] ); NewLine;
@@ -2385,6 +3244,15 @@ WriteS( "SWI " ); WriteNum( number ); WriteS( " in Task " ); WriteNum( caller );
   if (swi == OS_CallASWI) { number = regs->r[9]; swi = (number & ~Xbit); }
   else if (swi == OS_CallASWIR12) { number = regs->r[12]; swi = (number & ~Xbit); }
 
+  trace_event( Trace_SWIEntry, number, caller );
+
+  if (caller->swi_queued_at != 0) {
+    // Back to retry the SWI, see retry_from_swi
+    uint32_t waited = ((uint32_t) generic_timer_now()) - caller->swi_queued_at;
+    caller->swi_queued_at = 0;
+    record_swi_wait( swi, waited );
+  }
+
   svc_registers *resume_sp = regs + 1;
 
   TaskSlot *slot = caller->slot;
@@ -2426,18 +3294,19 @@ WriteS( "SWI " ); WriteNum( number ); WriteS( " in Task " ); WriteNum( caller );
     && !owner_of_slot_svc_stack( caller )) {
     // Claim the slot stack or block until it's free, if we really need it
 
-    uint32_t *lock = (uint32_t*) &slot->svc_stack_owner;
-    uint32_t key = (uint32_t) caller;
-
-    if (0 == change_word_if_equal( lock, 0, key )) {
-      // Now the owner of the slot specific svc stack
+    if (claim_svc_stack( slot, caller )) {
+      // Now the owner of one of the slot specific svc stacks
 
       // Copy the whole stack contents to the slot's svc_stack, including
       // any values pushed on to the stack by this routine.
+      // TODO: A stack per Task, with sp_svc pointing to it whenever the
+      // Task is in usr32 mode, would avoid this copy, and the moves to
+      // and from the core's stack in Kernel_default_irq; see task_slot.h
+      // for why the pool is leased per SWI instead.
       register uint32_t *stack asm ( "sp" );
       uint32_t *stack_bottom = stack;
       uint32_t *core_stack = core_svc_stack_top();
-      uint32_t *slot_stack = (uint32_t *) &svc_stack_top;
+      uint32_t *slot_stack = (uint32_t *) task_svc_stack_top( caller );
 
       do {
         *--slot_stack = *--core_stack;
@@ -2453,7 +3322,7 @@ WriteS( "SWI " ); WriteNum( number ); WriteS( " in Task " ); WriteNum( caller );
 
       resume_sp = regs + 1;
 
-      slot->svc_sp_when_unmapped = 0xbadf000d; // no_stack;
+      caller->svc_sp_when_unmapped = (void*) 0xbadf000d; // no_stack;
 
       assert( using_slot_svc_stack() );
 
@@ -2465,6 +3334,7 @@ WriteS( "SWI " ); WriteNum( number ); WriteS( " in Task " ); WriteNum( caller );
       workspace.task_slot.svc_stack_claims++;
     }
     else if (needs_slot_svc_stack) {
+      // All the slot's svc stacks are in use by other Tasks
 #ifdef DEBUG__TASK_SWITCHES
       WriteS( "Blocking for slot stack " ); WriteNum( caller ); NewLine;
 #endif
@@ -2480,6 +3350,9 @@ asm ( "bkpt 5" );
 
 // Reached when idle task yields, that's no good.
         retry_from_swi( regs, caller, &slot->waiting_for_slot_stack );
+
+        // In case one was released before the caller was queued
+        hand_over_free_svc_stacks( slot );
       }
     }
     // else leave transient callbacks to the current owner of the stack
@@ -2492,8 +3365,19 @@ asm ( "bkpt 5" );
 
   if (resume == caller) {
     // SWI can be executed by this Task, so go ahead
+    bool counting = shared.kernel.swi_statistics_enabled;
+    uint32_t started = counting ? cycle_counter() : 0;
+
     execute_swi( regs, number );
 
+    if (counting && caller->swi_queued_at == 0) {
+      // Not to be retried, so the call is complete (or the caller is
+      // blocked until it is, which is part of its job)
+      record_swi_call( swi, cycle_counter() - started );
+    }
+
+    trace_event( Trace_SWIExit, number, regs->spsr & VF );
+
     resume = workspace.task_slot.running;
   }
 
@@ -2505,6 +3389,7 @@ asm ( "bkpt 5" );
 
   if (resume == caller && 0 == (regs->spsr & 0x8f)) {
     // Only if interrupts enabled in caller and caller not in SVC mode
+    kick_trace_pipe();
     kick_debug_handler_thread( regs );
 
     if (resume == caller && 0 != (regs->spsr & 0x8f)) {
@@ -2545,7 +3430,7 @@ asm ( ".word 0xfffffffd" );
 asm ( ".word 0xfffffffc" );
 asm  ( "bkpt 4" );
       if (owner_of_slot_svc_stack( caller )) {
-        slot->svc_sp_when_unmapped = (uint32_t*) resume_sp;
+        caller->svc_sp_when_unmapped = (uint32_t*) resume_sp;
       }
 
       assert( slot == caller->slot );
@@ -2568,7 +3453,7 @@ assert( caller->regs.lr != 0 );
     // I will call it when the current task is the owner of the svc_stack, so the
     // CallBack can make legacy SWI calls. FIXME?
 
-    if (slot->callback_requested && resume_sp == &svc_stack_top) {
+    if (slot->callback_requested && resume_sp == task_svc_stack_top( resume )) {
       // Exit through the callback handler, which will
       // update the usr sp and lr for us...
       slot->callback_requested = false;
@@ -2610,8 +3495,9 @@ assert( caller->regs.lr != 0 );
     }
   }
 
-  if (resume_sp == &svc_stack_top) {
-    // Done with slot's svc_stack
+  if (owner_of_slot_svc_stack( resume )
+   && resume_sp == task_svc_stack_top( resume )) {
+    // Done with the slot's svc stack
 
     release_task_waiting_for_stack( resume );
 
@@ -2638,32 +3524,82 @@ fast_return:
 
 static const uint32_t *no_stack = (void*) 0xbaadf00d;
 
+// Lease one of the slot's svc stacks to the caller, if any is free
+static bool claim_svc_stack( TaskSlot *slot, Task *caller )
+{
+  assert( !owner_of_slot_svc_stack( caller ) );
+
+  for (int i = 0; i < TASK_SVC_STACKS; i++) {
+    uint32_t *lock = (uint32_t*) &slot->svc_stack_owner[i];
+
+    if (*lock == 0
+     && 0 == change_word_if_equal( lock, 0, (uint32_t) caller )) {
+      caller->svc_stack = i + 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Only the owner of the stack, or whoever has reserved it, may call this.
+// The new owner, if any, starts with an empty stack, and its SWI will be
+// retried with sp_svc already pointing to it.
+static void hand_over_svc_stack( TaskSlot *slot, uint32_t index, Task *next )
+{
+  if (next != 0) {
+    assert( !owner_of_slot_svc_stack( next ) );
+
+    next->svc_stack = index + 1;
+    next->svc_sp_when_unmapped = (uint32_t*) svc_stack_top_of( index );
+  }
+
+  // The new owner cannot do anything until it has been put into the running list
+  slot->svc_stack_owner[index] = next;
+
+  if (next != 0 && !send_to_allowed_core( next )) {
+    // FIXME put into shared runnable list instead
+    // Only needs mpsafe call when shared
+    mpsafe_insert_Task_after_head( &workspace.task_slot.running, next );
+  }
+}
+
+static void __attribute__(( noinline )) hand_over_free_svc_stacks( TaskSlot *slot )
+{
+  for (int i = 0; i < TASK_SVC_STACKS && slot->waiting_for_slot_stack != 0; i++) {
+    uint32_t *lock = (uint32_t*) &slot->svc_stack_owner[i];
+
+    // Reserved by the slot, rather than a Task, in case there turns out
+    // to be nobody waiting for it
+    if (*lock == 0
+     && 0 == change_word_if_equal( lock, 0, (uint32_t) slot )) {
+      hand_over_svc_stack( slot, i, mpsafe_detach_Task_at_head( &slot->waiting_for_slot_stack ) );
+    }
+  }
+}
+
 static void __attribute__(( noinline )) release_task_waiting_for_stack( Task *task )
 {
   assert( owner_of_slot_svc_stack( task ) );
 
   TaskSlot *slot = task->slot;
-  assert( slot->svc_stack_owner == task );
+  uint32_t index = task->svc_stack - 1;
+  assert( slot->svc_stack_owner[index] == task );
 
-  // This task has permission, as the owner, to change the owner
-  // The new owner cannot do anything until it has been put into the running list
-  slot->svc_stack_owner = mpsafe_detach_Task_at_head( &slot->waiting_for_slot_stack );
-  assert( slot->svc_stack_owner != task );
-asm ( ".word 0xffffffff" );
+  task->svc_stack = 0;
+  task->svc_sp_when_unmapped = (uint32_t*) no_stack;
 
 workspace.task_slot.svc_stack_releases++;
 
-  if (slot->svc_stack_owner != 0) {
-    // FIXME put into shared runnable list instead
-    // Only needs mpsafe call when shared
-    slot->svc_sp_when_unmapped = (uint32_t*) &svc_stack_top;
-    mpsafe_insert_Task_after_head( &workspace.task_slot.running, slot->svc_stack_owner );
-  }
-  else {
+  // This task has permission, as the owner, to change the owner
+  Task *next = mpsafe_detach_Task_at_head( &slot->waiting_for_slot_stack );
+  assert( next != task );
+
+  if (next == 0) {
 workspace.task_slot.svc_stack_nothing_waiting++;
-    // This will be set to &svc_stack_top when a new task claims ownership
-    slot->svc_sp_when_unmapped = no_stack;
   }
+
+  hand_over_svc_stack( slot, index, next );
 }
 
 static void __attribute__(( noinline, noreturn )) resume_task( Task *resume, TaskSlot *loaded )
@@ -2671,6 +3607,14 @@ static void __attribute__(( noinline, noreturn )) resume_task( Task *resume, Tas
   assert( is_a_task( resume ) );
   assert( resume->regs.lr != 0 ); // Not necessarily an invalid address, but generally an error
 
+  trace_event( Trace_TaskSwitch, resume, resume->slot );
+
+  // Normally already disabled by save_task_context, see vfp.c
+  if (workspace.task_slot.vfp_owner != 0
+   && workspace.task_slot.vfp_owner != resume) {
+    vfp_disable();
+  }
+
   // Set the stack to the top of the core's SVC stack, which is mapped
   // globally for the core and won't be mapped out by MMU_switch_to.
 
@@ -2687,11 +3631,11 @@ static void __attribute__(( noinline, noreturn )) resume_task( Task *resume, Tas
   }
 
   if (owner_of_slot_svc_stack( resume )) {
-    assert( resume->slot->svc_sp_when_unmapped != no_stack );
+    assert( resume->svc_sp_when_unmapped != no_stack );
     asm volatile (
       "\n  mov sp, %[new]"
       :
-      : [new] "r" (resume->slot->svc_sp_when_unmapped) );
+      : [new] "r" (resume->svc_sp_when_unmapped) );
   }
 
   // We are resuming a task that has been blocked for some reason,
@@ -2731,6 +3675,8 @@ Task *__attribute__(( noinline )) c_run_irq_tasks( Task *running )
       || (running->regs.spsr & 0x1f) == 0x10 );
   // The state of the running task is safely stored
 
+  trace_event( Trace_IRQEntry, running, 0 );
+
   Task *irq_task = next_irq_task();
 
   // This will be a problem if there are spurious interrupts, which are
@@ -2743,9 +3689,15 @@ Task *__attribute__(( noinline )) c_run_irq_tasks( Task *running )
 
     // Block the running task, but keep it on this core
     dll_attach_Task( irq_task, &workspace.task_slot.running );
+
+    // Its VFP registers, if it has any, stay where they are until
+    // another Task uses the VFP, see vfp.c
+    if (running == workspace.task_slot.vfp_owner) vfp_disable();
   }
   // TODO count spurious interrupts, I seem to be getting one in QEMU!
 
+  trace_event( Trace_IRQExit, workspace.task_slot.running, 0 );
+
   return workspace.task_slot.running;
 }
 
@@ -2854,8 +3806,10 @@ void Wimp_Polling()
     slot->creator = 0;
     creator->regs.r[0] = slot->wimp_task_handle;
 
-    Task *tail = running->next;
-    dll_attach_Task( creator, &tail );
+    if (!send_to_allowed_core( creator )) {
+      Task *tail = running->next;
+      dll_attach_Task( creator, &tail );
+    }
   }
 }
 
@@ -18,6 +18,8 @@
 typedef struct Task Task;
 typedef struct svc_registers svc_registers;
 
+#include "sleep_queue.h"
+
 // Root slot, does not require RMA or regs. Call once only per core.
 TaskSlot *TaskSlot_first();
 
@@ -35,6 +37,18 @@ void TaskSlot_detach_from_creator( TaskSlot *slot );
 void TaskSlot_new_application( char const *command, char const *args );
 void __attribute__(( noreturn )) TaskSlot_enter_application( void *start_address, void *private_word );
 
+// The section below svc_stack_top holds a pool of svc stacks for each
+// slot, leased by the slot's Tasks for SWIs that might block. Each is
+// TASK_SVC_STACK_PAGES long with an unmapped guard page below it; the
+// first one's top is svc_stack_top.
+// They are not per-Task stacks: SWIs enter on the core's stack and the
+// entry frame is copied when one is leased (see c_execute_swi). The
+// section can't hold a stack for every Task in ModuleTasksSlot (there's
+// an IRQ Task per source per core), and the SharedCLibrary finds its
+// svc workspace from the section's base, so they can't live elsewhere.
+#define TASK_SVC_STACKS 4
+#define TASK_SVC_STACK_PAGES 8
+
 Task *Task_new( TaskSlot *slot );
 
 TaskSlot *TaskSlot_now();
@@ -63,18 +77,74 @@ void __attribute__(( noinline )) do_FSControl( uint32_t *regs );
 void __attribute__(( noinline )) do_UpCall( uint32_t *regs );
 
 // While waiting for a full re-write, block the task until there's
-// no-one else using the non-reentrant kernel, then re-try the SWI
-// from the point it was called (which must always be usr32 mode, atm).
-bool Task_kernel_in_use( svc_registers *regs );
-void Task_kernel_release();
+// no-one else using the relevant part of the non-reentrant kernel,
+// then re-try the SWI from the point it was called (which must always
+// be usr32 mode, atm).
+// The parts are independent of each other, and listed from the
+// outermost to the innermost; a SWI in one class may call SWIs in
+// classes below it, waiting for them if necessary. Calls the other way
+// are out of order, they only get the class if it's free, otherwise the
+// SWI returns an error (see Task_kernel_in_use).
+typedef enum {
+  Legacy_None,          // No protection required
+  Legacy_Modules,       // OS_Module, OS_CLI
+  Legacy_FileSystem,    // OS_File, OS_Find, etc., filing system modules
+  Legacy_General,       // Anything not otherwise listed, module SWIs
+  Legacy_VDU,           // Screen output and state, sprites, modes
+  Legacy_SysVars,
+  Legacy_Heap,          // OS_Heap, dynamic areas
+  Legacy_Classes } legacy_class;
+
+bool Task_kernel_in_use( svc_registers *regs, legacy_class c, error_block **refused );
+void Task_kernel_release( legacy_class c );
+
+// The running Task is using this core's VDU variables (the graphics
+// cursor, colours, window, screen or sprite being drawn to), it will only
+// run on this core from now on. Called for Legacy_VDU SWIs and by code
+// that uses the variables without the legacy lock (native OS_Plot).
+void Task_using_vdu_state();
+
+// Called for undefined instructions, returns true if it was a VFP or NEON
+// instruction, which should be retried now the VFP has been enabled for
+// the running Task. In Thumb state (in spsr), instruction holds both
+// halfwords of a 32-bit instruction, the first in the top half.
+bool Task_vfp_undefined_instruction( uint32_t instruction, uint32_t spsr );
+
+// Called for data aborts the MMU code could not resolve. If the running
+// Task made the access in usr32 mode, its registers are copied into the
+// slot's exception registers buffer, the return is redirected to the
+// slot's data abort handler, and it returns true.
+// regs: r4-r11, r0-r3, r12, address of the aborting instruction, SPSR
+bool Task_data_abort( uint32_t *regs );
+
+typedef struct {
+  Task *owner;          // May be in other lists (normally running)
+  Task *waiting;        // Tasks blocked, waiting to re-try their SWI
+  uint32_t depth;       // Recursion depth of the owner
+
+  // Statistics, read using OS_ThreadOp, TaskOp_LegacyLockStatistics
+  uint32_t claims;      // Outermost entries to the class
+  uint32_t blocked;     // Times a Task has had to wait
+  uint32_t out_of_order; // Claimed while holding an inner class
+  uint32_t refused;     // Out of order SWIs refused, the class in use
+} legacy_lock;
 
 
 struct TaskSlot_workspace {
   Task *running;        // The task that is running on this core
   bool memory_mapped;   // Have the shared.task_slot.tasks_memory and shared.task_slot.slots_memory been mapped into this core's MMU?
-  Task *sleeping;       // 0 or more sleeping tasks
+  sleep_queue sleeping;  // Tasks sleeping on this core
+  uint32_t counts_per_us; // Generic timer counts per microsecond, 20.12 fixed point
 
   Task **irq_tasks;     // Array of tasks handling interrupts 
+
+  // Reports the interrupt sources pending on this core, one bit per
+  // source, registered by the HAL (TaskOp_PendingSourcesHandler). If
+  // there isn't one, IrqV is called to find the source.
+  void (*pending_sources)( uint32_t private_word, uint32_t *bitmap );
+  uint32_t pending_sources_private;
+  int last_irq;         // The search for the next source starts after it
+  uint64_t irq_entered; // Generic timer, when the current interrupt arrived
   char core_number_string[4]; // For OS_TaskSlot, 64 (CoreNumber)
 
   // FIXME debug only
@@ -86,6 +156,16 @@ struct TaskSlot_workspace {
   uint32_t svc_stack_claims;
   uint32_t svc_stack_releases;
   uint32_t svc_stack_resets;
+
+  uint32_t tasks_shared;        // Put in this core's runnable queue
+  uint32_t tasks_taken;         // From this core's runnable queue
+  uint32_t tasks_stolen;        // From another core's runnable queue
+  uint32_t tasks_migrated;      // Sent away from this core by their affinity
+
+  // VFP/NEON, see vfp.c
+  uint32_t vfp_registers;       // Doubles, 16 or 32, 0 if there's no VFP
+  Task *vfp_owner;              // Whose values are in the registers, or 0
+  bool vfp_dirty;               // Changed since they were last saved
 };
 
 struct TaskSlot_shared_workspace {
@@ -97,18 +177,23 @@ struct TaskSlot_shared_workspace {
   Task *tasks_pool;
   Task *next_to_allocate; // For when the pool needs expanding
 
-  // Until filesystems learn to play along, only one task at a time can
-  // make filesystem calls.
+  // Until filesystems, etc. learn to play along, only one task at a
+  // time can make calls to each class of legacy SWIs.
   // The task with access is allowed to recurse, though.
-  // The task with access can be in other lists, so legacy_caller is
-  // just a pointer to a Task which is probably in the running list.
-  // legacy_callers are the Tasks that have been blocked.
-  Task *legacy_callers;
-  Task *legacy_caller;
-  uint32_t legacy_depth;
+  legacy_lock legacy[Legacy_Classes];
 
-  Task *runnable;       // Tasks that may run on any core
+  // Tasks that may run on any core, one queue per core. A core shares
+  // Tasks when it has more than enough to do, and takes them from its
+  // own queue, then those of the other cores, when it has nothing else
+  // to run.
+  Task *runnable[8];
 
   uint32_t number_of_interrupt_sources;
   Task **irq_tasks;     // Array of tasks handling interrupts, number of cores x number of sources
+
+  // Generic timer counts from interrupt entry to the Task handling it
+  // resuming, per core; element n counts latencies of less than 2^n counts
+  // (and at least 2^(n-1)), the last one everything longer.
+  // Read using OS_ThreadOp, TaskOp_InterruptLatency
+  uint32_t irq_latency[8][16];
 };
@@ -0,0 +1,126 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+
+/* Lazy switching of the VFP/NEON registers between Tasks.
+ *
+ * The VFP is disabled whenever a core switches Tasks, so a Task's first
+ * VFP or NEON instruction after it resumes is undefined. The trap enables
+ * the VFP and, if the registers hold another Task's values, saves those
+ * and loads the running Task's (allocating it a context, the first time).
+ * Tasks that never use the VFP don't pay anything, and each core has its
+ * own registers, so Tasks using it can run in parallel.
+ *
+ * A Task that has used the VFP is saved (by save_task_context) whenever
+ * it blocks, since it may be resumed by another core. The values stay in
+ * the registers, though, so if it resumes on the same core before anyone
+ * else uses them, the trap only has to enable the VFP again.
+ *
+ * An interrupted Task stays on its core, so its registers aren't saved
+ * until another Task wants them.
+ */
+
+struct vfp_context {
+  uint64_t d[32];
+  uint32_t fpscr;
+  uint32_t loaded_on;   // Core + 1 whose registers last matched these
+};
+
+// Thumb instructions have their first halfword in the top half of i
+static inline bool vfp_instruction( uint32_t i, bool thumb )
+{
+  if (thumb) {
+    return (i & 0xfc000e00) == 0xec000a00 // cp10, cp11
+        || (i & 0xef000000) == 0xef000000 // NEON data processing
+        || (i & 0xff100000) == 0xf9000000; // NEON element or structure load/store
+  }
+
+  return ((i >> 28) != 0xf && (i & 0x0c000e00) == 0x0c000a00) // cp10, cp11
+      || (i & 0xfe000000) == 0xf2000000 // NEON data processing
+      || (i & 0xff100000) == 0xf4000000; // NEON element or structure load/store
+}
+
+static void save_registers( Task *task )
+{
+  vfp_context *c = task->vfp;
+  vfp_save( c->d, &c->fpscr, workspace.task_slot.vfp_registers );
+  c->loaded_on = workspace.core_number + 1;
+}
+
+static void load_registers( Task *task )
+{
+  vfp_context *c = task->vfp;
+  vfp_load( c->d, c->fpscr, workspace.task_slot.vfp_registers );
+  c->loaded_on = workspace.core_number + 1;
+}
+
+bool Task_vfp_undefined_instruction( uint32_t instruction, uint32_t spsr )
+{
+  if (workspace.task_slot.vfp_registers == 0) return false;
+  if (!vfp_instruction( instruction, 0 != (spsr & (1 << 5)) )) return false;
+  if (vfp_enabled()) return false; // Undefined for some other reason
+
+  Task *running = workspace.task_slot.running;
+  Task *owner = workspace.task_slot.vfp_owner;
+
+  if (running->vfp == 0) {
+    vfp_context *c = rma_allocate( sizeof( vfp_context ) );
+    if (c == 0) return false;
+    memset( c, 0, sizeof( vfp_context ) );
+    running->vfp = c;
+  }
+
+  vfp_enable();
+
+  if (owner != running
+   || running->vfp->loaded_on != workspace.core_number + 1) {
+    if (owner != 0 && workspace.task_slot.vfp_dirty) {
+      save_registers( owner );
+    }
+    load_registers( running );
+    workspace.task_slot.vfp_owner = running;
+  }
+
+  workspace.task_slot.vfp_dirty = true;
+
+  return true;
+}
+
+// Called for the owner of the registers when its context is saved.
+void Task_vfp_save( Task *task )
+{
+  assert( task == workspace.task_slot.vfp_owner );
+
+  if (workspace.task_slot.vfp_dirty) {
+    vfp_enable(); // It may have been interrupted
+    save_registers( task );
+    workspace.task_slot.vfp_dirty = false;
+  }
+
+  vfp_disable();
+}
+
+void Task_vfp_free( Task *task )
+{
+  if (task == workspace.task_slot.vfp_owner) {
+    vfp_disable();
+    workspace.task_slot.vfp_owner = 0;
+    workspace.task_slot.vfp_dirty = false;
+  }
+
+  rma_free( task->vfp );
+  task->vfp = 0;
+}
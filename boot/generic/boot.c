@@ -344,7 +344,7 @@ void __attribute__(( noreturn, noinline )) pre_mmu_with_stacks( core_workspace *
     shared_workspace *shared_memory = (void*) boot_data->shared_memory;
 
     // Block other cores from continuing until core 0 has enabled the MMU
-    shared_memory->kernel.boot_lock = 1; // lock is claimed by core 0 FIXME: knowledge of implementation of claim_lock
+    shared_memory->kernel.boot_lock = TICKET_LOCK_HELD_BY( 0 ); // lock is claimed by core 0
 
     for (int i = 1; i < max_cores; i++) {
       boot_data->core_to_enter_mmu = i;
@@ -81,12 +81,22 @@ enum { TaskOp_Start,
        TaskOp_GetHandle,
        TaskOp_LockClaim,
        TaskOp_LockRelease,
+       TaskOp_SleepMicroseconds,
+       TaskOp_SetAffinity,
+       TaskOp_GetAffinity,
 
        TaskOp_WaitForInterrupt = 32,
        TaskOp_InterruptIsOff,
        TaskOp_NumberOfInterruptSources,
+       TaskOp_WakeSleepers,
+       TaskOp_PendingSourcesHandler,
+       TaskOp_InterruptLatency,
 
        TaskOp_DebugString = 48,
        TaskOp_DebugNumber,
 
-       TaskOp_CoreNumber = 64 };
+       TaskOp_CoreNumber = 64,
+       TaskOp_LegacyLockStatistics,
+       TaskOp_LockStatistics,
+       TaskOp_Trace,
+       TaskOp_SWIStatistics };
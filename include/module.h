@@ -86,6 +86,7 @@ void __attribute__(( naked, section( ".text.init" ) )) file_start()
 #define NO_messages_file asm( "messages_file = header" )
 
 typedef unsigned long long uint64_t;
+typedef long long       int64_t;
 typedef unsigned        uint32_t;
 typedef int             int32_t;
 typedef unsigned short  uint16_t;
@@ -215,6 +216,19 @@ static inline void Sleep( uint32_t centiseconds )
       : "lr", "memory" );
 }
 
+static inline void SleepMicroseconds( uint32_t microseconds )
+{
+  register uint32_t request asm ( "r0" ) = TaskOp_SleepMicroseconds;
+  register uint32_t time asm ( "r1" ) = microseconds;
+
+  asm volatile ( "svc %[swi]"
+      :
+      : [swi] "i" (OS_ThreadOp)
+      , "r" (request)
+      , "r" (time)
+      : "lr", "memory" );
+}
+
 static inline void Yield()
 {
   Sleep( 0 );
@@ -231,6 +245,14 @@ static inline void *rma_claim( uint32_t bytes )
   return memory;
 }
 
+static inline void rma_free( void *block )
+{
+  // XOS_Module 7 Free
+  register void *memory asm( "r2" ) = block;
+  register uint32_t code asm( "r0" ) = 7;
+  asm volatile ( "svc 0x2001e" : : "r" (memory), "r" (code) : "lr", "memory" );
+}
+
 static inline void debug_string_with_length( char const *s, int length )
 {
   register int code asm( "r0" ) = 48;
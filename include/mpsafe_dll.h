@@ -18,12 +18,66 @@
 #include "doubly_linked_list.h"
 #endif
 
+// A list is locked by replacing its head pointer with 1; other cores
+// wanting the list back off, spinning for twice as long each time, up to
+// a limit, then wait for an event. Every unlock signals one, so a waiting
+// core will re-examine the list as soon as it is released.
+// Inserting into an empty list doesn't lock it, and doesn't signal, so a
+// core that fails to do that must not wait for an event; the head has
+// changed, so it simply tries again.
+
+#define MPSAFE_BACKOFF_LIMIT 64 // Delay iterations before using wfe
+
+#ifndef HOSTED_TESTING
+// Woken by the sev in mpsafe_list_released
+static inline void mpsafe_wait_for_event()
+{
+  asm volatile ( "wfe" );
+}
+
+static inline void mpsafe_list_released()
+{
+  asm volatile ( "dsb sy\n  sev" );
+}
+
+static inline void mpsafe_delay( uint32_t n )
+{
+  while (n-- > 0) asm volatile ( "yield" );
+}
+#else
+// Provided by the test program
+void mpsafe_wait_for_event();
+void mpsafe_list_released();
+void mpsafe_delay( uint32_t n );
+#endif
+
+// Called each time an attempt to lock a list fails; backoff should start
+// at zero.
+static inline void mpsafe_backoff( uint32_t *backoff )
+{
+  if (*backoff < MPSAFE_BACKOFF_LIMIT) {
+    mpsafe_delay( *backoff );
+    *backoff = *backoff * 2 + 1;
+  }
+  else {
+    mpsafe_wait_for_event();
+  }
+}
+
+// Replace the 1 in the head pointer of a list locked by this core
+static inline void mpsafe_unlock_list( void *head, void *value )
+{
+  uint32_t one = change_word_if_equal( (uint32_t*) head, 1, (uint32_t) value );
+  dll_assert( 1 == one ); one = one;
+  mpsafe_list_released();
+}
+
 #define MPSAFE_DLL_TYPE( T ) \
 dll_type( T ) \
  \
 static inline void mpsafe_insert_##T##_at_tail( T **head, T *item ) \
 { \
-  /* TODO add SEV/WFE */ \
+  uint32_t backoff = 0; \
   for (;;) { \
     T *old = *head; \
     uint32_t uold = (uint32_t) old; \
@@ -32,20 +86,25 @@ static inline void mpsafe_insert_##T##_at_tail( T **head, T *item ) \
       if (0 == change_word_if_equal( (uint32_t*) head, 0, (uint32_t) item )) { \
         return; \
       } \
+      /* ...in which case the head has changed; look again at once */ \
+      continue; \
     } \
-    else if (uold == change_word_if_equal( (uint32_t*) head, uold, 1 )) { \
+    else if (uold != 1 /* Locked by another core */ \
+          && uold == change_word_if_equal( (uint32_t*) head, uold, 1 )) { \
       /* Replaced head pointer with 1, can work on list safely... */ \
-      T **tail = &old->prev; \
-      dll_attach_##T( item, tail ); \
-      uint32_t one = change_word_if_equal( (uint32_t*) head, 1, (uint32_t) old ); \
-      dll_assert( 1 != one ); one = one; \
+      /* Attached in front of the head is the tail of a circular list */ \
+      T *tail = old; \
+      dll_attach_##T( item, &tail ); \
+      mpsafe_unlock_list( head, old ); \
       return; \
     } \
+    mpsafe_backoff( &backoff ); \
   } \
 } \
  \
 static inline void mpsafe_insert_##T##_at_head( T **head, T *item ) \
 { \
+  uint32_t backoff = 0; \
   for (;;) { \
     T *old = *head; \
     uint32_t uold = (uint32_t) old; \
@@ -53,18 +112,21 @@ static inline void mpsafe_insert_##T##_at_head( T **head, T *item ) \
       if (0 == change_word_if_equal( (uint32_t*) head, 0, (uint32_t) item )) { \
         return; \
       } \
+      continue; /* No backoff, see at_tail */ \
     } \
-    else if (uold == change_word_if_equal( (uint32_t*) head, uold, 1 )) { \
+    else if (uold != 1 /* Locked by another core */ \
+          && uold == change_word_if_equal( (uint32_t*) head, uold, 1 )) { \
       dll_attach_##T( item, &old ); \
-      uint32_t one = change_word_if_equal( (uint32_t*) head, 1, (uint32_t) old ); \
-      dll_assert( 1 != one ); one = one; \
+      mpsafe_unlock_list( head, old ); \
       return; \
     } \
+    mpsafe_backoff( &backoff ); \
   } \
 } \
  \
 static inline void mpsafe_insert_##T##_after_head( T **head, T *item ) \
 { \
+  uint32_t backoff = 0; \
   for (;;) { \
     T *old = *head; \
     uint32_t uold = (uint32_t) old; \
@@ -72,20 +134,23 @@ static inline void mpsafe_insert_##T##_after_head( T **head, T *item ) \
       if (0 == change_word_if_equal( (uint32_t*) head, 0, (uint32_t) item )) { \
         return; \
       } \
+      continue; /* No backoff, see at_tail */ \
     } \
-    else if (uold == change_word_if_equal( (uint32_t*) head, uold, 1 )) { \
+    else if (uold != 1 /* Locked by another core */ \
+          && uold == change_word_if_equal( (uint32_t*) head, uold, 1 )) { \
       T *tail = old; \
       dll_attach_##T( item, &tail ); \
-      uint32_t one = change_word_if_equal( (uint32_t*) head, 1, (uint32_t) old ); \
-      dll_assert( 1 != one ); one = one; \
+      mpsafe_unlock_list( head, old ); \
       return; \
     } \
+    mpsafe_backoff( &backoff ); \
   } \
 } \
  \
 /* For object pools: */ \
 static inline T *mpsafe_fill_and_detach_##T##_at_head( T **head, T *(*alloc)( int size ), int number ) \
 { \
+  uint32_t backoff = 0; \
   T *result = *head; \
   if (result == 0) { \
     result = (T*) change_word_if_equal( (uint32_t*) head, 0, 1 ); \
@@ -95,35 +160,39 @@ static inline T *mpsafe_fill_and_detach_##T##_at_head( T **head, T *(*alloc)( in
       result = new_head; \
       T *tail = result->next; \
       dll_detach_##T( result ); \
-      *head = tail; \
+      mpsafe_unlock_list( head, tail ); \
       return result; \
     } \
   } \
   while (result != 0) { \
     uint32_t uresult = (uint32_t) result; \
-    if (uresult == change_word_if_equal( (uint32_t*) head, uresult, 1 )) { \
+    if (uresult != 1 \
+     && uresult == change_word_if_equal( (uint32_t*) head, uresult, 1 )) { \
       /* Replaced head pointer with 1, can work on list safely... */ \
       T *tail = result->next; \
       if (tail == result) { \
         /* Only item in queue */ \
-        *head = 0; /* need dsb? */ \
+        mpsafe_unlock_list( head, 0 ); \
       } \
       else { \
         dll_detach_##T( result ); \
-        *head = tail; \
+        mpsafe_unlock_list( head, tail ); \
       } \
       break; \
     } \
+    mpsafe_backoff( &backoff ); \
     result = *head; \
   } \
   return result; \
 } \
 static inline T *mpsafe_find_and_remove_##T( T **head, T *match, bool (*equal)( T* a, T* b ) ) \
 { \
+  uint32_t backoff = 0; \
   T *head_item = *head; \
   while (head_item != 0) { \
     uint32_t uhead_item = (uint32_t) head_item; \
-    if (uhead_item == change_word_if_equal( (uint32_t*) head, uhead_item, 1 )) { \
+    if (uhead_item != 1 \
+     && uhead_item == change_word_if_equal( (uint32_t*) head, uhead_item, 1 )) { \
       /* Replaced head pointer with 1, can work on list safely... */ \
       T *item = head_item; \
       do { \
@@ -131,43 +200,50 @@ static inline T *mpsafe_find_and_remove_##T( T **head, T *match, bool (*equal)(
           if (item == head_item) head_item = head_item->next; \
           if (item == head_item) head_item = 0; \
           dll_detach_##T( item ); \
-          *head = head_item; \
+          mpsafe_unlock_list( head, head_item ); \
           return item; \
         } \
         item = item->next; \
       } while (item != head_item); \
-      *head = head_item; /* Release list */ \
+      mpsafe_unlock_list( head, head_item ); \
       break; \
     } \
+    mpsafe_backoff( &backoff ); \
     head_item = *head; \
   } \
   return 0; \
 } \
 static inline T *mpsafe_manipulate_##T##_list_returning_item( T **head, T *(*update)( T** a, void *p ), void *p ) \
 { \
+  uint32_t backoff = 0; \
   for (;;) { \
     T *head_item = *head; \
     uint32_t uhead_item = (uint32_t) head_item; \
-    if (uhead_item == change_word_if_equal( (uint32_t*) head, uhead_item, 1 )) { \
+    if (uhead_item != 1 \
+     && uhead_item == change_word_if_equal( (uint32_t*) head, uhead_item, 1 )) { \
       /* Replaced head pointer with 1, can work on list safely. (May be empty!) */ \
       T *result = update( &head_item, p ); \
-      *head = head_item; /* Release list */ \
+      mpsafe_unlock_list( head, head_item ); \
       return result; \
     } \
+    mpsafe_backoff( &backoff ); \
   } \
   return 0; \
 } \
 static inline void *mpsafe_manipulate_##T##_list( T **head, void *(*update)( T** a, void *p ), void *p ) \
 { \
+  uint32_t backoff = 0; \
   for (;;) { \
     T *head_item = *head; \
     uint32_t uhead_item = (uint32_t) head_item; \
-    if (uhead_item == change_word_if_equal( (uint32_t*) head, uhead_item, 1 )) { \
+    if (uhead_item != 1 \
+     && uhead_item == change_word_if_equal( (uint32_t*) head, uhead_item, 1 )) { \
       /* Replaced head pointer with 1, can work on list safely. (May be empty!) */ \
       void *result = update( &head_item, p ); \
-      *head = head_item; /* Release list */ \
+      mpsafe_unlock_list( head, head_item ); \
       return result; \
     } \
+    mpsafe_backoff( &backoff ); \
   } \
   return 0; \
 } \
@@ -187,7 +263,7 @@ static inline void *DO_NOT_USE_detach_##T##_head( T **head, void *p ) \
 } \
 static inline void *DO_NOT_USE_detach_##T( T **head, void *p ) \
 { \
-  T *i = i; \
+  T *i = p; \
   if (*head == i) { \
     *head = i->next; \
   } \
@@ -0,0 +1,166 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Index of module service call handlers, by service number, so that a
+// service call is only passed to the modules that want it.
+//
+// Modules from RISC OS 3.7 on may publish a service table, listing the
+// services they handle; each of those gets a handler in the list for the
+// service. Modules without a table are on the "everything" list, and get
+// every service call, as before.
+//
+// Every list is kept in module list order (the order field, which only
+// increases as modules are added), so that a service call can be passed
+// to the modules on the two lists in the same order as walking the module
+// list would have.
+//
+// Open addressing, linear probing, keyed on the service number (never
+// zero, that's Service_CallClaimed). Entries are never removed, only
+// their lists emptied.
+//
+// The index does not allocate anything; the handlers belong to the
+// module instances.
+
+#define SERVICE_INDEX_SIZE 256 // Power of two
+
+typedef struct service_handler service_handler;
+
+struct service_handler {
+  service_handler *next;
+  struct module *module;
+  uint32_t order;               // Of the module in the module list
+  uint32_t code;                // Entry point
+};
+
+typedef struct {
+  uint32_t service;
+  service_handler *handlers;
+} service_index_entry;
+
+typedef struct {
+  uint32_t used;
+  service_handler *everything;
+  service_index_entry entry[SERVICE_INDEX_SIZE];
+} service_index;
+
+static inline uint32_t service_index_hash( uint32_t service )
+{
+  // Fibonacci hashing, the top bits, enough to index the table
+  return (service * 2654435761u) >> (32 - __builtin_ctz( SERVICE_INDEX_SIZE ));
+}
+
+static inline service_index_entry *service_index_find( service_index *index, uint32_t service )
+{
+  uint32_t i = service_index_hash( service );
+
+  for (int tries = 0; tries < SERVICE_INDEX_SIZE; tries++) {
+    service_index_entry *e = &index->entry[i];
+    if (e->service == service || e->service == 0) return e;
+    i = (i + 1) & (SERVICE_INDEX_SIZE - 1);
+  }
+
+  return 0;
+}
+
+// The handlers for modules that listed the service in their tables
+static inline service_handler *service_index_lookup( service_index *index, uint32_t service )
+{
+  service_index_entry *e = service_index_find( index, service );
+  return (e == 0 || e->service == 0) ? 0 : e->handlers;
+}
+
+// Can all the services in the (zero terminated) list be entered, keeping
+// the index at most three quarters full?
+static inline bool service_index_has_room( service_index *index, uint32_t const *services )
+{
+  uint32_t used = index->used;
+
+  for (int i = 0; services[i] != 0; i++) {
+    service_index_entry *e = service_index_find( index, services[i] );
+    if (e == 0) return false;
+    if (e->service == 0) used++;
+  }
+
+  return used <= (SERVICE_INDEX_SIZE * 3) / 4;
+}
+
+static inline void service_handler_append( service_handler **list, service_handler *h )
+{
+  while (*list != 0) {
+    if ((*list)->module == h->module) return; // Service listed twice
+    list = &(*list)->next;
+  }
+  h->next = 0;
+  *list = h;
+}
+
+// Only after service_index_has_room has returned true for the module's
+// services. The handler's order must be greater than any already added.
+static inline void service_index_add( service_index *index, uint32_t service, service_handler *h )
+{
+  service_index_entry *e = service_index_find( index, service );
+
+  if (e->service == 0) {
+    e->service = service;
+    e->handlers = 0;
+    index->used++;
+  }
+
+  service_handler_append( &e->handlers, h );
+}
+
+static inline void service_index_add_everything( service_index *index, service_handler *h )
+{
+  service_handler_append( &index->everything, h );
+}
+
+static inline void service_handler_remove_module( service_handler **list, struct module *m )
+{
+  while (*list != 0) {
+    if ((*list)->module == m)
+      *list = (*list)->next;
+    else
+      list = &(*list)->next;
+  }
+}
+
+// Unlinks every handler belonging to the module
+static inline void service_index_remove( service_index *index, struct module *m )
+{
+  service_handler_remove_module( &index->everything, m );
+
+  for (int i = 0; i < SERVICE_INDEX_SIZE; i++) {
+    if (index->entry[i].service != 0) {
+      service_handler_remove_module( &index->entry[i].handlers, m );
+    }
+  }
+}
+
+// The next handler to call, from either list, in module list order.
+static inline service_handler *service_index_next( service_handler **interested, service_handler **everything )
+{
+  service_handler *h;
+
+  if (*everything == 0 || (*interested != 0 && (*interested)->order < (*everything)->order)) {
+    h = *interested;
+    if (h != 0) *interested = h->next;
+  }
+  else {
+    h = *everything;
+    *everything = h->next;
+  }
+
+  return h;
+}
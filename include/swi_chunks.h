@@ -0,0 +1,119 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Index of module SWI chunks, so that a module SWI does not have to walk
+// the whole module list to find the module that provides it.
+//
+// Open addressing, linear probing, keyed on the chunk base (a multiple of
+// 0x40, never zero for a module that provides SWIs).
+// An entry with a zero chunk has never been used, an entry with a chunk
+// but no module has been removed (probing continues past it).
+//
+// The table does not own anything, the module list remains the
+// authority; if the table ever fills up, lookups that miss have to fall
+// back to walking the list.
+
+#define SWI_CHUNK_TABLE_SIZE 256 // Power of two
+
+typedef struct {
+  uint32_t chunk;
+  struct module *module;
+} swi_chunk_entry;
+
+typedef struct {
+  uint32_t used;        // Including removed entries
+  bool overflowed;      // At least one module could not be entered
+  swi_chunk_entry entry[SWI_CHUNK_TABLE_SIZE];
+} swi_chunk_table;
+
+static inline uint32_t swi_chunk_hash( uint32_t chunk )
+{
+  // Fibonacci hashing on the chunk number; the top bits are the best mixed,
+  // take as many as it takes to index the table
+  return ((chunk >> 6) * 2654435761u) >> (32 - __builtin_ctz( SWI_CHUNK_TABLE_SIZE ));
+}
+
+static inline struct module *swi_chunk_lookup( swi_chunk_table *table, uint32_t chunk )
+{
+  uint32_t i = swi_chunk_hash( chunk );
+
+  for (int tries = 0; tries < SWI_CHUNK_TABLE_SIZE; tries++) {
+    swi_chunk_entry *e = &table->entry[i];
+    if (e->chunk == chunk) return e->module; // Might be removed (0)
+    if (e->chunk == 0) return 0;
+    i = (i + 1) & (SWI_CHUNK_TABLE_SIZE - 1);
+  }
+
+  return 0;
+}
+
+// The first module to claim a chunk keeps it, the same as the first match
+// in a walk of the module list. Returns false if there was no room.
+static inline bool swi_chunk_insert( swi_chunk_table *table, uint32_t chunk, struct module *m )
+{
+  if (chunk == 0) return true; // No SWIs
+
+  uint32_t i = swi_chunk_hash( chunk );
+  swi_chunk_entry *reuse = 0;
+
+  for (int tries = 0; tries < SWI_CHUNK_TABLE_SIZE; tries++) {
+    swi_chunk_entry *e = &table->entry[i];
+    if (e->chunk == chunk) {
+      if (e->module == 0) e->module = m;
+      return true;
+    }
+    if (e->chunk == 0) break;
+    if (e->module == 0 && reuse == 0) reuse = e;
+    i = (i + 1) & (SWI_CHUNK_TABLE_SIZE - 1);
+  }
+
+  if (reuse == 0) {
+    // Keep the table at most three quarters full, or probe sequences
+    // for unknown SWIs get long.
+    if (table->used >= (SWI_CHUNK_TABLE_SIZE * 3) / 4) {
+      table->overflowed = true;
+      return false;
+    }
+    reuse = &table->entry[i];
+    table->used++;
+  }
+
+  reuse->chunk = chunk;
+  reuse->module = m;
+
+  return true;
+}
+
+// Only removes the entry if it refers to the given module (another
+// instance may be the one providing the SWIs). Returns true if removed.
+static inline bool swi_chunk_remove( swi_chunk_table *table, uint32_t chunk, struct module *m )
+{
+  if (chunk == 0) return false;
+
+  uint32_t i = swi_chunk_hash( chunk );
+
+  for (int tries = 0; tries < SWI_CHUNK_TABLE_SIZE; tries++) {
+    swi_chunk_entry *e = &table->entry[i];
+    if (e->chunk == chunk) {
+      if (e->module != m) return false;
+      e->module = 0; // Leave the chunk, so probes continue past it
+      return true;
+    }
+    if (e->chunk == 0) return false;
+    i = (i + 1) & (SWI_CHUNK_TABLE_SIZE - 1);
+  }
+
+  return false;
+}
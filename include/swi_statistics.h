@@ -0,0 +1,136 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Per-SWI statistics, collected (when enabled) by c_execute_swi.
+//
+// Each core has its own table, indexed by SWI number (without the X bit),
+// so recording needs no lock, only interrupts disabled for a moment.
+// Readers add up the tables of all the cores.
+//
+// A call is counted once, when execute_swi returns without the caller
+// having been queued to retry the SWI; its cycles are those of the core
+// that ran it (the cycle counter isn't shared, so the caller mustn't move
+// in the middle). Time spent queued to retry the SWI (waiting for a legacy
+// lock, or the slot's svc stack) is counted separately, in generic timer
+// ticks, since the Task may resume on another core.
+//
+// The tables are cleared by incrementing a shared generation number; each
+// core clears its own table when it next records something.
+
+typedef struct {
+  uint32_t key;                 // SWI | SWI_STATISTICS_USED, zero if unused
+  uint32_t calls;
+  uint64_t cycles;              // Total
+  uint32_t waits;               // Times queued to retry the SWI
+  uint64_t wait_ticks;          // Total, generic timer
+  uint32_t histogram[32];       // Calls by log2 cycles, see swi_statistics_bucket
+} swi_statistics;
+
+#define SWI_STATISTICS_SIZE 256 // Power of two
+#define SWI_STATISTICS_USED (1u << 31) // SWI numbers only use 24 bits
+
+typedef struct {
+  uint32_t generation;          // Of the last clear
+  swi_statistics entries[SWI_STATISTICS_SIZE];
+} swi_statistics_table;
+
+// The SWI's entry, added if necessary, or null if the table is full.
+static inline swi_statistics *swi_statistics_entry( swi_statistics_table *table, uint32_t swi )
+{
+  uint32_t key = swi | SWI_STATISTICS_USED;
+  uint32_t i = (swi * 2654435761u) >> 24;
+
+  for (int tries = 0; tries < SWI_STATISTICS_SIZE; tries++) {
+    swi_statistics *entry = &table->entries[i];
+    if (entry->key == key) return entry;
+    if (entry->key == 0) {
+      entry->key = key;
+      return entry;
+    }
+    i = (i + 1) & (SWI_STATISTICS_SIZE - 1);
+  }
+
+  return 0;
+}
+
+// Bucket n holds calls taking from 2^(n-1) to 2^n - 1 cycles (bucket 0,
+// no cycles at all, the last bucket, anything longer).
+static inline uint32_t swi_statistics_bucket( uint32_t cycles )
+{
+  if (cycles == 0) return 0;
+  return 32 - __builtin_clz( cycles ) - ((cycles >> 31) & 1);
+}
+
+static inline void swi_statistics_call( swi_statistics *entry, uint32_t cycles )
+{
+  entry->calls++;
+  entry->cycles += cycles;
+  entry->histogram[swi_statistics_bucket( cycles )]++;
+}
+
+static inline void swi_statistics_wait( swi_statistics *entry, uint32_t ticks )
+{
+  entry->waits++;
+  entry->wait_ticks += ticks;
+}
+
+// Adds the entries of one table into another (which may then be full, in
+// which case the excess entries are lost).
+static inline void swi_statistics_add( swi_statistics_table *total, swi_statistics_table const *table )
+{
+  for (int i = 0; i < SWI_STATISTICS_SIZE; i++) {
+    swi_statistics const *from = &table->entries[i];
+    if (from->key == 0) continue;
+
+    swi_statistics *to = swi_statistics_entry( total, from->key & ~SWI_STATISTICS_USED );
+    if (to == 0) return;
+
+    to->calls += from->calls;
+    to->cycles += from->cycles;
+    to->waits += from->waits;
+    to->wait_ticks += from->wait_ticks;
+    for (int b = 0; b < number_of( to->histogram ); b++) {
+      to->histogram[b] += from->histogram[b];
+    }
+  }
+}
+
+// Copies up to max of the entries with the most cycles into top, most
+// first, returning the number copied.
+static inline uint32_t swi_statistics_top( swi_statistics_table const *table, swi_statistics *top, uint32_t max )
+{
+  uint32_t count = 0;
+
+  for (int i = 0; i < SWI_STATISTICS_SIZE; i++) {
+    swi_statistics const *entry = &table->entries[i];
+    if (entry->key == 0) continue;
+
+    uint32_t n = count;
+    while (n > 0 && top[n-1].cycles < entry->cycles) {
+      if (n < max) top[n] = top[n-1];
+      n--;
+    }
+    if (n < max) {
+      top[n] = *entry;
+      if (count < max) count++;
+    }
+  }
+
+  return count;
+}
+
+// Writes the top entries to the debug output, see TaskOp_SWIStatistics.
+// *SWIStatistics (GCC_Modules/SWIStatistics) writes them with OS_Write0.
+void swi_statistics_show( uint32_t max );
@@ -0,0 +1,174 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Fair (first come, first served) locks, in a single word, so that
+// claim_lock and release_lock can be used on the same uint32_t locks as
+// before, a zero word being a free lock.
+//
+//   bits  0-7   Owner: core number + 1 while held, otherwise 0
+//   bits  8-19  The ticket now being served
+//   bits 20-31  The next ticket to be given out
+//
+// A core takes the next ticket and waits for it to be served, then
+// records itself as the owner. A core that already owns the lock doesn't
+// take a ticket; claiming it "again" returns true, and it mustn't release
+// it (see claim_lock in processor.h).
+//
+// Releasing the lock serves the next ticket, and sends an event to wake
+// the waiting cores.
+//
+// Twelve bits of ticket are plenty, there will never be 4096 cores
+// waiting for a lock.
+
+#define TICKET_LOCK_OWNER       0x000000ff
+#define TICKET_LOCK_SERVING     0x000fff00
+#define TICKET_LOCK_SERVING_ONE 0x00000100
+#define TICKET_LOCK_NEXT        0xfff00000
+#define TICKET_LOCK_NEXT_ONE    0x00100000
+
+// The value of a lock claimed by the core, before anything else has
+// touched it (used to hold the other cores at boot).
+#define TICKET_LOCK_HELD_BY( core ) (TICKET_LOCK_NEXT_ONE | ((core) + 1))
+
+#ifndef HOSTED_TESTING
+// Woken by the sev in ticket_lock_released
+static inline void ticket_lock_wait()
+{
+  asm volatile ( "wfe" );
+}
+
+static inline void ticket_lock_released()
+{
+  asm volatile ( "dsb sy\n  sev" );
+}
+
+// Changes made while holding the lock must be visible before it's seen
+// to have been released
+static inline void ticket_lock_barrier()
+{
+  asm volatile ( "dmb sy" );
+}
+
+static inline uint32_t ticket_lock_now()
+{
+  uint32_t hi, lo;
+  asm volatile ( "mrrc p15, 0, %[lo], %[hi], c14" : [hi] "=r" (hi), [lo] "=r" (lo) ); // CNTPCT
+  return lo;
+}
+#else
+// Provided by the test program
+void ticket_lock_wait();
+void ticket_lock_released();
+void ticket_lock_barrier();
+uint32_t ticket_lock_now();
+#endif
+
+static inline uint32_t ticket_lock_serving( uint32_t value )
+{
+  return (value & TICKET_LOCK_SERVING) >> 8;
+}
+
+// Returns true if the core already owned the lock. Otherwise, if it had
+// to wait, *waited is set to the time it waited, in generic timer ticks
+// (it is left alone if the lock was free).
+static inline bool ticket_lock_claim( uint32_t volatile *lock, uint32_t core, uint32_t *waited )
+{
+  uint32_t me = core + 1;
+  uint32_t value;
+
+  do {
+    value = *lock;
+    if ((value & TICKET_LOCK_OWNER) == me) return true;
+  } while (value != change_word_if_equal( lock, value, value + TICKET_LOCK_NEXT_ONE ));
+
+  uint32_t ticket = value >> 20;
+
+  if (ticket_lock_serving( value ) != ticket) {
+    uint32_t start = ticket_lock_now();
+    while (ticket_lock_serving( *lock ) != ticket) {
+      ticket_lock_wait();
+    }
+    *waited = ticket_lock_now() - start;
+  }
+
+  // Ours; only the next ticket can change until it's released.
+  do {
+    value = *lock;
+  } while (value != change_word_if_equal( lock, value, value | me ));
+
+  return false;
+}
+
+static inline void ticket_lock_release( uint32_t volatile *lock )
+{
+  uint32_t value;
+  uint32_t next;
+
+  ticket_lock_barrier();
+
+  do {
+    value = *lock;
+    next = (value & TICKET_LOCK_NEXT)
+         | ((value + TICKET_LOCK_SERVING_ONE) & TICKET_LOCK_SERVING);
+  } while (value != change_word_if_equal( lock, value, next ));
+
+  ticket_lock_released();
+}
+
+// Statistics, collected (when enabled) by claim_lock for each lock it
+// sees, in a small table indexed by the address of the lock.
+// Only the lock's owner updates its entry.
+
+typedef struct {
+  uint32_t volatile *lock;      // Null for an unused entry
+  uint32_t acquisitions;        // Not including reclaims
+  uint32_t contended;           // Acquisitions that had to wait
+  uint32_t max_wait;            // Generic timer ticks
+  uint64_t total_wait;
+  uint32_t holder;              // Return address of the latest claim
+} lock_statistics;
+
+#define LOCK_STATISTICS_SIZE 64 // Power of two
+
+// The lock's entry, added if necessary, or null if the table is full.
+static inline lock_statistics *lock_statistics_entry( lock_statistics *table, uint32_t volatile *lock )
+{
+  uint32_t i = (((uint32_t) lock) * 2654435761u) >> 26;
+
+  for (int tries = 0; tries < LOCK_STATISTICS_SIZE; tries++) {
+    lock_statistics *entry = &table[i];
+    if (entry->lock == lock) return entry;
+    if (entry->lock == 0
+     && 0 == change_word_if_equal( (uint32_t*) &entry->lock, 0, (uint32_t) lock )) {
+      return entry;
+    }
+    if (entry->lock == lock) return entry; // Another core added it
+    i = (i + 1) & (LOCK_STATISTICS_SIZE - 1);
+  }
+
+  return 0;
+}
+
+// Called by the new owner of the lock
+static inline void lock_statistics_record( lock_statistics *entry, bool contended, uint32_t waited, uint32_t holder )
+{
+  entry->acquisitions++;
+  entry->holder = holder;
+  if (contended) {
+    entry->contended++;
+    entry->total_wait += waited;
+    if (waited > entry->max_wait) entry->max_wait = waited;
+  }
+}
@@ -0,0 +1,123 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Binary trace of kernel events.
+//
+// Each core has a trace pipe, an ordinary OS_PipeOp pipe whose sender is
+// the kernel: records are written straight into the pipe's memory, which
+// is mapped into the core's kernel memory at trace_pipe (see rool.script),
+// and handed over to the pipe on the way out of SWIs (kick_trace_pipe).
+// A user mode task drains it with WaitForData and DataConsumed, like any
+// other pipe; OS_ThreadOp TaskOp_Trace chooses the events to record and
+// returns the pipe of a core.
+//
+// Nothing waits for the drain task. When the pipe is full, records are
+// dropped and counted, and the next one written is preceded by a
+// Trace_Dropped record with the count.
+//
+// A record is four words: the core's cycle counter (which wraps every few
+// seconds, so a trace should be read as a sequence), the event, and two
+// words that depend on the event.
+//
+// Recording disables interrupts for a few instructions; there is no lock.
+
+enum { Trace_Dropped,           // a: number of records lost
+       Trace_SWIEntry,          // a: SWI number, b: Task
+       Trace_SWIExit,           // a: SWI number, b: non-zero if it failed
+       Trace_TaskSwitch,        // a: Task resumed, b: its slot
+       Trace_IRQEntry,          // a: interrupted Task
+       Trace_IRQExit,           // a: Task to run
+       Trace_LockContended,     // a: lock, b: generic timer ticks waited
+       Trace_PipeBlocked,       // a: pipe, b: Task
+       Trace_PipeUnblocked,     // a: pipe, b: Task
+       Trace_MMUSwitch,         // a: slot
+       Trace_Events };
+
+typedef struct {
+  uint32_t cycles;
+  uint32_t event;
+  uint32_t a;
+  uint32_t b;
+} trace_record;
+
+typedef struct {
+  uint32_t pipe;                // Handle, zero until the pipe is set up
+  trace_record *location;       // The space in the pipe, see kick_trace_pipe
+  uint32_t available;           // Bytes
+  uint32_t written;             // Bytes, not yet handed over to the pipe
+  uint32_t dropped;             // Records, since the last one written
+} trace_buffer;
+
+#ifndef HOSTED_TESTING
+static inline uint32_t trace_cycles()
+{
+  return cycle_counter();
+}
+
+static inline uint32_t trace_interrupts_off()
+{
+  uint32_t cpsr;
+  asm volatile ( "mrs %[cpsr], cpsr\n  cpsid i" : [cpsr] "=r" (cpsr) : : "memory" );
+  return cpsr;
+}
+
+static inline void trace_interrupts_restore( uint32_t cpsr )
+{
+  asm volatile ( "msr cpsr_c, %[cpsr]" : : [cpsr] "r" (cpsr) : "memory" );
+}
+#else
+// Provided by the test program
+uint32_t trace_cycles();
+uint32_t trace_interrupts_off();
+void trace_interrupts_restore( uint32_t cpsr );
+#endif
+
+static inline void trace_write( trace_buffer *t, uint32_t event, uint32_t a, uint32_t b )
+{
+  uint32_t cpsr = trace_interrupts_off();
+
+  uint32_t needed = sizeof( trace_record );
+  if (t->dropped != 0) needed += sizeof( trace_record );
+
+  if (t->written + needed > t->available) {
+    t->dropped++;
+  }
+  else {
+    trace_record *r = (void*) (((char*) t->location) + t->written);
+    uint32_t now = trace_cycles();
+
+    if (t->dropped != 0) {
+      *r++ = (trace_record) { .cycles = now, .event = Trace_Dropped, .a = t->dropped };
+      t->dropped = 0;
+    }
+
+    *r = (trace_record) { .cycles = now, .event = event, .a = a, .b = b };
+
+    t->written += needed;
+  }
+
+  trace_interrupts_restore( cpsr );
+}
+
+// Makes the new pipe the core's trace pipe, see TaskSlot/simple/pipes.c
+void setup_trace_pipe( uint32_t pipe );
+
+// Records the event, if it's one being traced; the mask is shared by all
+// cores, the buffer is the core's own.
+#define trace_event( event, a, b ) \
+  do { \
+    if (0 != (shared.kernel.trace_mask & (1 << (event)))) \
+      trace_write( &workspace.kernel.trace, (event), (uint32_t) (a), (uint32_t) (b) ); \
+  } while (0)
@@ -16,6 +16,7 @@
 typedef unsigned long long uint64_t;
 typedef unsigned        uint32_t;
 typedef int             int32_t;
+typedef unsigned short  uint16_t;
 typedef short           int16_t;
 typedef signed char     int8_t;
 typedef unsigned char   uint8_t;
@@ -0,0 +1,111 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Software vector chains.
+//
+// Each core has its own vectors. The handlers on a vector are held in an
+// array, most recently claimed first, with the kernel's default last and
+// a zero code after that. An array is never changed once it has been
+// published; OS_Claim and OS_Release build a new one and swap it in with
+// a single store. A vector with only the default handler has no array at
+// all (a null pointer), and the default is called directly.
+//
+// The old array may still be in use by a vector call on the same core
+// that has been interrupted, so it's only freed once every vector call
+// that was in progress when it was replaced has finished (the same scheme
+// as the system variables, in swis/varvals.c, but for one core).
+//
+// Nothing here allocates or frees memory.
+
+typedef struct {
+  uint32_t code;
+  uint32_t private_word;
+} vector_handler;
+
+typedef struct vector_chain vector_chain;
+
+struct vector_chain {
+  vector_chain *retired_next;
+  uint32_t generation;          // Of the core's vector calls, when retired
+  uint32_t count;               // Handlers, including the default
+  vector_handler handler[];     // count of them, then a zero code
+};
+
+typedef struct {
+  uint32_t depth;               // Vector calls in progress on the core
+  uint32_t generation;          // Incremented each time depth returns to 0
+  vector_chain *retired;        // Replaced, but possibly still in use
+} vector_calls;
+
+static inline bool vector_handler_equal( vector_handler const *a, vector_handler const *b )
+{
+  return a->code == b->code && a->private_word == b->private_word;
+}
+
+// Enough for a chain of count handlers, and the terminator
+static inline uint32_t vector_chain_bytes( uint32_t count )
+{
+  return sizeof( vector_chain ) + (count + 1) * sizeof( vector_handler );
+}
+
+static inline uint32_t vector_chain_count( vector_chain const *chain )
+{
+  return chain == 0 ? 1 : chain->count;
+}
+
+// Fills in chain (of at least vector_chain_bytes( vector_chain_count( old ) + 1 ))
+// with claim (if not null), followed by the handlers of old (or just the
+// default handler, if old is null) except any equal to remove (if not
+// null). The default handler is never removed.
+// Returns the number of handlers in the new chain.
+static inline uint32_t vector_chain_build( vector_chain *chain,
+                                           vector_chain const *old,
+                                           vector_handler const *default_handler,
+                                           vector_handler const *claim,
+                                           vector_handler const *remove )
+{
+  vector_handler const *from = (old == 0) ? default_handler : old->handler;
+  uint32_t count = vector_chain_count( old );
+  uint32_t n = 0;
+
+  if (claim != 0) chain->handler[n++] = *claim;
+
+  for (int i = 0; i < count; i++) {
+    bool last = (i == count - 1);
+    if (last || remove == 0 || !vector_handler_equal( &from[i], remove )) {
+      chain->handler[n++] = from[i];
+    }
+  }
+
+  chain->handler[n] = (vector_handler) { 0, 0 };
+  chain->count = n;
+  chain->retired_next = 0;
+  chain->generation = 0;
+
+  return n;
+}
+
+// The first handler to call
+static inline vector_handler const *vector_chain_handlers( vector_chain const *chain, vector_handler const *default_handler )
+{
+  return chain == 0 ? default_handler : chain->handler;
+}
+
+// Can the retired chain be freed? Only if every vector call that was in
+// progress when it was replaced has finished.
+static inline bool vector_chain_in_use( vector_calls const *calls, vector_chain const *chain )
+{
+  return calls->depth != 0 && calls->generation == chain->generation;
+}
@@ -81,6 +81,8 @@ void __attribute__(( noreturn, noinline )) Kernel_start()
   workspace.vectors.irq_vec       = Kernel_default_irq;
 
   Initialise_undefined_registers();
+  Initialise_cycle_counter();
+  workspace.task_slot.vfp_registers = Initialise_vfp();
 
   Initialise_privileged_mode_stacks();
   Initialise_privileged_mode_stack_pointers();
@@ -42,20 +42,18 @@ typedef struct shared_workspace shared_workspace;
 
 typedef struct module module;
 typedef struct callback callback;
-typedef callback vector;
 typedef callback transient_callback;
 typedef struct variable variable;
+typedef struct sysvar_table sysvar_table;
 typedef struct os_pipe os_pipe;
 
-typedef struct ticker_event ticker_event;
-struct ticker_event {
-  uint32_t code;
-  uint32_t private_word;
-  uint32_t remaining;
-  uint32_t reload;
-  ticker_event *next;
-  ticker_event *prev; // Doubly linked list
-};
+#include "include/swi_chunks.h"
+#include "include/service_index.h"
+#include "include/vector_chain.h"
+#include "include/trace.h"
+#include "include/swi_statistics.h"
+
+typedef struct ticker_wheel ticker_wheel; // See swis/ticker.c
 
 // Stacks sizes need to be checked (or use the zp memory)
 struct Kernel_workspace {
@@ -71,26 +69,36 @@ struct Kernel_workspace {
   uint32_t debug_written; // Written, but not reported to the pipe
   PipeSpace debug_space;
 
+  trace_buffer trace;     // See include/trace.h
+
   module *module_list_head;
   module *module_list_tail;
+  swi_chunk_table swi_chunks; // Index into the module list, by SWI chunk
+  service_index services;     // Module service handlers, by service number
+  uint32_t module_order;      // Of the last module added to the list
   uint32_t DomainId;
-  vector *vectors[64];   // https://www.riscosopen.org/wiki/documentation/show/Software%20Vector%20Numbers
-  vector *default_vectors[64]; // Needs to be core-specific for, e.g., DrawV, shouldn't be for others...
+  vector_chain *vectors[64];   // https://www.riscosopen.org/wiki/documentation/show/Software%20Vector%20Numbers
+                               // Null when only the default is there
+  vector_handler default_vectors[64]; // Needs to be core-specific for, e.g., DrawV, shouldn't be for others...
+  vector_calls vector_calls;   // For freeing replaced chains, see include/vector_chain.h
 
   // 0 -> disabled
   // There is no associated code, it will be listening for EventV.
   uint32_t event_enabled[29];
 
-  variable *variables; // Should be shared?
-
-  ticker_event *ticker_queue;
+  // Small RMA blocks freed on this core, by size, for re-use without
+  // locking the heap; see swis/os_heap.c
+  struct {
+    struct rma_cached_block *head;
+    uint32_t count;
+  } rma_cache[8];
 
   struct {
     uint32_t abt[64];
   } abort_stack;
 
   struct {
-    uint32_t und[64];
+    uint32_t und[256]; // Enough to allocate a Task's VFP context, see vfp.c
   } undef_stack;
 };
 
@@ -103,10 +111,6 @@ struct VDU_workspace {
     uint32_t right;
     uint32_t top;
   } ChangedBox;
-  struct {
-    int16_t x;
-    int16_t y;
-  } plot_points[3];
   // uint32_t modevars[13];
   // uint32_t vduvars[45];
   // FIXME: these should be in a graphics context of some kind
@@ -120,7 +124,15 @@ struct Kernel_shared_workspace {
   fs *filesystems;
   uint32_t fscontrol_lock;
 
-  uint32_t sysvars_lock;
+  // System variables, see swis/varvals.c
+  uint32_t sysvars_lock;        // Writers only
+  sysvar_table *sysvars;        // Published table, never modified
+  sysvar_table *retired_sysvars; // Replaced, waiting for readers to finish
+  struct {
+    uint32_t depth;             // Nested reads in progress on this core
+    uint32_t generation;        // Incremented as depth returns to zero
+    uint32_t padding[14];       // Keep each core's entry in its own cache line
+  } sysvar_readers[8];
 
   // Only one multiprocessing module can be initialised at at time (so the 
   // first has a chance to initialise their shared workspace).
@@ -133,11 +145,27 @@ struct Kernel_shared_workspace {
   module *module_list_tail;
 
   callback *callbacks_pool;
-  ticker_event *ticker_event_pool;
+
+  ticker_wheel *ticker_wheels[8]; // One per core, see swis/ticker.c
 
   uint32_t pipes_lock;
   os_pipe *pipes;
 
+  // See claim_lock and TaskOp_LockStatistics
+  uint32_t lock_statistics_enabled;
+  lock_statistics lock_statistics[LOCK_STATISTICS_SIZE];
+
+  // See include/trace.h and TaskOp_Trace
+  uint32_t trace_mask;          // 1 << event, for each event recorded
+  uint32_t trace_pipes[8];      // One per core
+
+  // See include/swi_statistics.h and TaskOp_SWIStatistics
+  uint32_t swi_statistics_enabled;
+  uint32_t swi_statistics_generation;   // Incremented to clear the tables
+  swi_statistics_table *swi_statistics[8]; // One per core, in the RMA
+  swi_statistics_table *swi_statistics_total; // For readers, under the lock
+  uint32_t swi_statistics_lock;
+
   uint32_t screen_lock; // Not sure if this will always be wanted; it might make sense to make the screen memory outer (only) sharable, and flush the L1 cache to it before releasing this lock.
 };
 
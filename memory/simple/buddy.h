@@ -0,0 +1,251 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Buddy allocator for physical pages.
+//
+// Blocks are 1 << order pages, naturally aligned. There is a bitmap for
+// each order, a bit is set if that block is free (and not merged with its
+// buddy into a free block of the next order up).
+//
+// The memory being managed is not mapped into virtual memory, so nothing
+// can be stored in the free blocks themselves. Instead, each bitmap has
+// summary levels above it, one bit per word of the level below, set if
+// that word is non-zero. Finding a free block of a given order is a walk
+// down from the single word at the top.
+//
+// Allocating and freeing a block are both O(log n), in the number of
+// orders and levels. Sizes that aren't a power of two are taken from a
+// large enough block, and the unused end is freed immediately.
+//
+// No locking; the caller is expected to hold a lock.
+//
+// The buddy_allocator structure is in memory_manager.h, so that it can be
+// part of the shared workspace.
+
+static inline uint32_t buddy_words( uint32_t bits )
+{
+  return (bits + 31) >> 5;
+}
+
+// Words of storage for the bitmaps needed to cover the given number of
+// pages (starting at page zero).
+static inline uint32_t buddy_storage_words( uint32_t pages )
+{
+  uint32_t total = 0;
+
+  for (int order = 0; order < BUDDY_ORDERS && (pages >> order) != 0; order++) {
+    uint32_t bits = pages >> order;
+    for (int level = 0; level < BUDDY_LEVELS; level++) {
+      bits = buddy_words( bits );
+      total += bits;
+    }
+  }
+
+  return total;
+}
+
+// The storage must be zeroed, and buddy_storage_words( pages ) long.
+// Initially, there are no free pages.
+static inline void buddy_initialise( buddy_allocator *a, uint32_t *storage, uint32_t pages )
+{
+  assert( pages != 0 && (pages & (pages - 1)) == 0 );
+  assert( pages <= BUDDY_MAX_PAGES );
+
+  a->pages = pages;
+  a->total_pages = 0;
+  a->free_pages = 0;
+
+  for (int order = 0; order < BUDDY_ORDERS; order++) {
+    a->free_blocks[order] = 0;
+
+    uint32_t bits = pages >> order;
+    for (int level = 0; level < BUDDY_LEVELS; level++) {
+      if (bits == 0) {
+        a->map[order][level] = 0;
+      }
+      else {
+        bits = buddy_words( bits );
+        a->map[order][level] = storage;
+        storage += bits;
+      }
+    }
+  }
+}
+
+static inline bool buddy_is_free( buddy_allocator *a, int order, uint32_t block )
+{
+  return 0 != (a->map[order][0][block >> 5] & (1u << (block & 31)));
+}
+
+static inline void buddy_mark_free( buddy_allocator *a, int order, uint32_t block )
+{
+  a->free_blocks[order]++;
+
+  for (int level = 0; level < BUDDY_LEVELS; level++) {
+    uint32_t *word = &a->map[order][level][block >> 5];
+    bool was_empty = (*word == 0);
+    *word |= (1u << (block & 31));
+    if (!was_empty) return;
+    block = block >> 5;
+  }
+}
+
+static inline void buddy_mark_used( buddy_allocator *a, int order, uint32_t block )
+{
+  a->free_blocks[order]--;
+
+  for (int level = 0; level < BUDDY_LEVELS; level++) {
+    uint32_t *word = &a->map[order][level][block >> 5];
+    *word &= ~(1u << (block & 31));
+    if (*word != 0) return;
+    block = block >> 5;
+  }
+}
+
+// Lowest numbered free block of the order, the caller knows there is one.
+static inline uint32_t buddy_find( buddy_allocator *a, int order )
+{
+  uint32_t index = 0;
+
+  for (int level = BUDDY_LEVELS - 1; level >= 0; level--) {
+    uint32_t word = a->map[order][level][index];
+    assert( word != 0 );
+    index = (index << 5) + __builtin_ctz( word );
+  }
+
+  return index;
+}
+
+// True if the page is in any free block
+static inline bool buddy_page_free( buddy_allocator *a, uint32_t page )
+{
+  for (int order = 0; order < BUDDY_ORDERS && a->map[order][0] != 0; order++) {
+    if (buddy_is_free( a, order, page >> order )) return true;
+  }
+  return false;
+}
+
+static inline void buddy_free_block( buddy_allocator *a, uint32_t page, int order )
+{
+  assert( (page & ((1 << order) - 1)) == 0 );
+  assert( !buddy_page_free( a, page ) ); // Freed twice?
+
+  a->free_pages += (1 << order);
+
+  // Merge with the buddy for as long as it's free
+  while (order + 1 < BUDDY_ORDERS
+      && (2 << order) <= a->pages
+      && buddy_is_free( a, order, (page >> order) ^ 1 )) {
+    buddy_mark_used( a, order, (page >> order) ^ 1 );
+    page &= ~(1 << order);
+    order++;
+  }
+
+  buddy_mark_free( a, order, page >> order );
+}
+
+// Any range of pages, freed as the largest aligned blocks that fit.
+static inline void buddy_free_range( buddy_allocator *a, uint32_t page, uint32_t count )
+{
+  assert( page + count <= a->pages );
+
+  while (count != 0) {
+    int order = (page == 0) ? BUDDY_ORDERS - 1 : __builtin_ctz( page );
+    if (order > BUDDY_ORDERS - 1) order = BUDDY_ORDERS - 1;
+    while ((1 << order) > count || (1 << order) > a->pages) order--;
+
+    buddy_free_block( a, page, order );
+
+    page += (1 << order);
+    count -= (1 << order);
+  }
+}
+
+// RAM becoming available for the first time
+static inline void buddy_add_range( buddy_allocator *a, uint32_t page, uint32_t count )
+{
+  a->total_pages += count;
+  buddy_free_range( a, page, count );
+}
+
+// Returns the first page of a naturally aligned block of 1 << order
+// pages, or 0xffffffff if there isn't one.
+static inline uint32_t buddy_allocate_block( buddy_allocator *a, int order )
+{
+  int found = order;
+
+  while (found < BUDDY_ORDERS && a->free_blocks[found] == 0) {
+    found++;
+  }
+
+  if (found == BUDDY_ORDERS) return 0xffffffff;
+
+  uint32_t block = buddy_find( a, found );
+  buddy_mark_used( a, found, block );
+
+  uint32_t page = block << found;
+
+  // Split, returning the upper halves
+  while (found > order) {
+    found--;
+    buddy_mark_free( a, found, (page >> found) + 1 );
+  }
+
+  a->free_pages -= (1 << order);
+
+  return page;
+}
+
+// Returns the first page of count contiguous pages, the first aligned to
+// a multiple of alignment (a power of two) pages, or 0xffffffff.
+static inline uint32_t buddy_allocate( buddy_allocator *a, uint32_t count, uint32_t alignment )
+{
+  assert( count != 0 );
+  assert( alignment != 0 && (alignment & (alignment - 1)) == 0 );
+
+  int order = 0;
+  while ((1 << order) < count || (1 << order) < alignment) {
+    order++;
+  }
+
+  if (order >= BUDDY_ORDERS) return 0xffffffff;
+
+  uint32_t page = buddy_allocate_block( a, order );
+
+  if (page != 0xffffffff && count < (1 << order)) {
+    buddy_free_range( a, page + count, (1 << order) - count );
+  }
+
+  return page;
+}
+
+static inline int buddy_largest_free_order( buddy_allocator *a )
+{
+  for (int order = BUDDY_ORDERS - 1; order >= 0; order--) {
+    if (a->free_blocks[order] != 0) return order;
+  }
+  return -1;
+}
+
+// Free pages that are only in blocks smaller than 1 << order pages, so
+// they can't be used for an allocation of that size.
+static inline uint32_t buddy_unusable_pages( buddy_allocator *a, int order )
+{
+  uint32_t result = 0;
+  for (int o = 0; o < order && o < BUDDY_ORDERS; o++) {
+    result += a->free_blocks[o] << o;
+  }
+  return result;
+}
@@ -26,6 +26,7 @@
 
 #include "inkernel.h"
 #include "trivial_display.h"
+#include "buddy.h"
 
 // Very, very simple implementation: one block of contiguous physical memory for each DA.
 // It will break very quickly, but hopefully demonstrate the principle.
@@ -789,6 +790,44 @@ Write0( "OS_Memory operation " ); WriteNum( regs->r[0] ); Write0( " VA " ); Writ
     return true;
     }
     break;
+  case 8:
+    {
+    // Amounts of memory, only DRAM for now
+    uint32_t type = (regs->r[0] >> 8) & 0xf;
+    regs->r[1] = (type == 1) ? shared.memory.free_pages.total_pages : 0;
+    regs->r[2] = 4096;
+    return true;
+    }
+    break;
+  case 64:
+    {
+    // C kernel: free physical page statistics
+    // On entry: R1 -> buffer for the number of free blocks of each size
+    //                 (1 << n pages), or 0, R2 = size of buffer in words
+    // On exit: R2 = total pages, R3 = free pages, R4 = largest free block
+    //          (pages), R5 = free pages only in blocks smaller than 1MiB
+    bool reclaimed = claim_lock( &shared.memory.lock );
+    assert( !reclaimed );
+
+    buddy_allocator *a = &shared.memory.free_pages;
+
+    uint32_t *counts = (void*) regs->r[1];
+    if (counts != 0) {
+      for (int i = 0; i < regs->r[2] && i < BUDDY_ORDERS; i++) {
+        counts[i] = a->free_blocks[i];
+      }
+    }
+
+    int largest = buddy_largest_free_order( a );
+    regs->r[2] = a->total_pages;
+    regs->r[3] = a->free_pages;
+    regs->r[4] = (largest < 0) ? 0 : (1 << largest);
+    regs->r[5] = buddy_unusable_pages( a, 8 );
+
+    if (!reclaimed) release_lock( &shared.memory.lock );
+    return true;
+    }
+    break;
   case 10:
     {
     // Free pool lock (as in, affect the lock on the free pool).
@@ -806,106 +845,83 @@ Write0( "OS_Memory operation " ); WriteNum( regs->r[0] ); Write0( " VA " ); Writ
 }
 
 
-void Kernel_add_free_RAM( uint32_t base_page, uint32_t size_in_pages )
+// The bitmaps for the free page allocator take the first pages of the
+// first RAM reported, and are mapped at free_page_bitmaps (see rool.script).
+// They cover physical pages 0 to BUDDY_MAX_PAGES, RAM above that is ignored.
+static void initialise_free_pages( uint32_t *base_page, uint32_t *size_in_pages )
 {
-  bool reclaimed = claim_lock( &shared.memory.lock );
-  assert( !reclaimed );
+  extern uint32_t free_page_bitmaps;
 
-  free_block *p = (free_block *) shared.memory.free_blocks;
+  uint32_t words = buddy_storage_words( BUDDY_MAX_PAGES );
+  uint32_t pages = (words * sizeof( uint32_t ) + 0xfff) >> 12;
 
-  while (p->size != 0) {
-    p++;
-  }
+  assert( *size_in_pages > pages );
 
-  p->base_page = base_page;
-  p->size = size_in_pages;
+  MMU_map_shared_at( &free_page_bitmaps, *base_page << 12, pages << 12 );
+  bzero( &free_page_bitmaps, pages << 12 );
 
-  if (!reclaimed) release_lock( &shared.memory.lock );
-}
+  buddy_initialise( &shared.memory.free_pages, &free_page_bitmaps, BUDDY_MAX_PAGES );
 
-static bool aligned( uint32_t b, uint32_t alignment )
-{
-  return 0 == (b & (alignment - 1));
+  *base_page += pages;
+  *size_in_pages -= pages;
 }
 
-static uint32_t misalignment( uint32_t b, uint32_t alignment )
+void Kernel_add_free_RAM( uint32_t base_page, uint32_t size_in_pages )
 {
-  return alignment - (b & (alignment - 1));
-}
+  bool reclaimed = claim_lock( &shared.memory.lock );
+  assert( !reclaimed );
+
+  if (base_page + size_in_pages > BUDDY_MAX_PAGES) {
+    WriteS( "Ignoring RAM above " ); WriteNum( BUDDY_MAX_PAGES << 12 ); NewLine;
+    size_in_pages = (base_page < BUDDY_MAX_PAGES) ? BUDDY_MAX_PAGES - base_page : 0;
+  }
 
-// How I think this algorithm will work:
-// as memory is allocated, the earlier blocks will become less aligned,
-// when a more aligned memory area is needed, there might not be a free_block
-// whose base is sufficiently aligned, so the last block will be made into
-// an aligned free block by taking the top off an earlier block at the first
-// point of alignment.
-// In practice, the first free blocks will be least aligned, and the last, most
-// aligned.
-// This is basically untested, and I'm sure there are dozens of better
-// approaches, which I intend to look up later.
-
-// This will not play nicely with freeing pages, but that comes later.
-// I anticipate having a linked list of freed blocks, and a page of OS
-// memory that I can remap to examine them. With the list structure at
-// the start of the freed memory blocks, there will be practically zero OS
-// memory overhead.
-
-// Or a red-black tree of free pages, whose maximum size would be a node
-// for each of the odd- or even-numbered pages (half allocated, half freed). 
+  if (size_in_pages != 0) {
+    if (shared.memory.free_pages.pages == 0) {
+      initialise_free_pages( &base_page, &size_in_pages );
+    }
 
+    buddy_add_range( &shared.memory.free_pages, base_page, size_in_pages );
+  }
+
+  if (!reclaimed) release_lock( &shared.memory.lock );
+}
+
+// Returns the physical address of size bytes (rounded up to whole pages),
+// aligned to alignment (a power of two, at least a page).
 uint32_t Kernel_allocate_pages( uint32_t size, uint32_t alignment )
 {
-  uint32_t result = -1;
-  uint32_t size_in_pages = size >> 12;
+  uint32_t size_in_pages = (size + 0xfff) >> 12;
   uint32_t alignment_in_pages = alignment >> 12;
 
+  if (alignment_in_pages == 0) alignment_in_pages = 1;
+
   bool reclaimed = claim_lock( &shared.memory.lock );
   assert( !reclaimed ); // IDK, seems sus.
 
-  free_block *p = (free_block *) shared.memory.free_blocks;
+  uint32_t page = buddy_allocate( &shared.memory.free_pages, size_in_pages, alignment_in_pages );
 
-  while (p->size != 0
-      && (!aligned( p->base_page, alignment_in_pages )
-       || p->size < size_in_pages)) {
-    p++;
-  }
-
-  if (p->size == 0) {
-    // Find a big enough block to split, and take the aligned part off into another free block
-    // Note: p points to a free entry
+  if (!reclaimed) release_lock( &shared.memory.lock );
 
-    free_block *big = (free_block *) shared.memory.free_blocks;
-    while (big->size != 0
-        && big->size < size_in_pages + misalignment( big->base_page, alignment_in_pages )) {
-      big++;
-    }
+  assert( page != 0xffffffff );
 
-    if (big->size != 0) {
-      uint32_t mis = misalignment( big->base_page, alignment_in_pages );
-      p->size = big->size - mis;
-      p->base_page = big->base_page + mis;
-      big->size = mis;
-    }
-  }
+  if (page == 0xffffffff) return page;
 
-  if (p->size != 0) {
-    result = p->base_page << 12;
-    p->base_page += size_in_pages;
-    p->size -= size_in_pages;
+  return page << 12;
+}
 
-    if (p->size == 0) {
-      do {
-        *p = *(p+1);
-        p++;
-      } while (p->size != 0);
-    }
-  }
+// The memory must no longer be mapped anywhere (or at least, not accessed
+// again).
+void Kernel_free_pages( uint32_t base, uint32_t size )
+{
+  assert( (base & 0xfff) == 0 );
 
-  if (!reclaimed) release_lock( &shared.memory.lock );
+  bool reclaimed = claim_lock( &shared.memory.lock );
+  assert( !reclaimed );
 
-  assert( result != -1 );
+  buddy_free_range( &shared.memory.free_pages, base >> 12, (size + 0xfff) >> 12 );
 
-  return result;
+  if (!reclaimed) release_lock( &shared.memory.lock );
 }
 
 #define W (480 * workspace.core_number)
@@ -959,8 +975,30 @@ void Kernel_failed_data_abort()
 }
 
 // Begin FPEmulator hack to get Wimp_StartTask to complete
-void __attribute__(( noinline )) UndefinedInstruction( uint32_t regs[6], uint32_t instruction )
+void __attribute__(( noinline )) UndefinedInstruction( uint32_t regs[7] )
 {
+  // regs: r0-r3, r12, return address, SPSR
+  bool thumb = 0 != (regs[6] & (1 << 5));
+  uint32_t instruction;
+
+  if (thumb) {
+    // The return address is the undefined instruction + 2, whatever its
+    // size. The second halfword is only read if there is one.
+    uint16_t const *halfwords = (void*) (regs[5] - 2);
+    instruction = halfwords[0];
+    if ((instruction >> 11) >= 0x1d) {
+      instruction = (instruction << 16) | halfwords[1];
+    }
+  }
+  else {
+    instruction = *(uint32_t const *) (regs[5] - 4);
+  }
+
+  if (Task_vfp_undefined_instruction( instruction, regs[6] )) {
+    regs[5] -= thumb ? 2 : 4; // Retry the instruction
+    return;
+  }
+
   // This breaks things: 
   // WriteS( "Undefined instruction at " ); WriteNum( regs[5] ); NewLine;
 
@@ -971,7 +1009,6 @@ void __attribute__(( noinline )) UndefinedInstruction( uint32_t regs[6], uint32_
 void __attribute__(( naked, noreturn )) Kernel_default_undef()
 {
   uint32_t *regs;
-  uint32_t instruction;
 
   // Return address is the instruction following the undefined one,
   // no need to change it.
@@ -979,11 +1016,9 @@ void __attribute__(( naked, noreturn )) Kernel_default_undef()
         "srsdb sp!, #0x1b // Store return address and SPSR (UND mode)" 
     "\n  push { "C_CLOBBERED" }"
     "\n  mov %[regs], sp"
-    "\n  ldr %[inst], [lr, #-4]"
-    : [regs] "=r" (regs)
-    , [inst] "=r" (instruction) );
+    : [regs] "=r" (regs) );
 
-  UndefinedInstruction( regs, instruction );
+  UndefinedInstruction( regs );
 
   asm ( "pop { "C_CLOBBERED" }"
     "\n  rfeia sp! // Restore (modified) execution and SPSR"
@@ -19,11 +19,20 @@ struct Memory_manager_workspace {
   DynamicArea *dynamic_areas;
 };
 
+// Free physical pages, see buddy.h
+#define BUDDY_ORDERS 19        // 4KiB to 1GiB
+#define BUDDY_LEVELS 4         // Enough for 1 << 20 blocks of any order
+#define BUDDY_MAX_PAGES (1 << (BUDDY_ORDERS - 1))
+
 typedef struct {
-  uint32_t base_page;
-  uint32_t size; // pages
-} free_block;
+  uint32_t pages;               // Pages covered by the bitmaps, a power of two
+  uint32_t total_pages;         // Pages ever added
+  uint32_t free_pages;
+  uint32_t free_blocks[BUDDY_ORDERS];
+  uint32_t *map[BUDDY_ORDERS][BUDDY_LEVELS];
+} buddy_allocator;
 
+// Only used by the ROM heap code (LEGACY_HEAP); native heaps have a lock each.
 // For debugging a deadlock; make both locks the same word, then detect when they're being re-claimed.
 #define os_heap_lock lock
 
@@ -34,7 +43,7 @@ struct Memory_manager_shared_workspace {
 
   uint32_t dynamic_areas_setup_lock; // This has to be separate from dynamic_areas_lock, because OS_Heap uses OS_DynamicArea
   uint32_t dynamic_areas_lock;
-  free_block free_blocks[64]; // This is the real free memory, not what we tell the applications!
+  buddy_allocator free_pages; // This is the real free memory, not what we tell the applications!
   DynamicArea *dynamic_areas;
   uint32_t rma_memory;  // Required before you can access the RMA dynamic areas
   uint32_t last_da_address;
@@ -53,6 +62,7 @@ void Initialise_system_DAs();
 
 void Kernel_add_free_RAM( uint32_t base_page, uint32_t size_in_pages );
 uint32_t Kernel_allocate_pages( uint32_t size, uint32_t alignment );
+void Kernel_free_pages( uint32_t base, uint32_t size );
 
 void __attribute__(( naked, noreturn )) Kernel_default_prefetch();
 void __attribute__(( naked, noreturn )) Kernel_default_data_abort();
@@ -94,6 +94,8 @@ struct module {
   module *next;         // Simple singly-linked list
   module *instances;    // Simple singly-linked list of instances. Instance number is how far along the list the module is, not a constant.
   module *base;
+  service_handler *service_handlers;    // One per service in the module's table, or null
+  service_handler every_service;        // If not, all service calls come here
   char postfix[];
 };
 
@@ -165,10 +167,10 @@ static inline uint32_t finalisation_code( module_header *header )
   return header->offset_to_finalisation + (uint32_t) header;
 }
 
-static bool __attribute__(( noinline )) run_service_call_handler_code( svc_registers *regs, module *m )
+static bool __attribute__(( noinline )) run_service_call_handler_code( svc_registers *regs, service_handler *h )
 {
-  register uint32_t non_kernel_code asm( "r14" ) = m->header->offset_to_service_call_handler + (uint32_t) m->header;
-  register uint32_t *private_word asm( "r12" ) = m->private_word;
+  register uint32_t non_kernel_code asm( "r14" ) = h->code;
+  register uint32_t *private_word asm( "r12" ) = h->module->private_word;
 
   asm goto (
         "  push { %[regs] }"
@@ -266,11 +268,8 @@ if (svc == 0x41b40 || svc == 0x61b40) {
 #ifdef DEBUG__SHOW_VECTORS_VERBOSE
 #define DEBUG__SHOW_VECTORS
 #endif
-#ifdef DEBUG__SHOW_VECTORS
-vector do_nothing;
-#endif
 
-static void run_interruptable_vector( svc_registers *regs, vector *v )
+static void run_interruptable_vector( svc_registers *regs, vector_handler const *h )
 {
   // "If your routine passes the call on, you can deliberately alter some of
   // the registers values to change the effect of the call, however, you must
@@ -283,7 +282,7 @@ static void run_interruptable_vector( svc_registers *regs, vector *v )
   //    Returns with mov pc, lr (allowing other handlers to execute)
   // AND the final, default, action of every vector handler is pop {pc}.
 
-  register vector *vec asm( "r10" ) = v;
+  register vector_handler const *handler asm( "r10" ) = h;
 
   // Code always exits via intercepted.
   asm volatile (
@@ -291,12 +290,13 @@ static void run_interruptable_vector( svc_registers *regs, vector *v )
       "\n  push { r0, %[regs] } // Save location of register storage at sp+4"
       "\n  ldm %[regs], { r0-r9 }"
       "\n0:"
-      "\n  ldr r14, [%[v], %[code]]"
-      "\n  ldr r12, [%[v], %[private]]"
+      "\n  ldr r12, [%[h], %[private]]"
+      "\n  ldr r14, [%[h]], %[size]"
+      "\n  cmp r14, #0 // End of chain; I don't think this should happen, but carry on if it does"
+      "\n  beq 1f"
       "\n  blx r14"
-      "\n  ldr %[v], [%[v], %[next]]"
-      "\n  cmp %[v], #0 // I don't think this should happen, but carry on if it does"
-      "\n  bne 0b"
+      "\n  b 0b"
+      "\n1:"
       "\n  pop {lr} // intercepted"
       "\nintercepted:"
       "\n  pop { r14 } // regs (intercepted already popped)"
@@ -307,19 +307,34 @@ static void run_interruptable_vector( svc_registers *regs, vector *v )
       "\n  and r2, r2, #0xf0000000"
       "\n  orr r1, r1, r2"
       "\n  str r1, [r14, %[spsr]]"
-      : "=r" (v) // Updated by code
+      : "=r" (h) // Updated by code
       , "=r" (regs) // Corrupted by DrawV, I think
       : [regs] "r" (regs)
-      , [v] "r" (vec)
+      , [h] "r" (handler)
 
-      , [next] "i" ((char*) &((vector*) 0)->next)
-      , [private] "i" ((char*) &((vector*) 0)->private_word)
-      , [code] "i" ((char*) &((vector*) 0)->code)
+      , [size] "i" (sizeof( vector_handler ))
+      , [private] "i" ((char*) &((vector_handler*) 0)->private_word)
       , [spsr] "i" (4 * (&regs->spsr - &regs->r[0]))
 
       : "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r12", "r14" );
 }
 
+static inline void begin_vector_call()
+{
+  // Only this core uses its vectors; a call on this core that interrupts
+  // this one leaves the depth as it found it.
+  workspace.kernel.vector_calls.depth++;
+  asm volatile ( "" : : : "memory" ); // Counted before the chain is read
+}
+
+static inline void end_vector_call()
+{
+  asm volatile ( "" : : : "memory" ); // Finished with the chain before saying so
+  if (0 == --workspace.kernel.vector_calls.depth) {
+    workspace.kernel.vector_calls.generation++;
+  }
+}
+
 bool run_vector( svc_registers *regs, int vec )
 {
 #ifdef DEBUG__SHOW_VECTORS_VERBOSE
@@ -327,21 +342,28 @@ bool run_vector( svc_registers *regs, int vec )
   if (vec != 3 && vec != 0x1c)
   {
     WriteS( "Running vector " ); WriteNum( vec ); NewLine;
-    vector *v = workspace.kernel.vectors[vec];
-    assert( v != 0 );
+    vector_handler const *h = vector_chain_handlers( workspace.kernel.vectors[vec], &workspace.kernel.default_vectors[vec] );
     do {
-      WriteNum( v->code ); WriteS( " " ); WriteNum( v->private_word ); WriteS( " " ); WriteNum( v->next ); NewLine;
-      v = v->next;
-    } while (v != workspace.kernel.vectors[vec]);
+      WriteNum( h->code ); WriteS( " " ); WriteNum( h->private_word ); NewLine;
+    } while (h++ != &workspace.kernel.default_vectors[vec] && h->code != 0);
     NewLine;
     for (int i = 0; i < 10; i++) { WriteNum( regs->r[i] ); WriteS( " " ); }
     WriteNum( regs->lr );
     NewLine;
   }
 #endif
-  run_interruptable_vector( regs, workspace.kernel.vectors[vec] );
+  if (workspace.kernel.vectors[vec] == 0) {
+    // Only the default handler, which can't be freed.
+    run_interruptable_vector( regs, &workspace.kernel.default_vectors[vec] );
+  }
+  else {
+    begin_vector_call();
+    vector_chain *chain = workspace.kernel.vectors[vec];
+    run_interruptable_vector( regs, vector_chain_handlers( chain, &workspace.kernel.default_vectors[vec] ) );
+    end_vector_call();
+  }
 #ifdef DEBUG__SHOW_VECTORS_VERBOSE
-  if (vec != 3 && vec != 0x1c && workspace.kernel.vectors[3] != &do_nothing)
+  if (vec != 3 && vec != 0x1c)
   {
     WriteS( "Vector " ); WriteNum( vec ); NewLine;
   }
@@ -374,14 +396,110 @@ static inline const char *module_commands( module_header *header )
   return pointer_at_offset_from( header, header->offset_to_help_and_command_keyword_table );
 }
 
+// RISC OS 3.7 and later modules may have a service table, listing the
+// services the module handles (zero terminated), after a flags word and
+// the offset of the handler to call for them (skipping the module's own
+// checks). The service call entry is then marked by a mov r0, r0, with
+// the offset of the table in the word before it.
+static uint32_t const *service_table( module_header *header )
+{
+  uint32_t const *entry = pointer_at_offset_from( header, header->offset_to_service_call_handler );
+
+  if (entry == 0 || entry[0] != 0xe1a00000) return 0;
+
+  uint32_t offset = entry[-1];
+  if (offset == 0 || (offset & 3) != 0) return 0;
+
+  uint32_t const *table = pointer_at_offset_from( header, offset );
+  if (table[0] != 0 || table[1] == 0) return 0; // No flags defined, yet
+
+  return table;
+}
+
+// Modules with a service table only get the services they asked for,
+// the rest get them all (as do those that can't be fitted in the index).
+static void index_service_handlers( module *instance )
+{
+  module_header *header = instance->header;
+  service_index *index = &workspace.kernel.services;
+  uint32_t order = ++workspace.kernel.module_order;
+
+  instance->service_handlers = 0;
+
+  if (header->offset_to_service_call_handler == 0) return;
+
+  uint32_t const *table = service_table( header );
+
+  if (table != 0 && service_index_has_room( index, table + 2 )) {
+    uint32_t const *services = table + 2;
+    uint32_t count = 0;
+    while (services[count] != 0) count++;
+
+    service_handler *handlers = count == 0 ? 0 : rma_allocate( count * sizeof( service_handler ) );
+
+    if (count == 0 || handlers != 0) {
+      uint32_t code = table[1] + (uint32_t) header;
+
+      for (uint32_t i = 0; i < count; i++) {
+        handlers[i].module = instance;
+        handlers[i].order = order;
+        handlers[i].code = code;
+        service_index_add( index, services[i], &handlers[i] );
+      }
+
+      instance->service_handlers = handlers;
+      return;
+    }
+  }
+
+  instance->every_service.module = instance;
+  instance->every_service.order = order;
+  instance->every_service.code = header->offset_to_service_call_handler + (uint32_t) header;
+  service_index_add_everything( index, &instance->every_service );
+}
+
+// The module list is the authority on which module provides which SWIs,
+// workspace.kernel.swi_chunks saves walking it for every module SWI.
+// The first module in the list with a given chunk provides the SWIs.
+// Similarly, workspace.kernel.services saves passing every service call
+// to every module.
+
+static void append_to_module_list( module *instance )
+{
+  if (workspace.kernel.module_list_tail == 0) {
+    workspace.kernel.module_list_head = instance;
+  }
+  else {
+    workspace.kernel.module_list_tail->next = instance;
+  }
+
+  workspace.kernel.module_list_tail = instance;
+
+  swi_chunk_insert( &workspace.kernel.swi_chunks, instance->header->swi_chunk, instance );
+
+  index_service_handlers( instance );
+}
+
+static module *module_providing_swis( uint32_t chunk )
+{
+  module *m = swi_chunk_lookup( &workspace.kernel.swi_chunks, chunk );
+
+  if (m == 0 && workspace.kernel.swi_chunks.overflowed) {
+    // Not every module made it into the table, do it the slow way
+    m = workspace.kernel.module_list_head;
+    while (m != 0 && m->header->swi_chunk != chunk) {
+      m = m->next;
+    }
+  }
+
+  return m;
+}
+
 bool do_module_swi( svc_registers *regs, uint32_t svc )
 {
   uint32_t chunk = svc & ~Xbit & ~0x3f;
 
-  module *m = workspace.kernel.module_list_head;
-  while (m != 0 && m->header->swi_chunk != chunk) {
-    m = m->next;
-  }
+  module *m = module_providing_swis( chunk );
   if (m == 0) {
     return Kernel_Error_UnknownSWI( regs );
   }
@@ -616,46 +734,42 @@ static inline void show_module_commands( module_header *header )
 bool do_OS_ServiceCall( svc_registers *regs )
 {
   bool result = true;
-  module *m = workspace.kernel.module_list_head;
   uint32_t call = regs->r[1];
+  service_index *index = &workspace.kernel.services;
+  service_handler *interested = service_index_lookup( index, call );
+  service_handler *everything = index->everything;
+  service_handler *h;
 
 #ifdef DEBUG__SHOW_SERVICE_CALLS
 int count = 0;
 describe_service_call( regs );
 WriteNum( call );
-if (m == 0) {
+if (workspace.kernel.module_list_head == 0) {
   WriteS( "No modules initialised\n" ); NewLine;
 }
 #endif
 
   uint32_t r12 = regs->r[12];
-  while (m != 0 && regs->r[1] != 0 && result) {
-    regs->r[12] = (uint32_t) m->private_word;
-    if (0 != m->header->offset_to_service_call_handler) {
+  while (result && regs->r[1] != 0
+      && 0 != (h = service_index_next( &interested, &everything ))) {
+    regs->r[12] = (uint32_t) h->module->private_word;
 #if DEBUG__SHOW_SERVICE_CALLS
 //if (regs->r[1] == 0x46 || regs->r[1] == 0x73) {
 {
-Space; Write0( title_string( m->header ) ); Space; WriteNum( pointer_at_offset_from( m->header, m->header->offset_to_service_call_handler ) );
+Space; Write0( title_string( h->module->header ) ); Space; WriteNum( h->code );
 count++;
 }
 #endif
-      result = run_service_call_handler_code( regs, m );
+    result = run_service_call_handler_code( regs, h );
 
-      assert( regs->r[1] == 0 || regs->r[1] == call );
+    assert( regs->r[1] == 0 || regs->r[1] == call );
 
-      if (regs->r[1] == 0) {
-#if DEBUG__SHOW_SERVICE_CALLS
-        WriteS( "Claimed" );
-#endif
-        break;
-      }
-    }
-    else {
+    if (regs->r[1] == 0) {
 #if DEBUG__SHOW_SERVICE_CALLS
-      Space; Write0( title_string( m->header ) ); Space; WriteS( "No handler" );
+      WriteS( "Claimed" );
 #endif
+      break;
     }
-    m = m->next;
   }
 #ifdef DEBUG__SHOW_SERVICE_CALLS
   NewLine; WriteS( "Passed to " ); WriteNum( count ); WriteS( " modules" ); NewLine;
@@ -768,6 +882,7 @@ static module *new_module( module *base, module_header *m, const char *postfix )
     instance->next = 0;
     instance->base = base;
     instance->instances = 0;
+    instance->service_handlers = 0;
 
     if (base != 0) {
       module **p = &base->instances;
@@ -913,14 +1028,7 @@ static bool initialise_module( svc_registers *regs, uint32_t *memory, char const
     }
 
     if (success) {
-      if (workspace.kernel.module_list_tail == 0) {
-        workspace.kernel.module_list_head = instance;
-      }
-      else {
-        workspace.kernel.module_list_tail->next = instance;
-      }
-
-      workspace.kernel.module_list_tail = instance;
+      append_to_module_list( instance );
     }
   }
 
@@ -1302,14 +1410,7 @@ Write0( __func__ ); Space; WriteNum( parameters ); NewLine;
   }
 
   if (success) {
-    if (workspace.kernel.module_list_tail == 0) {
-      workspace.kernel.module_list_head = instance;
-    }
-    else {
-      workspace.kernel.module_list_tail->next = instance;
-    }
-
-    workspace.kernel.module_list_tail = instance;
+    append_to_module_list( instance );
   }
 
   return success;
@@ -1527,7 +1628,7 @@ bool do_OS_Module( svc_registers *regs )
 
 bool do_OS_CallAVector( svc_registers *regs )
 {
-  if (regs->r[9] > number_of( workspace.kernel.vectors )) {
+  if (regs->r[9] >= number_of( workspace.kernel.vectors )) {
     asm ( "bkpt %[line]" : : [line] "i" (__LINE__) );
   }
   return run_vector( regs, regs->r[9] );
@@ -1540,10 +1641,62 @@ static bool error_InvalidVector( svc_registers *regs )
   return false;
 }
 
-static inline bool equal_callback( callback *a, callback *b )
+static void add_to_retired_vector_chains( vector_chain *chain )
+{
+  vector_chain *head;
+
+  do {
+    head = workspace.kernel.vector_calls.retired;
+    chain->retired_next = head;
+  } while ((uint32_t) head != change_word_if_equal( (uint32_t*) &workspace.kernel.vector_calls.retired, (uint32_t) head, (uint32_t) chain ));
+}
+
+// Free the replaced chains that no vector call on this core can still be
+// using. Another task on this core may be doing the same thing, so the
+// list is taken as a whole, and the survivors put back.
+static void free_retired_vector_chains()
+{
+  vector_chain *list;
+
+  do {
+    list = workspace.kernel.vector_calls.retired;
+  } while (list != 0 && (uint32_t) list != change_word_if_equal( (uint32_t*) &workspace.kernel.vector_calls.retired, (uint32_t) list, 0 ));
+
+  while (list != 0) {
+    vector_chain *next = list->retired_next;
+    if (vector_chain_in_use( &workspace.kernel.vector_calls, list ))
+      add_to_retired_vector_chains( list );
+    else
+      rma_free( list );
+    list = next;
+  }
+}
+
+// Replaces the vector's chain with chain (which may be null, for the
+// default only), as long as it is still old. Returns false, having freed
+// chain, if another task on this core got in first.
+static bool publish_vector_chain( int number, vector_chain *old, vector_chain *chain )
 {
-  assert( a != 0 && b != 0 );
-  return (a->code == b->code) && (a->private_word == b->private_word);
+  asm volatile ( "" : : : "memory" ); // Chain filled in before it's visible
+
+  if ((uint32_t) old != change_word_if_equal( (uint32_t*) &workspace.kernel.vectors[number], (uint32_t) old, (uint32_t) chain )) {
+    if (chain != 0) rma_free( chain );
+    return false;
+  }
+
+  if (old != 0) {
+    if (workspace.kernel.vector_calls.depth == 0) {
+      rma_free( old );
+    }
+    else {
+      old->generation = workspace.kernel.vector_calls.generation;
+      add_to_retired_vector_chains( old );
+    }
+  }
+
+  free_retired_vector_chains();
+
+  return true;
 }
 
 bool do_OS_Claim( svc_registers *regs )
@@ -1558,40 +1711,27 @@ bool do_OS_Claim( svc_registers *regs )
 workspace.kernel.frame_buffer_initialised = 1;
 
   int number = regs->r[0];
-  if (number > number_of( workspace.kernel.vectors )) {
+  if (number >= number_of( workspace.kernel.vectors )) {
     return error_InvalidVector( regs );
   }
 
-  vector **p = &workspace.kernel.vectors[number];
-  assert( *p != 0 );
+  vector_handler claim = { .code = regs->r[1], .private_word = regs->r[2] };
 
-  vector cb = { .code = regs->r[1], .private_word = regs->r[2] };
-  assert( equal_callback( &cb, &cb ) );
+  // A duplicate is removed, so claiming again moves the handler to the head.
+  vector_chain *old;
+  vector_chain *chain;
 
-  vector *found = mpsafe_find_and_remove_callback( p, &cb, equal_callback );
-
-  vector *new;
-
-  if (found != 0) {
-    // Duplicate to be removed, except we'll just move it up to the head instead,
-    // without having to allocate new space.
-    new = found;
-  }
-  else {
-    new = callback_new( &shared.kernel.callbacks_pool );
-    if (new == 0) {
+  do {
+    old = workspace.kernel.vectors[number];
+    chain = rma_allocate( vector_chain_bytes( vector_chain_count( old ) + 1 ) );
+    if (chain == 0) {
       return error_nomem( regs );
     }
 
-    new->code = regs->r[1];
-    new->private_word = regs->r[2];
-  }
-
-  assert( new->code == regs->r[1] && new->private_word == regs->r[2] );
-
-  mpsafe_insert_callback_at_head( p, new );
+    vector_chain_build( chain, old, &workspace.kernel.default_vectors[number], &claim, &claim );
+  } while (!publish_vector_chain( number, old, chain ));
 
-  assert( *p == new );
+  assert( vector_handler_equal( &workspace.kernel.vectors[number]->handler[0], &claim ) );
 
 #ifdef DEBUG__SHOW_VECTORS
   WriteS( "New new vector" ); NewLine;
@@ -1603,23 +1743,40 @@ workspace.kernel.frame_buffer_initialised = 1;
 bool do_OS_Release( svc_registers *regs )
 {
   int number = regs->r[0];
-  if (number > number_of( workspace.kernel.vectors )) {
+  if (number >= number_of( workspace.kernel.vectors )) {
     return error_InvalidVector( regs );
   }
 
-  vector **p = &workspace.kernel.vectors[number];
+  vector_handler release = { .code = regs->r[1], .private_word = regs->r[2] };
 
-  vector cb = { .code = regs->r[1], .private_word = regs->r[2] };
-
-  vector *found;
+  vector_chain *old;
+  vector_chain *chain;
+  uint32_t count;
 
   do {
-    found = mpsafe_find_and_remove_callback( p, &cb, equal_callback );
-    if (found != 0)
-      mpsafe_insert_callback_at_tail( &shared.kernel.callbacks_pool, found );
-  } while (found != 0);
+    old = workspace.kernel.vectors[number];
+    if (old == 0) break; // Only the default
 
-  if (found != 0) return true;
+    chain = rma_allocate( vector_chain_bytes( vector_chain_count( old ) ) );
+    if (chain == 0) {
+      return error_nomem( regs );
+    }
+
+    count = vector_chain_build( chain, old, &workspace.kernel.default_vectors[number], 0, &release );
+    if (count == old->count) { // Not there
+      rma_free( chain );
+      break;
+    }
+
+    if (count == 1) { // Back to the default, called directly
+      rma_free( chain );
+      chain = 0;
+    }
+
+    if (publish_vector_chain( number, old, chain )) {
+      return true;
+    }
+  } while (true);
 
   static error_block not_there = { 0x1a1, "Bad vector release" };
   regs->r[0] = (uint32_t) &not_there;
@@ -3143,21 +3300,6 @@ extern void SpriteVecHandler();
 extern void MOSPaletteV();
 extern void MOSGraphicsV();
 
-static uint32_t screen_colour_from_os_colour( uint32_t os )
-{
-  union {
-    struct { // BGR0
-      uint32_t Z:8;
-      uint32_t B:8;
-      uint32_t G:8;
-      uint32_t R:8;
-    };
-    uint32_t raw;
-  } os_colour = { .raw = os };
-
-  return (255 << 24) | (os_colour.R << 16) | (os_colour.G << 8) | os_colour.B;
-}
-
 #ifdef DEBUG__SHOW_HLINES
 static void show_sprite()
 {
@@ -3207,107 +3349,36 @@ void __attribute__(( noinline )) c_horizontal_line_draw( uint32_t left, uint32_t
 {
 #ifdef DEBUG__SHOW_HLINES
   WriteS( "HLine: " ); WriteNum( left ); Space; WriteNum( right ); Space; WriteNum( y ); Space; WriteNum( action ); NewLine;
-  // FIXME needs to work in sprites as well, I think. I really does, especially for fonts!
 
   WriteS( "HLine:  " ); WriteNum( workspace.vectors.zp.vdu_drivers.ws.GWBRow );
   Space; WriteNum( workspace.vectors.zp.vdu_drivers.ws.GWTRow );
   Space; WriteNum( workspace.vectors.zp.vdu_drivers.ws.GWLCol );
   Space; WriteNum( workspace.vectors.zp.vdu_drivers.ws.GWRCol );
   NewLine;
-#endif
-
-  if (y < workspace.vectors.zp.vdu_drivers.ws.GWBRow || y > workspace.vectors.zp.vdu_drivers.ws.GWTRow) return;
-  if (left > workspace.vectors.zp.vdu_drivers.ws.GWRCol || right < workspace.vectors.zp.vdu_drivers.ws.GWLCol) return;
 
-  switch (workspace.vectors.zp.vdu_drivers.ws.XShftFactor) {
-  case 0: break;
-  case 5: break;
-  default: WriteS( "HLine called, shift factor " ); WriteNum( workspace.vectors.zp.vdu_drivers.ws.XShftFactor ); NewLine;
-  }
-
-#ifdef DEBUG__SHOW_HLINES
-  WriteNum( workspace.vectors.zp.vdu_drivers.ws.XShftFactor ); Space;
   WriteNum( workspace.vectors.zp.vdu_drivers.ws.XWindLimit ); Space;
   WriteNum( workspace.vectors.zp.vdu_drivers.ws.YWindLimit ); Space;
   WriteNum( workspace.vectors.zp.vdu_drivers.ws.ScreenStart ); Space;
-  WriteNum( workspace.vectors.zp.vdu_drivers.ws.Log2BPP ); Space;
-  WriteNum( workspace.vectors.zp.vdu_drivers.ws.Log2BPC ); NewLine;
-#endif
-
-  // FIXME These things need to be moved into some graphics context. The Kernel/s/vdu stuff accesses this directly, but the DrawMod uses the ReadVduVariables interface.
-
-  // EcfOraEor *ecf;
-  uint32_t bpp = 1 << workspace.vectors.zp.vdu_drivers.ws.Log2BPP;
-  uint32_t *screen = (void*) workspace.vectors.zp.vdu_drivers.ws.ScreenStart;
-  uint32_t y_from_top = workspace.vectors.zp.vdu_drivers.ws.YWindLimit - y;
-  int32_t stride = (((workspace.vectors.zp.vdu_drivers.ws.XWindLimit + 1) * bpp + 31) / 32);
-  uint32_t *row = screen + stride * y_from_top;
-  uint32_t *l = row + (left * bpp) / 32;
-  uint32_t *r = row + (right * bpp) / 32;
-  uint32_t lmask = 0xffffffff << ((left * bpp) & 31);
-  uint32_t rmask = 0xffffffff >> (31 - ((right * bpp) & 31));
-#ifdef DEBUG__SHOW_HLINES
-  WriteS( "Row: " ); WriteNum( row ); Space;
-  WriteS( "L: " ); WriteNum( l ); Space;
-  WriteS( "R: " ); WriteNum( r ); Space;
-  if (l == r) WriteNum( lmask & rmask ); else { WriteNum( lmask ); Space; WriteNum( rmask ); } NewLine;
+  WriteNum( workspace.vectors.zp.vdu_drivers.ws.LineLength ); Space;
+  WriteNum( workspace.vectors.zp.vdu_drivers.ws.Log2BPP ); NewLine;
   show_sprite();
 #endif
 
-  uint32_t c;
-  switch (workspace.vectors.zp.vdu_drivers.ws.Log2BPP) {
-  case 0: // 1bpp
-    c = workspace.vectors.zp.vdu_drivers.ws.FgEcf[0];
-    assert( c == 0xffffffff || c == 0 );
-    break;
-  case 5: // 32bpp
-    c = screen_colour_from_os_colour( workspace.vectors.zp.vdu_drivers.ws.FgEcf[0] );
-    break;
-  default:
-    WriteS( "Unsupported bit depth" ); NewLine;
-    c = 0xffffffff;
-  }
+  // Works for sprites as well as the screen, since the legacy code
+  // switches the VDU variables over to the sprite when output is
+  // redirected to it.
+
+  EcfOraEor const *ecf;
 
   switch (action) {
-  case 1: // Foreground
-    {
-    // FIXME URGENTLY Only sets to one!
-    if (l == r) {
-      *l = ((*l) & ~(lmask & rmask)) | (c & (lmask & rmask));
-    }
-    else {
-      if (lmask != 0xffffffff) { *l = (*l & ~lmask) | (c & lmask); l++; }
-      while (l < r) {
-        *l++ = c;
-      }
-      assert( l == r );
-      if (rmask != 0xffffffff) *l |= (*l & ~rmask) | (c & rmask); else *l = 0xffffffff;
-    }
-    }
-    break;
-#if 0
-  case 2: // Invert
-    {
-    uint32_t *p = l;
-    while (p <= r) {
-      *p = ~*p;
-      p++;
-    }
-    }
-    break;
-  case 3: // Background
-    {
-    uint32_t *p = l;
-    uint32_t c = screen_colour_from_os_colour( *vduvarloc[154 - 128] );
-    while (p <= r) {
-      *p = c;
-      p++;
-    }
-    }
-    break;
-#endif
-  default: break;
+  case 0: return; // No effect
+  case 1: ecf = &workspace.vectors.zp.vdu_drivers.ws.FgEcfOraEor; break;
+  case 2: ecf = &span_invert; break;
+  case 3: ecf = &workspace.vectors.zp.vdu_drivers.ws.BgEcfOraEor; break;
+  default: ecf = (void*) action; // Caller's own pattern
   }
+
+  plot_span( left, y, right, ecf );
 }
 
 // Actual "parameters":
@@ -3567,7 +3638,6 @@ static void setup_OS_vectors()
   void (*code)();
 
   for (int i = 0; i < number_of( workspace.kernel.vectors ); i++) {
-    workspace.kernel.default_vectors[i] = callback_new( &shared.kernel.callbacks_pool );
     switch (i) {
     case 0x02: code = default_irq; break;
     case 0x05: code = default_os_cli; break;
@@ -3584,11 +3654,13 @@ static void setup_OS_vectors()
     default:
       code = finish_vector;
     }
-    workspace.kernel.default_vectors[i]->code = (uint32_t) code;
+    workspace.kernel.default_vectors[i].code = (uint32_t) code;
     if (i == 0x22 || i == 0x23)
-      workspace.kernel.default_vectors[i]->private_word = (uint32_t) &workspace.vectors.zp.vdu_drivers.ws;
+      workspace.kernel.default_vectors[i].private_word = (uint32_t) &workspace.vectors.zp.vdu_drivers.ws;
+    else
+      workspace.kernel.default_vectors[i].private_word = 0;
 
-    workspace.kernel.vectors[i] = workspace.kernel.default_vectors[i];
+    workspace.kernel.vectors[i] = 0; // Only the default
   }
 }
 
@@ -3630,9 +3702,7 @@ static void __attribute__(( naked, noreturn )) idle_thread()
 
 extern void __attribute__(( noreturn )) UsrBoot();
 
-#ifndef NO_DEBUG_OUTPUT
 #include "include/pipeop.h"
-#endif
 
 #include "trivial_display.h"
 
@@ -3656,6 +3726,9 @@ void PreUsrBoot()
     workspace.kernel.debug_space = PipeOp_WaitForSpace( workspace.kernel.debug_pipe, 2048 );
     PipeOp_PassingOff( workspace.kernel.debug_pipe, 0 ); // The task doesn't exist yet
 #endif
+
+    uint32_t trace = PipeOp_CreateForTransfer( 16 << 10 ); // 1024 records
+    if (trace != 0) setup_trace_pipe( trace );
     WriteS( "Kernel starting HAL" ); NewLine;
 
     char args[] = "HAL ########";
@@ -3684,7 +3757,7 @@ void PreUsrBoot()
 
 static uint32_t start_idle_task()
 {
-  register uint32_t request asm ( "r0" ) = 0; // Create Thread
+  register uint32_t request asm ( "r0" ) = 0x200; // Create Thread, pinned to this core
   register void *code asm ( "r1" ) = idle_thread;
   register void *stack_top asm ( "r2" ) = 0;
   register uint32_t core_number asm( "r3" ) = workspace.core_number;
@@ -54,6 +54,36 @@ void Initialise_undefined_registers()
     asm ( "msr spsr_fiq, %[zero]" : : [zero] "r" (0) );
 }
 
+void Initialise_cycle_counter()
+{
+  uint32_t reg;
+  uint32_t const bits = (1 << 2) | (1 << 0);
+  // PMCR: Enable the counters (E), and reset the cycle counter (C)
+  MODIFY_CP15_REG( "c9, c12, 0", bits, bits, reg );
+  // PMCNTENSET: Cycle counter
+  asm ( "mcr p15, 0, %[bit], c9, c12, 1" : : [bit] "r" (1 << 31) );
+}
+
+uint32_t Initialise_vfp()
+{
+  uint32_t reg;
+  uint32_t const bits = (0xf << 20);
+  // CPACR: Full access to cp10 and cp11 (bits that don't stick mean
+  // there's no VFP)
+  MODIFY_CP15_REG( "c1, c0, 2", bits, bits, reg );
+  asm volatile ( "isb" );
+  asm volatile ( "mrc p15, 0, %[v], c1, c0, 2" : [v] "=r" (reg) );
+  if ((reg & bits) != bits) return 0;
+
+  vfp_disable();
+
+  // MVFR0, bits 3:0: 2 for 32 double registers, 1 for 16
+  register uint32_t mvfr0 asm ( "r1" );
+  asm volatile ( ".word 0xeef71a10 // vmrs r1, mvfr0" : "=r" (mvfr0) );
+
+  return ((mvfr0 & 0xf) == 2) ? 32 : 16;
+}
+
 void Cortex_A7_set_smp_mode()
 {
   uint32_t reg;
@@ -321,77 +351,25 @@ uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t
 
 bool claim_lock( uint32_t volatile *lock )
 {
-  // TODO: return 0 != change_word_if_equal( lock, 0, workspace.core_number + 1 );
-  // Except that would be wrong. Don't do that.
-  uint32_t failed;
-  uint32_t value;
-  uint32_t core = workspace.core_number+1;
+  uint32_t waited = 0xffffffff; // Unchanged if the lock was free
 
-int tries = 0;
-#if 0
-if ((void*) 0xfffe4030 != lock) {
-WriteS( "Claim " ); WriteNum( lock );
-}
-#endif
-  do {
-tries++;
-    asm volatile ( "ldrex %[value], [%[lock]]"
-                   : [value] "=&r" (value)
-                   : [lock] "r" (lock) );
-
-    if (value == 0) {
-      // The failed and lock registers are not allowed to be the same, so
-      // pretend to gcc that the lock may be written as well as read.
+  bool reclaimed = ticket_lock_claim( lock, workspace.core_number, &waited );
 
-      asm volatile ( "strex %[failed], %[value], [%[lock]]"
-                     : [failed] "=&r" (failed)
-                     , [lock] "+r" (lock)
-                     : [value] "r" (core) );
+  if (!reclaimed && shared.kernel.lock_statistics_enabled) {
+    lock_statistics *entry = lock_statistics_entry( shared.kernel.lock_statistics, lock );
+    if (entry != 0) {
+      lock_statistics_record( entry, waited != 0xffffffff, waited, (uint32_t) __builtin_return_address( 0 ) );
     }
-    else {
-      asm volatile ( "clrex" );
-      asm volatile ( "wfe" );
-    
-      if (value == core) {
-#if 0
-if ((void*) 0xfffe4030 != lock) {
-WriteS( " (reclaim)" ); NewLine;
-}
-#endif
-        // No need for a barrier, the memory hasn't been changed
-        return true;
-      }
+  }
 
-      failed = true;
-    }
-  } while (failed);
-  asm volatile ( "dmb sy" );
+  if (waited != 0xffffffff) {
+    trace_event( Trace_LockContended, lock, waited );
+  }
 
-#if 0
-if ((void*) 0xfffe4030 != lock) {
-WriteS( " claimed " ); WriteNum( tries ); NewLine;
-}
-#endif
-  return false;
+  return reclaimed;
 }
 
 void release_lock( uint32_t volatile *lock )
 {
-#if 0
-if ((void*) 0xfffe4030 != lock) {
-WriteS( "Release " ); WriteNum( lock ); Space; WriteNum( *lock );
-if (*lock != workspace.core_number+1) WriteS( " not owner" );
-NewLine;
-}
-#endif
-  // Ensure that any changes made while holding the lock are visible before the lock is seen to have been released
-  asm volatile ( "dmb sy" );
-  *lock = 0;
-  asm volatile ( "dsb sy" );
-  asm volatile ( "sev" ); // Wake any other core waiting on this lock
-#if 0
-if ((void*) 0xfffe4030 != lock) {
-WriteS( "Released " ); WriteNum( lock ); Space; WriteNum( *lock ); NewLine;
-}
-#endif
+  ticket_lock_release( lock );
 }
@@ -147,6 +147,79 @@ void Initialise_undefined_registers();
 
 void Initialise_privileged_mode_stack_pointers();
 
+// Starts the core's cycle counter, used for timestamps in the trace and
+// for the SWI statistics
+void Initialise_cycle_counter();
+
+// PMCCNTR, counts up from Initialise_cycle_counter; not shared between cores
+static inline uint32_t cycle_counter()
+{
+  uint32_t cycles;
+  asm volatile ( "mrc p15, 0, %[c], c9, c13, 0" : [c] "=r" (cycles) );
+  return cycles;
+}
+
+// VFP and NEON, switched lazily between Tasks by TaskSlot/simple/vfp.c
+// The kernel is built without floating point support (-march=...+nofp),
+// so the instructions are encoded by hand; the context is in r0, FPSCR
+// and FPEXC pass through r1.
+
+// Gives access to coprocessors 10 and 11, leaving the VFP disabled, so
+// that every VFP or NEON instruction is undefined.
+// Returns the number of double registers (16 or 32), or 0 if there is
+// no VFP.
+uint32_t Initialise_vfp();
+
+static inline void vfp_set_fpexc( uint32_t value )
+{
+  register uint32_t fpexc asm ( "r1" ) = value;
+  asm volatile ( ".word 0xeee81a10 // vmsr fpexc, r1" : : "r" (fpexc) : "memory" );
+}
+
+static inline uint32_t vfp_fpexc()
+{
+  register uint32_t fpexc asm ( "r1" );
+  asm volatile ( ".word 0xeef81a10 // vmrs r1, fpexc" : "=r" (fpexc) );
+  return fpexc;
+}
+
+static inline void vfp_enable()
+{
+  vfp_set_fpexc( 1 << 30 ); // EN
+}
+
+static inline void vfp_disable()
+{
+  vfp_set_fpexc( 0 );
+}
+
+static inline bool vfp_enabled()
+{
+  return 0 != (vfp_fpexc() & (1 << 30));
+}
+
+// The VFP must be enabled. d holds 16 or 32 doubles.
+static inline void vfp_save( uint64_t *d, uint32_t *fpscr, uint32_t registers )
+{
+  register uint64_t *p asm ( "r0" ) = d;
+  register uint32_t status asm ( "r1" );
+  asm volatile ( ".word 0xeca00b20 // vstmia r0!, { d0-d15 }" : "+r" (p) : : "memory" );
+  if (registers == 32)
+    asm volatile ( ".word 0xece00b20 // vstmia r0!, { d16-d31 }" : "+r" (p) : : "memory" );
+  asm volatile ( ".word 0xeef11a10 // vmrs r1, fpscr" : "=r" (status) );
+  *fpscr = status;
+}
+
+static inline void vfp_load( uint64_t const *d, uint32_t fpscr, uint32_t registers )
+{
+  register uint64_t const *p asm ( "r0" ) = d;
+  register uint32_t status asm ( "r1" ) = fpscr;
+  asm volatile ( ".word 0xecb00b20 // vldmia r0!, { d0-d15 }" : "+r" (p) : "m" (*d) );
+  if (registers == 32)
+    asm volatile ( ".word 0xecf00b20 // vldmia r0!, { d16-d31 }" : "+r" (p) : "m" (*d) );
+  asm volatile ( ".word 0xeee11a10 // vmsr fpscr, r1" : : "r" (status) );
+}
+
 // There's no possibility of a RISC OS thread of execution to hand over to
 // another running on the same core, so there's no call for a particularly
 // flexible lock system.
@@ -165,6 +238,8 @@ void Initialise_privileged_mode_stack_pointers();
 //  bool reclaimed = claim_lock( &lock );
 //  ...
 //  if (!reclaimed) release_lock( &lock );
+// Cores waiting for a lock get it in the order they asked for it, see
+// include/ticket_lock.h
 bool claim_lock( uint32_t volatile *lock );
 
 void release_lock( uint32_t volatile *lock );
@@ -173,12 +248,42 @@ void release_lock( uint32_t volatile *lock );
 // Returns the original content of word (= from if changed successfully)
 uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t to );
 
+#include "include/ticket_lock.h"
+
 static inline void flush_location( void *va )
 {
   // DCCMVAC
   asm ( "mcr p15, 0, %[va], cr7, cr10, 1" : : [va] "r" (va) );
 }
 
+// The generic timer; the HAL sets the frequency (CNTFRQ) and owns the
+// physical timer interrupt, but the kernel may bring it forward.
+static inline uint64_t generic_timer_now()
+{
+  uint32_t hi, lo;
+  asm volatile ( "mrrc p15, 0, %[lo], %[hi], c14" : [hi] "=r" (hi), [lo] "=r" (lo) : : "memory" ); // CNTPCT
+  return (((uint64_t) hi) << 32) | lo;
+}
+
+static inline uint32_t generic_timer_frequency()
+{
+  uint32_t frequency;
+  asm ( "mrc p15, 0, %[f], c14, c0, 0" : [f] "=r" (frequency) ); // CNTFRQ
+  return frequency;
+}
+
+static inline uint64_t generic_timer_interrupt_time()
+{
+  uint32_t hi, lo;
+  asm volatile ( "mrrc p15, 2, %[lo], %[hi], c14" : [hi] "=r" (hi), [lo] "=r" (lo) ); // CNTP_CVAL
+  return (((uint64_t) hi) << 32) | lo;
+}
+
+static inline void generic_timer_interrupt_at( uint64_t then )
+{
+  asm volatile ( "mcrr p15, 2, %[lo], %[hi], c14" : : [hi] "r" (then >> 32), [lo] "r" (0xffffffff & then) : "memory" ); // CNTP_CVAL
+}
+
 static inline void bzero( void *p, int length )
 {
   char *cp = p;
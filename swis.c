@@ -605,245 +605,6 @@ static bool do_OS_ValidateAddress( svc_registers *regs )
   return true;
 }
 
-// Ticker events
-#ifndef MPSAFE_DLL_TYPE
-#include "include/mpsafe_dll.h"
-#endif
-MPSAFE_DLL_TYPE( ticker_event )
-
-void release_ticker_event( ticker_event **pool, ticker_event *c )
-{
-  mpsafe_insert_ticker_event_at_tail( pool, c );
-}
-
-static inline ticker_event *alloc_ticker_event( int size )
-{
-  return rma_allocate( size );
-}
-
-// Future possibility: Store the TaskSlot associated with the callback
-// (transient callbacks, too), and swap it in and out again as needed.
-static ticker_event *allocate_ticker_event()
-{
-  return mpsafe_fill_and_detach_ticker_event_at_head( &shared.kernel.ticker_event_pool, alloc_ticker_event, 64 );
-}
-
-static void find_place_in_queue( ticker_event *new )
-{
-  ticker_event **queue = &workspace.kernel.ticker_queue;
-  ticker_event *head = *queue;
-  uint32_t unew = (uint32_t) new;
-  assert( new != 0 );
-
-  for (;;) {
-    if (head == 0) {
-      head = (ticker_event*) change_word_if_equal( (uint32_t*) head, 0, unew );
-      if (0 == head) { // Successfully attached new as only item in list
-        return;
-      }
-    }
-
-    while (head != 0) {
-      uint32_t uint = (uint32_t) head;
-      if (uint == change_word_if_equal( (uint32_t*) head, uint, 1 )) {
-        // I own the non-empty list!
-        ticker_event *item = head;
-        while (item->remaining >= new->remaining) {
-          new->remaining -= (*queue)->remaining;
-          item = item->next;
-          if (item == head) break;
-        }
-        if (item != head) {
-          item->remaining -= new->remaining;
-        }
-        // Put new in front of item in the list, even if item is the old head
-        dll_attach_ticker_event( new, &item );
-        *queue = head;
-        return;
-      }
-    }
-  }
-}
-
-static inline void run_handler( uint32_t code, uint32_t private )
-{
-  // Very trustingly, run module code
-  register uint32_t p asm ( "r12" ) = private;
-  register uint32_t c asm ( "r14" ) = code;
-  asm volatile ( "blx r14" : : "r" (p), "r" (c) : "cc", "memory", "lr" );
-}
-
-static void run_ticker_events()
-{
-asm ( "bkpt 0x1999" );
-/*
-  asm ( "push { r0-r12, r14 }" );
-  while (shared.kernel.ticker_queue->remaining == 0) {
-    ticker_event *e = shared.kernel.ticker_queue;
-    shared.kernel.ticker_queue = e->next;
-    run_handler( e->code, e->private_word );
-    if (e->reload != 0) {
-      e->remaining = e->reload;
-      find_place_in_queue( e );
-    }
-    else {
-      e->next = workspace.kernel.ticker_event_pool;
-      shared.kernel.ticker_event_pool = e;
-    }
-  }
-  asm ( "pop { r0-r12, pc }" );
-*/
-}
-
-static void __attribute__(( naked )) TickerV_handler();
-
-static void release_TickerV()
-{
-  register uint32_t vector asm( "r0" ) = 0x1c;
-  register void *code asm( "r1" ) = TickerV_handler;
-  register uint32_t private asm( "r2" ) = 0;
-  // Private word not used
-  asm ( "svc %[swi]"
-           :
-           : [swi] "i" (OS_Release | 0x20000)
-           , "r" (vector)
-           , "r" (code)
-           , "r" (private)
-           : "lr", "cc", "memory" );
-}
-
-static void claim_TickerV()
-{
-  register uint32_t vector asm( "r0" ) = 0x1c;
-  register void *code asm( "r1" ) = TickerV_handler;
-  register uint32_t private asm( "r2" ) = 0;
-  // Private word not used
-  asm ( "svc %[swi]"
-           :
-           : [swi] "i" (OS_Claim | 0x20000)
-           , "r" (vector)
-           , "r" (code)
-           , "r" (private) 
-           : "lr", "cc", "memory" );
-}
-
-static void __attribute__(( noinline )) C_TickerV_handler()
-{
-  if (workspace.kernel.ticker_queue != 0) {
-    workspace.kernel.ticker_queue->remaining--;
-    if (workspace.kernel.ticker_queue->remaining == 0) {
-      run_ticker_events();
-    }
-  }
-
-  if (workspace.kernel.ticker_queue == 0) {
-    release_TickerV();
-  }
-}
-
-static void __attribute__(( naked )) TickerV_handler()
-{
-  // C will ensure the callee saved registers are preserved.
-  // We don't care about the private word.
-  asm ( "push { "C_CLOBBERED", lr }" ); // Not intercepting vector, so storing return address
-  C_TickerV_handler();
-  asm ( "pop { "C_CLOBBERED", pc }" );
-}
-
-static bool insert_into_timer_queue( uint32_t code, uint32_t private, uint32_t timeout, uint32_t reload )
-{
-  if (workspace.kernel.ticker_queue == 0) {
-    claim_TickerV();
-  }
-
-  ticker_event *new = allocate_ticker_event();
-  if (new == 0)
-    return false;
-
-  new->remaining = timeout;
-  new->reload = reload;
-  new->code = code;
-  new->private_word = private;
-
-  find_place_in_queue( new );
-
-  return true;
-}
-
-static bool do_OS_CallAfter( svc_registers *regs ) 
-{
-  if (!insert_into_timer_queue( regs->r[1], regs->r[2], regs->r[0], 0 ))
-    return error_nomem( regs );
-  return true;
-}
-
-static bool do_OS_CallEvery( svc_registers *regs )
-{
-  if (!insert_into_timer_queue( regs->r[1], regs->r[2], regs->r[0], regs->r[0] ))
-    return error_nomem( regs );
-  return true;
-}
-
-static inline ticker_event *remove_ticker( ticker_event **head, void *p )
-{
-  ticker_event *e = p;
-  ticker_event *item = *head;
-  ticker_event *found = 0;
-
-  if (item != 0) {
-    do {
-      if (item->code == e->code && item->private_word == e->private_word) {
-        found = item;
-      }
-      else {
-        item = item->next;
-      }
-    } while (item != *head && !found);
-
-    if (found) {
-      if (item->next != *head) {
-        // Not last (only?) item in list
-        item->next->remaining += item->remaining;
-      }
-
-      if (item->next == item) {
-        // Only item in list
-        *head = 0;
-      }
-      else {
-        if (item == *head) {
-          // First item in list with more than one item
-          *head = (*head)->next;
-        }
-        dll_detach_ticker_event( item );
-      }
-    }
-  }
-
-  return found;
-}
-
-static bool do_OS_RemoveTickerEvent( svc_registers *regs )
-{
-  // FIXME Is is necessary to return an error if it's not found?
-  ticker_event **queue = &workspace.kernel.ticker_queue;
-
-  ticker_event event = { .code = regs->r[1], .private_word = regs->r[2] };
-
-  ticker_event *found = mpsafe_manipulate_ticker_event_list_returning_item( queue, remove_ticker, &event );
-
-  if (found != 0) {
-    mpsafe_insert_ticker_event_at_head( &shared.kernel.ticker_event_pool, found );
-  }
-
-  // Don't release the vector if the event wasn't found
-  if (found && workspace.kernel.ticker_queue == 0) {
-    release_TickerV();
-  }
-
-  return true;
-}
-
 mode_selector_block const only_one_mode = { .mode_selector_flags = 1, .xres = only_one_mode_xres, .yres = only_one_mode_yres, .log2bpp = 5, .frame_rate = 60, { { -1, 0 } } };
 
 
@@ -1954,28 +1715,13 @@ static inline int32_t GraphicsWindow_ic_Top()
 static bool CLG( svc_registers *regs )
 {
   // Was using Plot, but this is not allowed to affect the graphics cursor.
-  // Ugly, ignores many aspects of colour management FIXME.
-  // Good enough for only_one_mode
+  // The background ECF includes the background GCOL action.
 
   VduDriversWorkspace *ws = &workspace.vectors.zp.vdu_drivers.ws;
 
-  int32_t x = GraphicsWindow_ic_Left();
-  int32_t y = GraphicsWindow_ic_Top();
-
-  uint32_t bg_colour = ws->BgEcfOraEor.line[0].eor ^ ws->BgEcfOraEor.line[0].orr;
-  // Write0( "CLG" ); WriteNum( ws->BgEcfOraEor.line[0].orr ); Space; WriteNum( ws->BgEcfOraEor.line[0].eor ); NewLine;
-  
-  uint32_t left = (uint32_t) ws->ScreenStart + (ws->YWindLimit - y) * ws->LineLength + (x << 2);
-
-  //int32_t rows = GraphicsWindow_ic_Top() - GraphicsWindow_ic_Bottom();
-
-  for (; y > GraphicsWindow_ic_Bottom(); y--) {
-    uint32_t *p = (uint32_t*) left;
-    left += ws->LineLength;
-    for (int xx = x; xx < GraphicsWindow_ic_Right(); xx++) {
-      *p++ = bg_colour;
-    }
-  }
+  plot_rectangle( GraphicsWindow_ic_Left(), GraphicsWindow_ic_Bottom(),
+                  GraphicsWindow_ic_Right(), GraphicsWindow_ic_Top(),
+                  &ws->BgEcfOraEor );
 
   return true;
 }
@@ -2308,26 +2054,6 @@ static bool do_OS_FlushCache( svc_registers *regs )
 
 static bool do_OS_ConvertFileSize( svc_registers *regs ) { Write0( __func__ ); NewLine; return Kernel_Error_UnimplementedSWI( regs ); }
 
-bool do_OS_Heap( svc_registers *regs )
-{
-  // Note: This could possibly be improved by having a lock per heap,
-  // one bit in the header, say.
-  // I would hope this is never called from an interrupt handler, but 
-  // if so, we should probably return an error, if shared.memory.os_heap_lock 
-  // is non-zero. Masking interrupts is no longer a guarantee of atomicity.
-  // OS_Heap appears to call itself, even without interrupts...
-  bool reclaimed = claim_lock( &shared.memory.os_heap_lock );
-
-  if (reclaimed) { WriteS( "OS_Heap, recursing: " ); WriteNum( regs->lr ); NewLine; }
-  // assert( !reclaimed );
-
-  bool result = run_risos_code_implementing_swi( regs, OS_Heap );
-  //Write0( "OS_Heap returns " ); WriteNum( regs->r[3] ); NewLine;
-
-  if (!reclaimed) release_lock( &shared.memory.os_heap_lock );
-  return result;
-}
-
 typedef bool (*swifn)( svc_registers *regs );
 
 static swifn os_swis[256] = {
@@ -2419,7 +2145,7 @@ static swifn os_swis[256] = {
   [OS_SubstituteArgs] =  do_OS_SubstituteArgs,
 
   [OS_PrettyPrint] =  do_OS_PrettyPrint,
-  // [OS_Plot] =  do_OS_Plot,
+  [OS_Plot] =  do_OS_Plot,
   [OS_WriteN] =  do_OS_WriteN,
   [OS_AddToVector] =  do_OS_AddToVector,
 
@@ -2715,9 +2441,46 @@ static bool special_swi( svc_registers *regs, uint32_t number )
 // RMA, make it a pipe, have GSRead read a character at a time from the
 // pipe and delete it and the memory when the last character read.
 
-// TODO: We might like to make this a level, rather than Boolean.
-// Global, Core, Slot, Safe?
-static bool blockable_swi( uint32_t number )
+// OS_Byte reasons handled by the VDU drivers (cursor, font, screen banks,
+// VDU variables and queue)
+static bool os_byte_uses_vdu( uint32_t reason )
+{
+  switch (reason) {
+  case 0x14: // Explode soft font
+  case 0x19: // Reset font definitions
+  case 0x70: // Screen bank for VDU output
+  case 0x71: // Screen bank displayed
+  case 0x72: // Shadow/non-shadow modes
+  case 0x75: // Read VDU status
+  case 0x86: // Read text cursor position
+  case 0x87: // Read character at text cursor, and screen mode
+  case 0x90: // *TV
+  case 0xa0: // Read VDU variable
+  case 0xd9: // Paged mode line count
+  case 0xda: // Bytes in VDU queue
+    return true;
+  }
+  return false;
+}
+
+// OS_Word reasons handled by the VDU drivers (pixels, character
+// definitions, palette, graphics cursors, pointer, screen base)
+static bool os_word_uses_vdu( uint32_t reason )
+{
+  switch (reason) {
+  case 0x09 ... 0x0d:
+  case 0x15:
+  case 0x16:
+    return true;
+  }
+  return false;
+}
+
+// Which part of the legacy kernel each SWI is likely to use, see
+// legacy_class in task_slot.h. Anything that uses the VDU variables
+// (which are per-core) must be Legacy_VDU, so the Task stays on the
+// core whose variables it has used.
+static legacy_class swi_legacy_class( svc_registers const *regs, uint32_t number )
 {
   switch (number & ~Xbit) { // FIXME
   case OS_CallAVector:
@@ -2728,8 +2491,16 @@ static bool blockable_swi( uint32_t number )
   case OS_FlushCache:
   case OS_IntOn:
   case OS_IntOff:
-    return false;
+    return Legacy_None;
+
+  case OS_Plot:
+    // Only draws into this core's screen or sprite, see swis/plot.c
+    return plot_is_native( regs->r[0] ) ? Legacy_None : Legacy_VDU;
+
+  case OS_Module:
   case OS_CLI:
+    return Legacy_Modules;
+
   case OS_File:
   case OS_Args:
   case OS_BGet:
@@ -2739,33 +2510,104 @@ static bool blockable_swi( uint32_t number )
   case OS_FSControl:
     // These listed SWIs will need protection using a lock until they can
     // be made multi-processor safe
+    return Legacy_FileSystem;
+
+  case 0x40180 ... 0x401bf: // ADFS
+  case 0x40540 ... 0x4057f: // FileCore
+  case 0x40780 ... 0x407bf: // RamFS
+  case 0x40980 ... 0x409bf: // SCSIFS
+  case 0x41b40 ... 0x41b7f: // ResourceFS
+  case 0x41e80 ... 0x41ebf: // CDFS
+  case 0x59040 ... 0x5907f: // SDFS
+    // Filing system modules, part of the same non-reentrant stack
+    return Legacy_FileSystem;
+
+  case OS_Byte:
+    return os_byte_uses_vdu( regs->r[0] ) ? Legacy_VDU : Legacy_General;
+
+  case OS_Word:
+    return os_word_uses_vdu( regs->r[0] ) ? Legacy_VDU : Legacy_General;
+
+  case OS_WriteC:
+  case OS_WriteS:
+  case OS_Write0:
+  case OS_NewLine:
+  case OS_WriteN:
+  case OS_WriteI ... OS_WriteI+255:
+  case OS_ReadVduVariables:
+  case OS_ReadModeVariable:
+  case OS_ReadPoint:
+  case OS_RemoveCursors:
+  case OS_RestoreCursors:
+  case OS_ReadPalette:
+  case OS_SetECFOrigin:
+  case OS_ChangedBox:
+  case OS_SetColour:
+  case OS_CheckModeValid:
+  case OS_VduCommand:
+  case OS_SpriteOp:
+  case OS_ScreenMode:
+  case OS_Pointer:
+    return Legacy_VDU;
+
+#ifndef LEGACY_SYSTEM_VARIABLES
+  case OS_ReadVarVal:
+#endif
+  case OS_GSInit:
+  case OS_GSRead:
+  case OS_GSTrans:
+    // Native, and only read system variables, which needs no lock
+    return Legacy_None;
+
+#ifdef LEGACY_SYSTEM_VARIABLES
+  case OS_ReadVarVal:
+#endif
+  case OS_SetVarVal:
+  case OS_EvaluateExpression:
+    return Legacy_SysVars;
+
+#ifndef LEGACY_HEAP
+  case OS_Heap:
+    // Native, each heap has its own lock (see lock_heap)
+    return Legacy_None;
+#endif
+
+#ifdef LEGACY_HEAP
+  case OS_Heap:
+#endif
+  case OS_ChangeDynamicArea:
+  case OS_ReadDynamicArea:
+  case OS_DynamicArea:
+    return Legacy_Heap;
+
   default:
-    return true;
+    return Legacy_General;
   }
 }
 
-// Need to centralise the runnable pool of tasks into shared.task_slot...
-static bool swi_blocked( svc_registers *regs, uint32_t number )
+// Returns true if the task has been blocked, and will re-try the SWI later
+// Sets *refused if the SWI must not be run (see Task_kernel_in_use).
+static bool swi_blocked( svc_registers *regs, uint32_t number, legacy_class c, error_block **refused )
 {
-  if (blockable_swi( number )) {
+  if (c != Legacy_None) {
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION_SWIS
-    WriteS( "SWI " ); WriteNum( number ); WriteS( " starting, task " ); WriteNum( workspace.task_slot.runnable ); NewLine;
+    WriteS( "SWI " ); WriteNum( number ); WriteS( " starting, task " ); WriteNum( workspace.task_slot.running ); NewLine;
 #endif
-    // One caller at a time, system wide for now.
-    return Task_kernel_in_use( regs );
+    // One caller at a time per class, system wide for now.
+    return Task_kernel_in_use( regs, c, refused );
   }
 
   return false;
 }
 
-static void swi_completed( uint32_t number )
+static void swi_completed( uint32_t number, legacy_class c )
 {
-  if (blockable_swi( number )) {
-    // One caller at a time, system wide for now.
+  if (c != Legacy_None) {
+    // One caller at a time per class, system wide for now.
 #ifdef DEBUG__SHOW_LEGACY_PROTECTION_SWIS
-    WriteS( "SWI " ); WriteNum( number ); WriteS( " completed, task " ); WriteNum( workspace.task_slot.runnable ); NewLine;
+    WriteS( "SWI " ); WriteNum( number ); WriteS( " completed, task " ); WriteNum( workspace.task_slot.running ); NewLine;
 #endif
-    Task_kernel_release();
+    Task_kernel_release( c );
   }
 }
 
@@ -2775,11 +2617,26 @@ void __attribute__(( noinline )) execute_swi( svc_registers *regs, uint32_t numb
 
   if (special_swi( regs, number )) return;
 
-  if (swi_blocked( regs, number )) return;
+  // Decided before the SWI changes the registers
+  legacy_class c = swi_legacy_class( regs, number );
+
+  error_block *refused = 0;
+
+  if (swi_blocked( regs, number, c, &refused )) return;
 
   bool read_var_val_for_length = ((number & ~Xbit) == 0x23 && regs->r[2] == -1);
 
-  bool result = Kernel_go_svc( regs, number );
+  bool result;
+
+  if (refused != 0) {
+    // The class was never claimed
+    c = Legacy_None;
+    regs->r[0] = (uint32_t) refused;
+    result = false;
+  }
+  else {
+    result = Kernel_go_svc( regs, number );
+  }
 
   if (result) {
     // Worked
@@ -2858,5 +2715,5 @@ if (copy.r[0] != regs->r[0]) asm ( "bkpt 77" );
     break;
   }
 
-  swi_completed( number );
+  swi_completed( number, c );
 }
@@ -31,8 +31,7 @@ bool do_OS_EvaluateExpression( svc_registers *regs );
 bool do_OS_SubstituteArgs32( svc_registers *regs );
 
 
-// Not Implemented in os_heap.c:
-// Implementation in swis.c, calls legacy code
+// swis/os_heap.c
 bool do_OS_Heap( svc_registers *regs );
 
 // modules.c:
@@ -111,6 +110,26 @@ bool do_OS_RestoreCursors( svc_registers *regs );
 
 // swis/plot.c
 bool do_OS_Plot( svc_registers *regs );
+bool plot_is_native( uint32_t code ); // Plot types that don't use legacy code
+
+// swis/spans.c
+typedef struct {
+  int32_t left;
+  int32_t y;
+  int32_t right;
+} span;
+
+extern EcfOraEor const span_no_effect;
+extern EcfOraEor const span_invert;
+
+void plot_span( int32_t left, int32_t y, int32_t right, EcfOraEor const *ecf );
+void plot_spans( span const *spans, uint32_t count, EcfOraEor const *ecf );
+void plot_rectangle( int32_t left, int32_t bottom, int32_t right, int32_t top, EcfOraEor const *ecf );
+
+// swis/ticker.c
+bool do_OS_CallAfter( svc_registers *regs );
+bool do_OS_CallEvery( svc_registers *regs );
+bool do_OS_RemoveTickerEvent( svc_registers *regs );
 
 // swis/varvals.c
 enum VarTypes { VarType_String = 0,
@@ -132,6 +151,7 @@ bool Kernel_Error_UnimplementedSWI( svc_registers *regs );
 extern uint32_t rma_base; // Linker generated
 extern uint32_t rma_heap; // Linker generated
 
+#ifdef LEGACY_HEAP
 static inline void rma_free( void const *block )
 {
   register uint32_t code asm( "r0" ) = 3;
@@ -165,6 +185,21 @@ static inline void *rma_allocate( uint32_t size )
 
   return memory;
 }
+#else
+// swis/os_heap.c, no need for a SWI from inside the kernel.
+void *rma_claim( uint32_t size ); // Returns 0 if there's no room
+void rma_release( void const *block );
+
+static inline void rma_free( void const *block )
+{
+  rma_release( block );
+}
+
+static inline void *rma_allocate( uint32_t size )
+{
+  return rma_claim( size );
+}
+#endif
 
 static inline bool error_nomem( svc_registers *regs )
 {
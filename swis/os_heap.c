@@ -0,0 +1,834 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "inkernel.h"
+
+#ifdef LEGACY_HEAP
+// The ROM implementation, under a single lock for all heaps.
+
+bool do_OS_Heap( svc_registers *regs )
+{
+  // I would hope this is never called from an interrupt handler, but
+  // if so, we should probably return an error, if shared.memory.os_heap_lock
+  // is non-zero. Masking interrupts is no longer a guarantee of atomicity.
+  // OS_Heap appears to call itself, even without interrupts...
+  bool reclaimed = claim_lock( &shared.memory.os_heap_lock );
+
+  if (reclaimed) { WriteS( "OS_Heap, recursing: " ); WriteNum( regs->lr ); NewLine; }
+  // assert( !reclaimed );
+
+  bool result = run_risos_code_implementing_swi( regs, OS_Heap );
+  //Write0( "OS_Heap returns " ); WriteNum( regs->r[3] ); NewLine;
+
+  if (!reclaimed) release_lock( &shared.memory.os_heap_lock );
+  return result;
+}
+
+#else
+// Native OS_Heap.
+//
+// The layout of a heap is compatible with the ROM heap manager, so code
+// that looks inside heaps (at the size word before a block, usually) still
+// works:
+//
+//   A 16 byte header (magic word, offset to the first free block, offset
+//   to the unused space at the top, size of the heap), then the blocks.
+//   An allocated block is a size word (the size includes the word itself),
+//   followed by the caller's data.
+//   A free block is an offset to the next free block (relative to this
+//   one, zero for the last), followed by its size. Free blocks are kept
+//   in address order, and are never adjacent to each other or to the
+//   unused space at the top.
+//   All blocks are multiples of 8 bytes; the first block is placed so that
+//   the caller's data is always 8-byte aligned.
+//
+// Each heap has its own lock, with no space needed outside the heap: while
+// a core is working on a heap, the magic word is replaced by a value that
+// identifies the core. Different heaps can be used by different cores at
+// the same time.
+//
+// Almost all blocks in the RMA are small. Those up to 256 bytes are rounded
+// up to a multiple of 32 bytes and, when freed, are kept by the freeing
+// core for re-use without taking the heap's lock. Each core keeps a
+// limited number of each size; the excess is returned to the heap in
+// batches. Kernel code is not interrupted, so the caches don't need a
+// lock. Cached blocks are marked in their size word (which is otherwise a
+// multiple of 8), so a block freed twice is noticed whichever core's
+// cache it's in, and anything looking at the heap sees them as not being
+// blocks at all.
+
+typedef struct {
+  uint32_t magic;
+  uint32_t free;        // Offset from this word to the first free block, 0 if none
+  uint32_t base;        // Offset to the unused space at the top
+  uint32_t end;         // Size of the heap
+} heap_header;
+
+#define HEAP_MAGIC 0x70616548 // "Heap"
+#define HEAP_BUSY  0x79737542 // "Busy", plus the number of the core using the heap
+
+// Offsets from the start of the heap; the header's free word counts as the
+// link word of a free block at offset 4.
+#define HEAP_HEAD 4
+
+typedef struct rma_cached_block rma_cached_block;
+struct rma_cached_block {
+  rma_cached_block *next;
+};
+
+#define RMA_CACHE_GRANULE 32
+#define RMA_CACHE_SIZES number_of( workspace.kernel.rma_cache )
+#define RMA_CACHE_LIMIT 16
+#define RMA_CACHE_BATCH 8
+#define RMA_CACHED 1
+
+#ifndef HOSTED_TESTING
+static inline heap_header *rma()
+{
+  return (void*) &rma_heap;
+}
+
+// Woken by the sev in release_heap
+static inline void wait_for_heap()
+{
+  asm volatile ( "wfe" );
+}
+
+static inline void release_heap( heap_header *heap )
+{
+  // Changes to the heap must be visible before the heap is seen to be free
+  asm volatile ( "dmb sy" );
+  heap->magic = HEAP_MAGIC;
+  asm volatile ( "dsb sy" );
+  asm volatile ( "sev" );
+}
+#else
+// Provided by the test program
+heap_header *rma();
+void wait_for_heap();
+void release_heap( heap_header *heap );
+#endif
+
+static error_block *error_bad_reason()
+{
+  static error_block error = { 0x180, "Bad reason code for OS_Heap" };
+  return &error;
+}
+
+static error_block *error_bad_alignment()
+{
+  static error_block error = { 0x181, "Bad alignment request" };
+  return &error;
+}
+
+static error_block *error_bad_heap()
+{
+  static error_block error = { 0x182, "Not a heap" };
+  return &error;
+}
+
+static error_block *error_bad_link()
+{
+  static error_block error = { 0x183, "Heap corrupted" };
+  return &error;
+}
+
+static error_block *error_heap_full()
+{
+  static error_block error = { 0x184, "Not enough room in heap" };
+  return &error;
+}
+
+static error_block *error_not_a_block()
+{
+  static error_block error = { 0x185, "Not a heap block" };
+  return &error;
+}
+
+static error_block *error_excessive_shrink()
+{
+  static error_block error = { 0x187, "Can't shrink heap any further" };
+  return &error;
+}
+
+static error_block *error_heap_locked()
+{
+  static error_block error = { 0x188, "Heap is in use by this core" };
+  return &error;
+}
+
+static error_block *lock_heap( heap_header *heap )
+{
+  uint32_t busy = HEAP_BUSY + workspace.core_number;
+
+  for (;;) {
+    uint32_t magic = change_word_if_equal( &heap->magic, HEAP_MAGIC, busy );
+
+    if (magic == HEAP_MAGIC) return 0;
+
+    // Re-entered on this core; it can't be waited for.
+    if (magic == busy) return error_heap_locked();
+
+    if (magic - HEAP_BUSY >= 8) return error_bad_heap();
+
+    wait_for_heap();
+  }
+}
+
+static inline uint32_t *heap_word( heap_header *heap, uint32_t offset )
+{
+  return (uint32_t*) (((char*) heap) + offset);
+}
+
+// The first block is placed so that block data is 8-byte aligned
+static inline uint32_t first_block( heap_header *heap )
+{
+  uint32_t address = (uint32_t) heap;
+  return (((address + sizeof( heap_header ) + 4 + 7) & ~7) - 4) - address;
+}
+
+// The free block after the one whose link word is at link, or 0
+static inline uint32_t next_free( heap_header *heap, uint32_t link )
+{
+  uint32_t offset = *heap_word( heap, link );
+  return (offset == 0) ? 0 : link + offset;
+}
+
+static inline void set_next_free( heap_header *heap, uint32_t link, uint32_t block )
+{
+  *heap_word( heap, link ) = (block == 0) ? 0 : block - link;
+}
+
+static inline uint32_t free_size( heap_header *heap, uint32_t block )
+{
+  return *heap_word( heap, block + 4 );
+}
+
+static inline uint32_t block_size( uint32_t bytes )
+{
+  // The size word, rounded up to a multiple of 8, at least 8
+  return (bytes + 4 + 7) & ~7;
+}
+
+// A free block that follows the one at previous (which may be the
+// header), and is within the allocated part of the heap.
+static inline bool sane_free_block( heap_header *heap, uint32_t previous, uint32_t block )
+{
+  if (block <= previous
+   || block < first_block( heap )
+   || block >= heap->base
+   || ((block - first_block( heap )) & 7) != 0) return false;
+
+  uint32_t size = free_size( heap, block );
+  return size >= 8
+      && (size & 7) == 0
+      && size < heap->base - block;
+}
+
+// Offset of the block whose data is at address, or 0 if it isn't inside
+// the allocated part of the heap.
+static uint32_t block_offset( heap_header *heap, void const *address )
+{
+  uint32_t block = ((char const *) address - (char const *) heap) - 4;
+  if (block < first_block( heap )
+   || block >= heap->base
+   || ((block - first_block( heap )) & 7) != 0) return 0;
+
+  uint32_t size = *heap_word( heap, block );
+  if (size < 8
+   || (size & 7) != 0
+   || size > heap->base - block) return 0;
+
+  return block;
+}
+
+// First fit from the free list, then from the top of the heap.
+// Returns the offset of the block, or 0.
+static uint32_t allocate( heap_header *heap, uint32_t size, error_block **error )
+{
+  uint32_t link = HEAP_HEAD;
+  uint32_t block = next_free( heap, link );
+
+  while (block != 0) {
+    if (!sane_free_block( heap, link, block )) {
+      *error = error_bad_link();
+      return 0;
+    }
+
+    uint32_t available = free_size( heap, block );
+
+    if (available == size) {
+      set_next_free( heap, link, next_free( heap, block ) );
+      *heap_word( heap, block ) = size;
+      return block;
+    }
+
+    if (available > size) {
+      uint32_t rest = block + size;
+      *heap_word( heap, rest + 4 ) = available - size;
+      set_next_free( heap, rest, next_free( heap, block ) );
+      set_next_free( heap, link, rest );
+      *heap_word( heap, block ) = size;
+      return block;
+    }
+
+    link = block;
+    block = next_free( heap, block );
+  }
+
+  if (heap->end - heap->base < size) {
+    *error = error_heap_full();
+    return 0;
+  }
+
+  block = heap->base;
+  heap->base += size;
+  *heap_word( heap, block ) = size;
+
+  return block;
+}
+
+// Return a block to the free list, merging it with its neighbours, or to
+// the unused space at the top.
+static error_block *release( heap_header *heap, uint32_t block )
+{
+  uint32_t size = *heap_word( heap, block );
+
+  uint32_t link = HEAP_HEAD;
+  uint32_t previous = 0;
+  uint32_t previous_link = 0;
+  uint32_t next = next_free( heap, link );
+
+  while (next != 0 && next < block) {
+    if (!sane_free_block( heap, link, next )) return error_bad_link();
+    previous_link = link;
+    previous = next;
+    link = next;
+    next = next_free( heap, next );
+  }
+
+  if (next == block
+   || (previous != 0 && previous + free_size( heap, previous ) > block)
+   || (next != 0 && block + size > next)) {
+    return error_not_a_block(); // Already free, or overlapping a free block
+  }
+
+  uint32_t following = next;
+
+  if (next != 0 && block + size == next) {
+    size += free_size( heap, next );
+    following = next_free( heap, next );
+  }
+
+  if (previous != 0 && previous + free_size( heap, previous ) == block) {
+    size += free_size( heap, previous );
+    block = previous;
+    link = previous_link;
+  }
+
+  if (block + size == heap->base) {
+    assert( following == 0 );
+    heap->base = block;
+    set_next_free( heap, link, 0 );
+  }
+  else {
+    *heap_word( heap, block + 4 ) = size;
+    set_next_free( heap, block, following );
+    set_next_free( heap, link, block );
+  }
+
+  return 0;
+}
+
+// The offset of the first block that could be made in the space from
+// block to limit, leaving any space before it as a free block; or 0.
+static uint32_t aligned_block( heap_header *heap, uint32_t block, uint32_t limit,
+                               uint32_t size, uint32_t alignment, uint32_t boundary )
+{
+  uint32_t earliest = (uint32_t) heap + block + 4;
+  uint32_t data = (earliest + alignment - 1) & ~(alignment - 1);
+
+  if (data != earliest && data - earliest < 8) {
+    // Too little space before it for a free block
+    data = (earliest + 8 + alignment - 1) & ~(alignment - 1);
+  }
+
+  if (boundary != 0
+   && (data & ~(boundary - 1)) != ((data + size - 5) & ~(boundary - 1))) {
+    // The boundary is a multiple of the alignment
+    data = (data + boundary - 1) & ~(boundary - 1);
+  }
+
+  uint32_t start = data - 4 - (uint32_t) heap;
+
+  if (start + size > limit) return 0;
+
+  return start;
+}
+
+static uint32_t allocate_aligned( heap_header *heap, uint32_t size, uint32_t alignment,
+                                  uint32_t boundary, error_block **error )
+{
+  uint32_t link = HEAP_HEAD;
+  uint32_t block = next_free( heap, link );
+  uint32_t start = 0;
+  uint32_t limit = 0;
+
+  while (block != 0) {
+    if (!sane_free_block( heap, link, block )) {
+      *error = error_bad_link();
+      return 0;
+    }
+
+    limit = block + free_size( heap, block );
+    start = aligned_block( heap, block, limit, size, alignment, boundary );
+    if (start != 0) {
+      // Take the whole free block, give back what isn't needed
+      set_next_free( heap, link, next_free( heap, block ) );
+      break;
+    }
+
+    link = block;
+    block = next_free( heap, block );
+  }
+
+  if (start == 0) {
+    block = heap->base;
+    start = aligned_block( heap, block, heap->end, size, alignment, boundary );
+    if (start == 0) {
+      *error = error_heap_full();
+      return 0;
+    }
+    limit = start + size;
+    heap->base = limit;
+  }
+
+  *heap_word( heap, start ) = size;
+
+  if (start + size < limit) {
+    *heap_word( heap, start + size ) = limit - (start + size);
+    release( heap, start + size );
+  }
+
+  if (start != block) {
+    *heap_word( heap, block ) = start - block;
+    release( heap, block );
+  }
+
+  return start;
+}
+
+// Returns the new offset of the block, or 0 if it has been freed. On
+// failure, the block is unchanged.
+static uint32_t extend_block( heap_header *heap, uint32_t block, int32_t change, error_block **error )
+{
+  uint32_t size = *heap_word( heap, block );
+  int32_t wanted = size - 4 + change;
+
+  if (wanted <= 0) {
+    *error = release( heap, block );
+    return 0;
+  }
+
+  uint32_t new_size = block_size( wanted );
+
+  if (new_size == size) return block;
+
+  if (new_size < size) {
+    *heap_word( heap, block ) = new_size;
+    *heap_word( heap, block + new_size ) = size - new_size;
+    *error = release( heap, block + new_size );
+    return block;
+  }
+
+  uint32_t end = block + size;
+
+  if (end == heap->base) {
+    if (heap->end - block >= new_size) {
+      heap->base = block + new_size;
+      *heap_word( heap, block ) = new_size;
+      return block;
+    }
+  }
+  else {
+    // Absorb all or part of a free block that follows this one
+    uint32_t link = HEAP_HEAD;
+    uint32_t next = next_free( heap, link );
+    while (next != 0 && next < end) {
+      link = next;
+      next = next_free( heap, next );
+    }
+
+    if (next == end && size + free_size( heap, next ) >= new_size) {
+      uint32_t available = size + free_size( heap, next );
+      uint32_t following = next_free( heap, next );
+
+      if (available == new_size) {
+        set_next_free( heap, link, following );
+      }
+      else {
+        uint32_t rest = block + new_size;
+        *heap_word( heap, rest + 4 ) = available - new_size;
+        set_next_free( heap, rest, following );
+        set_next_free( heap, link, rest );
+      }
+
+      *heap_word( heap, block ) = new_size;
+      return block;
+    }
+  }
+
+  // Move it
+  uint32_t moved = allocate( heap, new_size, error );
+  if (moved == 0) return block;
+
+  memcpy( heap_word( heap, moved + 4 ), heap_word( heap, block + 4 ), size - 4 );
+  *error = release( heap, block );
+
+  return moved;
+}
+
+static void describe( heap_header *heap, uint32_t *largest, uint32_t *total, error_block **error )
+{
+  uint32_t link = HEAP_HEAD;
+  uint32_t block = next_free( heap, link );
+
+  *largest = heap->end - heap->base;
+  *total = *largest;
+
+  while (block != 0) {
+    if (!sane_free_block( heap, link, block )) {
+      *error = error_bad_link();
+      return;
+    }
+
+    uint32_t size = free_size( heap, block );
+    *total += size;
+    if (size > *largest) *largest = size;
+
+    link = block;
+    block = next_free( heap, block );
+  }
+
+  // The usable part of the largest block
+  *largest = (*largest < 8) ? 0 : *largest - 4;
+}
+
+static error_block *initialise( heap_header *heap, uint32_t size )
+{
+  if ((((uint32_t) heap) & 3) != 0
+   || size < first_block( heap ) + 8) {
+    return error_bad_heap();
+  }
+
+  heap->magic = HEAP_MAGIC;
+  heap->free = 0;
+  heap->base = first_block( heap );
+  heap->end = size;
+
+  return 0;
+}
+
+static error_block *free_block( heap_header *heap, void const *address )
+{
+  error_block *error = lock_heap( heap );
+  if (error != 0) return error;
+
+  uint32_t block = block_offset( heap, address );
+  if (block == 0)
+    error = error_not_a_block();
+  else
+    error = release( heap, block );
+
+  release_heap( heap );
+
+  return error;
+}
+
+static inline uint32_t rma_cache_index( uint32_t size )
+{
+  return (size - 1) / RMA_CACHE_GRANULE;
+}
+
+static inline uint32_t *rma_size_word( rma_cached_block *cached )
+{
+  return ((uint32_t*) cached) - 1;
+}
+
+// Return blocks from this core's cache to the RMA, until there are only
+// keep left.
+static void rma_cache_flush( uint32_t index, uint32_t keep )
+{
+  heap_header *heap = rma();
+  error_block *error = lock_heap( heap );
+  assert( error == 0 );
+
+  while (workspace.kernel.rma_cache[index].count > keep) {
+    rma_cached_block *cached = workspace.kernel.rma_cache[index].head;
+    workspace.kernel.rma_cache[index].head = cached->next;
+    workspace.kernel.rma_cache[index].count--;
+
+    *rma_size_word( cached ) &= ~RMA_CACHED;
+    error = release( heap, ((char*) cached - (char*) heap) - 4 );
+    assert( error == 0 );
+  }
+
+  release_heap( heap );
+}
+
+void *rma_claim( uint32_t bytes )
+{
+  heap_header *heap = rma();
+  uint32_t size = block_size( bytes );
+
+  if (size <= RMA_CACHE_GRANULE * RMA_CACHE_SIZES) {
+    uint32_t index = rma_cache_index( size );
+    size = (index + 1) * RMA_CACHE_GRANULE;
+
+    if (workspace.kernel.rma_cache[index].head == 0) {
+      // Fill the cache, rather than take the lock for every block
+      error_block *error = lock_heap( heap );
+      if (error != 0) return 0;
+
+      for (int i = 0; i < RMA_CACHE_BATCH; i++) {
+        uint32_t block = allocate( heap, size, &error );
+        if (block == 0) break;
+
+        rma_cached_block *cached = (void*) heap_word( heap, block + 4 );
+        *rma_size_word( cached ) = size | RMA_CACHED;
+        cached->next = workspace.kernel.rma_cache[index].head;
+        workspace.kernel.rma_cache[index].head = cached;
+        workspace.kernel.rma_cache[index].count++;
+      }
+
+      release_heap( heap );
+
+      if (workspace.kernel.rma_cache[index].head == 0) return 0;
+    }
+
+    rma_cached_block *cached = workspace.kernel.rma_cache[index].head;
+    workspace.kernel.rma_cache[index].head = cached->next;
+    workspace.kernel.rma_cache[index].count--;
+
+    *rma_size_word( cached ) &= ~RMA_CACHED;
+
+    return cached;
+  }
+
+  error_block *error = lock_heap( heap );
+  if (error != 0) return 0;
+
+  uint32_t block = allocate( heap, size, &error );
+
+  release_heap( heap );
+
+  return (block == 0) ? 0 : heap_word( heap, block + 4 );
+}
+
+// Returns false if the block is not one that can be cached; that
+// includes anything that doesn't look like an allocated RMA block, which
+// is left for free_block to check properly. A block that's already in a
+// cache (freed twice) isn't added again, that's an error.
+static bool rma_free_to_cache( void const *address, error_block **error )
+{
+  heap_header *heap = rma();
+
+  uint32_t block = ((char const *) address - (char const *) heap) - 4;
+  if (block < first_block( heap ) || block >= heap->base) return false;
+
+  rma_cached_block *cached = (void*) address;
+  uint32_t *size_word = rma_size_word( cached );
+  uint32_t size = *size_word;
+
+  if ((size & RMA_CACHED) != 0) {
+    // In this or another core's cache, it would be handed out twice
+    *error = error_not_a_block();
+    return true;
+  }
+
+  if (block != block_offset( heap, address )
+   || size > RMA_CACHE_GRANULE * RMA_CACHE_SIZES
+   || (size % RMA_CACHE_GRANULE) != 0) return false;
+
+  // Another core may be freeing the same block
+  if (size != change_word_if_equal( size_word, size, size | RMA_CACHED )) {
+    *error = error_not_a_block();
+    return true;
+  }
+
+  uint32_t index = rma_cache_index( size );
+
+  cached->next = workspace.kernel.rma_cache[index].head;
+  workspace.kernel.rma_cache[index].head = cached;
+  workspace.kernel.rma_cache[index].count++;
+
+  if (workspace.kernel.rma_cache[index].count > RMA_CACHE_LIMIT) {
+    rma_cache_flush( index, RMA_CACHE_LIMIT - RMA_CACHE_BATCH );
+  }
+
+  return true;
+}
+
+void rma_release( void const *block )
+{
+  if (block == 0) return;
+
+  error_block *error = 0;
+
+  if (!rma_free_to_cache( block, &error )) {
+    error = free_block( rma(), block );
+  }
+
+  assert( error == 0 );
+}
+
+enum { HeapReason_Init,
+       HeapReason_Desc,
+       HeapReason_Get,
+       HeapReason_Free,
+       HeapReason_ExtendBlock,
+       HeapReason_ExtendHeap,
+       HeapReason_ReadBlockSize,
+       HeapReason_GetAligned };
+
+bool do_OS_Heap( svc_registers *regs )
+{
+  heap_header *heap = (void*) regs->r[1];
+  uint32_t reason = regs->r[0];
+  error_block *error = 0;
+
+  if (reason == HeapReason_Init) {
+    error = initialise( heap, regs->r[3] );
+  }
+  else if (reason == HeapReason_Get && heap == rma()) {
+    void *block = rma_claim( regs->r[3] );
+    if (block == 0)
+      error = error_heap_full();
+    else
+      regs->r[2] = (uint32_t) block;
+  }
+  else if (reason == HeapReason_Free
+        && heap == rma()
+        && rma_free_to_cache( (void*) regs->r[2], &error )) {
+    // Nothing more to do (unless it was already free)
+  }
+  else {
+    error = lock_heap( heap );
+
+    if (error == 0) {
+      switch (reason) {
+      case HeapReason_Desc:
+        {
+          uint32_t largest;
+          uint32_t total;
+          describe( heap, &largest, &total, &error );
+          if (error == 0) {
+            regs->r[2] = largest;
+            regs->r[3] = total;
+          }
+        }
+        break;
+
+      case HeapReason_Get:
+        {
+          uint32_t block = allocate( heap, block_size( regs->r[3] ), &error );
+          if (block != 0) regs->r[2] = (uint32_t) heap_word( heap, block + 4 );
+        }
+        break;
+
+      case HeapReason_Free:
+        {
+          uint32_t block = block_offset( heap, (void*) regs->r[2] );
+          if (block == 0)
+            error = error_not_a_block();
+          else
+            error = release( heap, block );
+        }
+        break;
+
+      case HeapReason_ExtendBlock:
+        {
+          uint32_t block = block_offset( heap, (void*) regs->r[2] );
+          if (block == 0)
+            error = error_not_a_block();
+          else {
+            block = extend_block( heap, block, regs->r[3], &error );
+            if (error == 0) {
+              regs->r[2] = (block == 0) ? -1 : (uint32_t) heap_word( heap, block + 4 );
+            }
+          }
+        }
+        break;
+
+      case HeapReason_ExtendHeap:
+        {
+          int32_t change = regs->r[3];
+          uint32_t unused = heap->end - heap->base;
+          if (change < 0 && -change > unused) {
+            // Shrink as far as possible
+            change = -unused;
+            error = error_excessive_shrink();
+          }
+          heap->end += change;
+          regs->r[3] = change;
+        }
+        break;
+
+      case HeapReason_ReadBlockSize:
+        {
+          uint32_t block = block_offset( heap, (void*) regs->r[2] );
+          if (block == 0)
+            error = error_not_a_block();
+          else
+            regs->r[3] = *heap_word( heap, block );
+        }
+        break;
+
+      case HeapReason_GetAligned:
+        {
+          uint32_t alignment = regs->r[2];
+          uint32_t boundary = regs->r[4];
+          uint32_t size = block_size( regs->r[3] );
+
+          if (alignment < 8) alignment = 8;
+
+          if ((alignment & (alignment - 1)) != 0
+           || (boundary & (boundary - 1)) != 0
+           || (boundary != 0 && (boundary < alignment || size - 4 > boundary))) {
+            error = error_bad_alignment();
+          }
+          else {
+            uint32_t block = allocate_aligned( heap, size, alignment, boundary, &error );
+            if (block != 0) regs->r[2] = (uint32_t) heap_word( heap, block + 4 );
+          }
+        }
+        break;
+
+      default:
+        error = error_bad_reason();
+      }
+
+      release_heap( heap );
+    }
+  }
+
+  if (error != 0) {
+    regs->r[0] = (uint32_t) error;
+    return false;
+  }
+
+  return true;
+}
+#endif
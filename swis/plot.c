@@ -15,91 +15,649 @@
 
 #include "inkernel.h"
 
-static void new_absolute_point( svc_registers *regs )
+// OS_Plot, natively, for lines, points, triangles, rectangles,
+// parallelograms, horizontal line and flood fills, circles and ellipses.
+// Everything else (arcs, segments, sectors, block copies, sprites, fonts)
+// is passed to the legacy code.
+//
+// Shapes are converted to spans (see spans.c), a batch at a time, which are
+// clipped to the graphics window.
+//
+// All the state used is in the VDU variables of the core doing the
+// plotting, including the screen or sprite being drawn to, so the native
+// plot types don't need the legacy VDU lock (see swi_legacy_class in
+// swis.c). The plotting Task has to stay with those variables, though.
+//
+// The graphics cursor is kept in the legacy variables, so that plotting
+// with VDU 25 through the legacy code carries on from the same points.
+
+typedef struct {
+  int32_t x;
+  int32_t y;
+} point;
+
+typedef struct {
+  EcfOraEor const *ecf;
+  uint32_t count;
+  span spans[32];
+} span_batch;
+
+static inline VduDriversWorkspace *vdu_ws()
+{
+  return &workspace.vectors.zp.vdu_drivers.ws;
+}
+
+static void flush_spans( span_batch *batch )
+{
+  if (batch->count != 0) plot_spans( batch->spans, batch->count, batch->ecf );
+  batch->count = 0;
+}
+
+static void add_span( span_batch *batch, int32_t left, int32_t y, int32_t right )
+{
+  if (batch->count == number_of( batch->spans )) flush_spans( batch );
+
+  span *s = &batch->spans[batch->count++];
+  s->left = left;
+  s->y = y;
+  s->right = right;
+}
+
+static inline int32_t min( int32_t a, int32_t b ) { return a < b ? a : b; }
+static inline int32_t max( int32_t a, int32_t b ) { return a > b ? a : b; }
+static inline int32_t absolute( int32_t a ) { return a < 0 ? -a : a; }
+
+// Widen [*l, *r] to include x and the pixels up to, but not including,
+// next. This keeps the edges of shapes connected on rows where they move
+// more than one pixel sideways.
+static inline void extend_towards( int32_t x, int32_t next, int32_t *l, int32_t *r )
 {
-  workspace.vdu.plot_points[2] = workspace.vdu.plot_points[1];
-  workspace.vdu.plot_points[1] = workspace.vdu.plot_points[0];
-  workspace.vdu.plot_points[0].x = (int32_t) regs->r[1];
-  workspace.vdu.plot_points[0].y = (int32_t) regs->r[2];
+  int32_t far = x;
+  if (next > x + 1) far = next - 1;
+  else if (next < x - 1) far = next + 1;
+
+  *l = min( *l, min( x, far ) );
+  *r = max( *r, max( x, far ) );
 }
 
-static void new_relative_point( svc_registers *regs )
+static uint32_t isqrt( uint64_t n )
 {
-  workspace.vdu.plot_points[2] = workspace.vdu.plot_points[1];
-  workspace.vdu.plot_points[1] = workspace.vdu.plot_points[0];
-  workspace.vdu.plot_points[0].x += (int32_t) regs->r[1];
-  workspace.vdu.plot_points[0].y += (int32_t) regs->r[2];
+  uint64_t root = 0;
+  uint64_t bit = 1ull << 62;
+
+  while (bit > n) bit >>= 2;
+
+  while (bit != 0) {
+    if (n >= root + bit) {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+
+  return root;
 }
 
-typedef void (*plotter)( uint32_t left, uint32_t right, uint32_t y );
+// Lines
 
-static void fg_plotter( uint32_t left, uint32_t right, uint32_t y )
+// The dot pattern is DotLineLength bits long (64 if zero), most
+// significant bit of DotLineStyle[0] first. LineDotCnt counts down to the
+// pattern restarting.
+static bool next_dot( VduDriversWorkspace *ws )
 {
+  uint32_t length = ws->DotLineLength;
+  if (length == 0 || length > 64) length = 64;
+
+  if (ws->LineDotCnt == 0 || ws->LineDotCnt > length) ws->LineDotCnt = length;
+
+  uint32_t n = length - ws->LineDotCnt--;
+
+  return 0 != (ws->DotLineStyle[n / 8] & (0x80 >> (n % 8)));
 }
 
-static void bg_plotter( uint32_t left, uint32_t right, uint32_t y )
+// Groups 0 to 7 (plot codes 0x00 to 0x38):
+//  bit 0: exclude the final point
+//  bit 1: dotted
+//  bit 2: exclude the initial point, continuing the dot pattern
+static void line( span_batch *batch, point from, point to, uint32_t group )
 {
+  VduDriversWorkspace *ws = vdu_ws();
+
+  bool exclude_last = 0 != (group & 1);
+  bool dotted = 0 != (group & 2);
+  bool exclude_first = 0 != (group & 4);
+
+  if (dotted && !exclude_first) ws->LineDotCnt = 0;
+
+  int32_t dx = absolute( to.x - from.x );
+  int32_t dy = absolute( to.y - from.y );
+  int32_t sx = from.x < to.x ? 1 : -1;
+  int32_t sy = from.y < to.y ? 1 : -1;
+  int32_t err = dx - dy;
+  int32_t steps = max( dx, dy );
+
+  int32_t x = from.x;
+  int32_t y = from.y;
+
+  // Pixels on the same row are collected into one span
+  bool in_run = false;
+  int32_t run_l = 0;
+  int32_t run_r = 0;
+  int32_t run_y = 0;
+
+  for (int32_t i = 0; i <= steps; i++) {
+    bool plot = !(i == 0 && exclude_first) && !(i == steps && exclude_last);
+
+    if (plot && dotted) plot = next_dot( ws );
+
+    if (plot && in_run && y == run_y && (x == run_r + 1 || x == run_l - 1)) {
+      run_l = min( run_l, x );
+      run_r = max( run_r, x );
+    }
+    else {
+      if (in_run) add_span( batch, run_l, run_y, run_r );
+      in_run = plot;
+      run_l = run_r = x;
+      run_y = y;
+    }
+
+    int32_t e2 = 2 * err;
+    if (e2 > -dy) { err -= dy; x += sx; }
+    if (e2 < dx) { err += dx; y += sy; }
+  }
+
+  if (in_run) add_span( batch, run_l, run_y, run_r );
 }
 
-static void invert_plotter( uint32_t left, uint32_t right, uint32_t y )
+// Triangles and parallelograms
+
+typedef struct {
+  int32_t bottom;
+  int32_t top;
+  int32_t x;            // At the current row
+  int32_t other_x;      // For horizontal edges
+  int32_t step;         // Whole pixels per row
+  int32_t rem;          // Fraction of a pixel per row, in dy'ths
+  int32_t err;
+  int32_t dy;
+} edge;
+
+static void new_edge( edge *e, point a, point b )
 {
+  if (a.y > b.y) { point t = a; a = b; b = t; }
+
+  e->bottom = a.y;
+  e->top = b.y;
+  e->x = a.x;
+  e->other_x = b.x;
+  e->dy = b.y - a.y;
+
+  if (e->dy != 0) {
+    int32_t dx = b.x - a.x;
+    e->step = dx / e->dy;
+    e->rem = dx % e->dy;
+    if (e->rem < 0) { e->step--; e->rem += e->dy; }
+    e->err = e->dy / 2; // Round to the nearest pixel
+  }
 }
 
-static void solid_line( plotter plot )
+// err and rem are both less than dy, their sum may not fit in an int32_t
+static inline int32_t next_x( edge *e )
 {
+  int32_t x = e->x + e->step;
+  if ((uint32_t) e->err + e->rem >= e->dy) x++;
+  return x;
 }
 
-bool do_OS_Plot( svc_registers *regs )
+static inline void step_edge( edge *e )
 {
-asm ( "bkpt 4" );
-  if (0 == (regs->r[0] & 4))
-    new_relative_point( regs );
-  else
-    new_absolute_point( regs );
+  uint32_t err = (uint32_t) e->err + e->rem;
+  e->x += e->step;
+  if (err >= e->dy) { e->x++; err -= e->dy; }
+  e->err = err;
+}
+
+// Move the edge on by rows, as if step_edge had been called for each.
+// rows * rem can be too big for 32 bits, and there's no 64-bit division
+// (__aeabi_uldivmod), so the whole pixels in it are found a bit of rows
+// at a time, like long division.
+static void skip_rows( edge *e, int32_t rows )
+{
+  uint32_t dy = e->dy;
+  uint32_t whole = 0;
+  uint32_t err = 0;
+
+  for (int bit = 31; bit >= 0; bit--) {
+    whole <<= 1;
+    err <<= 1;
+    if (err >= dy) { err -= dy; whole++; }
+
+    if (0 != (rows & (1 << bit))) {
+      err += e->rem;
+      if (err >= dy) { err -= dy; whole++; }
+    }
+  }
+
+  err += e->err;
+  if (err >= dy) { err -= dy; whole++; }
+
+  e->x += rows * e->step + whole;
+  e->err = err;
+}
+
+// Corners in order, either way round
+static void fill_convex( span_batch *batch, point const *corners, int n )
+{
+  VduDriversWorkspace *ws = vdu_ws();
+
+  edge edges[4];
+  int32_t bottom = corners[0].y;
+  int32_t top = corners[0].y;
+
+  for (int i = 0; i < n; i++) {
+    new_edge( &edges[i], corners[i], corners[(i + 1) % n] );
+    bottom = min( bottom, corners[i].y );
+    top = max( top, corners[i].y );
+  }
+
+  top = min( top, ws->GWTRow );
+
+  if (bottom < (int32_t) ws->GWBRow) {
+    // Start at the bottom of the window, rather than walking the rows
+    // below it.
+    bottom = ws->GWBRow;
+
+    for (int i = 0; i < n; i++) {
+      edge *e = &edges[i];
+      if (e->dy != 0 && e->bottom < bottom && bottom <= e->top) {
+        skip_rows( e, bottom - e->bottom );
+      }
+    }
+  }
+
+  for (int32_t y = bottom; y <= top; y++) {
+    int32_t l = 0x7fffffff;
+    int32_t r = 0x80000000;
+
+    for (int i = 0; i < n; i++) {
+      edge *e = &edges[i];
+      if (y < e->bottom || y > e->top) continue;
 
-  plotter plot;
-  switch (regs->r[0] & 3) {
-  case 0: return true; // Moved, nothing to plot
-  case 1: plot = fg_plotter; break;
-  case 2: plot = invert_plotter; break;
-  case 3: plot = bg_plotter; break;
+      if (e->dy == 0) {
+        l = min( l, min( e->x, e->other_x ) );
+        r = max( r, max( e->x, e->other_x ) );
+      }
+      else {
+        if (y < e->top)
+          extend_towards( e->x, next_x( e ), &l, &r );
+        else
+          extend_towards( e->x, e->x, &l, &r );
+        step_edge( e );
+      }
+    }
+
+    if (l <= r) add_span( batch, l, y, r );
+  }
+}
+
+// Circles and ellipses
+
+// Half the width of an ellipse's row, dy rows from the centre. The edge
+// is taken half a row further out, so the top and bottom rows aren't a
+// single pixel, as with the midpoint circle algorithm.
+static inline int32_t half_width( int32_t a, int32_t b, int32_t dy )
+{
+  uint32_t t = b * b + b - dy * dy;
+  return isqrt( (uint64_t) a * a * t ) / b;
+}
+
+// Offset of the middle of a sheared ellipse's row, rounded
+static inline int32_t row_offset( int32_t shear, int32_t b, int32_t dy )
+{
+  return (shear * dy + (dy < 0 ? -b / 2 : b / 2)) / b;
+}
+
+// Centred on c, extending a pixels either side on the centre row, and b
+// rows above and below. The top row is offset by shear pixels, the rows in
+// between in proportion.
+static void ellipse( span_batch *batch, point c, int32_t a, int32_t b, int32_t shear, bool fill )
+{
+  VduDriversWorkspace *ws = vdu_ws();
+
+  if (b == 0) {
+    add_span( batch, c.x - a, c.y, c.x + a );
+    return;
   }
-  switch (regs->r[0] / 8) {
-  case 0: solid_line( plot ); break;
+
+  int32_t first = max( -b, (int32_t) ws->GWBRow - c.y );
+  int32_t last = min( b, (int32_t) ws->GWTRow - c.y );
+
+  for (int32_t dy = first; dy <= last; dy++) {
+    int32_t w = half_width( a, b, dy );
+    int32_t o = row_offset( shear, b, dy );
+
+    int32_t l = c.x + o - w;
+    int32_t r = c.x + o + w;
+
+    if (fill) {
+      add_span( batch, l, c.y + dy, r );
+    }
+    else {
+      // Reach towards the row nearer the centre, to keep the outline
+      // connected.
+      int32_t in = (dy < 0) ? dy + 1 : (dy > 0) ? dy - 1 : 0;
+      int32_t win = half_width( a, b, in );
+      int32_t oin = row_offset( shear, b, in );
+
+      int32_t ll = l, lr = l;
+      int32_t rl = r, rr = r;
+      extend_towards( l, c.x + oin - win, &ll, &lr );
+      extend_towards( r, c.x + oin + win, &rl, &rr );
+
+      // The top and bottom rows are all edge
+      if (lr + 1 >= rl || dy == b || dy == -b) {
+        add_span( batch, ll, c.y + dy, rr );
+      }
+      else {
+        add_span( batch, ll, c.y + dy, lr );
+        add_span( batch, rl, c.y + dy, rr );
+      }
+    }
+  }
+}
+
+// Horizontal line and flood fills
+
+static uint32_t pixel( VduDriversWorkspace *ws, int32_t x, int32_t y )
+{
+  uint32_t const *row = (void*) (ws->ScreenStart + (ws->YWindLimit - y) * ws->LineLength);
+  uint32_t bit = x << ws->Log2BPP;
+  uint32_t word = row[bit / 32] >> (bit % 32);
+
+  if (ws->Log2BPP == 5) return word & 0xffffff; // Ignore the top byte
+  return word & ((1 << (1 << ws->Log2BPP)) - 1);
+}
+
+typedef struct {
+  VduDriversWorkspace *ws;
+  uint32_t colour;
+  bool while_equal;     // Fill while the pixels are the colour, or until they are
+  uint32_t *visited;    // Flood fills only, one bit per pixel in the window
+} fill_test;
+
+static void set_up_fill_test( fill_test *test, bool background, bool while_equal )
+{
+  VduDriversWorkspace *ws = vdu_ws();
+  test->ws = ws;
+  test->colour = background ? ws->GBCOL : ws->GFCOL;
+  if (ws->Log2BPP == 5) test->colour &= 0xffffff;
+  test->while_equal = while_equal;
+  test->visited = 0;
+}
+
+static inline uint32_t visited_bit( fill_test *test, int32_t x, int32_t y )
+{
+  VduDriversWorkspace *ws = test->ws;
+  return (y - ws->GWBRow) * (ws->GWRCol - ws->GWLCol + 1) + (x - ws->GWLCol);
+}
+
+static bool fillable( fill_test *test, int32_t x, int32_t y )
+{
+  VduDriversWorkspace *ws = test->ws;
+
+  if (x < (int32_t) ws->GWLCol || x > (int32_t) ws->GWRCol
+   || y < (int32_t) ws->GWBRow || y > (int32_t) ws->GWTRow) return false;
+
+  if (test->visited != 0) {
+    uint32_t bit = visited_bit( test, x, y );
+    if (0 != (test->visited[bit / 32] & (1 << (bit % 32)))) return false;
+  }
+
+  return (pixel( ws, x, y ) == test->colour) == test->while_equal;
+}
+
+// Groups 9, 11, 13 and 15 (plot codes 0x48, 0x58, 0x68 and 0x78)
+static void horizontal_fill( span_batch *batch, point p, uint32_t group )
+{
+  fill_test test;
+  bool right_only = 0 != (group & 2);
+
+  switch (group) {
+  case 9: set_up_fill_test( &test, true, true ); break;    // To non-background
+  case 11: set_up_fill_test( &test, true, false ); break;  // Right only, to background
+  case 13: set_up_fill_test( &test, false, false ); break; // To foreground
+  case 15: set_up_fill_test( &test, false, true ); break;  // Right only, to non-foreground
+  }
+
+  if (!fillable( &test, p.x, p.y )) return;
+
+  int32_t l = p.x;
+  int32_t r = p.x;
+  if (!right_only) while (fillable( &test, l - 1, p.y )) l--;
+  while (fillable( &test, r + 1, p.y )) r++;
+
+  add_span( batch, l, p.y, r );
+}
+
+typedef struct {
+  point *stack;
+  uint32_t count;
+  uint32_t capacity;
+} seeds;
+
+static bool push_seed( seeds *s, int32_t x, int32_t y )
+{
+  if (s->count == s->capacity) {
+    uint32_t capacity = (s->capacity == 0) ? 64 : 2 * s->capacity;
+    point *bigger = rma_allocate( capacity * sizeof( point ) );
+    if (bigger == 0) return false;
+    if (s->stack != 0) {
+      memcpy( bigger, s->stack, s->count * sizeof( point ) );
+      rma_free( s->stack );
+    }
+    s->stack = bigger;
+    s->capacity = capacity;
+  }
+
+  s->stack[s->count].x = x;
+  s->stack[s->count].y = y;
+  s->count++;
+
+  return true;
+}
+
+// Seeds the start of each fillable run on the row between l and r
+static bool seed_row( seeds *s, fill_test *test, int32_t l, int32_t r, int32_t y )
+{
+  int32_t x = l;
+  while (x <= r) {
+    if (fillable( test, x, y )) {
+      if (!push_seed( s, x, y )) return false;
+      while (x <= r && fillable( test, x, y )) x++;
+    }
+    else {
+      x++;
+    }
   }
   return true;
 }
 
+// Groups 16 and 17 (plot codes 0x80 and 0x88), scan line by scan line.
+// Pixels are only filled once, even if the fill doesn't change them.
+static bool flood_fill( span_batch *batch, point p, uint32_t group )
+{
+  VduDriversWorkspace *ws = vdu_ws();
+  fill_test test;
 
-/* Notes about ECF patterns that are used by legacy code.
+  if (group == 16)
+    set_up_fill_test( &test, true, true );      // To non-background
+  else
+    set_up_fill_test( &test, false, false );    // To foreground
 
-   Each one is 8 word pairs:
-     typedef struct {
-       uint32_t orr;
-       uint32_t eor;
-     } ECF[8];
+  if (!fillable( &test, p.x, p.y )) return true;
 
-  static const ECF NoEffect = { { 0, 0 },
-                              { 0, 0 },
-                              { 0, 0 },
-                              { 0, 0 }, 
-                              { 0, 0 }, 
-                              { 0, 0 }, 
-                              { 0, 0 }, 
-                              { 0, 0 } };
+  uint32_t pixels = (ws->GWRCol - ws->GWLCol + 1) * (ws->GWTRow - ws->GWBRow + 1);
+  uint32_t bytes = 4 * ((pixels + 31) / 32);
+  test.visited = rma_allocate( bytes );
+  if (test.visited == 0) return false;
+  memset( test.visited, 0, bytes );
 
-  static const ECF Invert = { { 0, 0xffffffff },
-                              { 0, 0xffffffff },
-                              { 0, 0xffffffff },
-                              { 0, 0xffffffff }, 
-                              { 0, 0xffffffff }, 
-                              { 0, 0xffffffff }, 
-                              { 0, 0xffffffff }, 
-                              { 0, 0xffffffff } };
+  seeds s = { 0 };
+  bool ok = push_seed( &s, p.x, p.y );
 
-  Pixels, I think, are set by new = (old ^ ecf[y&7].eor) | ecf[y&7].orr;
+  while (ok && s.count != 0) {
+    point seed = s.stack[--s.count];
+    int32_t y = seed.y;
 
-  Once identified (NoEffect, Invert, workspace...FgEcfOraEor, or workspace...BgEcfOraEor), address stored in workspace...GColAdr.
+    if (!fillable( &test, seed.x, y )) continue;
 
-  HLine called.
-*/
+    int32_t l = seed.x;
+    int32_t r = seed.x;
+    while (fillable( &test, l - 1, y )) l--;
+    while (fillable( &test, r + 1, y )) r++;
+
+    for (int32_t x = l; x <= r; x++) {
+      uint32_t bit = visited_bit( &test, x, y );
+      test.visited[bit / 32] |= (1 << (bit % 32));
+    }
+
+    add_span( batch, l, y, r );
+
+    ok = seed_row( &s, &test, l, r, y + 1 )
+      && seed_row( &s, &test, l, r, y - 1 );
+  }
+
+  if (s.stack != 0) rma_free( s.stack );
+  rma_free( test.visited );
+
+  return ok;
+}
+
+bool plot_is_native( uint32_t code )
+{
+  uint32_t group = (code & 0xff) >> 3;
+  return group <= 19 || group == 24 || group == 25;
+}
+
+// Points are internal coordinates: p0 is the new point, p1 the previous
+// one, p2 the one before that. dx, dy are from p1 to p0 in external units.
+static bool plot( uint32_t code, point p2, point p1, point p0, int32_t dx, int32_t dy )
+{
+  VduDriversWorkspace *ws = vdu_ws();
+  span_batch batch;
+  bool ok = true;
+
+  switch (code & 3) {
+  case 1: batch.ecf = &ws->FgEcfOraEor; break;
+  case 2: batch.ecf = &span_invert; break;
+  case 3: batch.ecf = &ws->BgEcfOraEor; break;
+  }
+  batch.count = 0;
+
+  uint32_t group = (code & 0xff) >> 3;
+
+  switch (group) {
+  case 0 ... 7:
+    line( &batch, p1, p0, group );
+    break;
+  case 8: // Point
+    add_span( &batch, p0.x, p0.y, p0.x );
+    break;
+  case 9: case 11: case 13: case 15:
+    horizontal_fill( &batch, p0, group );
+    break;
+  case 10: // Triangle
+    {
+      point corners[3] = { p2, p1, p0 };
+      fill_convex( &batch, corners, 3 );
+    }
+    break;
+  case 12: // Rectangle
+    plot_rectangle( p1.x, p1.y, p0.x, p0.y, batch.ecf );
+    break;
+  case 14: // Parallelogram, the fourth corner opposite p1
+    {
+      point p3 = { p2.x + p0.x - p1.x, p2.y + p0.y - p1.y };
+      point corners[4] = { p2, p1, p0, p3 };
+      fill_convex( &batch, corners, 4 );
+    }
+    break;
+  case 16: case 17:
+    ok = flood_fill( &batch, p0, group );
+    break;
+  case 18: case 19: // Circle, centred on p1, through p0
+    {
+      uint64_t ax = absolute( dx );
+      uint64_t ay = absolute( dy );
+      int32_t r = isqrt( ax * ax + ay * ay );
+      ellipse( &batch, p1, r >> ws->XEigFactor, r >> ws->YEigFactor, 0, group == 19 );
+    }
+    break;
+  case 24: case 25: // Ellipse, centred on p2, across to p1.x, up to p0
+    {
+      int32_t a = absolute( p1.x - p2.x );
+      int32_t b = p0.y - p2.y;
+      int32_t shear = p0.x - p2.x;
+      if (b < 0) { b = -b; shear = -shear; }
+      ellipse( &batch, p2, a, b, shear, group == 25 );
+    }
+    break;
+  default:
+    assert( false ); // plot_is_native should have excluded it
+  }
+
+  flush_spans( &batch );
+
+  return ok;
+}
+
+bool do_OS_Plot( svc_registers *regs )
+{
+  uint32_t code = regs->r[0];
+
+  if (!plot_is_native( code )) {
+    return run_risos_code_implementing_swi( regs, OS_Plot );
+  }
+
+  Task_using_vdu_state();
+
+  VduDriversWorkspace *ws = vdu_ws();
+
+  // External coordinates, relative to the graphics origin
+  int32_t x = regs->r[1];
+  int32_t y = regs->r[2];
+
+  if (0 == (code & 4)) {
+    x += (int32_t) ws->GCsX;
+    y += (int32_t) ws->GCsY;
+  }
+
+  point p0 = { (x + (int32_t) ws->OrgX) >> ws->XEigFactor,
+               (y + (int32_t) ws->OrgY) >> ws->YEigFactor };
+  point p1 = { ws->GCsIX, ws->GCsIY };
+  point p2 = { ws->OldCsX, ws->OldCsY };
+
+  bool ok = true;
+
+  if ((code & 3) != 0) {
+    ok = plot( code, p2, p1, p0, x - (int32_t) ws->GCsX, y - (int32_t) ws->GCsY );
+  }
+
+  ws->OlderCsX = ws->OldCsX;
+  ws->OlderCsY = ws->OldCsY;
+  ws->OldCsX = ws->GCsIX;
+  ws->OldCsY = ws->GCsIY;
+  ws->GCsX = x;
+  ws->GCsY = y;
+  ws->GCsIX = p0.x;
+  ws->GCsIY = p0.y;
+  ws->NewPtX = p0.x;
+  ws->NewPtY = p0.y;
+
+  if (!ok) return error_nomem( regs );
+
+  return true;
+}
@@ -0,0 +1,93 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "inkernel.h"
+#include "spans.h"
+
+// Horizontal spans of pixels, the basis of all the graphics plotting.
+//
+// Coordinates are internal (pixels, from the bottom left of the screen or
+// sprite being drawn to), and spans are clipped to the graphics window.
+// Each row is plotted with the pair of words from line y & 7 of the ECF
+// pattern, so patterns line up between neighbouring shapes.
+//
+// The screen (or sprite) in use is described by the legacy VDU variables,
+// so the legacy code can redirect output just by changing them.
+
+EcfOraEor const span_no_effect = { 0 };
+
+EcfOraEor const span_invert = { .line = {
+  { 0, 0xffffffff }, { 0, 0xffffffff }, { 0, 0xffffffff }, { 0, 0xffffffff },
+  { 0, 0xffffffff }, { 0, 0xffffffff }, { 0, 0xffffffff }, { 0, 0xffffffff } } };
+
+static inline uint32_t *screen_row( VduDriversWorkspace const *ws, int32_t y )
+{
+  return (uint32_t*) (ws->ScreenStart + (ws->YWindLimit - y) * ws->LineLength);
+}
+
+static inline void clipped_span( VduDriversWorkspace const *ws, int32_t left, int32_t y, int32_t right, EcfOraEor const *ecf )
+{
+  if (y < (int32_t) ws->GWBRow || y > (int32_t) ws->GWTRow) return;
+  if (left < (int32_t) ws->GWLCol) left = ws->GWLCol;
+  if (right > (int32_t) ws->GWRCol) right = ws->GWRCol;
+  if (left > right) return;
+
+  span_fill_row( screen_row( ws, y ), left, right, ws->Log2BPP,
+                 ecf->line[y & 7].orr, ecf->line[y & 7].eor );
+}
+
+void plot_span( int32_t left, int32_t y, int32_t right, EcfOraEor const *ecf )
+{
+  VduDriversWorkspace const *ws = &workspace.vectors.zp.vdu_drivers.ws;
+
+  if (left > right) { int32_t t = left; left = right; right = t; }
+
+  clipped_span( ws, left, y, right, ecf );
+}
+
+// For shapes that are drawn as many spans at once (filled polygons,
+// circles, glyphs), saving a call and the window lookups per span.
+void plot_spans( span const *spans, uint32_t count, EcfOraEor const *ecf )
+{
+  VduDriversWorkspace const *ws = &workspace.vectors.zp.vdu_drivers.ws;
+
+  for (uint32_t i = 0; i < count; i++) {
+    clipped_span( ws, spans[i].left, spans[i].y, spans[i].right, ecf );
+  }
+}
+
+// Corners inclusive, in any order
+void plot_rectangle( int32_t left, int32_t bottom, int32_t right, int32_t top, EcfOraEor const *ecf )
+{
+  VduDriversWorkspace const *ws = &workspace.vectors.zp.vdu_drivers.ws;
+
+  if (left > right) { int32_t t = left; left = right; right = t; }
+  if (bottom > top) { int32_t t = bottom; bottom = top; top = t; }
+
+  if (left < (int32_t) ws->GWLCol) left = ws->GWLCol;
+  if (right > (int32_t) ws->GWRCol) right = ws->GWRCol;
+  if (bottom < (int32_t) ws->GWBRow) bottom = ws->GWBRow;
+  if (top > (int32_t) ws->GWTRow) top = ws->GWTRow;
+  if (left > right || bottom > top) return;
+
+  uint32_t *row = screen_row( ws, top );
+  uint32_t stride = ws->LineLength / 4;
+
+  for (int32_t y = top; y >= bottom; y--) {
+    span_fill_row( row, left, right, ws->Log2BPP,
+                   ecf->line[y & 7].orr, ecf->line[y & 7].eor );
+    row += stride;
+  }
+}
@@ -0,0 +1,103 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Filling a horizontal run of pixels in one row, at any depth from 1 to
+// 32 bits per pixel, with a pair of words from an ECF pattern:
+//
+//   new = (old | orr) ^ eor
+//
+// The words are already replicated for the pixel depth (by the legacy
+// GCOL code), so only the partial words at each end of the run depend on
+// it. Pixels are packed from the least significant bit of each word.
+//
+// Setting pixels to a colour (orr all ones) is by far the commonest
+// case; the whole words are then stored without reading them, eight at a
+// time.
+
+static inline void span_store_words( uint32_t *p, uint32_t *end, uint32_t value )
+{
+#ifdef __arm__
+  if (end - p >= 8) {
+    register uint32_t v0 asm ( "r2" ) = value;
+    register uint32_t v1 asm ( "r3" ) = value;
+    register uint32_t v2 asm ( "r4" ) = value;
+    register uint32_t v3 asm ( "r5" ) = value;
+    register uint32_t v4 asm ( "r6" ) = value;
+    register uint32_t v5 asm ( "r7" ) = value;
+    register uint32_t v6 asm ( "r8" ) = value;
+    register uint32_t v7 asm ( "r12" ) = value;
+
+    do {
+      asm volatile ( "stmia %[p]!, { r2-r8, r12 }"
+          : [p] "+r" (p)
+          : "r" (v0), "r" (v1), "r" (v2), "r" (v3)
+          , "r" (v4), "r" (v5), "r" (v6), "r" (v7)
+          : "memory" );
+    } while (end - p >= 8);
+  }
+#endif
+
+  while (p < end) *p++ = value;
+}
+
+static inline void span_ora_eor_words( uint32_t *p, uint32_t *end, uint32_t orr, uint32_t eor )
+{
+  while (p < end) {
+    *p = (*p | orr) ^ eor;
+    p++;
+  }
+}
+
+static inline void span_ora_eor_masked( uint32_t *p, uint32_t mask, uint32_t orr, uint32_t eor )
+{
+  *p = (*p & ~mask) | (((*p | orr) ^ eor) & mask);
+}
+
+// Pixels left to right inclusive, left <= right
+static inline void span_fill_row( uint32_t *row, uint32_t left, uint32_t right, uint32_t log2bpp, uint32_t orr, uint32_t eor )
+{
+  if (orr == 0 && eor == 0) return; // No effect
+
+  uint32_t first = left << log2bpp;                     // Bits
+  uint32_t last = ((right + 1) << log2bpp) - 1;
+
+  uint32_t *l = row + (first >> 5);
+  uint32_t *r = row + (last >> 5);
+  uint32_t lmask = 0xffffffff << (first & 31);
+  uint32_t rmask = 0xffffffff >> (31 - (last & 31));
+
+  if (l == r) {
+    span_ora_eor_masked( l, lmask & rmask, orr, eor );
+    return;
+  }
+
+  if (lmask != 0xffffffff) {
+    span_ora_eor_masked( l, lmask, orr, eor );
+    l++;
+  }
+
+  if (rmask != 0xffffffff) {
+    span_ora_eor_masked( r, rmask, orr, eor );
+  }
+  else {
+    r++;
+  }
+
+  // l to r (exclusive) are whole words
+  if (orr == 0xffffffff)
+    span_store_words( l, r, ~eor );
+  else
+    span_ora_eor_words( l, r, orr, eor );
+}
@@ -0,0 +1,377 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "inkernel.h"
+#include "include/doubly_linked_list.h"
+
+// Ticker events: OS_CallAfter, OS_CallEvery and OS_RemoveTickerEvent.
+//
+// Each core has a hierarchical timing wheel, advanced by TickerV, which
+// the HAL's timer task calls on every core, once a centisecond. An event
+// is handled on the core it was registered on; the core and slot it was
+// registered from are recorded in the event.
+//
+// There are four levels of 64 slots, a slot in level n covering 64^n
+// ticks. Events due in the next 64 ticks are in the level 0 slot for the
+// tick they're due; later ones are in a higher level, and are moved down
+// (cascaded) as the time gets nearer. Registering and removing an event
+// are O(1); each tick handles one level 0 slot and, once every 64 ticks,
+// cascades one slot of the level above.
+//
+// Events are found for removal by their code and private word, in a small
+// hash table per wheel. A wheel is only locked while it's being changed,
+// not while handlers run, so handlers may register and remove events,
+// including themselves, and other cores may remove events from it.
+//
+// TickerV runs in the HAL timer task, with interrupts disabled. As with
+// the ROM, the application memory visible to a handler is that of the
+// current slot, not necessarily the one the event was registered from.
+// (Switching slot would unmap the SVC stack that TickerV is running on.)
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE (1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_HASH 64
+
+typedef struct ticker_event ticker_event;
+
+struct ticker_event {
+  uint32_t code;
+  uint32_t private_word;
+  uint32_t expires;             // The tick it's due to be handled
+  uint32_t reload;              // Zero for OS_CallAfter
+  ticker_event *next;
+  ticker_event *prev;           // Doubly linked list
+  ticker_event **bucket;        // Wheel slot it's in, zero while due
+  ticker_event *same_hash;
+  TaskSlot *slot;               // Registered from
+  uint32_t core;                // Registered on, and handled on
+  bool removed;                 // Removed while due, not yet freed
+};
+
+struct ticker_wheel {
+  uint32_t lock;
+  uint32_t now;                 // The next tick to be handled
+  uint32_t events;
+  ticker_event *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  ticker_event *hash[WHEEL_HASH];
+};
+
+dll_type( ticker_event )
+
+#ifndef HOSTED_TESTING
+static inline void run_handler( uint32_t code, uint32_t private )
+{
+  // Very trustingly, run module code
+  register uint32_t p asm ( "r12" ) = private;
+  register uint32_t c asm ( "r14" ) = code;
+  asm volatile ( "blx r14" : : "r" (p), "r" (c) : "cc", "memory" );
+}
+
+// Other cores may find the wheel as soon as it's in shared memory
+static inline void publish_wheel( ticker_wheel *wheel )
+{
+  asm ( "dmb sy" );
+  shared.kernel.ticker_wheels[workspace.core_number] = wheel;
+}
+
+static inline TaskSlot *current_slot()
+{
+  return TaskSlot_now();
+}
+
+static void __attribute__(( naked )) TickerV_handler();
+
+static void claim_TickerV()
+{
+  register uint32_t vector asm( "r0" ) = 0x1c;
+  register void *code asm( "r1" ) = TickerV_handler;
+  register uint32_t private asm( "r2" ) = 0;
+  // Private word not used
+  asm ( "svc %[swi]"
+           :
+           : [swi] "i" (OS_Claim | 0x20000)
+           , "r" (vector)
+           , "r" (code)
+           , "r" (private)
+           : "lr", "cc", "memory" );
+}
+#endif
+
+static inline ticker_event **hash_chain( ticker_wheel *wheel, uint32_t code, uint32_t private_word )
+{
+  uint32_t h = (code >> 2) ^ private_word ^ (private_word >> WHEEL_BITS);
+  return &wheel->hash[h & (WHEEL_HASH - 1)];
+}
+
+static void unhash( ticker_wheel *wheel, ticker_event *e )
+{
+  ticker_event **p = hash_chain( wheel, e->code, e->private_word );
+  while (*p != e) {
+    assert( *p != 0 );
+    p = &(*p)->same_hash;
+  }
+  *p = e->same_hash;
+}
+
+static ticker_event *take_first( ticker_event **list )
+{
+  ticker_event *e = *list;
+  *list = (e->next == e) ? 0 : e->next;
+  dll_detach_ticker_event( e );
+  return e;
+}
+
+// Into the slot for the time it's due, or as near as the wheel goes
+static void add_to_wheel( ticker_wheel *wheel, ticker_event *e )
+{
+  uint32_t when = e->expires;
+  uint32_t delta = when - wheel->now;
+  int level = 0;
+
+  if (delta >= WHEEL_RANGE) {
+    when = wheel->now + WHEEL_RANGE - 1;
+    level = WHEEL_LEVELS - 1;
+  }
+  else {
+    while (delta >= (1 << (WHEEL_BITS * (level + 1)))) level++;
+  }
+
+  ticker_event **bucket = &wheel->slots[level][(when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+
+  // At the tail, so events due on the same tick are handled in the order
+  // they were registered
+  dll_new_ticker_event( e );
+  dll_attach_ticker_event( e, bucket );
+  *bucket = e->next;
+  e->bucket = bucket;
+}
+
+static void remove_from_wheel( ticker_event *e )
+{
+  ticker_event **bucket = e->bucket;
+  if (*bucket == e) *bucket = (e->next == e) ? 0 : e->next;
+  dll_detach_ticker_event( e );
+  e->bucket = 0;
+}
+
+static void cascade( ticker_wheel *wheel, ticker_event **bucket )
+{
+  ticker_event *list = *bucket;
+  *bucket = 0;
+  while (list != 0) {
+    add_to_wheel( wheel, take_first( &list ) );
+  }
+}
+
+static void free_event( ticker_wheel *wheel, ticker_event *e )
+{
+  wheel->events--;
+  rma_free( e );
+}
+
+// Called once for each tick on the core, with nothing locked
+void ticker_wheel_tick( ticker_wheel *wheel )
+{
+  bool reclaimed = claim_lock( &wheel->lock );
+
+  uint32_t now = wheel->now;
+
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    if ((now & ((1 << (WHEEL_BITS * level)) - 1)) != 0) break;
+    cascade( wheel, &wheel->slots[level][(now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)] );
+  }
+
+  // Anything registered from here on is due after this tick, even if it
+  // goes into the same slot.
+  ticker_event *due = wheel->slots[0][now & (WHEEL_SLOTS - 1)];
+  wheel->slots[0][now & (WHEEL_SLOTS - 1)] = 0;
+  wheel->now = now + 1;
+
+  if (due != 0) {
+    ticker_event *e = due;
+    do {
+      e->bucket = 0;
+      e = e->next;
+    } while (e != due);
+  }
+
+  while (due != 0) {
+    ticker_event *e = take_first( &due );
+
+    if (!e->removed) {
+      if (!reclaimed) release_lock( &wheel->lock );
+
+      run_handler( e->code, e->private_word );
+
+      reclaimed = claim_lock( &wheel->lock );
+    }
+
+    if (e->removed) {
+      free_event( wheel, e );
+    }
+    else if (e->reload != 0) {
+      e->expires += e->reload;
+      add_to_wheel( wheel, e );
+    }
+    else {
+      unhash( wheel, e );
+      free_event( wheel, e );
+    }
+  }
+
+  if (!reclaimed) release_lock( &wheel->lock );
+}
+
+static ticker_wheel *this_cores_wheel()
+{
+  ticker_wheel *wheel = shared.kernel.ticker_wheels[workspace.core_number];
+
+  if (wheel == 0) {
+    wheel = rma_allocate( sizeof( ticker_wheel ) );
+    if (wheel == 0) return 0;
+
+    memset( wheel, 0, sizeof( ticker_wheel ) );
+
+    publish_wheel( wheel );
+    claim_TickerV();
+  }
+
+  return wheel;
+}
+
+static bool insert_ticker_event( uint32_t code, uint32_t private, uint32_t delay, uint32_t reload )
+{
+  ticker_wheel *wheel = this_cores_wheel();
+  if (wheel == 0) return false;
+
+  ticker_event *e = rma_allocate( sizeof( ticker_event ) );
+  if (e == 0) return false;
+
+  e->code = code;
+  e->private_word = private;
+  e->reload = reload;
+  e->slot = current_slot();
+  e->core = workspace.core_number;
+  e->removed = false;
+
+  if (delay == 0) delay = 1;
+
+  bool reclaimed = claim_lock( &wheel->lock );
+
+  // Handled in the delay'th tick from now
+  e->expires = wheel->now + delay - 1;
+  add_to_wheel( wheel, e );
+
+  ticker_event **chain = hash_chain( wheel, code, private );
+  e->same_hash = *chain;
+  *chain = e;
+
+  wheel->events++;
+
+  if (!reclaimed) release_lock( &wheel->lock );
+
+  return true;
+}
+
+static bool remove_from( ticker_wheel *wheel, uint32_t code, uint32_t private )
+{
+  bool reclaimed = claim_lock( &wheel->lock );
+
+  ticker_event *e = *hash_chain( wheel, code, private );
+
+  while (e != 0 && (e->code != code || e->private_word != private)) {
+    e = e->same_hash;
+  }
+
+  if (e != 0) {
+    unhash( wheel, e );
+
+    if (e->bucket != 0) {
+      remove_from_wheel( e );
+      free_event( wheel, e );
+    }
+    else {
+      // Due, or being handled, now; the core handling it frees it
+      e->removed = true;
+    }
+  }
+
+  if (!reclaimed) release_lock( &wheel->lock );
+
+  return e != 0;
+}
+
+bool do_OS_CallAfter( svc_registers *regs )
+{
+  if (!insert_ticker_event( regs->r[1], regs->r[2], regs->r[0], 0 ))
+    return error_nomem( regs );
+  return true;
+}
+
+bool do_OS_CallEvery( svc_registers *regs )
+{
+  uint32_t period = regs->r[0];
+  if (period == 0) period = 1;
+
+  if (!insert_ticker_event( regs->r[1], regs->r[2], period, period ))
+    return error_nomem( regs );
+  return true;
+}
+
+bool do_OS_RemoveTickerEvent( svc_registers *regs )
+{
+  uint32_t code = regs->r[1];
+  uint32_t private = regs->r[2];
+
+  // Most likely registered on this core
+  uint32_t core = workspace.core_number;
+
+  if (shared.kernel.ticker_wheels[core] != 0
+   && remove_from( shared.kernel.ticker_wheels[core], code, private )) {
+    return true;
+  }
+
+  for (int i = 0; i < number_of( shared.kernel.ticker_wheels ); i++) {
+    ticker_wheel *wheel = shared.kernel.ticker_wheels[i];
+    if (i != core && wheel != 0 && remove_from( wheel, code, private )) {
+      return true;
+    }
+  }
+
+  // Not an error if it's not found
+  return true;
+}
+
+#ifndef HOSTED_TESTING
+static void __attribute__(( noinline )) C_TickerV_handler()
+{
+  ticker_wheel *wheel = shared.kernel.ticker_wheels[workspace.core_number];
+
+  if (wheel != 0) {
+    ticker_wheel_tick( wheel );
+  }
+}
+
+static void __attribute__(( naked )) TickerV_handler()
+{
+  // C will ensure the callee saved registers are preserved.
+  // We don't care about the private word.
+  asm ( "push { "C_CLOBBERED", lr }" ); // Not intercepting vector, so storing return address
+  C_TickerV_handler();
+  asm ( "pop { "C_CLOBBERED", pc }" );
+}
+#endif
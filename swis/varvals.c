@@ -15,8 +15,8 @@
 
 #include "inkernel.h"
 
-#if 1
-// Use the legacy code until re-implemented GSTrans etc.
+#ifdef LEGACY_SYSTEM_VARIABLES
+// The ROM implementation, under a single lock.
 
 bool do_OS_ReadVarVal( svc_registers *regs )
 {
@@ -121,33 +121,54 @@ bool do_OS_SetVarVal( svc_registers *regs )
   return result;
 }
 
-
-
-
-
-
-
-
-
-
 #else
-// TODO
-// Does anybody really use code variables? Yes!
-// GSTrans on Set or Read of value
-// Numbers, code, macros.
-
-// This structure forms the header of the entry in the RMA; the value
-// is stored immediately after it, the name follows immediately after
-// that.
+// Native system variables, shared by all cores.
+//
+// The variables are indexed by an immutable table, which OS_SetVarVal
+// replaces as a whole (under shared.kernel.sysvars_lock) and publishes
+// with a single store. Readers never take a lock; they record that they
+// are reading (begin_reading) and use whichever table was published at
+// the time. A replaced table, and the variable it no longer includes,
+// are only freed once every core that might have been using them has
+// finished reading.
+//
+// Each table holds the variables in case-insensitive alphabetical order,
+// for enumeration and for wildcards with a literal prefix (Alias$*,
+// File$Type_*), and an open-addressed hash of the names for plain lookups.
+
+// This structure forms the header of the variable in the RMA; the value
+// is stored immediately after it, followed by a nul and the name (also
+// nul terminated).
 struct variable {
   uint32_t length:24;
   uint32_t type:8; // enum VarTypes
-  variable *next;
+  uint32_t hash;
 };
 
-static char *varname( variable *v )
+struct sysvar_table {
+  uint32_t count;
+  uint32_t hash_mask;   // Size of hash - 1
+  uint32_t *hash;       // Index into sorted + 1, or 0; follows sorted
+
+  // Only used once the table has been replaced:
+  sysvar_table *retired_next;
+  variable *retired_variable; // Not in the replacement table
+  uint32_t readers;     // Bit per core reading when the table was replaced
+  uint32_t generation[number_of( shared.kernel.sysvar_readers )];
+
+  variable *sorted[];
+};
+
+static inline char upper( char c )
+{
+  if (c >= 'a' && c <= 'z') c += 'A' - 'a';
+  return c;
+}
+
+// Names are control- or space-terminated, case insensitive, but only ASCII
+static inline char namechar( char c )
 {
-  return (void*) (((char *)(v+1)) + v->length);
+  return (c <= ' ') ? '\0' : upper( c );
 }
 
 static char *varval( variable *v )
@@ -155,324 +176,723 @@ static char *varval( variable *v )
   return (char *)(v+1);
 }
 
-static uint32_t gstrans_length( const char *string )
+static char *varname( variable *v )
 {
-  uint32_t store = (uint32_t) string;
-
-  asm goto (
-    "\n  ldr r0, %[store]"
-    "\n  mov r3, #0"
-    "\n  svc 0x25"
-    "\n  bvs %l[failed]"
-    "\n0:"
-    "\n  svc 0x26"
-    "\n  bvs %l[failed]"
-    "\n  addcc r3, r3, #1"
-    "\n  bcc 0b"
-    "\n  str r3, %[store]"
-    :
-    : [store] "m" (store)
-    : "r0", "r1", "r2", "r3", "memory", "cc", "lr"
-    : failed );
+  return varval( v ) + v->length + 1;
+}
 
-  return store;
+#ifndef HOSTED_TESTING
+static inline void sysvar_barrier()
+{
+  asm volatile ( "dmb sy" : : : "memory" );
+}
 
-failed:
-  return 0;
+static inline void synchronise_code( void const *code, uint32_t length )
+{
+  // As OS_SynchroniseCodeAreas
+  clean_cache_to_PoC();
+  clean_cache_to_PoU();
+  asm volatile ( "isb sy" );
 }
 
-static uint32_t gstrans( const char *string, char *buffer, uint32_t max )
+// The read entry of a code variable is at offset 4, the write entry at 0
+static error_block *read_code_variable( variable *v, char const **value, uint32_t *length )
 {
-  register const char *r0 asm( "r0" ) = string;
-  register char *r1 asm( "r1" ) = buffer;
-  register uint32_t r2 asm( "r2" ) = max;
-  asm ( "svc 0x27" : "=r" (r2) : "r" (r0), "r" (r1), "r" (r2) : "lr", "memory" );
-  return r2;
+  error_block *error = 0;
+  register uint32_t code asm( "r14" ) = 4 + (uint32_t) varval( v );
+  register char const *r0 asm( "r0" );
+  register uint32_t r2 asm( "r2" );
+
+  asm volatile (
+      "\n  blx r14"
+      "\n  strvs r0, %[error]"
+      : "=&r" (r0)
+      , "=&r" (r2)
+      , "+r" (code)
+      , [error] "+m" (error)
+      :
+      : "r1", "r3", "r12", "cc", "memory" );
+
+  *value = r0;
+  *length = r2;
+
+  return error;
 }
 
-static inline char upper( char c )
+static error_block *write_code_variable( variable *v, char const *value, uint32_t length )
 {
-  if (c >= 'A' && c <= 'Z') c += 'A' - 'a';
-  return c;
+  error_block *error = 0;
+  register uint32_t code asm( "r14" ) = (uint32_t) varval( v );
+  register char const *r1 asm( "r1" ) = value;
+  register uint32_t r2 asm( "r2" ) = length;
+
+  asm volatile (
+      "\n  blx r14"
+      "\n  strvs r0, %[error]"
+      : "+r" (r1)
+      , "+r" (r2)
+      , "+r" (code)
+      , [error] "+m" (error)
+      :
+      : "r0", "r3", "r12", "cc", "memory" );
+
+  return error;
 }
+#endif
 
-// Control- or space-terminated, non-null, case insensitive, but only ASCII
 static int varnamecmp( const char *left, const char *right )
 {
-  int result = 0;
+  char l;
+  char r;
+
+  do {
+    l = namechar( *left++ );
+    r = namechar( *right++ );
+  } while (l == r && l != '\0');
+
+  return l - r;
+}
 
-  while (result == 0 && *left > ' ' && *right > ' ') {
-    result = upper( *left++ ) - upper( *right++ );
+// Compares only the first length characters of name (which may be shorter)
+static int varnameprefixcmp( const char *name, const char *prefix, uint32_t length )
+{
+  for (int i = 0; i < length; i++) {
+    char n = namechar( name[i] );
+    char p = upper( prefix[i] );
+    if (n != p) return n - p;
   }
 
-  // The terminators don't have to be the same character for a match
-  return (*left <= ' ' && *right <= ' ') ? 0 : result;
+  return 0;
 }
 
-// Control- or space-terminated, non-null, case insensitive, but only ASCII
+static uint32_t varnamehash( const char *name )
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  char c;
+
+  while ('\0' != (c = namechar( *name++ ))) {
+    hash = (hash ^ (uint8_t) c) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Wildcards are: * (to match any number of characters) and # (to match a
+// single character).
 static bool varnamematch( const char *wildcarded, const char *name )
 {
-  char w;
-  char n;
-  bool match;
+  for (;;) {
+    char w = namechar( *wildcarded );
 
-  do {
-    // Wildcards are: * (to match any number of charaters) and # (to match a single character?) FIXME
-    // Will match any characters in name, until the character (or terminator) following the *
-
-    if (*wildcarded == '*') {
-      // Anything after the wildcard?
-      while (*wildcarded == '*') { wildcarded++; }
-
-      if (*wildcarded > ' ') {
-        char tofollow = upper( *wildcarded );
-
-        // Skip to the next instance of tofollow in name.
-        // If the remainder doesn't match, look for another instance.
-        while (*name > ' ') {
-          while (*name > ' ' && (tofollow != '#' && upper( *name ) != tofollow)) name++;
-          if (varnamematch( wildcarded, name ))
-            return true;
-        }
-      }
-      else {
-        // Matches to the end of name
-        while (*name > ' ') name++;
+    if (w == '*') {
+      while (*wildcarded == '*') wildcarded++;
+
+      if (namechar( *wildcarded ) == '\0') return true; // Matches the rest
+
+      // Try the remainder of the pattern at every position in the name
+      while (namechar( *name ) != '\0') {
+        if (varnamematch( wildcarded, name )) return true;
+        name++;
       }
+
+      return false;
     }
 
-    w = upper( *wildcarded++ );
-    n = upper( *name++ );
+    char n = namechar( *name );
 
-    bool wildcard_match = ((w == '#') && (n >= ' ')); // Wildcard #
-    match = wildcard_match || (n == w);
-  } while (match && *name > ' ' && *wildcarded > ' ');
+    if (w == '\0' || n == '\0') return w == n;
+    if (w != '#' && w != n) return false;
 
-  return (n == w || (*wildcarded <= ' ' && *name <= ' '));
+    wildcarded++;
+    name++;
+  }
 }
 
-bool do_OS_ReadVarVal( svc_registers *regs )
+// Readers
+
+static inline sysvar_table *begin_reading()
 {
-  static error_block buffer_overflow = { 0x1e4, "Buffer overflow" };
-  static error_block not_found = { 0x124, "System variable not found" }; // FIXME
+  // Only this core writes its entry; a read on this core that interrupts
+  // this one leaves the depth as it found it.
+  assert( workspace.core_number < number_of( shared.kernel.sysvar_readers ) );
+  shared.kernel.sysvar_readers[workspace.core_number].depth++;
+  sysvar_barrier(); // Visible to writers before the table is read
 
-  char *wildcarded = (void*) regs->r[0];
-  variable *v = workspace.kernel.variables;
-  char *buffer = (void*) regs->r[1];
-  uint32_t buffer_size = regs->r[2];
+  return shared.kernel.sysvars;
+}
 
-  Write0( wildcarded );
-  WriteS( " " );
+static inline void end_reading()
+{
+  sysvar_barrier(); // Finished with the table before saying so
 
-  if (regs->r[3] != 0) {
-    // Skip over previously matched variable, don't assume we've been passed a real pointer.
-    while (v != 0 && (uint32_t) varname( v ) != regs->r[3]) {
-      v = v->next;
-    }
-    if (v != 0)
-      v = v->next;
+  if (0 == --shared.kernel.sysvar_readers[workspace.core_number].depth) {
+    shared.kernel.sysvar_readers[workspace.core_number].generation++;
   }
+}
 
-  while (v != 0 && !varnamematch( wildcarded, varname( v ) )) {
-    v = v->next;
+// Index of the named variable in table->sorted, or table->count
+static uint32_t find_index( sysvar_table *table, const char *name )
+{
+  uint32_t hash = varnamehash( name );
+  uint32_t i = hash & table->hash_mask;
+  uint32_t index;
+
+  while (0 != (index = table->hash[i])) {
+    variable *v = table->sorted[index - 1];
+    if (v->hash == hash && 0 == varnamecmp( varname( v ), name )) return index - 1;
+    i = (i + 1) & table->hash_mask;
   }
 
-  if (v == 0) {
-WriteS( "not found" ); NewLine;
-    regs->r[0] = (uint32_t) &not_found;
-    regs->r[2] = 0; // Length
-    regs->r[3] = 0; // Name
+  return table->count;
+}
+
+static variable *find_variable( sysvar_table *table, const char *name )
+{
+  if (table == 0) return 0;
 
-    return false;
+  uint32_t i = find_index( table, name );
+
+  return (i == table->count) ? 0 : table->sorted[i];
+}
+
+// Index of the first variable in the table whose name starts with prefix
+// (or would follow it, if there are none).
+static uint32_t first_with_prefix( sysvar_table *table, const char *prefix, uint32_t length )
+{
+  uint32_t low = 0;
+  uint32_t high = table->count;
+
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    if (varnameprefixcmp( varname( table->sorted[mid] ), prefix, length ) < 0)
+      low = mid + 1;
+    else
+      high = mid;
   }
 
-  regs->r[3] = (uint32_t) varname( v );
+  return low;
+}
 
-  bool size_request = (0 != (buffer_size & (1 << 31)));
+// The first variable matching the (possibly wildcarded) name, after the
+// one whose name is at context, if context is non-zero.
+static variable *find_match( sysvar_table *table, const char *wildcarded, uint32_t context )
+{
+  if (table == 0) return 0;
 
-  switch (v->type) {
-  case VarType_String:
-    WriteS( "String: " );
-    regs->r[2] = v->length - 1; // Stored with a nul terminator
-    if (!size_request) {
-      memcpy( buffer, varval( v ), v->length-1 );
+  uint32_t prefix = 0;
+  while (wildcarded[prefix] > ' '
+      && wildcarded[prefix] != '*'
+      && wildcarded[prefix] != '#') {
+    prefix++;
+  }
+
+  if (wildcarded[prefix] <= ' ') {
+    // Not wildcarded, there can only be one match
+    variable *v = find_variable( table, wildcarded );
+    if (v != 0 && context == (uint32_t) varname( v )) v = 0;
+    return v;
+  }
+
+  uint32_t i;
+
+  if (context == 0) {
+    // Only the variables starting with the literal part need be checked
+    i = first_with_prefix( table, wildcarded, prefix );
+  }
+  else {
+    // The context is the name of the previous match; as in the ROM, it's
+    // the caller's responsibility that it's a value returned earlier. If
+    // that variable has since been deleted, the enumeration ends.
+    i = find_index( table, (void*) context );
+
+    if (i == table->count
+     || context != (uint32_t) varname( table->sorted[i] )) return 0;
+
+    i++;
+  }
+
+  while (i < table->count
+      && 0 == varnameprefixcmp( varname( table->sorted[i] ), wildcarded, prefix )) {
+    variable *v = table->sorted[i++];
+    if (varnamematch( wildcarded, varname( v ) )) return v;
+  }
+
+  return 0;
+}
+
+static uint32_t signed_decimal( int32_t n, char *buffer )
+{
+  char digits[12];
+  uint32_t u = (n < 0) ? -n : n;
+  int d = 0;
+  uint32_t length = 0;
+
+  do {
+    digits[d++] = '0' + (u % 10);
+    u = u / 10;
+  } while (u != 0);
+
+  if (n < 0) buffer[length++] = '-';
+  while (d > 0) buffer[length++] = digits[--d];
+
+  return length;
+}
+
+// Returns a nul terminated, GSTrans'd copy of the string in the RMA, or
+// null with an error in regs->r[0].
+static char *gstrans_to_rma( svc_registers *regs, const char *string, uint32_t *length )
+{
+  uint32_t size = 256;
+
+  for (;;) {
+    char *buffer = rma_allocate( size );
+    if (buffer == 0) {
+      error_nomem( regs );
+      return 0;
     }
-    break;
+
+    svc_registers gsregs = { .spsr = 0 };
+    gsregs.r[0] = (uint32_t) string;
+    gsregs.r[1] = (uint32_t) buffer;
+    gsregs.r[2] = size - 1; // GSTrans stores the terminator after the result
+
+    if (!do_OS_GSTrans( &gsregs )) {
+      rma_free( buffer );
+      regs->r[0] = gsregs.r[0];
+      return 0;
+    }
+
+    if (0 == (gsregs.spsr & CF)) {
+      *length = gsregs.r[2];
+      buffer[*length] = '\0';
+      return buffer;
+    }
+
+    rma_free( buffer );
+    size = size * 2;
+  }
+}
+
+static bool read_value( svc_registers *regs, variable *v )
+{
+  static error_block buffer_overflow = { 0x1e4, "Buffer overflow" };
+
+  bool size_request = (0 != (regs->r[2] & (1 << 31)));
+  uint32_t size = size_request ? 0 : regs->r[2];
+  bool expand = (regs->r[4] == 3);
+
+  char const *value = varval( v );
+  uint32_t length = v->length;
+  uint32_t type = v->type;
+  char number[12];
+  char *expanded = 0;
+
+  switch (v->type) {
   case VarType_Number:
-    WriteS( "Number" ); NewLine;
-    if (regs->r[4] == 3) return Kernel_Error_UnimplementedSWI( regs );
-    if (!size_request) {
-      regs->r[2] = 4;
-      *(uint32_t*) buffer = *(uint32_t*) varval( v );
+    if (expand) {
+      length = signed_decimal( *(int32_t*) value, number );
+      value = number;
+      type = VarType_String;
     }
     break;
-  case VarType_LiteralString:
-    WriteS( "Literal string: " );
-    regs->r[2] = v->length-1;
-    if (!size_request) {
-      memcpy( buffer, varval( v ), v->length-1 );
+  case VarType_Macro:
+    if (expand) {
+      expanded = gstrans_to_rma( regs, value, &length );
+      if (expanded == 0) return false;
+      value = expanded;
+      type = VarType_String;
     }
     break;
-  case VarType_Macro:
+  case VarType_Code:
     {
-    WriteS( "Macro: " );
-    uint32_t length = gstrans_length( varval( v ) );
-    regs->r[2] = length;
-    if (!size_request) {
-      gstrans( buffer, varval( v ), length );
-    }
+      error_block *error = read_code_variable( v, &value, &length );
+      if (error != 0) {
+        regs->r[0] = (uint32_t) error;
+        return false;
+      }
+      type = VarType_String;
     }
     break;
-  case VarType_Expanded:
-  case VarType_Code:
-    return Kernel_Error_UnimplementedSWI( regs );
+  default:
+    type = VarType_String;
+    break;
   }
 
-  if (size_request) {
-    // length check
-    uint32_t l = regs->r[2];
-WriteS( "length " ); WriteNum( l ); NewLine;
+  regs->r[3] = (uint32_t) varname( v );
+
+  bool result = (length <= size);
+
+  if (result) {
+    memcpy( (void*) regs->r[1], value, length );
+    regs->r[2] = length;
+    regs->r[4] = type;
+  }
+  else {
     regs->r[0] = (uint32_t) &buffer_overflow;
-    regs->r[2] = ~regs->r[2];
-    return false;
+    regs->r[2] = ~length;
   }
 
-NewLine; Write0( regs->r[1] ); NewLine;
-asm ( "svc 0xff" : : : "cc", "lr" );
+  if (expanded != 0) rma_free( expanded );
 
-  return true;
+  return result;
 }
 
-bool do_OS_SetVarVal( svc_registers *regs )
+bool do_OS_ReadVarVal( svc_registers *regs )
 {
-  if (regs->r[2] < 0) { // Delete
-WriteS( "Deleting " ); Write0( regs->r[0] ); NewLine;
-
-    // Alphabetical order
-
-    variable **p = &workspace.kernel.variables;
-    int cmp = 0;
-    while (cmp <= 0 && (*p) != 0) {
-      cmp = varnamecmp( varname( *p ), (const char *) regs->r[0] );
-      if (cmp == 0) {
-        // Matched, delete it.
-        variable *v = *p;
-        *p = v->next; // Removed from list
-        rma_free( v );
-        return true;
-      }
-      p = &((*p)->next);
-    }
-    return true; // Should be an error, perhaps?
+  static error_block not_found = { 0x124, "System variable not found" };
+
+  sysvar_table *table = begin_reading();
+
+  variable *v = find_match( table, (void*) regs->r[0], regs->r[3] );
+
+#ifdef DEBUG__SHOW_SYSTEM_VARIABLE
+  WriteS( "Reading " ); Write0( regs->r[0] );
+  if (v == 0) WriteS( " (not found)" );
+  NewLine;
+#endif
+
+  bool result;
+
+  if (v == 0) {
+    regs->r[0] = (uint32_t) &not_found;
+    regs->r[2] = 0; // Length
+    regs->r[3] = 0; // Name
+    result = false;
   }
   else {
-// Question: Should the variables be shared among the cores, or not?
-// Answer: No.
-// If so, we need to lock them. Also if we go multi-threading
-// But beware of GSTrans needing to read strings to expand values being
-// inserted or removed. I expect reading the old value of the variable
-// being read is quite common, like PATH=$PATH:/newpath in Unix.
-
-/*
-svc_registers before;
-svc_registers after;
-
-register svc_registers *lr asm( "lr" ) = &before;
-asm ( "stm lr, { r0-r12 }" : : "r" (lr) );
-*/
-WriteS( "Setting " ); Write0( regs->r[0] ); WriteS( " to \"" ); 
-
-    const char *name = (void*) regs->r[0];
-    uint32_t name_length = 0;
-
-    while (name[name_length] >= ' ') name_length++;
-    name_length++; // For nul terminator
-
-    const char *value = (void*) regs->r[1];
-    uint32_t length = regs->r[2];
-
-    enum VarTypes type = regs->r[4];
-
-    if (length == 0 && (type == VarType_String || type == VarType_LiteralString)) {
-WriteS( "*" ); // Indicate unknown length, undocumented feature
-      // This is not a documented feature, afaics, but it is used by parts of the OS
-      while (value[length] != '\0' && value[length] != 10 && value[length] != 13) {
-        length++;
-      }
+    result = read_value( regs, v );
+  }
+
+  end_reading();
+
+  return result;
+}
+
+// Writers
+
+static sysvar_table *allocate_table( uint32_t count )
+{
+  uint32_t hash_size = 16;
+  while (hash_size < 2 * (count + 1)) hash_size = hash_size * 2;
+
+  sysvar_table *table = rma_allocate( sizeof( sysvar_table )
+                                    + count * sizeof( variable * )
+                                    + hash_size * sizeof( uint32_t ) );
+  if (table == 0) return 0;
+
+  table->count = count;
+  table->hash_mask = hash_size - 1;
+  table->hash = (void*) &table->sorted[count];
+  table->retired_next = 0;
+  table->retired_variable = 0;
+  table->readers = 0;
+  memset( table->hash, 0, hash_size * sizeof( uint32_t ) );
+
+  return table;
+}
+
+// A copy of the old table (which may be null), with add inserted in
+// alphabetical order and without drop (either may be null).
+static sysvar_table *copy_table( sysvar_table *old, variable *add, variable *drop )
+{
+  uint32_t count = (old == 0) ? 0 : old->count;
+  if (add != 0) count++;
+  if (drop != 0) count--;
+
+  sysvar_table *table = allocate_table( count );
+  if (table == 0) return 0;
+
+  uint32_t n = 0;
+  bool added = (add == 0);
+
+  for (int i = 0; old != 0 && i < old->count; i++) {
+    variable *v = old->sorted[i];
+    if (!added && varnamecmp( varname( add ), varname( v ) ) < 0) {
+      table->sorted[n++] = add;
+      added = true;
     }
+    if (v != drop) table->sorted[n++] = v;
+  }
+  if (!added) table->sorted[n++] = add;
+
+  assert( n == count );
+
+  for (int i = 0; i < count; i++) {
+    variable *v = table->sorted[i];
+    uint32_t h = v->hash & table->hash_mask;
+    while (table->hash[h] != 0) h = (h + 1) & table->hash_mask;
+    table->hash[h] = i + 1;
+  }
 
-if (type == VarType_Number) { WriteNum( *(uint32_t*) regs->r[1] ); }
-else { WriteS( "\"" ); Write0( regs->r[1] ); WriteS( "\"" ); WriteNum( length ); }
-NewLine; 
+  return table;
+}
 
-    uint32_t store_length = length;
+static bool still_being_read( sysvar_table *table )
+{
+  for (int c = 0; c < number_of( shared.kernel.sysvar_readers ); c++) {
+    if (0 != (table->readers & (1 << c))
+     && 0 != shared.kernel.sysvar_readers[c].depth
+     && table->generation[c] == shared.kernel.sysvar_readers[c].generation) {
+      return true;
+    }
+  }
 
-    if (type == VarType_String) {
-      store_length = gstrans_length( value ) + 1;
+  return false;
+}
+
+// Called with the lock held.
+static void publish( sysvar_table *table, variable *dropped )
+{
+  sysvar_table *old = shared.kernel.sysvars;
+
+  sysvar_barrier(); // Table (and variables) complete before publishing
+  shared.kernel.sysvars = table;
+  sysvar_barrier(); // Published before looking for readers of the old one
+
+  if (old != 0) {
+    old->retired_variable = dropped;
+    for (int c = 0; c < number_of( shared.kernel.sysvar_readers ); c++) {
+      if (0 != shared.kernel.sysvar_readers[c].depth) {
+        old->readers |= (1 << c);
+        old->generation[c] = shared.kernel.sysvar_readers[c].generation;
+      }
     }
-    else if (type == VarType_Number) {
-      store_length = 4;
+    old->retired_next = shared.kernel.retired_sysvars;
+    shared.kernel.retired_sysvars = old;
+  }
+
+  // Free anything no longer visible to any reader
+  sysvar_table **p = &shared.kernel.retired_sysvars;
+  while (*p != 0) {
+    sysvar_table *t = *p;
+    if (still_being_read( t )) {
+      p = &t->retired_next;
     }
     else {
-      store_length ++; // Store a terminator, so that the value can easily be passed to gstrans or strcpy
+      *p = t->retired_next;
+      if (t->retired_variable != 0) rma_free( t->retired_variable );
+      rma_free( t );
     }
+  }
+}
 
-    variable *v;
-    do {
-      v = rma_allocate( sizeof( variable ) + ((store_length + name_length +3)&~3) );
-if (v == 0) {
-  WriteS( "No space in RMA" ); for (;;) { asm ( "svc 0xff\n  wfi" : : : "cc", "lr" ); }
-}
-    } while (v == 0);
-    v->type = type;
-
-NewLine; WriteS( "Store length: " ); WriteNum( store_length ); NewLine;
-    v->length = store_length;
-
-    switch (type) {
-    case VarType_String:
-      {
-        uint32_t wrote = gstrans( value, varval( v ), store_length );
-        if (wrote != store_length-1) asm ( "bkpt 3" );
-        varval( v )[store_length] = '\0';
-WriteS( "Wrote: " ); Write0( varval( v ) ); NewLine; WriteN( varval( v ), v->length - 1 );
-      }
-      break;
-    case VarType_Number:
-      *(uint32_t*) varval( v ) = regs->r[1];
-      break;
-    case VarType_LiteralString:
-    case VarType_Macro:
-      memcpy( varval( v ), value, length );
-      varval( v )[length] = '\0';
-      break;
-    case VarType_Expanded:
-    case VarType_Code:
-      return Kernel_Error_UnimplementedSWI( regs );
-      break;
+static variable *allocate_variable( const char *name, uint32_t length, uint32_t type )
+{
+  uint32_t name_length = 0;
+  while (name[name_length] > ' ') name_length++;
+
+  variable *v = rma_allocate( sizeof( variable ) + length + name_length + 2 );
+  if (v == 0) return 0;
+
+  v->length = length;
+  v->type = type;
+  v->hash = varnamehash( name );
+
+  varval( v )[length] = '\0';
+  memcpy( varname( v ), name, name_length );
+  varname( v )[name_length] = '\0';
+
+  return v;
+}
+
+// A nul terminated copy, for GSTrans or EvaluateExpression
+static char *terminated_copy( svc_registers *regs, const char *value, uint32_t length )
+{
+  char *copy = rma_allocate( length + 1 );
+  if (copy == 0) {
+    error_nomem( regs );
+    return 0;
+  }
+  memcpy( copy, value, length );
+  copy[length] = '\0';
+  return copy;
+}
+
+// Creates the new variable without holding the lock; GSTrans and
+// EvaluateExpression may need to read other variables.
+static variable *new_variable( svc_registers *regs )
+{
+  const char *name = (void*) regs->r[0];
+  const char *value = (void*) regs->r[1];
+  uint32_t length = regs->r[2];
+  uint32_t type = regs->r[4];
+
+  if (length == 0 && type != VarType_Number && type != VarType_Code) {
+    // This is not a documented feature, afaics, but it is used by parts of the OS
+    while (value[length] != '\0' && value[length] != 10 && value[length] != 13) {
+      length++;
+    }
+  }
+
+  variable *v = 0;
+
+  switch (type) {
+  case VarType_String:
+    {
+      char *copy = terminated_copy( regs, value, length );
+      if (copy == 0) return 0;
+
+      char *translated = gstrans_to_rma( regs, copy, &length );
+      rma_free( copy );
+      if (translated == 0) return 0;
+
+      v = allocate_variable( name, length, VarType_String );
+      if (v != 0) memcpy( varval( v ), translated, length );
+      rma_free( translated );
     }
+    break;
+  case VarType_Number:
+    v = allocate_variable( name, 4, VarType_Number );
+    if (v != 0) memcpy( varval( v ), value, 4 );
+    break;
+  case VarType_LiteralString:
+  case VarType_Macro:
+  case VarType_Code:
+    v = allocate_variable( name, length, (type == VarType_LiteralString) ? VarType_String : type );
+    if (v != 0) memcpy( varval( v ), value, length );
+    if (v != 0 && type == VarType_Code) synchronise_code( varval( v ), length );
+    break;
+  case VarType_Expanded:
+    {
+      char *copy = terminated_copy( regs, value, length );
+      if (copy == 0) return 0;
+
+      uint32_t size = 256;
+      for (;;) {
+        char *buffer = rma_allocate( size );
+        if (buffer == 0) {
+          rma_free( copy );
+          error_nomem( regs );
+          return 0;
+        }
 
-    memcpy( varname( v ), name, name_length );
-    varname( v )[name_length] = '\0';
+        svc_registers evregs = { .spsr = 0 };
+        evregs.r[0] = (uint32_t) copy;
+        evregs.r[1] = (uint32_t) buffer;
+        evregs.r[2] = size;
+
+        if (do_OS_EvaluateExpression( &evregs )) {
+          if (evregs.r[1] == 0) {
+            v = allocate_variable( name, 4, VarType_Number );
+            if (v != 0) memcpy( varval( v ), &evregs.r[2], 4 );
+          }
+          else {
+            v = allocate_variable( name, evregs.r[2], VarType_String );
+            if (v != 0) memcpy( varval( v ), buffer, evregs.r[2] );
+          }
+          rma_free( buffer );
+          break;
+        }
 
-    variable **p = &workspace.kernel.variables;
+        rma_free( buffer );
 
-    // Alphabetical order
-    int cmp;
-    while ((*p) != 0 && (cmp = varnamecmp( varname( *p ), varname( v ) )) < 0) {
-NewLine; Write0( varname( *p ) ); Space; WriteNum( (*p)->length-1 ); Space; WriteN( varval( *p ), (*p)->length - 1 );
-      p = &((*p)->next);
+        error_block *error = (void*) evregs.r[0];
+        if (error->code != 0x1e4) { // Not buffer overflow
+          rma_free( copy );
+          regs->r[0] = evregs.r[0];
+          return 0;
+        }
+
+        size = size * 2;
+      }
+
+      rma_free( copy );
+    }
+    break;
+  default:
+    {
+      static error_block bad_type = { 666, "Bad variable type" };
+      regs->r[0] = (uint32_t) &bad_type;
+      return 0;
     }
-    if (0 == cmp) {
-      v->next = (*p)->next;
-      rma_free( *p );
+  }
+
+  if (v == 0) error_nomem( regs );
+
+  return v;
+}
+
+static bool delete_variable( svc_registers *regs )
+{
+  static error_block not_found = { 0x124, "System variable not found" };
+
+  bool result = true;
+
+  bool reclaimed = claim_lock( &shared.kernel.sysvars_lock );
+
+  sysvar_table *old = shared.kernel.sysvars;
+  variable *v = find_match( old, (void*) regs->r[0], 0 );
+
+  if (v == 0) {
+    regs->r[0] = (uint32_t) &not_found;
+    result = false;
+  }
+  else {
+    sysvar_table *table = copy_table( old, 0, v );
+    if (table == 0) {
+      result = error_nomem( regs );
     }
     else {
-      v->next = *p;
+      publish( table, v );
     }
-    *p = v;
   }
 
+  if (!reclaimed) release_lock( &shared.kernel.sysvars_lock );
+
+  return result;
+}
+
+bool do_OS_SetVarVal( svc_registers *regs )
+{
+#ifdef DEBUG__SHOW_SYSTEM_VARIABLE
+  WriteS( "Setting " ); Write0( regs->r[0] ); WriteS( ", type " ); WriteNum( regs->r[4] ); NewLine;
+#endif
+
+  if (0 != (regs->r[2] & (1 << 31))) {
+    return delete_variable( regs );
+  }
+
+  if (regs->r[4] != VarType_Code) {
+    // Code variables deal with their own values
+    sysvar_table *table = begin_reading();
+    variable *existing = find_variable( table, (void*) regs->r[0] );
+    error_block *error = 0;
+    bool code = (existing != 0 && existing->type == VarType_Code);
+    if (code) {
+      error = write_code_variable( existing, (void*) regs->r[1], regs->r[2] );
+    }
+    end_reading();
+
+    if (error != 0) {
+      regs->r[0] = (uint32_t) error;
+      return false;
+    }
+    if (code) return true;
+  }
+
+  variable *v = new_variable( regs );
+  if (v == 0) return false;
+
+  bool reclaimed = claim_lock( &shared.kernel.sysvars_lock );
+
+  sysvar_table *old = shared.kernel.sysvars;
+  variable *replaced = find_variable( old, varname( v ) );
+  sysvar_table *table = copy_table( old, v, replaced );
+
+  if (table != 0) {
+    publish( table, replaced );
+  }
+
+  if (!reclaimed) release_lock( &shared.kernel.sysvars_lock );
+
+  if (table == 0) {
+    rma_free( v );
+    return error_nomem( regs );
+  }
+
+  if (regs->r[4] == VarType_Expanded) regs->r[4] = v->type;
+
   return true;
 }
 
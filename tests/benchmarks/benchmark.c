@@ -0,0 +1,291 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput and latency of the kernel's shared data structures, built
+// from the real headers, with 1 to N threads (see harness.h):
+//
+//   claim_lock:      claim and release one lock, around a shared counter
+//   dll:             attach and detach on a list private to each thread
+//                    (the cost without any sharing)
+//   mpsafe queue:    add to the tail of a shared list, take from the head
+//   callbacks pool:  callback_new and release_callback, as OS_Claim and
+//                    transient callbacks use them
+//   free pages:      the buddy allocator, under a lock, as
+//                    Kernel_allocate_pages and Kernel_free_pages use it
+//
+// Every benchmark checks that the structure is intact afterwards.
+//
+// Run it before and after changing a primitive, on the same machine, with
+// nothing else running; the numbers are only comparable with each other.
+//
+// gcc -O2 -I ../.. -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast benchmark.c -o benchmark -pthread && ./benchmark [max threads] [operations per thread]
+
+#include "harness.h"
+
+#include "include/doubly_linked_list.h"
+#include "include/mpsafe_dll.h"
+#include "include/callbacks.h"
+
+#include <assert.h>
+#include "memory/simple/memory_manager.h"
+#include "memory/simple/buddy.h"
+
+// claim_lock
+
+static uint32_t *lock;
+static uint32_t *counter;
+static uint32_t operations;
+
+static void lock_setup( int threads )
+{
+  if (lock == 0) {
+    lock = low_allocate( sizeof( uint32_t ) );
+    counter = low_allocate( sizeof( uint32_t ) );
+  }
+  *lock = 0;
+  *counter = 0;
+}
+
+static void lock_operation( uint32_t core, uint32_t i )
+{
+  bool reclaimed = claim_lock( lock );
+  if (reclaimed) fail( "Reclaimed", core );
+  (*counter)++;
+  release_lock( lock );
+}
+
+static void lock_check( int threads )
+{
+  if (*counter != threads * operations) fail( "Increments lost", *counter );
+}
+
+// dll and mpsafe queue
+
+typedef struct node node;
+
+struct node {
+  node *next;
+  node *prev;
+  uint32_t owner;
+};
+
+MPSAFE_DLL_TYPE( node )
+
+#define NODES_PER_THREAD 16
+
+static node *nodes;
+static node *private_lists[MAX_THREADS];
+static node **shared_queue;
+static node *in_hand[MAX_THREADS];      // Taken from the queue
+
+static void nodes_setup( int threads )
+{
+  if (nodes == 0) {
+    nodes = low_allocate( MAX_THREADS * NODES_PER_THREAD * sizeof( node ) );
+    shared_queue = low_allocate( sizeof( node * ) );
+  }
+  *shared_queue = 0;
+  for (int t = 0; t < threads; t++) {
+    private_lists[t] = 0;
+    for (int i = 0; i < NODES_PER_THREAD; i++) {
+      node *n = &nodes[t * NODES_PER_THREAD + i];
+      dll_new_node( n );
+      n->owner = t;
+      dll_attach_node( n, &private_lists[t] );
+    }
+    in_hand[t] = 0;
+  }
+}
+
+static void dll_operation( uint32_t core, uint32_t i )
+{
+  node *n = private_lists[core];
+  private_lists[core] = n->next;
+  dll_detach_node( n );
+  dll_attach_node( n, &private_lists[core] );
+  private_lists[core] = private_lists[core]->next; // At the tail
+}
+
+static uint32_t list_length( node *list )
+{
+  uint32_t count = 0;
+  node *n = list;
+  if (n != 0) {
+    do {
+      if (n->next->prev != n) fail( "List broken", count );
+      count++;
+      n = n->next;
+    } while (n != list && count <= MAX_THREADS * NODES_PER_THREAD);
+  }
+  return count;
+}
+
+static void dll_check( int threads )
+{
+  for (int t = 0; t < threads; t++) {
+    if (list_length( private_lists[t] ) != NODES_PER_THREAD) fail( "Nodes lost", t );
+  }
+}
+
+static void queue_operation( uint32_t core, uint32_t i )
+{
+  // Pass on the node taken last time (or one of the thread's own)
+  node *n = in_hand[core];
+  if (n == 0) {
+    n = &nodes[core * NODES_PER_THREAD];
+    dll_new_node( n );
+  }
+  mpsafe_insert_node_at_tail( shared_queue, n );
+  in_hand[core] = mpsafe_detach_node_at_head( shared_queue );
+  if (in_hand[core] == 0) fail( "Queue empty", core );
+}
+
+static void queue_check( int threads )
+{
+  if (list_length( *shared_queue ) != 0) fail( "Queue not empty", list_length( *shared_queue ) );
+  for (int t = 0; t < threads; t++) {
+    if (in_hand[t] == 0 || in_hand[t]->next != in_hand[t]) fail( "Node lost", t );
+    for (int u = 0; u < t; u++) {
+      if (in_hand[t] == in_hand[u]) fail( "Node taken twice", t );
+    }
+  }
+}
+
+// callbacks pool
+
+static callback **pool;
+static callback *held[MAX_THREADS][4];
+
+static void pool_setup( int threads )
+{
+  if (pool == 0) {
+    pool = low_allocate( sizeof( callback * ) );
+  }
+  memset( held, 0, sizeof( held ) );
+}
+
+static void pool_operation( uint32_t core, uint32_t i )
+{
+  // Keep a few, like transient callbacks waiting to be run
+  callback **slot = &held[core][i % number_of( held[0] )];
+  if (*slot != 0) release_callback( pool, *slot );
+  *slot = callback_new( pool );
+  if (*slot == 0) fail( "No callback", core );
+  (*slot)->code = core;
+}
+
+static void pool_check( int threads )
+{
+  for (int t = 0; t < threads; t++) {
+    for (int i = 0; i < number_of( held[0] ); i++) {
+      if (held[t][i] == 0 || held[t][i]->code != t) fail( "Callback shared", t );
+      release_callback( pool, held[t][i] );
+    }
+  }
+  callback *c = *pool;
+  uint32_t count = 0;
+  do {
+    if (c->next->prev != c) fail( "Pool broken", count );
+    count++;
+    c = c->next;
+  } while (c != *pool);
+  if (count % 64 != 0) fail( "Callbacks lost", count );
+}
+
+// Free pages
+
+#define PAGES (256 << 8) // 256MiB
+
+static buddy_allocator *free_pages;
+static uint32_t *free_pages_lock;
+static struct { uint32_t page; uint32_t count; } live[MAX_THREADS][16];
+static uint8_t owner[PAGES];
+
+static void pages_setup( int threads )
+{
+  if (free_pages == 0) {
+    free_pages = low_allocate( sizeof( buddy_allocator ) );
+    free_pages_lock = low_allocate( sizeof( uint32_t ) );
+  }
+  static uint32_t *storage = 0;
+  uint32_t words = buddy_storage_words( PAGES );
+  if (storage == 0) storage = malloc( words * sizeof( uint32_t ) );
+  memset( storage, 0, words * sizeof( uint32_t ) );
+  buddy_initialise( free_pages, storage, PAGES );
+  buddy_add_range( free_pages, 0, PAGES );
+  memset( live, 0, sizeof( live ) );
+  memset( owner, 0, sizeof( owner ) );
+  *free_pages_lock = 0;
+}
+
+static void pages_operation( uint32_t core, uint32_t i )
+{
+  // Replace one of the thread's allocations with one of a different size
+  typeof( live[0][0] ) *a = &live[core][(i * 7) % number_of( live[0] )];
+
+  claim_lock( free_pages_lock );
+
+  if (a->count != 0) {
+    for (int p = 0; p < a->count; p++) {
+      if (owner[a->page + p] != core + 1) fail( "Page owned by someone else", a->page + p );
+      owner[a->page + p] = 0;
+    }
+    buddy_free_range( free_pages, a->page, a->count );
+  }
+
+  a->count = 1 + ((i * 2654435761u) >> 28); // 1 to 16 pages
+  a->page = buddy_allocate( free_pages, a->count, 1 );
+  if (a->page == 0xffffffff) fail( "Out of pages", core );
+
+  for (int p = 0; p < a->count; p++) {
+    if (owner[a->page + p] != 0) fail( "Page allocated twice", a->page + p );
+    owner[a->page + p] = core + 1;
+  }
+
+  release_lock( free_pages_lock );
+}
+
+static void pages_check( int threads )
+{
+  for (int t = 0; t < threads; t++) {
+    for (int i = 0; i < number_of( live[0] ); i++) {
+      if (live[t][i].count != 0) buddy_free_range( free_pages, live[t][i].page, live[t][i].count );
+    }
+  }
+  if (buddy_allocate( free_pages, PAGES, PAGES ) != 0) fail( "Pages not merged back", 0 );
+}
+
+static const benchmark benchmarks[] = {
+  { "claim_lock", lock_setup, lock_operation, lock_check },
+  { "dll", nodes_setup, dll_operation, dll_check },
+  { "mpsafe queue", nodes_setup, queue_operation, queue_check },
+  { "callbacks pool", pool_setup, pool_operation, pool_check },
+  { "free pages", pages_setup, pages_operation, pages_check } };
+
+int main( int argc, char const *argv[] )
+{
+  int max_threads = (argc > 1) ? atoi( argv[1] ) : 4;
+  operations = (argc > 2) ? atoi( argv[2] ) : 100000;
+
+  if (max_threads < 1 || max_threads > MAX_THREADS) fail( "Threads, 1 to", MAX_THREADS );
+
+  low_allocate( 0 ); // Before there are any threads
+
+  for (int i = 0; i < number_of( benchmarks ); i++) {
+    benchmark_report( &benchmarks[i], max_threads, operations );
+  }
+
+  return 0;
+}
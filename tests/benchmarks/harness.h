@@ -0,0 +1,242 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Linux-hosted harness for benchmarking the kernel's data structures and
+// concurrency primitives, with a pthread standing in for each core.
+//
+// Provides what the kernel headers expect of the processor:
+// change_word_if_equal, claim_lock and release_lock (the real ticket
+// locks from include/ticket_lock.h), and the wfe/sev hooks used under
+// HOSTED_TESTING. Waiting for an event yields the processor, since there
+// may well be more threads than host cores.
+//
+// The kernel stores pointers in 32-bit words, so everything those
+// pointers refer to has to be in the bottom 4GB of the address space;
+// low_allocate provides memory from there (MAP_32BIT, x86-64).
+//
+// A benchmark is a function called by every thread, once per operation,
+// after an optional set-up function; each operation is timed, giving
+// operations per second for all the threads together, and percentiles
+// of the latency of a single operation (which includes the ~20ns cost of
+// reading the clock).
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#define number_of( arr ) (sizeof( arr ) / sizeof( arr[0] ))
+
+#define HOSTED_TESTING
+
+#define MAX_THREADS 16
+
+static __thread uint32_t core_number;
+
+uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t to )
+{
+  return __sync_val_compare_and_swap( word, from, to );
+}
+
+// include/mpsafe_dll.h
+void mpsafe_wait_for_event()
+{
+  sched_yield();
+}
+
+void mpsafe_list_released()
+{
+}
+
+void mpsafe_delay( uint32_t n )
+{
+  while (n-- > 0) asm volatile ( "" : : : "memory" );
+}
+
+// include/ticket_lock.h
+void ticket_lock_wait()
+{
+  sched_yield();
+}
+
+void ticket_lock_released()
+{
+}
+
+void ticket_lock_barrier()
+{
+  __sync_synchronize();
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t ticket_lock_now()
+{
+  return (uint32_t) now_ns();
+}
+
+#include "include/ticket_lock.h"
+
+bool claim_lock( uint32_t volatile *lock )
+{
+  uint32_t waited;
+  return ticket_lock_claim( lock, core_number, &waited );
+}
+
+void release_lock( uint32_t volatile *lock )
+{
+  ticket_lock_release( lock );
+}
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static char *low_memory;
+static uint32_t low_memory_used;
+static const uint32_t low_memory_size = 64 << 20;
+
+// Never freed
+static void *low_allocate( uint32_t size )
+{
+  if (low_memory == 0) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+    void *m = mmap( 0, low_memory_size, PROT_READ | PROT_WRITE, flags, -1, 0 );
+    if (m == MAP_FAILED || (uint64_t) (uintptr_t) m >> 32 != 0) fail( "No low memory", 0 );
+    // Only one thread should get here; call low_allocate before starting threads
+    low_memory = m;
+  }
+
+  size = (size + 63) & ~63; // Separate cache lines
+  uint32_t offset = __atomic_fetch_add( &low_memory_used, size, __ATOMIC_RELAXED );
+  if (offset + size > low_memory_size) fail( "Out of low memory", size );
+
+  return low_memory + offset;
+}
+
+// include/callbacks.h
+static inline void *rma_allocate( uint32_t size )
+{
+  return low_allocate( size );
+}
+
+typedef struct {
+  char const *name;
+  void (*setup)( int threads );         // Before the threads start (may be null)
+  void (*operation)( uint32_t core, uint32_t i );
+  void (*check)( int threads );         // After they finish (may be null)
+} benchmark;
+
+typedef struct {
+  pthread_t thread;
+  uint32_t number;
+  benchmark const *b;
+  uint32_t operations;
+  uint32_t *latency;                    // ns, one per operation
+  pthread_barrier_t *start;
+} benchmark_thread;
+
+static void *benchmark_run( void *p )
+{
+  benchmark_thread *t = p;
+  core_number = t->number;
+
+  pthread_barrier_wait( t->start );
+
+  for (uint32_t i = 0; i < t->operations; i++) {
+    uint64_t start = now_ns();
+    t->b->operation( t->number, i );
+    t->latency[i] = now_ns() - start;
+  }
+
+  return 0;
+}
+
+static int compare_latency( void const *a, void const *b )
+{
+  uint32_t la = *(uint32_t const *) a;
+  uint32_t lb = *(uint32_t const *) b;
+  return (la > lb) - (la < lb);
+}
+
+// Runs the benchmark with 1, 2, 4, ... up to max_threads threads, each
+// performing operations operations, and reports the results.
+static void benchmark_report( benchmark const *b, int max_threads, uint32_t operations )
+{
+  static uint32_t *latencies = 0;
+  if (latencies == 0) latencies = malloc( MAX_THREADS * operations * sizeof( uint32_t ) );
+
+  printf( "%s\n", b->name );
+  printf( "Threads    k ops/s    p50 ns    p90 ns    p99 ns  p99.9 ns    max ns\n" );
+
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    benchmark_thread t[MAX_THREADS];
+    pthread_barrier_t start;
+
+    if (b->setup != 0) b->setup( threads );
+
+    pthread_barrier_init( &start, 0, threads + 1 );
+
+    for (int i = 0; i < threads; i++) {
+      t[i] = (benchmark_thread) { .number = i, .b = b, .operations = operations,
+                                  .latency = &latencies[i * operations], .start = &start };
+      pthread_create( &t[i].thread, 0, benchmark_run, &t[i] );
+    }
+
+    uint64_t began = now_ns();
+    pthread_barrier_wait( &start );
+
+    for (int i = 0; i < threads; i++) {
+      pthread_join( t[i].thread, 0 );
+    }
+    uint64_t elapsed = now_ns() - began;
+
+    pthread_barrier_destroy( &start );
+
+    if (b->check != 0) b->check( threads );
+
+    uint32_t total = threads * operations;
+    qsort( latencies, total, sizeof( uint32_t ), compare_latency );
+
+    printf( "%7d %10.0f %9u %9u %9u %9u %9u\n", threads,
+            (double) total * 1000000.0 / elapsed,
+            latencies[total / 2],
+            latencies[(uint64_t) total * 90 / 100],
+            latencies[(uint64_t) total * 99 / 100],
+            latencies[(uint64_t) total * 999 / 1000],
+            latencies[total - 1] );
+  }
+
+  printf( "\n" );
+}
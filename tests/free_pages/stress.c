@@ -0,0 +1,261 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stress test of the free page (buddy) allocator, with the RAM layout of
+// a 1GiB Pi 3 (bitmaps at the bottom, the ROM image taken out of the
+// middle, the GPU's memory at the top).
+//
+// Random allocations and frees of random sizes and alignments, checked
+// against a record of which allocation owns each page. At the end,
+// everything is freed and the free blocks must be the same as at the
+// start (everything merged back together).
+//
+// gcc -O2 -I ../.. stress.c -o stress && ./stress
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+
+typedef unsigned bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#include "memory/simple/memory_manager.h"
+#include "memory/simple/buddy.h"
+
+static buddy_allocator a;
+
+static uint32_t owner[BUDDY_MAX_PAGES]; // 0 = free (or not RAM)
+
+typedef struct {
+  uint32_t page;
+  uint32_t count;
+} allocation;
+
+static allocation live[BUDDY_MAX_PAGES];
+static int live_count = 0;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add_ram()
+{
+  buddy_add_range( &a, 17, 0x8000 - 17 );               // Below the ROM image
+  buddy_add_range( &a, 0x8000 + 0x500, 0x3b400 - 0x8500 ); // Above it, up to the GPU
+}
+
+static void check_consistency()
+{
+  uint32_t free_pages = 0;
+
+  for (int order = 0; order < BUDDY_ORDERS; order++) {
+    free_pages += a.free_blocks[order] << order;
+
+    // Every summary bit matches a non-zero word below
+    uint32_t bits = a.pages >> order;
+    for (int level = 0; level + 1 < BUDDY_LEVELS; level++) {
+      uint32_t words = buddy_words( bits );
+      for (uint32_t w = 0; w < words; w++) {
+        bool summary = 0 != (a.map[order][level+1][w >> 5] & (1u << (w & 31)));
+        if (summary != (a.map[order][level][w] != 0)) {
+          printf( "Summary mismatch, order %d level %d word %u\n", order, level, w );
+          exit( 1 );
+        }
+      }
+      bits = words;
+    }
+
+    // No free block has a free buddy (they should have been merged)
+    uint32_t blocks = a.pages >> order;
+    uint32_t counted = 0;
+    for (uint32_t b = 0; b < blocks; b++) {
+      if (buddy_is_free( &a, order, b )) {
+        counted++;
+        if (order + 1 < BUDDY_ORDERS && buddy_is_free( &a, order, b ^ 1 )) {
+          printf( "Unmerged buddies, order %d block %u\n", order, b );
+          exit( 1 );
+        }
+      }
+    }
+    if (counted != a.free_blocks[order]) {
+      printf( "Free block count wrong, order %d\n", order );
+      exit( 1 );
+    }
+  }
+
+  if (free_pages != a.free_pages) {
+    printf( "Free page count wrong: %u, %u\n", free_pages, a.free_pages );
+    exit( 1 );
+  }
+}
+
+static uint64_t allocating = 0;
+static uint64_t freeing = 0;
+
+static bool allocate( uint32_t count, uint32_t alignment, uint32_t id )
+{
+  uint64_t start = now_ns();
+  uint32_t page = buddy_allocate( &a, count, alignment );
+  allocating += now_ns() - start;
+
+  if (page == 0xffffffff) return false;
+
+  if ((page & (alignment - 1)) != 0) {
+    printf( "Misaligned: %x, %u\n", page, alignment );
+    exit( 1 );
+  }
+
+  for (uint32_t p = page; p < page + count; p++) {
+    if (owner[p] != 0 || buddy_page_free( &a, p )) {
+      printf( "Page %x allocated twice\n", p );
+      exit( 1 );
+    }
+    if (p < 17 || (p >= 0x8000 && p < 0x8500) || p >= 0x3b400) {
+      printf( "Page %x isn't RAM\n", p );
+      exit( 1 );
+    }
+    owner[p] = id;
+  }
+
+  live[live_count].page = page;
+  live[live_count].count = count;
+  live_count++;
+
+  return true;
+}
+
+static void release( int i )
+{
+  allocation al = live[i];
+  live[i] = live[--live_count];
+
+  for (uint32_t p = al.page; p < al.page + al.count; p++) {
+    owner[p] = 0;
+  }
+
+  uint64_t start = now_ns();
+  buddy_free_range( &a, al.page, al.count );
+  freeing += now_ns() - start;
+}
+
+static uint32_t random_size()
+{
+  // Mostly single pages (translation tables, pipes), some stacks and
+  // application memory, a few MiB-sized dynamic areas.
+  switch (rand() % 10) {
+  case 0: return 256 * (1 + rand() % 4);
+  case 1: case 2: return 1 + rand() % 300;
+  case 3: return 40;
+  default: return 1;
+  }
+}
+
+static uint32_t random_alignment()
+{
+  switch (rand() % 8) {
+  case 0: return 256;
+  case 1: return 16;
+  default: return 1;
+  }
+}
+
+int main( int argc, char const *argv[] )
+{
+  uint32_t *storage = calloc( buddy_storage_words( BUDDY_MAX_PAGES ), sizeof( uint32_t ) );
+  printf( "Bitmaps: %lu bytes for %u pages\n", buddy_storage_words( BUDDY_MAX_PAGES ) * sizeof( uint32_t ), BUDDY_MAX_PAGES );
+
+  buddy_initialise( &a, storage, BUDDY_MAX_PAGES );
+
+  add_ram();
+  check_consistency();
+
+  uint32_t initial_blocks[BUDDY_ORDERS];
+  for (int i = 0; i < BUDDY_ORDERS; i++) initial_blocks[i] = a.free_blocks[i];
+  uint32_t total = a.free_pages;
+
+  // Exhaustion, one page at a time, then everything freed again
+  {
+    uint32_t id = 1;
+    while (allocate( 1, 1, id )) id++;
+    if (id - 1 != total || a.free_pages != 0) {
+      printf( "Only allocated %u of %u pages\n", id - 1, total );
+      return 1;
+    }
+    while (live_count > 0) release( rand() % live_count );
+    check_consistency();
+  }
+
+  srand( 1 );
+
+  uint64_t allocations = 0;
+  uint64_t frees = 0;
+  uint64_t failures = 0;
+
+  allocating = 0;
+  freeing = 0;
+
+  for (int round = 0; round < 2000000; round++) {
+    // Allocate and free about equally often, never more than three-quarters
+    // full; the sizes and lifetimes are random, so it fragments
+    bool grow = (live_count == 0)
+             || (a.free_pages > total / 4 && (rand() & 1));
+
+    if (grow) {
+      uint32_t count = random_size();
+      uint32_t alignment = random_alignment();
+      if (allocate( count, alignment, round + 1 )) allocations++; else failures++;
+    }
+    else {
+      release( rand() % live_count );
+      frees++;
+    }
+
+    if ((round % 200000) == 0) {
+      check_consistency();
+      int largest = buddy_largest_free_order( &a );
+      printf( "Round %7d: %5d allocations, %6u free pages, largest free block %6u pages, %5u free pages not in a MiB block\n",
+              round, live_count, a.free_pages, largest < 0 ? 0 : 1 << largest, buddy_unusable_pages( &a, 8 ) );
+    }
+  }
+
+  printf( "%lu allocations (%.0f ns), %lu frees (%.0f ns), %lu failed\n",
+          allocations, (double) allocating / allocations,
+          frees, (double) freeing / frees, failures );
+
+  while (live_count > 0) release( rand() % live_count );
+
+  check_consistency();
+
+  for (int i = 0; i < BUDDY_ORDERS; i++) {
+    if (initial_blocks[i] != a.free_blocks[i]) {
+      printf( "Not all merged back, order %d: %u, %u\n", i, initial_blocks[i], a.free_blocks[i] );
+      return 1;
+    }
+  }
+  if (a.free_pages != total) {
+    printf( "Pages lost: %u of %u\n", total - a.free_pages, total );
+    return 1;
+  }
+
+  printf( "OK\n" );
+
+  return 0;
+}
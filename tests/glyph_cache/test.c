@@ -0,0 +1,270 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the FontManager's glyph cache and rasteriser
+// (GCC_Modules/FontManager/glyph_cache.h and glyph_raster.h).
+//
+// The cache must find what was put in it, discard the least recently
+// used glyphs first, and keep within its limit.
+//
+// Random polygons (and a curved shape) are rasterised and compared with
+// the coverage found by point sampling each pixel 16 x 16 times with the
+// non-zero winding rule; they should differ by no more than the sampling
+// error.
+//
+// gcc -O2 -I ../../GCC_Modules/FontManager test.c -o test && ./test
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "glyph_cache.h"
+#include "glyph_raster.h"
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static glyph *new_glyph( uint32_t ch, uint32_t size )
+{
+  glyph *g = calloc( 1, glyph_bytes( size, size ) );
+  g->key.font = (void*) 0x1234;
+  g->key.size = 12 << 4;
+  g->key.transform[0] = g->key.transform[3] = 0x10000;
+  g->key.ch = ch;
+  g->bytes = glyph_bytes( size, size );
+  g->width = g->height = size;
+  return g;
+}
+
+static void add( glyph_cache *cache, glyph *g )
+{
+  while (glyph_cache_full( cache, g->bytes )) free( glyph_cache_evict( cache ) );
+  glyph_cache_insert( cache, g );
+}
+
+static void cache_tests()
+{
+  glyph_cache cache;
+  glyph_cache_initialise( &cache, 10 * glyph_bytes( 10, 10 ) );
+
+  for (uint32_t ch = 'a'; ch < 'a' + 10; ch++) add( &cache, new_glyph( ch, 10 ) );
+  if (cache.glyphs != 10 || cache.evictions != 0) fail( "Not all glyphs kept", cache.glyphs );
+
+  glyph_key key = new_glyph( 'a', 10 )->key;
+  if (glyph_cache_find( &cache, &key ) == 0) fail( "Glyph not found", key.ch );
+
+  key.sub_x = 1;
+  if (glyph_cache_find( &cache, &key ) != 0) fail( "Wrong glyph found", key.ch );
+  key.sub_x = 0;
+
+  // 'a' was used more recently than 'b', so 'b' goes first
+  add( &cache, new_glyph( 'z', 10 ) );
+  key.ch = 'b';
+  if (glyph_cache_find( &cache, &key ) != 0) fail( "Least recently used glyph kept", key.ch );
+  key.ch = 'a';
+  if (glyph_cache_find( &cache, &key ) == 0) fail( "Recently used glyph evicted", key.ch );
+  if (cache.hits != 2 || cache.misses != 2 || cache.evictions != 1) fail( "Wrong statistics", cache.hits );
+
+  // Lots of glyphs, some large, all the same bucket or not
+  srand( 1 );
+  for (int i = 0; i < 100000; i++) {
+    uint32_t ch = rand() % 500;
+    key.ch = ch;
+    if (glyph_cache_find( &cache, &key ) == 0) add( &cache, new_glyph( ch, 1 + rand() % 20 ) );
+    if (cache.used > cache.limit) fail( "Over limit", cache.used );
+  }
+
+  uint32_t glyphs = 0;
+  uint32_t used = 0;
+  for (glyph *g = cache.newest; g != 0; g = g->older) { glyphs++; used += g->bytes; }
+  if (glyphs != cache.glyphs || used != cache.used) fail( "Lost track of glyphs", glyphs );
+
+  while (cache.oldest != 0) free( glyph_cache_evict( &cache ) );
+  for (int i = 0; i < GLYPH_CACHE_BUCKETS; i++) {
+    if (cache.bucket[i] != 0) fail( "Glyph left in hash table", i );
+  }
+  if (cache.used != 0 || cache.newest != 0) fail( "Cache not empty", cache.used );
+
+  printf( "Cache: OK\n" );
+}
+
+// Non-zero winding number of the point, for the flattened outline
+static bool inside( glyph_outline const *o, double x, double y )
+{
+  int winding = 0;
+  for (uint32_t i = 0; i < o->count; i++) {
+    glyph_edge const *e = &o->edges[i];
+    double y0 = e->y0 / 64.0, y1 = e->y1 / 64.0;
+    if ((y0 <= y) == (y1 <= y)) continue;
+    double cx = e->x0 / 64.0 + (y - y0) * (e->x1 - e->x0) / (double) (e->y1 - e->y0);
+    if (cx < x) winding += (y1 > y0) ? 1 : -1;
+  }
+  return winding != 0;
+}
+
+static int check( uint32_t const *path, int32_t const *matrix, int n )
+{
+  static glyph_edge edges[4096];
+  static uint16_t cells[GLYPH_MAX_PIXELS + 1];
+  static uint8_t alpha[GLYPH_MAX_PIXELS * GLYPH_MAX_PIXELS];
+
+  glyph_outline o = { .edges = edges, .max = 4096 };
+  glyph_box box;
+
+  if (!glyph_outline_from_path( &o, path, matrix )) fail( "Path not understood", n );
+  if (!glyph_outline_box( &o, &box )) return 0;
+
+  glyph_rasterise( &o, &box, cells, alpha, true );
+
+  int worst = 0;
+  for (uint32_t row = 0; row < box.height; row++) {
+    for (uint32_t col = 0; col < box.width; col++) {
+      int count = 0;
+      for (int sy = 0; sy < 16; sy++) {
+        for (int sx = 0; sx < 16; sx++) {
+          count += inside( &o, box.left + (int) col + (sx + 0.5) / 16,
+                               box.bottom + (int) (box.height - 1 - row) + (sy + 0.5) / 16 );
+        }
+      }
+      int expected = count > 255 ? 255 : count;
+      int difference = abs( expected - alpha[row * box.width + col] );
+      if (difference > worst) worst = difference;
+    }
+  }
+
+  return worst;
+}
+
+static void raster_tests()
+{
+  // A square, exactly covering pixels 1 to 4, in both directions
+  uint32_t square[] = { 2, 1 << 8, 1 << 8, 8, 5 << 8, 1 << 8, 8, 5 << 8, 5 << 8, 8, 1 << 8, 5 << 8, 0 };
+  int32_t identity[6] = { 0x400000, 0, 0, 0x400000, 0, 0 }; // Design units are pixels
+  if (check( square, identity, 0 ) != 0) fail( "Square wrong", 0 );
+
+  // Half a pixel over
+  int32_t shifted[6] = { 0x400000, 0, 0, 0x400000, 32, 32 };
+  if (check( square, shifted, 0 ) > 2) fail( "Shifted square wrong", 0 );
+
+  // Overlapping random polygons, any direction
+  srand( 2 );
+  int worst = 0;
+  for (int n = 0; n < 300; n++) {
+    uint32_t path[200];
+    uint32_t *p = path;
+    int polygons = 1 + rand() % 3;
+    for (int i = 0; i < polygons; i++) {
+      int points = 3 + rand() % 6;
+      for (int j = 0; j < points; j++) {
+        *p++ = (j == 0) ? 2 : 8;
+        *p++ = (rand() % 4000) << 8;
+        *p++ = (rand() % 4000) << 8;
+      }
+    }
+    *p++ = 0;
+
+    int32_t matrix[6] = { 0x10000 / 100, 0, 0, 0x10000 / 100, rand() % 64, rand() % 64 };
+    int d = check( path, matrix, n );
+    if (d > worst) worst = d;
+  }
+  // Four sub-scanlines: a pixel crossed by an edge at a shallow angle can
+  // be out by up to a quarter.
+  if (worst > 72) fail( "Polygon coverage wrong", worst );
+  printf( "Polygons: OK, worst difference %d/255\n", worst );
+
+  // A circle-ish shape, made of four curves
+  int32_t k = 552; // 0.552 * 1000
+  uint32_t circle[] = { 2, 1000 << 8, 0,
+    6, 1000 << 8, k << 8, k << 8, 1000 << 8, 0, 1000 << 8,
+    6, -k << 8, 1000 << 8, -1000 << 8, k << 8, -1000 << 8, 0,
+    6, -1000 << 8, -k << 8, -k << 8, -1000 << 8, 0, -1000 << 8,
+    6, k << 8, -1000 << 8, 1000 << 8, -k << 8, 1000 << 8, 0,
+    0 };
+  int32_t scale[6] = { 0x10000 / 200, 0, 0, 0x10000 / 200, 0, 0 }; // 20 pixel radius
+  int d = check( circle, scale, 0 );
+  if (d > 72) fail( "Circle coverage wrong", d );
+  printf( "Curves: OK, worst difference %d/255\n", d );
+}
+
+static void timing()
+{
+  static glyph_edge edges[1024];
+  static uint16_t cells[GLYPH_MAX_PIXELS + 1];
+  static uint8_t alpha[GLYPH_MAX_PIXELS * GLYPH_MAX_PIXELS];
+
+  int32_t k = 552;
+  uint32_t o_shape[] = { 2, 1000 << 8, 0,
+    6, 1000 << 8, k << 8, k << 8, 1000 << 8, 0, 1000 << 8,
+    6, -k << 8, 1000 << 8, -1000 << 8, k << 8, -1000 << 8, 0,
+    6, -1000 << 8, -k << 8, -k << 8, -1000 << 8, 0, -1000 << 8,
+    6, k << 8, -1000 << 8, 1000 << 8, -k << 8, 1000 << 8, 0,
+    2, 700 << 8, 0,
+    6, 700 << 8, -k << 8, k << 8, -700 << 8, 0, -700 << 8,
+    6, -k << 8, -700 << 8, -700 << 8, -k << 8, -700 << 8, 0,
+    6, -700 << 8, k << 8, -k << 8, 700 << 8, 0, 700 << 8,
+    6, k << 8, 700 << 8, 700 << 8, k << 8, 700 << 8, 0,
+    0 };
+  int32_t scale[6] = { 0x10000 / 600, 0, 0, 0x10000 / 600, 0, 0 }; // About 13 pixels high
+
+  glyph_cache cache;
+  glyph_cache_initialise( &cache, 1 << 20 );
+  glyph *g = new_glyph( 'o', 14 );
+  add( &cache, g );
+
+  const int rounds = 100000;
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    glyph_outline o = { .edges = edges, .max = 1024 };
+    glyph_box box;
+    glyph_outline_from_path( &o, o_shape, scale );
+    glyph_outline_box( &o, &box );
+    glyph_rasterise( &o, &box, cells, alpha, true );
+    asm volatile ( "" : : "r" (alpha) : "memory" );
+  }
+  uint64_t raster_time = now_ns() - start;
+
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    glyph *found = glyph_cache_find( &cache, &g->key );
+    asm volatile ( "" : : "r" (found) : "memory" );
+  }
+  uint64_t lookup_time = now_ns() - start;
+
+  printf( "Rasterise 'o' %6.0f ns, cache lookup %4.0f ns\n",
+          (double) raster_time / rounds, (double) lookup_time / rounds );
+}
+
+int main( int argc, char const *argv[] )
+{
+  cache_tests();
+  raster_tests();
+  timing();
+
+  return 0;
+}
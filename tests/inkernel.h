@@ -27,22 +27,58 @@ typedef struct core_workspace core_workspace;
 typedef struct shared_workspace shared_workspace;
 
 typedef struct variable variable;
+typedef struct sysvar_table sysvar_table;
+
+typedef struct TaskSlot TaskSlot;
+typedef struct ticker_wheel ticker_wheel;
+
+// Hosted builds of kernel code leave out the parts that can only run on
+// the target; the test program provides replacements.
+#define HOSTED_TESTING
+
+#define WriteNum( n )
+#define WriteN( s, n )
+#define WriteS( string )
+#define Write0( string )
+#define NewLine
+#define Space
+
+#define assert( x ) if (!(x)) { fprintf( stderr, "Assertion failed: %s, line %d\n", #x, __LINE__ ); }
 
 struct Kernel_workspace {
-  variable *variables; // Should be shared?
+  struct {
+    struct rma_cached_block *head;
+    uint32_t count;
+  } rma_cache[8];
 };
 
 struct Kernel_shared_workspace {
+  uint32_t sysvars_lock;
+  sysvar_table *sysvars;
+  sysvar_table *retired_sysvars;
+  struct {
+    uint32_t depth;
+    uint32_t generation;
+    uint32_t padding[14];
+  } sysvar_readers[8];
+  ticker_wheel *ticker_wheels[8];
 };
 
-extern struct core_workspace {
+// Tests that run a thread per core define HOSTED_THREADS
+#ifdef HOSTED_THREADS
+#define CORE_LOCAL __thread
+#else
+#define CORE_LOCAL
+#endif
+
+extern CORE_LOCAL struct core_workspace {
   uint32_t core_number;
   struct Kernel_workspace kernel;
 } workspace;
 
 extern struct shared_workspace {
   struct Kernel_shared_workspace kernel;
-} volatile shared;
+} shared;
 
 static const uint32_t NF = (1 << 31);
 static const uint32_t ZF = (1 << 30);
@@ -103,8 +139,10 @@ enum {
  
 // OS SWIs implemented other than in swis.c:
 
-// Implemented in os_heap.c:
+// swis/os_heap.c
 bool do_OS_Heap( svc_registers *regs );
+void *rma_claim( uint32_t size );
+void rma_release( void const *block );
 
 // modules.c:
 bool do_OS_Module( svc_registers *regs );
@@ -141,18 +179,39 @@ bool do_OS_RestoreCursors( svc_registers *regs );
 
 
 // swis/varvals.c
-enum { VarType_String = 0,
-       VarType_Number,
-       VarType_Macro,
-       VarType_Expanded,
-       VarType_LiteralString,
-       VarType_Code = 16 } VarTypes;
+enum VarTypes { VarType_String = 0,
+                VarType_Number,
+                VarType_Macro,
+                VarType_Expanded,
+                VarType_LiteralString,
+                VarType_Code = 16 };
 bool do_OS_ReadVarVal( svc_registers *regs );
 bool do_OS_SetVarVal( svc_registers *regs );
 
-void *rma_allocate( uint32_t size, svc_registers *regs );
-
 typedef struct {
   uint32_t code;
-  char text[];
+  char desc[];
 } error_block;
+
+bool do_OS_GSTrans( svc_registers *regs );
+bool do_OS_EvaluateExpression( svc_registers *regs );
+
+void *rma_allocate( uint32_t size );
+void rma_free( void const *block );
+bool error_nomem( svc_registers *regs );
+
+bool claim_lock( uint32_t *lock );
+void release_lock( uint32_t *lock );
+uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t to );
+
+// Replacements for the target-only parts of swis/varvals.c
+void sysvar_barrier();
+void synchronise_code( void const *code, uint32_t length );
+error_block *read_code_variable( variable *v, char const **value, uint32_t *length );
+error_block *write_code_variable( variable *v, char const *value, uint32_t length );
+
+// Replacements for the target-only parts of swis/ticker.c
+void run_handler( uint32_t code, uint32_t private );
+void publish_wheel( ticker_wheel *wheel );
+TaskSlot *current_slot();
+void claim_TickerV();
@@ -0,0 +1,216 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Contention on the mpsafe list primitives (include/mpsafe_dll.h), with
+// one thread per "core", all taking items from the head of a shared pool
+// and returning them to the tail, like the callbacks pool.
+//
+//   Spin:     retry immediately when the list is locked (as before)
+//   Backoff:  delay, doubling, then wait for an event, as on the target
+//
+// wfe and sev are emulated with a global event counter; a waiting thread
+// yields the processor until it changes.
+//
+// The numbers are thousands of operations per second and retries per
+// operation: the times an operation found the list locked by another
+// thread and had to go round again (each one a delay or a wait for an
+// event, see mpsafe_backoff).
+//
+// Every item is marked with the thread using it, so an item being handed
+// to two threads at once would be noticed, and the list must be intact at
+// the end.
+//
+// The primitives store pointers in 32-bit words, so the items must be in
+// the bottom 4GB (MAP_32BIT, x86-64), or build with a 32-bit compiler:
+//
+// gcc -O2 -I ../.. -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast contention.c -o contention -pthread && ./contention
+//
+// arm-linux-gnueabihf-gcc -O2 -static -I ../.. contention.c -o contention -pthread && qemu-arm ./contention
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#define HOSTED_TESTING
+
+uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t to );
+
+#include "include/doubly_linked_list.h"
+#include "include/mpsafe_dll.h"
+
+typedef struct block block;
+
+struct block {
+  block *next;
+  block *prev;
+  uint32_t volatile user;
+};
+
+MPSAFE_DLL_TYPE( block )
+
+enum { Spin, Backoff };
+static const char *names[] = { "Spin", "Backoff" };
+
+static int mode;
+
+static uint32_t volatile events;
+static __thread uint32_t seen_events;
+static __thread uint32_t retries;
+
+uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t to )
+{
+  return __sync_val_compare_and_swap( word, from, to );
+}
+
+// mpsafe_backoff calls one of these each time a list is found locked
+
+void mpsafe_delay( uint32_t n )
+{
+  retries++;
+  if (mode == Spin) return;
+  while (n-- > 0) asm volatile ( "" : : : "memory" );
+}
+
+void mpsafe_wait_for_event()
+{
+  retries++;
+  if (mode == Spin) return;
+  // The event "register" is set if there's been an event since the last wait
+  while (events == seen_events) sched_yield();
+  seen_events = events;
+}
+
+void mpsafe_list_released()
+{
+  __atomic_add_fetch( &events, 1, __ATOMIC_RELEASE );
+}
+
+#define ITEMS 64
+
+static block *pool = 0;
+
+typedef struct {
+  pthread_t thread;
+  uint32_t number;
+  uint32_t retries;
+} core;
+
+static const int operations = 200000;
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static void *run( void *p )
+{
+  core *c = p;
+  retries = 0;
+
+  for (int i = 0; i < operations; i++) {
+    block *it;
+    while (0 == (it = mpsafe_detach_block_at_head( &pool ))) {
+      sched_yield(); // All in use by other threads
+    }
+    if (0 != __sync_val_compare_and_swap( &it->user, 0, c->number )) fail( "Item given out twice", c->number );
+    for (int j = 0; j < 20; j++) asm volatile ( "" : : : "memory" ); // Use it
+    it->user = 0;
+    if ((i & 7) == 0)
+      mpsafe_insert_block_at_head( &pool, it );
+    else
+      mpsafe_insert_block_at_tail( &pool, it );
+  }
+
+  c->retries = retries;
+  return 0;
+}
+
+static void check_pool()
+{
+  int count = 0;
+  block *i = pool;
+  if (i == 0) fail( "Pool empty", 0 );
+  do {
+    if (i->next->prev != i) fail( "List broken at", count );
+    if (i->user != 0) fail( "Item still in use", count );
+    count++;
+    i = i->next;
+  } while (i != pool && count <= ITEMS);
+  if (count != ITEMS) fail( "Items lost", count );
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int main( int argc, char const *argv[] )
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+  flags |= MAP_32BIT;
+#endif
+  block *items = mmap( 0, ITEMS * sizeof( block ), PROT_READ | PROT_WRITE, flags, -1, 0 );
+  if (items == MAP_FAILED || (uint64_t) (uintptr_t) items >> 32 != 0) fail( "No low memory", 0 );
+
+  for (int i = 0; i < ITEMS; i++) {
+    dll_new_block( &items[i] );
+    items[i].user = 0;
+    mpsafe_insert_block_at_tail( &pool, &items[i] );
+  }
+  check_pool();
+
+  printf( "Threads   %-8s k ops/s    retries/op   %-8s k ops/s    retries/op\n", names[Spin], names[Backoff] );
+
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    printf( "%7d", threads );
+
+    for (mode = Spin; mode <= Backoff; mode++) {
+      core cores[8];
+      uint64_t start = now_ns();
+      for (int t = 0; t < threads; t++) {
+        cores[t].number = t + 1;
+        pthread_create( &cores[t].thread, 0, run, &cores[t] );
+      }
+      uint32_t total = 0;
+      for (int t = 0; t < threads; t++) {
+        pthread_join( cores[t].thread, 0 );
+        total += cores[t].retries;
+      }
+      uint64_t elapsed = now_ns() - start;
+
+      check_pool();
+
+      // Two list operations per iteration
+      double ops = 2.0 * operations * threads;
+      printf( "   %16.0f   %11.4f", ops * 1000000.0 / elapsed, total / ops );
+    }
+    printf( "\n" );
+  }
+
+  return 0;
+}
@@ -0,0 +1,237 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the ticket locks behind claim_lock (include/ticket_lock.h),
+// one thread per "core".
+//
+// Only one core may hold the lock at a time; a core that holds it gets
+// true from claiming it again, and the lock is free afterwards. The
+// tickets are served in order, even when they wrap.
+//
+// Then, for 1 to 8 cores, all claiming the same lock for a fixed time,
+// the share of the acquisitions each core got, for the ticket lock and
+// the old test-and-set lock (the fairest would have all equal shares),
+// and the statistics collected.
+//
+// wfe and sev are emulated by yielding the processor.
+//
+// gcc -O2 -I ../.. -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast fairness.c -o fairness -pthread && ./fairness
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#define HOSTED_TESTING
+
+uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t to )
+{
+  return __sync_val_compare_and_swap( word, from, to );
+}
+
+#include "include/ticket_lock.h"
+
+void ticket_lock_wait()
+{
+  sched_yield();
+}
+
+void ticket_lock_released()
+{
+}
+
+void ticket_lock_barrier()
+{
+  __sync_synchronize();
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t ticket_lock_now()
+{
+  return now_ns() / 1000; // "Ticks" of a microsecond
+}
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+// The old lock, for comparison
+static bool tas_claim( uint32_t volatile *lock, uint32_t core )
+{
+  uint32_t value;
+  while (0 != (value = change_word_if_equal( lock, 0, core + 1 ))) {
+    if (value == core + 1) return true;
+    sched_yield();
+  }
+  return false;
+}
+
+static void tas_release( uint32_t volatile *lock )
+{
+  __sync_synchronize();
+  *lock = 0;
+}
+
+enum { Ticket, Test_and_set };
+
+typedef struct {
+  pthread_t thread;
+  uint32_t number;
+  int kind;
+  uint32_t acquisitions;
+} core;
+
+static uint32_t volatile *lock;
+static lock_statistics *statistics;
+static uint32_t volatile holders;
+static uint32_t volatile acquired;
+static uint32_t volatile stop;
+
+static void *run( void *p )
+{
+  core *c = p;
+
+  while (!stop) {
+    uint32_t waited = 0xffffffff;
+    bool reclaimed = (c->kind == Ticket)
+                   ? ticket_lock_claim( lock, c->number, &waited )
+                   : tas_claim( lock, c->number );
+    if (reclaimed) fail( "Reclaimed a lock not held", c->number );
+
+    if (c->kind == Ticket) {
+      lock_statistics *entry = lock_statistics_entry( statistics, lock );
+      if (entry == 0) fail( "No statistics entry", c->number );
+      lock_statistics_record( entry, waited != 0xffffffff, waited, c->number );
+
+      if (ticket_lock_serving( *lock ) != (acquired & 0xfff)) fail( "Served out of order", acquired );
+      uint32_t dummy;
+      if (!ticket_lock_claim( lock, c->number, &dummy )) fail( "Not reclaimed", c->number );
+    }
+
+    if (holders++ != 0) fail( "Two holders", c->number );
+    for (int i = 0; i < 100; i++) asm volatile ( "" : : : "memory" );
+    acquired++;
+    holders--;
+
+    c->acquisitions++;
+
+    if (c->kind == Ticket)
+      ticket_lock_release( lock );
+    else
+      tas_release( lock );
+  }
+
+  return 0;
+}
+
+int main( int argc, char const *argv[] )
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+  flags |= MAP_32BIT;
+#endif
+  void *low = mmap( 0, 4096 + LOCK_STATISTICS_SIZE * sizeof( lock_statistics ), PROT_READ | PROT_WRITE, flags, -1, 0 );
+  if (low == MAP_FAILED || (uint64_t) (uintptr_t) low >> 32 != 0) fail( "No low memory", 0 );
+
+  lock = low;
+  statistics = (void*) ((char*) low + 4096);
+
+  // Boot: held by core 0 before anything else has touched it
+  *lock = TICKET_LOCK_HELD_BY( 0 );
+  uint32_t waited;
+  if (!ticket_lock_claim( lock, 0, &waited )) fail( "Held by core 0", 0 );
+  ticket_lock_release( lock );
+  if (ticket_lock_claim( lock, 1, &waited )) fail( "Held by core 1", 1 );
+  ticket_lock_release( lock );
+  if (ticket_lock_serving( *lock ) != (*lock >> 20) || (*lock & TICKET_LOCK_OWNER) != 0) fail( "Not free", *lock );
+
+  // Wrapping tickets
+  for (int i = 0; i < 10000; i++) {
+    if (ticket_lock_claim( lock, i & 7, &waited )) fail( "Reclaimed", i );
+    ticket_lock_release( lock );
+  }
+  *lock = 0;
+
+  printf( "Cores   Ticket: min  max share   waited  longest   Test-and-set: min  max share\n" );
+
+  for (int cores = 1; cores <= 8; cores *= 2) {
+    double shares[2][2];
+    uint32_t contended = 0;
+    uint32_t longest = 0;
+    uint32_t acquisitions = 1;
+
+    for (int kind = Ticket; kind <= Test_and_set; kind++) {
+      core c[8];
+
+      *lock = 0;
+      acquired = 0;
+      stop = false;
+      for (int i = 0; i < LOCK_STATISTICS_SIZE; i++) statistics[i] = (lock_statistics) { 0 };
+
+      for (int i = 0; i < cores; i++) {
+        c[i] = (core) { .number = i, .kind = kind };
+        pthread_create( &c[i].thread, 0, run, &c[i] );
+      }
+
+      uint64_t start = now_ns();
+      while (now_ns() - start < 200000000) sched_yield();
+      stop = true;
+
+      uint32_t total = 0, least = 0xffffffff, most = 0;
+      for (int i = 0; i < cores; i++) {
+        pthread_join( c[i].thread, 0 );
+        total += c[i].acquisitions;
+        if (c[i].acquisitions < least) least = c[i].acquisitions;
+        if (c[i].acquisitions > most) most = c[i].acquisitions;
+      }
+      if (total != acquired) fail( "Acquisitions lost", total );
+
+      shares[kind][0] = (double) least * cores / total;
+      shares[kind][1] = (double) most * cores / total;
+
+      if (kind == Ticket) {
+        lock_statistics *entry = lock_statistics_entry( statistics, lock );
+        if (entry->acquisitions != total) fail( "Statistics wrong", entry->acquisitions );
+        if (entry->contended > total) fail( "Statistics wrong", entry->contended );
+        acquisitions = entry->acquisitions;
+        contended = entry->contended;
+        longest = entry->max_wait;
+      }
+    }
+
+    printf( "%5d   %11.2f %4.2f   %6.0f%% %6uus   %17.2f %4.2f\n", cores,
+            shares[Ticket][0], shares[Ticket][1],
+            100.0 * contended / acquisitions, longest,
+            shares[Test_and_set][0], shares[Test_and_set][1] );
+  }
+
+  return 0;
+}
@@ -0,0 +1,315 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Claim/free throughput of the native OS_Heap, one thread per core, for 1
+// to 4 cores:
+//
+//   One lock:  a heap per core, but every call under a single lock (as
+//              the ROM code was called, under shared.memory.os_heap_lock)
+//   Own heap:  a heap per core, each with its own lock
+//   Shared:    one heap (not the RMA) shared by all the cores
+//   RMA:       rma_claim and rma_release, with the per-core caches
+//
+// Each core keeps 256 blocks, mostly small, replacing a random one each
+// time. Every block is marked with its owner, and checked before it's
+// freed, so two cores being given the same block would be noticed. At the
+// end, everything is freed and each heap must be completely free again.
+//
+// First, a small RMA block is freed twice, on the same core and then on
+// another, and both second frees must be refused.
+//
+// The numbers are millions of claim/free pairs per second, for all the
+// cores together; they only mean much if the host has at least 4 cores.
+//
+// Like the varvals tests, compile with -static so that pointers fit in 32 bits:
+// gcc -O2 -static -w -pthread -I .. benchmark.c -o benchmark && ./benchmark
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define HOSTED_THREADS
+#include "../../swis/os_heap.c"
+
+CORE_LOCAL struct core_workspace workspace = {};
+
+#define HEAP_SIZE (4 << 20)
+
+static uint32_t __attribute__(( aligned( 4096 ) )) rma_space[HEAP_SIZE / 4];
+static uint32_t __attribute__(( aligned( 4096 ) )) own_heaps[4][HEAP_SIZE / 4];
+static uint32_t __attribute__(( aligned( 4096 ) )) shared_space[HEAP_SIZE / 4];
+
+heap_header *rma()
+{
+  return (void*) rma_space;
+}
+
+void wait_for_heap()
+{
+  sched_yield();
+}
+
+void release_heap( heap_header *heap )
+{
+  __atomic_store_n( &heap->magic, HEAP_MAGIC, __ATOMIC_RELEASE );
+}
+
+uint32_t change_word_if_equal( uint32_t volatile *word, uint32_t from, uint32_t to )
+{
+  return __sync_val_compare_and_swap( word, from, to );
+}
+
+bool claim_lock( uint32_t *lock )
+{
+  while (!__sync_bool_compare_and_swap( lock, 0, 1 )) sched_yield();
+  return false;
+}
+
+void release_lock( uint32_t *lock )
+{
+  __atomic_store_n( lock, 0, __ATOMIC_RELEASE );
+}
+
+static uint32_t one_lock = 0;
+
+enum { One_Lock, Own_Heap, Shared, RMA };
+
+static const char *names[] = { "One lock", "Own heap", "Shared", "RMA" };
+
+typedef struct {
+  int core;
+  int mode;
+  heap_header *heap;
+  uint32_t failures;
+} core;
+
+static const int pairs = 400000;
+
+static void fail( char const *message, core *c )
+{
+  printf( "%s, core %d, %s\n", message, c->core, names[c->mode] );
+  exit( 1 );
+}
+
+static void *core_claim( core *c, uint32_t size )
+{
+  if (c->mode == RMA) return rma_claim( size );
+
+  svc_registers regs = { .r = { 2, (uint32_t) c->heap, 0, size } };
+
+  if (c->mode == One_Lock) claim_lock( &one_lock );
+  bool ok = do_OS_Heap( &regs );
+  if (c->mode == One_Lock) release_lock( &one_lock );
+
+  return ok ? (void*) regs.r[2] : 0;
+}
+
+static void core_free( core *c, void *block )
+{
+  if (c->mode == RMA) {
+    rma_release( block );
+    return;
+  }
+
+  svc_registers regs = { .r = { 3, (uint32_t) c->heap, (uint32_t) block } };
+
+  if (c->mode == One_Lock) claim_lock( &one_lock );
+  bool ok = do_OS_Heap( &regs );
+  if (c->mode == One_Lock) release_lock( &one_lock );
+
+  if (!ok) fail( ((error_block*) regs.r[0])->desc, c );
+}
+
+static uint32_t random_size( uint32_t *seed )
+{
+  *seed = *seed * 1103515245 + 12345;
+  uint32_t r = *seed >> 8;
+  // Mostly callbacks, variables, pipe and ticker structures; a few buffers
+  if ((r & 15) == 0) return 256 + (r >> 4) % 2048;
+  return 4 + (r >> 4) % 240;
+}
+
+static void *run( void *arg )
+{
+  core *c = arg;
+  workspace.core_number = c->core;
+
+  uint32_t *blocks[256] = { 0 };
+  uint32_t seed = c->core + 1;
+  uint32_t mark = 0x11111111 * (c->core + 1);
+
+  for (int i = 0; i < pairs; i++) {
+    seed = seed * 1103515245 + 12345;
+    int n = (seed >> 16) & 255;
+
+    if (blocks[n] != 0) {
+      if (*blocks[n] != mark) fail( "Block overwritten", c );
+      core_free( c, blocks[n] );
+    }
+
+    blocks[n] = core_claim( c, random_size( &seed ) );
+
+    if (blocks[n] == 0) c->failures++;
+    else *blocks[n] = mark;
+  }
+
+  for (int n = 0; n < 256; n++) {
+    if (blocks[n] != 0) core_free( c, blocks[n] );
+  }
+
+  if (c->mode == RMA) {
+    for (int i = 0; i < RMA_CACHE_SIZES; i++) {
+      if (workspace.kernel.rma_cache[i].count != 0) rma_cache_flush( i, 0 );
+    }
+  }
+
+  return 0;
+}
+
+static void initialise_heap( heap_header *heap )
+{
+  svc_registers regs = { .r = { 0, (uint32_t) heap, 0, HEAP_SIZE } };
+  if (!do_OS_Heap( &regs )) {
+    printf( "Heap not initialised\n" );
+    exit( 1 );
+  }
+}
+
+static void fail_double_free( char const *message )
+{
+  printf( "%s\n", message );
+  exit( 1 );
+}
+
+static void check_empty( heap_header *heap )
+{
+  svc_registers regs = { .r = { 1, (uint32_t) heap } };
+  if (!do_OS_Heap( &regs )) {
+    printf( "%s\n", ((error_block*) regs.r[0])->desc );
+    exit( 1 );
+  }
+  if (regs.r[3] != HEAP_SIZE - first_block( heap ) || heap->free != 0) {
+    printf( "Heap not empty: %u free of %u\n", regs.r[3], HEAP_SIZE - first_block( heap ) );
+    exit( 1 );
+  }
+}
+
+// Free the block through OS_Heap on the given core; true if refused
+static void *free_on_core( void *arg )
+{
+  void **block = arg;
+  workspace.core_number = 1;
+
+  svc_registers regs = { .r = { 3, (uint32_t) rma(), (uint32_t) *block } };
+  *block = do_OS_Heap( &regs ) ? 0 : *block;
+
+  return 0;
+}
+
+// A small block freed twice, on this core or another, must be refused
+// rather than cached twice.
+static void double_frees()
+{
+  initialise_heap( rma() );
+
+  void *block = rma_claim( 20 );
+  svc_registers regs = { .r = { 3, (uint32_t) rma(), (uint32_t) block } };
+  if (!do_OS_Heap( &regs )) fail_double_free( "First free refused" );
+  if (do_OS_Heap( &regs )) fail_double_free( "Second free on the same core accepted" );
+
+  pthread_t thread;
+  void *again = block;
+  pthread_create( &thread, 0, free_on_core, &again );
+  pthread_join( thread, 0 );
+  if (again == 0) fail_double_free( "Second free on another core accepted" );
+
+  void *first = rma_claim( 20 );
+  void *second = rma_claim( 20 );
+  if (first != block) fail_double_free( "Block not re-used" );
+  if (second == block) fail_double_free( "Block handed out twice" );
+
+  rma_release( first );
+  rma_release( second );
+  for (int i = 0; i < RMA_CACHE_SIZES; i++) {
+    if (workspace.kernel.rma_cache[i].count != 0) rma_cache_flush( i, 0 );
+  }
+  check_empty( rma() );
+
+  printf( "Double frees refused: OK\n" );
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int main( int argc, char const *argv[] )
+{
+  double_frees();
+
+  printf( "Million claim/free pairs per second\n" );
+  printf( "Cores   One lock   Own heap     Shared        RMA\n" );
+
+  for (int cores = 1; cores <= 4; cores++) {
+    printf( "%5d", cores );
+
+    for (int mode = One_Lock; mode <= RMA; mode++) {
+      core c[4];
+      pthread_t threads[4];
+
+      initialise_heap( rma() );
+      initialise_heap( (void*) shared_space );
+      for (int i = 0; i < cores; i++) {
+        c[i].core = i;
+        c[i].mode = mode;
+        c[i].failures = 0;
+        switch (mode) {
+        case One_Lock:
+        case Own_Heap: c[i].heap = (void*) own_heaps[i]; break;
+        case Shared: c[i].heap = (void*) shared_space; break;
+        case RMA: c[i].heap = rma(); break;
+        }
+        initialise_heap( (void*) own_heaps[i] );
+      }
+
+      uint64_t start = now_ns();
+      for (int i = 0; i < cores; i++) {
+        pthread_create( &threads[i], 0, run, &c[i] );
+      }
+      for (int i = 0; i < cores; i++) {
+        pthread_join( threads[i], 0 );
+      }
+      uint64_t elapsed = now_ns() - start;
+
+      for (int i = 0; i < cores; i++) {
+        if (c[i].failures != 0) {
+          printf( "\nHeap full, core %d\n", i );
+          return 1;
+        }
+        check_empty( c[i].heap );
+      }
+
+      printf( "   %8.2f", (double) pairs * cores * 1000.0 / elapsed );
+      fflush( stdout );
+    }
+
+    printf( "\n" );
+  }
+
+  return 0;
+}
@@ -0,0 +1,81 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Just enough of the kernel for swis/plot.c and swis/spans.c to be built
+// into a test program (see ../inkernel.h for the other tests).
+
+#ifndef __KERNEL_H
+#define __KERNEL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#define number_of( arr ) (sizeof( arr ) / sizeof( arr[0] ))
+
+#define HOSTED_TESTING
+
+#define assert( x ) if (!(x)) { fprintf( stderr, "Assertion failed: %s, line %d\n", #x, __LINE__ ); }
+
+#include "Legacy/ZeroPage.h"
+
+extern struct core_workspace {
+  struct {
+    LegacyZeroPage zp;
+  } vectors;
+} workspace;
+
+typedef struct __attribute__(( packed )) {
+  uint32_t r[13];
+  uint32_t lr;
+  uint32_t spsr;
+} svc_registers;
+
+typedef struct {
+  uint32_t code;
+  char desc[];
+} error_block;
+
+static const uint32_t OS_Plot = 0x45;
+
+void *rma_allocate( uint32_t size );
+void rma_free( void const *block );
+bool error_nomem( svc_registers *regs );
+
+// The plotting Task stays on the core
+void Task_using_vdu_state();
+
+// The plot types that aren't native
+bool run_risos_code_implementing_swi( svc_registers *regs, uint32_t svc );
+
+// swis/spans.c
+typedef struct {
+  int32_t left;
+  int32_t y;
+  int32_t right;
+} span;
+
+extern EcfOraEor const span_no_effect;
+extern EcfOraEor const span_invert;
+
+void plot_span( int32_t left, int32_t y, int32_t right, EcfOraEor const *ecf );
+void plot_spans( span const *spans, uint32_t count, EcfOraEor const *ecf );
+void plot_rectangle( int32_t left, int32_t bottom, int32_t right, int32_t top, EcfOraEor const *ecf );
+
+#endif
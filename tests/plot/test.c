@@ -0,0 +1,319 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the native OS_Plot code (swis/plot.c), drawing into an 8bpp
+// screen in memory through do_OS_Plot.
+//
+// Lines, triangles and rectangles are compared with known pixels, with
+// and without a graphics window in the way.
+//
+// Then random lines, triangles, parallelograms and rectangles, partly off
+// the screen, are drawn with the whole screen as the window and again
+// with a random window; the second must be the first, cut to the window.
+//
+// Finally, a triangle reaching a long way below the window has to be
+// drawn without visiting every row down there.
+//
+// gcc -O2 -Wno-cpp -I . -I ../.. test.c -o test && ./test
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../swis/spans.c"
+#include "../../swis/plot.c"
+
+struct core_workspace workspace;
+
+#define WIDTH 64
+#define HEIGHT 48
+
+static uint8_t screen[HEIGHT][WIDTH];
+static uint8_t expected[HEIGHT][WIDTH];
+
+void *rma_allocate( uint32_t size )
+{
+  return malloc( size );
+}
+
+void rma_free( void const *block )
+{
+  free( (void*) block );
+}
+
+bool error_nomem( svc_registers *regs )
+{
+  return false;
+}
+
+void Task_using_vdu_state()
+{
+}
+
+bool run_risos_code_implementing_swi( svc_registers *regs, uint32_t svc )
+{
+  printf( "Plot code %x is not native\n", regs->r[0] );
+  exit( 1 );
+}
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void set_window( int32_t left, int32_t bottom, int32_t right, int32_t top )
+{
+  VduDriversWorkspace *ws = &workspace.vectors.zp.vdu_drivers.ws;
+  ws->GWLCol = left;
+  ws->GWBRow = bottom;
+  ws->GWRCol = right;
+  ws->GWTRow = top;
+}
+
+// Colour 1, stored, the window covering the whole screen
+static void set_up_screen()
+{
+  VduDriversWorkspace *ws = &workspace.vectors.zp.vdu_drivers.ws;
+
+  memset( screen, 0, sizeof( screen ) );
+
+  ws->ScreenStart = &screen[0][0];
+  ws->LineLength = WIDTH;
+  ws->XWindLimit = WIDTH - 1;
+  ws->YWindLimit = HEIGHT - 1;
+  ws->Log2BPP = 3;
+  ws->XEigFactor = 0;
+  ws->YEigFactor = 0;
+  ws->OrgX = 0;
+  ws->OrgY = 0;
+
+  for (int i = 0; i < 8; i++) {
+    ws->FgEcfOraEor.line[i].orr = 0xffffffff;
+    ws->FgEcfOraEor.line[i].eor = ~0x01010101;
+  }
+
+  set_window( 0, 0, WIDTH - 1, HEIGHT - 1 );
+}
+
+static void os_plot( uint32_t code, int32_t x, int32_t y )
+{
+  svc_registers regs = { .r = { code, x, y } };
+  if (!do_OS_Plot( &regs )) fail( "OS_Plot failed, code", code );
+}
+
+static uint8_t pixel_at( int32_t x, int32_t y )
+{
+  return screen[HEIGHT - 1 - y][x];
+}
+
+// The picture is of the bottom left corner of the screen, top row first,
+// '#' for a plotted pixel; nothing else on the screen may be plotted.
+static void check_picture( char const *name, char const *const *picture, int rows )
+{
+  for (int32_t y = 0; y < HEIGHT; y++) {
+    for (int32_t x = 0; x < WIDTH; x++) {
+      char const *row = (y < rows) ? picture[rows - 1 - y] : "";
+      uint8_t want = (x < strlen( row ) && row[x] == '#') ? 1 : 0;
+      if (pixel_at( x, y ) != want) {
+        printf( "%s: pixel %d, %d is %d\n", name, x, y, pixel_at( x, y ) );
+        for (int32_t r = rows - 1; r >= 0; r--) {
+          for (int32_t c = 0; c < 16; c++) putchar( pixel_at( c, r ) ? '#' : '.' );
+          putchar( '\n' );
+        }
+        exit( 1 );
+      }
+    }
+  }
+}
+
+#define CHECK_PICTURE( name, picture ) check_picture( name, picture, number_of( picture ) )
+
+static void known_pixels()
+{
+  static char const *const line[] = {
+    ".......##",
+    ".....##..",
+    "..###....",
+    "##......." };
+
+  set_up_screen();
+  os_plot( 4, 0, 0 );      // Move
+  os_plot( 5, 8, 3 );      // Line
+  CHECK_PICTURE( "Line", line );
+
+  static char const *const clipped_line[] = {
+    ".........",
+    ".....##..",
+    "..###....",
+    "........." };
+
+  set_up_screen();
+  set_window( 2, 1, 6, 3 );
+  os_plot( 4, 0, 0 );
+  os_plot( 5, 8, 3 );
+  CHECK_PICTURE( "Clipped line", clipped_line );
+
+  static char const *const triangle[] = {
+    "#.......",
+    "##......",
+    "####....",
+    "#####...",
+    "#######.",
+    "########" };
+
+  set_up_screen();
+  os_plot( 4, 0, 0 );
+  os_plot( 4, 7, 0 );
+  os_plot( 0x55, 0, 5 );   // Triangle
+  CHECK_PICTURE( "Triangle", triangle );
+
+  static char const *const clipped_triangle[] = {
+    "........",
+    ".#......",
+    ".###....",
+    ".####...",
+    "........",
+    "........" };
+
+  set_up_screen();
+  set_window( 1, 2, 5, 4 );
+  os_plot( 4, 0, 0 );
+  os_plot( 4, 7, 0 );
+  os_plot( 0x55, 0, 5 );
+  CHECK_PICTURE( "Clipped triangle", clipped_triangle );
+
+  static char const *const rectangle[] = {
+    "..####",
+    "..####",
+    "..####",
+    "......" };
+
+  set_up_screen();
+  os_plot( 4, 5, 3 );
+  os_plot( 0x65, 2, 1 );   // Rectangle, corners either way round
+  CHECK_PICTURE( "Rectangle", rectangle );
+
+  static char const *const clipped_rectangle[] = {
+    "......",
+    "...##.",
+    "...##.",
+    "......" };
+
+  set_up_screen();
+  set_window( 3, 1, 4, 2 );
+  os_plot( 4, 5, 3 );
+  os_plot( 0x65, 2, 1 );
+  CHECK_PICTURE( "Clipped rectangle", clipped_rectangle );
+
+  printf( "Known pixels: OK\n" );
+}
+
+static int32_t random_coordinate( int32_t size )
+{
+  return rand() % (size + 80) - 40;
+}
+
+static void random_shape( uint32_t seed )
+{
+  srand( seed );
+
+  int32_t x[3];
+  int32_t y[3];
+  for (int i = 0; i < 3; i++) {
+    x[i] = random_coordinate( WIDTH );
+    y[i] = random_coordinate( HEIGHT );
+  }
+
+  static const uint32_t codes[] = { 0x05, 0x55, 0x65, 0x75 };
+  uint32_t code = codes[rand() % number_of( codes )];
+
+  os_plot( 4, x[0], y[0] );
+  os_plot( 4, x[1], y[1] );
+  os_plot( code, x[2], y[2] );
+}
+
+static void clipping()
+{
+  srand( 1 );
+
+  for (int i = 0; i < 100000; i++) {
+    uint32_t seed = rand();
+
+    int32_t l = rand() % WIDTH;
+    int32_t r = l + rand() % (WIDTH - l);
+    int32_t b = rand() % HEIGHT;
+    int32_t t = b + rand() % (HEIGHT - b);
+
+    set_up_screen();
+    random_shape( seed );
+
+    for (int32_t y = 0; y < HEIGHT; y++) {
+      for (int32_t x = 0; x < WIDTH; x++) {
+        bool inside = (x >= l && x <= r && y >= b && y <= t);
+        expected[HEIGHT - 1 - y][x] = inside ? pixel_at( x, y ) : 0;
+      }
+    }
+
+    set_up_screen();
+    set_window( l, b, r, t );
+    random_shape( seed );
+
+    if (0 != memcmp( screen, expected, sizeof( screen ) )) {
+      printf( "Window %d, %d - %d, %d\n", l, b, r, t );
+      fail( "Clipped shape differs", i );
+    }
+  }
+
+  printf( "Clipped shapes: OK\n" );
+}
+
+static void far_below_the_window()
+{
+  set_up_screen();
+
+  uint64_t start = now_ns();
+  os_plot( 4, 0, -(1 << 30) );
+  os_plot( 4, 0, HEIGHT - 1 );
+  os_plot( 0x55, WIDTH - 1, HEIGHT - 1 );
+  uint64_t time = now_ns() - start;
+
+  // The rows below the window must not be walked one by one, that would
+  // take seconds.
+  if (time > 100000000) fail( "Triangle from far below took ms", time / 1000000 );
+
+  // The visible part is almost a rectangle, the sloping edge is less
+  // than a pixel from the right of the screen.
+  for (int32_t y = 0; y < HEIGHT; y++) {
+    if (!pixel_at( 0, y ) || !pixel_at( WIDTH - 2, y )) fail( "Triangle row missing", y );
+  }
+
+  printf( "Triangle from far below: OK\n" );
+}
+
+int main()
+{
+  known_pixels();
+  clipping();
+  far_below_the_window();
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Cost of passing a service call round the modules, calling every
+// module's handler (as do_OS_ServiceCall used to) against only those of
+// modules that listed it in their service table, plus those without a
+// table.
+//
+// The modules called must be the same ones, in the same order, as those
+// that would have done something with the call walking the list.
+//
+// gcc -O2 -I ../.. benchmark.c -o benchmark && ./benchmark
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#include "include/service_index.h"
+
+typedef struct module module;
+
+struct module {
+  uint32_t services[8];         // Zero terminated
+  bool has_table;
+  module *next;
+  service_handler handlers[8];
+  service_handler every_service;
+};
+
+static module modules[200];
+
+static uint32_t called[200];
+static int calls_made;
+
+// What a module's handler does: check the number against each it handles
+static void __attribute__(( noinline )) handler( module *m, uint32_t service )
+{
+  for (int i = 0; m->services[i] != 0; i++) {
+    if (m->services[i] == service) {
+      called[calls_made++] = m - modules;
+      return;
+    }
+  }
+}
+
+static void walk( module *head, uint32_t service )
+{
+  for (module *m = head; m != 0; m = m->next) {
+    handler( m, service );
+  }
+}
+
+static void indexed( service_index *index, uint32_t service )
+{
+  service_handler *interested = service_index_lookup( index, service );
+  service_handler *everything = index->everything;
+  service_handler *h;
+
+  while (0 != (h = service_index_next( &interested, &everything ))) {
+    handler( h->module, service );
+  }
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static const int calls = 1000000;
+
+int main( int argc, char const *argv[] )
+{
+  static const int sizes[] = { 10, 50, 100, 150, 200 };
+
+  // Most modules handle a few services, from a set of a hundred or so;
+  // one in ten have no service table.
+  srand( 1 );
+  for (int i = 0; i < sizeof( modules ) / sizeof( modules[0] ); i++) {
+    int n = rand() % 6;
+    for (int j = 0; j < n; j++) modules[i].services[j] = 1 + rand() % 120;
+    modules[i].services[n] = 0;
+    modules[i].has_table = (i % 10 != 3);
+  }
+
+  printf( "Modules   Walk ns/call   Index ns/call\n" );
+
+  for (int s = 0; s < sizeof( sizes ) / sizeof( sizes[0] ); s++) {
+    int count = sizes[s];
+    static service_index index;
+    index = (service_index) { 0 };
+
+    for (int i = 0; i < count; i++) {
+      module *m = &modules[i];
+      m->next = (i + 1 < count) ? &modules[i+1] : 0;
+      if (m->has_table && service_index_has_room( &index, m->services )) {
+        for (int j = 0; m->services[j] != 0; j++) {
+          m->handlers[j] = (service_handler) { .module = (void*) m, .order = i + 1 };
+          service_index_add( &index, m->services[j], &m->handlers[j] );
+        }
+      }
+      else {
+        m->every_service = (service_handler) { .module = (void*) m, .order = i + 1 };
+        service_index_add_everything( &index, &m->every_service );
+      }
+    }
+
+    // The same modules, in the same order
+    for (uint32_t service = 1; service <= 130; service++) {
+      uint32_t expected[200];
+      calls_made = 0;
+      walk( &modules[0], service );
+      int n = calls_made;
+      for (int i = 0; i < n; i++) expected[i] = called[i];
+
+      calls_made = 0;
+      indexed( &index, service );
+      if (calls_made != n) fail( "Different number of modules called", service );
+      for (int i = 0; i < n; i++) {
+        if (called[i] != expected[i]) fail( "Modules called out of order", service );
+      }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < calls; i++) {
+      calls_made = 0;
+      walk( &modules[0], 1 + i % 130 );
+    }
+    uint64_t walked = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < calls; i++) {
+      calls_made = 0;
+      indexed( &index, 1 + i % 130 );
+    }
+    uint64_t looked_up = now_ns() - start;
+
+    printf( "%7d   %12.2f   %13.2f\n", count,
+            (double) walked / calls, (double) looked_up / calls );
+  }
+
+  // Removing a module takes it off every list
+  {
+    static service_index index;
+    index = (service_index) { 0 };
+    for (int i = 0; i < 100; i++) {
+      module *m = &modules[i];
+      if (m->has_table) {
+        for (int j = 0; m->services[j] != 0; j++) {
+          m->handlers[j] = (service_handler) { .module = (void*) m, .order = i + 1 };
+          service_index_add( &index, m->services[j], &m->handlers[j] );
+        }
+      }
+      else {
+        m->every_service = (service_handler) { .module = (void*) m, .order = i + 1 };
+        service_index_add_everything( &index, &m->every_service );
+      }
+    }
+    for (int i = 0; i < 100; i += 2) {
+      service_index_remove( &index, (void*) &modules[i] );
+    }
+    for (uint32_t service = 1; service <= 130; service++) {
+      calls_made = 0;
+      indexed( &index, service );
+      for (int i = 0; i < calls_made; i++) {
+        if ((called[i] & 1) == 0) fail( "Removed module called", called[i] );
+      }
+    }
+  }
+
+  return 0;
+}
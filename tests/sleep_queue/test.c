@@ -0,0 +1,172 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the sleeping Task queue (TaskSlot/simple/sleep_queue.h).
+//
+// Tasks go to sleep for random times, as the time moves on at random;
+// every Task must be woken once, no earlier than it's due, and before any
+// Task due later. The cost of adding and waking hundreds of sleepers is
+// compared with the delta list it replaced.
+//
+// gcc -O2 -I ../.. test.c -o test && ./test
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef unsigned bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+typedef struct Task Task;
+
+#include "TaskSlot/simple/sleep_queue.h"
+
+#define TASKS 1000
+
+struct Task {
+  uint64_t due;
+  bool asleep;
+};
+
+static Task tasks[TASKS];
+static sleeper storage[TASKS];
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void random_sleeps()
+{
+  sleep_queue q = { .heap = storage, .count = 0, .capacity = TASKS };
+  uint64_t now = 0;
+  int woken = 0;
+  int sleeps = 0;
+
+  srand( 1 );
+
+  for (int round = 0; round < 1000000; round++) {
+    int n = rand() % TASKS;
+    if (!tasks[n].asleep) {
+      // Mostly short sleeps, some long ones, several due at the same time
+      uint64_t delay = (rand() % 8 == 0) ? rand() % 1000000 : (rand() % 100) * 10;
+      tasks[n].due = now + delay;
+      tasks[n].asleep = true;
+      if (sleep_queue_full( &q )) fail( "Full", q.count );
+      sleep_queue_add( &q, &tasks[n], tasks[n].due );
+      sleeps++;
+    }
+
+    now += rand() % 20;
+
+    uint64_t last = 0;
+    Task *t;
+    while (0 != (t = sleep_queue_take_due( &q, now ))) {
+      if (!t->asleep) fail( "Woken twice", t - tasks );
+      if (t->due > now) fail( "Woken early", t - tasks );
+      if (t->due < last) fail( "Woken out of order", t - tasks );
+      last = t->due;
+      t->asleep = false;
+      woken++;
+    }
+
+    uint64_t next = sleep_queue_next( &q );
+    for (int i = 0; i < TASKS; i++) {
+      if (tasks[i].asleep && tasks[i].due <= now) fail( "Not woken", i );
+      if (tasks[i].asleep && tasks[i].due < next) fail( "Wrong next time", i );
+    }
+  }
+
+  if (sleep_queue_contains( &q, &tasks[0] ) != tasks[0].asleep) fail( "Contains", 0 );
+
+  printf( "%d sleeps, %d woken, %u still asleep: OK\n", sleeps, woken, q.count );
+}
+
+// The delta list that TaskOp_Sleep used to use, walked on every sleep
+typedef struct delta delta;
+struct delta {
+  uint32_t remaining;
+  delta *next;
+};
+
+static delta deltas[TASKS];
+
+static void delta_insert( delta **list, delta *d, uint32_t ticks )
+{
+  while (*list != 0 && (*list)->remaining <= ticks) {
+    ticks -= (*list)->remaining;
+    list = &(*list)->next;
+  }
+  if (*list != 0) (*list)->remaining -= ticks;
+  d->remaining = ticks;
+  d->next = *list;
+  *list = d;
+}
+
+static void compare( int sleepers )
+{
+  sleep_queue q = { .heap = storage, .count = 0, .capacity = TASKS };
+  delta *list = 0;
+  const int rounds = 200000;
+
+  // A steady state of sleepers, each one woken replaced by another
+  srand( 2 );
+  for (int i = 0; i < sleepers; i++) {
+    uint32_t ticks = 1 + rand() % 1000;
+    sleep_queue_add( &q, &tasks[i], ticks );
+    delta_insert( &list, &deltas[i], ticks );
+  }
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    uint64_t due = sleep_queue_next( &q );
+    Task *t = sleep_queue_take_due( &q, due );
+    sleep_queue_add( &q, t, due + 1 + rand() % 1000 );
+  }
+  uint64_t heap_time = now_ns() - start;
+
+  srand( 2 );
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    delta *d = list;
+    list = d->next; // The rest are relative to d's time, which is now
+    delta_insert( &list, d, 1 + rand() % 1000 );
+  }
+  uint64_t delta_time = now_ns() - start;
+
+  printf( "%4d sleepers: heap %5.0f ns, delta list %6.0f ns per sleep\n", sleepers,
+          (double) heap_time / rounds, (double) delta_time / rounds );
+}
+
+int main( int argc, char const *argv[] )
+{
+  random_sleeps();
+
+  compare( 10 );
+  compare( 100 );
+  compare( 1000 );
+
+  return 0;
+}
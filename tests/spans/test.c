@@ -0,0 +1,146 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the horizontal span filling (swis/spans.h).
+//
+// Random spans are filled at every depth with random OR/EOR words, and
+// the stored patterns; every pixel in the span must be changed exactly as
+// if it was done a pixel at a time, and no pixel outside it may change.
+// The time to fill a 1920 pixel row is compared with a pixel at a time.
+//
+// gcc -O2 -I ../.. test.c -o test && ./test
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "swis/spans.h"
+
+#define ROW_WORDS 64
+
+static uint32_t row[ROW_WORDS + 2];     // Guard words either side
+static uint32_t expected[ROW_WORDS + 2];
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t random_word()
+{
+  return (rand() << 16) ^ rand();
+}
+
+static void pixel_at_a_time( uint32_t *row, uint32_t left, uint32_t right, uint32_t log2bpp, uint32_t orr, uint32_t eor )
+{
+  uint32_t bpp = 1 << log2bpp;
+  uint32_t mask = (bpp == 32) ? 0xffffffff : (1 << bpp) - 1;
+
+  for (uint32_t x = left; x <= right; x++) {
+    uint32_t bit = x * bpp;
+    uint32_t *w = &row[bit / 32];
+    uint32_t shift = bit % 32;
+    uint32_t old = (*w >> shift) & mask;
+    uint32_t new = ((old | (orr >> shift)) ^ (eor >> shift)) & mask;
+    *w = (*w & ~(mask << shift)) | (new << shift);
+  }
+}
+
+static void random_spans()
+{
+  int spans = 0;
+
+  srand( 1 );
+
+  for (uint32_t log2bpp = 0; log2bpp <= 5; log2bpp++) {
+    uint32_t pixels = (ROW_WORDS * 32) >> log2bpp;
+
+    for (int i = 0; i < 200000; i++) {
+      uint32_t left = rand() % pixels;
+      uint32_t right = left + rand() % (pixels - left);
+      if (rand() % 4 == 0) right = left + rand() % 4;
+      if (right >= pixels) right = pixels - 1;
+
+      uint32_t orr;
+      uint32_t eor = random_word();
+      switch (rand() % 5) {
+      case 0: orr = 0xffffffff; break;          // Store
+      case 1: orr = 0; eor = 0; break;          // No effect
+      case 2: orr = 0; eor = 0xffffffff; break; // Invert
+      default: orr = random_word();
+      }
+
+      for (int w = 0; w < ROW_WORDS + 2; w++) row[w] = expected[w] = random_word();
+
+      span_fill_row( row + 1, left, right, log2bpp, orr, eor );
+      pixel_at_a_time( expected + 1, left, right, log2bpp, orr, eor );
+
+      if (0 != memcmp( row, expected, sizeof( row ) )) {
+        printf( "%d bpp, %u to %u, orr %08x, eor %08x\n", 1 << log2bpp, left, right, orr, eor );
+        fail( "Wrong pixels", i );
+      }
+      spans++;
+    }
+  }
+
+  printf( "%d spans: OK\n", spans );
+}
+
+static void compare( uint32_t log2bpp, uint32_t orr, uint32_t eor, char const *name )
+{
+  static uint32_t screen_row[1920];     // 32bpp, the largest
+  const int rounds = 20000;
+  uint32_t right = 1918;
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    span_fill_row( screen_row, 1, right, log2bpp, orr, eor );
+    asm volatile ( "" : : "r" (screen_row) : "memory" );
+  }
+  uint64_t span_time = now_ns() - start;
+
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    pixel_at_a_time( screen_row, 1, right, log2bpp, orr, eor );
+    asm volatile ( "" : : "r" (screen_row) : "memory" );
+  }
+  uint64_t pixel_time = now_ns() - start;
+
+  printf( "%2d bpp %-6s: span %6.0f ns, pixel at a time %6.0f ns per row\n", 1 << log2bpp, name,
+          (double) span_time / rounds, (double) pixel_time / rounds );
+}
+
+int main( int argc, char const *argv[] )
+{
+  random_spans();
+
+  for (uint32_t log2bpp = 0; log2bpp <= 5; log2bpp++) {
+    compare( log2bpp, 0xffffffff, 0x12345678, "store" );
+  }
+  compare( 5, 0, 0xffffffff, "invert" );
+  compare( 3, 0x0f0f0f0f, 0x11111111, "or/eor" );
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Cost of finding the module that provides a SWI, walking the module list
+// (as do_module_swi used to) against looking it up in the chunk table, for
+// increasing numbers of modules.
+//
+// gcc -O2 -I ../.. benchmark.c -o benchmark && ./benchmark
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#include "include/swi_chunks.h"
+
+typedef struct module module;
+
+struct module {
+  uint32_t swi_chunk;
+  module *next;
+};
+
+static module modules[200];
+
+static module *walk( module *head, uint32_t chunk )
+{
+  module *m = head;
+  while (m != 0 && m->swi_chunk != chunk) {
+    m = m->next;
+  }
+  return m;
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const int calls = 10000000;
+
+int main( int argc, char const *argv[] )
+{
+  static const int sizes[] = { 1, 10, 25, 50, 100, 150, 200 };
+
+  // About a third of the ROM modules provide no SWIs
+  srand( 1 );
+  for (int i = 0; i < sizeof( modules ) / sizeof( modules[0] ); i++) {
+    modules[i].swi_chunk = (i % 3 == 2) ? 0 : (0x40000 + 0x40 * i) | ((rand() & 0x3) << 18);
+  }
+
+  printf( "Modules   Walk ns/call   Table ns/call\n" );
+
+  for (int s = 0; s < sizeof( sizes ) / sizeof( sizes[0] ); s++) {
+    int count = sizes[s];
+    static swi_chunk_table table;
+    table = (swi_chunk_table) { 0 };
+
+    for (int i = 0; i < count; i++) {
+      modules[i].next = (i + 1 < count) ? &modules[i+1] : 0;
+      if (!swi_chunk_insert( &table, modules[i].swi_chunk, (void*) &modules[i] )) {
+        printf( "Table full\n" );
+        return 1;
+      }
+    }
+
+    // Call the SWIs of every module in turn, like a desktop spread over
+    // Wimp, Font, ColourTrans, etc.
+    uint32_t chunks[count];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+      if (modules[i].swi_chunk != 0) chunks[n++] = modules[i].swi_chunk;
+    }
+    if (n == 0) chunks[n++] = modules[0].swi_chunk ^ 0x40; // Unknown SWI
+
+    uintptr_t check = 0;
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < calls; i++) {
+      check += (uintptr_t) walk( &modules[0], chunks[i % n] );
+    }
+    uint64_t walked = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < calls; i++) {
+      check -= (uintptr_t) swi_chunk_lookup( &table, chunks[i % n] );
+    }
+    uint64_t looked_up = now_ns() - start;
+
+    if (check != 0) {
+      printf( "Table and list disagree!\n" );
+      return 1;
+    }
+
+    printf( "%7d   %12.2f   %13.2f\n", count,
+            (double) walked / calls, (double) looked_up / calls );
+  }
+
+  // Removal leaves the other entries reachable
+  {
+    static swi_chunk_table table;
+    table = (swi_chunk_table) { 0 };
+    for (int i = 0; i < 150; i++) {
+      swi_chunk_insert( &table, modules[i].swi_chunk, (void*) &modules[i] );
+    }
+    for (int i = 0; i < 150; i += 2) {
+      swi_chunk_remove( &table, modules[i].swi_chunk, (void*) &modules[i] );
+    }
+    for (int i = 0; i < 150; i++) {
+      void *expected = ((i & 1) != 0 && modules[i].swi_chunk != 0) ? &modules[i] : 0;
+      if (swi_chunk_lookup( &table, modules[i].swi_chunk ) != expected
+       && modules[i].swi_chunk != 0) {
+        printf( "Lookup failed after removal: %d\n", i );
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
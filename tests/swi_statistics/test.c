@@ -0,0 +1,109 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the per-SWI statistics tables (include/swi_statistics.h).
+//
+// Two "cores" record calls and waits in their own tables, which are then
+// added up and the busiest SWIs picked out, as TaskOp_SWIStatistics does.
+//
+// gcc -O2 -I ../.. test.c -o test && ./test
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#define number_of( arr ) (sizeof( arr ) / sizeof( arr[0] ))
+
+#include "include/swi_statistics.h"
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static swi_statistics_table cores[2];
+static swi_statistics_table total;
+
+int main()
+{
+  // Buckets: 0, then by the highest bit set
+  if (swi_statistics_bucket( 0 ) != 0) fail( "Bucket of 0", swi_statistics_bucket( 0 ) );
+  if (swi_statistics_bucket( 1 ) != 1) fail( "Bucket of 1", swi_statistics_bucket( 1 ) );
+  if (swi_statistics_bucket( 3 ) != 2) fail( "Bucket of 3", swi_statistics_bucket( 3 ) );
+  if (swi_statistics_bucket( 4 ) != 3) fail( "Bucket of 4", swi_statistics_bucket( 4 ) );
+  if (swi_statistics_bucket( 0x7fffffff ) != 31) fail( "Bucket of 2^31-1", swi_statistics_bucket( 0x7fffffff ) );
+  if (swi_statistics_bucket( 0xffffffff ) != 31) fail( "Bucket of 2^32-1", swi_statistics_bucket( 0xffffffff ) );
+
+  // SWI 0 (OS_WriteC) is a SWI like any other
+  swi_statistics *writec = swi_statistics_entry( &cores[0], 0 );
+  if (writec == 0 || writec->key == 0) fail( "SWI 0 not recorded", 0 );
+  if (swi_statistics_entry( &cores[0], 0 ) != writec) fail( "SWI 0 added twice", 0 );
+
+  // SWI n costs n cycles per call, and is called n times on each core
+  for (int core = 0; core < number_of( cores ); core++) {
+    for (uint32_t swi = 1; swi <= 100; swi++) {
+      uint32_t number = (swi < 50) ? swi : 0x40000 + swi; // Some module SWIs
+      swi_statistics *entry = swi_statistics_entry( &cores[core], number );
+      if (entry == 0) fail( "Table full", swi );
+      for (int i = 0; i < swi; i++) swi_statistics_call( entry, swi );
+      if (swi % 10 == 0) swi_statistics_wait( entry, 1000 );
+    }
+  }
+
+  swi_statistics_add( &total, &cores[0] );
+  swi_statistics_add( &total, &cores[1] );
+
+  swi_statistics *entry = swi_statistics_entry( &total, 0x40000 + 64 );
+  if (entry->calls != 2 * 64) fail( "Calls", entry->calls );
+  if (entry->cycles != 2 * 64 * 64) fail( "Cycles", entry->cycles );
+  if (entry->waits != 0) fail( "Waits", entry->waits );
+  if (entry->histogram[7] != 2 * 64) fail( "Histogram", entry->histogram[7] );
+
+  entry = swi_statistics_entry( &total, 30 );
+  if (entry->waits != 2 || entry->wait_ticks != 2000) fail( "Wait ticks", entry->wait_ticks );
+
+  // The busiest, most first
+  swi_statistics top[5];
+  uint32_t count = swi_statistics_top( &total, top, number_of( top ) );
+  if (count != number_of( top )) fail( "Top count", count );
+  for (int i = 0; i < count; i++) {
+    if (top[i].key != ((0x40000 + 100 - i) | SWI_STATISTICS_USED)) fail( "Top order", i );
+  }
+
+  // Fewer entries than asked for
+  memset( &total, 0, sizeof( total ) );
+  swi_statistics_call( swi_statistics_entry( &total, 7 ), 3 );
+  swi_statistics_call( swi_statistics_entry( &total, 8 ), 5 );
+  count = swi_statistics_top( &total, top, number_of( top ) );
+  if (count != 2 || top[0].key != (8 | SWI_STATISTICS_USED) || top[1].key != (7 | SWI_STATISTICS_USED)) fail( "Short top", count );
+
+  // Full table: no entry, rather than a wrong one
+  memset( &total, 0, sizeof( total ) );
+  for (uint32_t swi = 0; swi < SWI_STATISTICS_SIZE; swi++) {
+    if (swi_statistics_entry( &total, swi ) == 0) fail( "Full too early", swi );
+  }
+  if (swi_statistics_entry( &total, SWI_STATISTICS_SIZE ) != 0) fail( "Overfull", 0 );
+  if (swi_statistics_entry( &total, 17 ) == 0) fail( "Existing entry lost", 17 );
+
+  printf( "SWI statistics OK\n" );
+
+  return 0;
+}
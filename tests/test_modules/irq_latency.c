@@ -0,0 +1,147 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Interrupt latency reporting module.
+
+   On initialisation, starts a task that, every ten seconds, writes the
+   histogram of the time from each interrupt arriving to the task that
+   handles it resuming, for each core, to the debug pipe, then clears
+   it.
+
+   Each line is the number of interrupts handled in less than 1, 2, 4,
+   8, ... generic timer counts; the frequency of the timer is reported
+   first.
+*/
+
+/* Build commands:
+  arm-linux-gnueabi-gcc-8 irq_latency.c -Wall -o IrqLatency.elf -fpic -I ../.. -I ../../include
+    -nostartfiles -nostdlib -fno-zero-initialized-in-bss -static -O4
+    -g -march=armv8-a+nofp -T ../../module.script -I . -DNO_MODULE_SIZE &&
+  arm-linux-gnueabi-objdump -x --disassemble-all IrqLatency.elf > IrqLatency.dump &&
+  arm-linux-gnueabi-objcopy -R .ignoring -O binary IrqLatency.elf IrqLatency
+*/
+
+const unsigned module_flags = 1;
+// Bit 0: 32-bit compatible
+// Bit 1: Multiprocessing
+
+#include "module.h"
+
+NO_start;
+//NO_init;
+NO_finalise;
+NO_service_call;
+//NO_title;
+NO_help;
+NO_keywords;
+NO_swi_handler;
+NO_swi_names;
+NO_swi_decoder;
+NO_messages_file;
+
+const char title[] = "IrqLatency";
+
+struct workspace {
+  uint32_t number_of_cores;
+  uint64_t stack[128];
+};
+
+static void start_task( void *code, void *stack_top, struct workspace *ws )
+{
+  register uint32_t request asm ( "r0" ) = TaskOp_Start;
+  register void *Rcode asm ( "r1" ) = code;
+  register void *Rstack_top asm ( "r2" ) = stack_top;
+  register struct workspace *Rws asm( "r3" ) = ws;
+
+  asm volatile ( "svc %[swi]"
+      :
+      : [swi] "i" (OS_ThreadOp)
+      , "r" (request)
+      , "r" (Rcode)
+      , "r" (Rstack_top)
+      , "r" (Rws)
+      : "lr", "cc" );
+}
+
+// Returns the timer frequency
+static uint32_t read_and_clear( uint32_t core, uint32_t *histogram )
+{
+  register uint32_t request asm ( "r0" ) = TaskOp_InterruptLatency;
+  register uint32_t Rcore asm ( "r1" ) = core;
+  register uint32_t *Rhistogram asm ( "r2" ) = histogram;
+  register uint32_t clear asm ( "r3" ) = 1;
+
+  register uint32_t frequency asm ( "r0" );
+
+  asm volatile ( "svc %[swi]"
+      : "=r" (frequency)
+      : [swi] "i" (OS_ThreadOp)
+      , "r" (request)
+      , "r" (Rcore)
+      , "r" (Rhistogram)
+      , "r" (clear)
+      : "lr", "cc", "memory" );
+
+  return frequency;
+}
+
+static void WriteDecimal( uint32_t num )
+{
+  char buffer[12];
+  char *c = &buffer[sizeof( buffer ) - 1];
+  *c = '\0';
+  if (num == 0) *--c = '0';
+  while (num > 0) {
+    *--c = '0' + (num % 10);
+    num = num / 10;
+  }
+  Write0( c );
+}
+
+static void __attribute__(( noreturn )) report_task( uint32_t handle, struct workspace *ws )
+{
+  for (;;) {
+    Sleep( 1000 );
+
+    uint32_t histogram[16];
+
+    for (int core = 0; core < ws->number_of_cores; core++) {
+      uint32_t frequency = read_and_clear( core, histogram );
+      if (core == 0) {
+        WriteS( "IRQ latency, timer counts at " ); WriteDecimal( frequency ); WriteS( "Hz" ); NewLine;
+      }
+      WriteS( "Core " ); WriteDecimal( core ); WriteS( ":" );
+      for (int i = 0; i < number_of( histogram ); i++) {
+        Space; WriteDecimal( histogram[i] );
+      }
+      NewLine;
+    }
+  }
+}
+
+void init( uint32_t this_core, uint32_t number_of_cores )
+{
+  struct workspace **private;
+  // Preserve r12, in case we make a function call
+  asm volatile ( "mov %[private_word], r12" : [private_word] "=r" (private) );
+
+  if (*private != 0) return;
+
+  struct workspace *workspace = rma_claim( sizeof( struct workspace ) );
+  workspace->number_of_cores = number_of_cores;
+  *private = workspace;
+
+  start_task( report_task, &workspace->stack[128], workspace );
+}
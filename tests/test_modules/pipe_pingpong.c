@@ -0,0 +1,209 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Pipe ping-pong benchmark module.
+
+   On initialisation, starts a task (in its own slot) that sends messages
+   of various sizes through one pipe to an echo task, which sends them
+   straight back through another, for one second each. The echo task is
+   first in the same slot, then in another one.
+
+   The results go to the debug pipe, as messages (each way) per second and
+   bytes per second.
+
+   The echo tasks are left waiting for data, forever.
+*/
+
+/* Build commands:
+  arm-linux-gnueabi-gcc-8 pipe_pingpong.c -Wall -o PipePingPong.elf -fpic -I ../.. -I ../../include
+    -nostartfiles -nostdlib -fno-zero-initialized-in-bss -static -O4
+    -g -march=armv8-a+nofp -T ../../module.script -I . -DNO_MODULE_SIZE &&
+  arm-linux-gnueabi-objdump -x --disassemble-all PipePingPong.elf > PipePingPong.dump &&
+  arm-linux-gnueabi-objcopy -R .ignoring -O binary PipePingPong.elf PipePingPong
+*/
+
+const unsigned module_flags = 1;
+// Bit 0: 32-bit compatible
+// Bit 1: Multiprocessing
+
+#include "module.h"
+
+NO_start;
+//NO_init;
+NO_finalise;
+NO_service_call;
+//NO_title;
+NO_help;
+NO_keywords;
+NO_swi_handler;
+NO_swi_names;
+NO_swi_decoder;
+NO_messages_file;
+
+const char title[] = "PipePingPong";
+
+#include "include/pipeop.h"
+
+struct workspace {
+  uint64_t ping_stack[256];
+  uint64_t echo_stack[2][256];
+};
+
+static uint32_t monotonic_time()
+{
+  register uint32_t time asm( "r0" );
+  asm volatile ( "svc 0x20042" : "=r" (time) : : "lr", "cc" );
+  return time;
+}
+
+static uint32_t start_task( void *code, void *stack_top, struct workspace *ws, uint32_t r4, uint32_t r5, bool separate )
+{
+  register uint32_t request asm ( "r0" ) = TaskOp_Start + (separate ? 0x100 : 0);
+  register void *Rcode asm ( "r1" ) = code;
+  register void *Rstack_top asm ( "r2" ) = stack_top;
+  register struct workspace *Rws asm( "r3" ) = ws;
+  register uint32_t Rr4 asm( "r4" ) = r4;
+  register uint32_t Rr5 asm( "r5" ) = r5;
+
+  register uint32_t handle asm ( "r0" );
+
+  asm volatile ( "svc %[swi]"
+      : "=r" (handle)
+      : [swi] "i" (OS_ThreadOp)
+      , "r" (request)
+      , "r" (Rcode)
+      , "r" (Rstack_top)
+      , "r" (Rws)
+      , "r" (Rr4)
+      , "r" (Rr5)
+      : "lr", "cc" );
+
+  return handle;
+}
+
+static void WriteDecimal( uint32_t num )
+{
+  char buffer[12];
+  char *c = &buffer[sizeof( buffer ) - 1];
+  *c = '\0';
+  if (num == 0) *--c = '0';
+  while (num > 0) {
+    *--c = '0' + (num % 10);
+    num = num / 10;
+  }
+  Write0( c );
+}
+
+static void copy( uint32_t *to, uint32_t const *from, uint32_t bytes )
+{
+  for (int i = 0; i < bytes / 4; i++) to[i] = from[i];
+}
+
+// Returns everything that arrives in the input pipe through the output pipe
+static void __attribute__(( noreturn )) echo_task( uint32_t handle, struct workspace *ws, uint32_t in, uint32_t out )
+{
+  PipeSpace data = PipeOp_WaitForData( in, 4 );
+
+  for (;;) {
+    uint32_t bytes = data.available;
+    PipeSpace space = PipeOp_WaitForSpace( out, bytes );
+
+    copy( space.location, data.location, bytes );
+
+    PipeOp_SpaceFilled( out, bytes );
+    PipeOp_DataConsumed( in, bytes );
+
+    data = PipeOp_WaitForData( in, 4 );
+  }
+}
+
+static const uint32_t sizes[] = { 4, 64, 1024, 4096 };
+
+static void ping( uint32_t to_echo, uint32_t from_echo, uint32_t size )
+{
+  uint32_t count = 0;
+  uint32_t start = monotonic_time();
+  uint32_t now;
+
+  do {
+    PipeSpace space = PipeOp_WaitForSpace( to_echo, size );
+    ((uint32_t*) space.location)[0] = count;
+    PipeOp_SpaceFilled( to_echo, size );
+
+    PipeSpace data = PipeOp_WaitForData( from_echo, size );
+    assert( ((uint32_t*) data.location)[0] == count );
+    PipeOp_DataConsumed( from_echo, size );
+
+    count++;
+    now = monotonic_time();
+  } while (now - start < 100);
+
+  // Messages each way
+  uint32_t per_second = (200 * count) / (now - start);
+
+  WriteDecimal( size ); WriteS( " bytes: " );
+  WriteDecimal( per_second ); WriteS( " messages/s, " );
+  WriteDecimal( per_second * size ); WriteS( " bytes/s" ); NewLine;
+}
+
+static void __attribute__(( noreturn )) ping_task( uint32_t handle, struct workspace *ws )
+{
+  for (int separate = 0; separate < 2; separate++) {
+    // Room for a few of the largest messages
+    uint32_t to_echo = PipeOp_CreateForTransfer( 16384 );
+    uint32_t from_echo = PipeOp_CreateForTransfer( 16384 );
+
+    // Whichever task waits first takes the other ends
+    PipeOp_PassingOff( to_echo, 0 );
+    PipeOp_PassingOver( from_echo, 0 );
+
+    start_task( echo_task, &ws->echo_stack[separate][256], ws, to_echo, from_echo, separate );
+
+    WriteS( "Pipe ping-pong, echo task in " );
+    if (separate) WriteS( "another slot" ); else WriteS( "the same slot" );
+    NewLine;
+
+    for (int i = 0; i < number_of( sizes ); i++) {
+      ping( to_echo, from_echo, sizes[i] );
+    }
+  }
+
+  for (;;) Sleep( 100000 );
+}
+
+static struct workspace *new_workspace()
+{
+  uint32_t required = sizeof( struct workspace );
+
+  struct workspace *memory = rma_claim( required );
+
+  memset( memory, 0, required );
+
+  return memory;
+}
+
+void init( uint32_t this_core, uint32_t number_of_cores )
+{
+  struct workspace **private;
+  // Preserve r12, in case we make a function call
+  asm volatile ( "mov %[private_word], r12" : [private_word] "=r" (private) );
+
+  if (*private != 0) return;
+
+  struct workspace *workspace = new_workspace();
+  *private = workspace;
+
+  start_task( ping_task, &workspace->ping_stack[256], workspace, 0, 0, true );
+}
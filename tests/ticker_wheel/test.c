@@ -0,0 +1,344 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the ticker event timing wheel (swis/ticker.c).
+//
+// Events must be handled on exactly the tick they're due, however far
+// ahead they were registered, OS_CallEvery events must repeat until
+// removed, and handlers may register and remove events (including
+// themselves). The cores are simulated by changing workspace.core_number.
+//
+// Finally, random events are registered and removed, and checked against
+// a simple list of what should happen when.
+//
+// Compile with -static so that code addresses fit in 32 bits:
+// gcc -O2 -static -I .. -I ../.. test.c -o test && ./test
+
+#include <stdlib.h>
+
+#include "../../swis/ticker.c"
+
+struct core_workspace workspace = {};
+struct shared_workspace shared = {};
+
+static int allocated = 0;
+
+void *rma_allocate( uint32_t size )
+{
+  allocated++;
+  return malloc( size );
+}
+
+void rma_free( void const *block )
+{
+  allocated--;
+  free( (void*) block );
+}
+
+bool claim_lock( uint32_t *lock )
+{
+  if (*lock != 0) {
+    printf( "Lock already held\n" );
+    exit( 1 );
+  }
+  *lock = 1;
+  return false;
+}
+
+void release_lock( uint32_t *lock )
+{
+  *lock = 0;
+}
+
+bool error_nomem( svc_registers *regs )
+{
+  printf( "Out of memory\n" );
+  exit( 1 );
+}
+
+void run_handler( uint32_t code, uint32_t private )
+{
+  void (*handler)( uint32_t ) = (void*) (uintptr_t) code;
+  handler( private );
+}
+
+void publish_wheel( ticker_wheel *wheel )
+{
+  shared.kernel.ticker_wheels[workspace.core_number] = wheel;
+}
+
+TaskSlot *current_slot()
+{
+  return (void*) 0x5107;
+}
+
+void claim_TickerV()
+{
+}
+
+static uint32_t ticks[8] = { 0 }; // Ticks handled, per core
+
+static void tick()
+{
+  ticker_wheel *wheel = shared.kernel.ticker_wheels[workspace.core_number];
+  ticks[workspace.core_number]++;
+  if (wheel != 0) ticker_wheel_tick( wheel );
+}
+
+static void fail( char const *message, uint32_t n )
+{
+  printf( "%s: %u\n", message, n );
+  exit( 1 );
+}
+
+#define MAX_EVENTS 1024
+
+static uint32_t fired_at[MAX_EVENTS]; // Tick the event was last handled
+static uint32_t fired_count[MAX_EVENTS];
+
+static void record( uint32_t private )
+{
+  fired_at[private] = ticks[workspace.core_number];
+  fired_count[private]++;
+}
+
+static void call_after( uint32_t delay, void (*code)( uint32_t ), uint32_t private )
+{
+  svc_registers regs = { .r = { delay, (uint32_t) (uintptr_t) code, private } };
+  do_OS_CallAfter( &regs );
+}
+
+static void call_every( uint32_t period, void (*code)( uint32_t ), uint32_t private )
+{
+  svc_registers regs = { .r = { period, (uint32_t) (uintptr_t) code, private } };
+  do_OS_CallEvery( &regs );
+}
+
+static void remove_event( void (*code)( uint32_t ), uint32_t private )
+{
+  svc_registers regs = { .r = { 0, (uint32_t) (uintptr_t) code, private } };
+  do_OS_RemoveTickerEvent( &regs );
+}
+
+static void reset()
+{
+  memset( fired_at, 0, sizeof( fired_at ) );
+  memset( fired_count, 0, sizeof( fired_count ) );
+}
+
+static void check_empty( char const *test )
+{
+  for (int i = 0; i < number_of( shared.kernel.ticker_wheels ); i++) {
+    ticker_wheel *wheel = shared.kernel.ticker_wheels[i];
+    if (wheel != 0 && wheel->events != 0) {
+      printf( "%s: %u events left on core %d\n", test, wheel->events, i );
+      exit( 1 );
+    }
+  }
+  // Only the wheels themselves
+  int wheels = 0;
+  for (int i = 0; i < number_of( shared.kernel.ticker_wheels ); i++) {
+    if (shared.kernel.ticker_wheels[i] != 0) wheels++;
+  }
+  if (allocated != wheels) fail( "Events not freed", allocated - wheels );
+  printf( "%s: OK\n", test );
+}
+
+static void exact_delays()
+{
+  static const uint32_t delays[] = { 0, 1, 2, 5, 63, 64, 65, 127, 128, 4095, 4096, 4097,
+                                     262143, 262144, 262145, 300000,
+                                     (1 << 24) - 1, 1 << 24, (1 << 24) + 1, 20000000 };
+
+  reset();
+  // Part way through a cycle of every level
+  for (int i = 0; i < 100000; i++) tick();
+
+  uint32_t start = ticks[0];
+  for (int i = 0; i < number_of( delays ); i++) {
+    call_after( delays[i], record, i );
+  }
+
+  while (ticks[0] - start < 20000001) tick();
+
+  for (int i = 0; i < number_of( delays ); i++) {
+    uint32_t expected = start + (delays[i] == 0 ? 1 : delays[i]);
+    if (fired_count[i] != 1) fail( "Not handled exactly once, delay", delays[i] );
+    if (fired_at[i] != expected) fail( "Handled at the wrong time, delay", delays[i] );
+  }
+
+  check_empty( "Exact delays" );
+}
+
+static void periodic()
+{
+  reset();
+  uint32_t start = ticks[0];
+  call_every( 3, record, 1 );
+  call_every( 100, record, 2 );
+  call_every( 0, record, 3 ); // Every tick
+
+  for (int i = 0; i < 1000; i++) tick();
+
+  if (fired_count[1] != 333 || fired_at[1] != start + 999) fail( "Every 3", fired_count[1] );
+  if (fired_count[2] != 10 || fired_at[2] != start + 1000) fail( "Every 100", fired_count[2] );
+  if (fired_count[3] != 1000) fail( "Every tick", fired_count[3] );
+
+  remove_event( record, 1 );
+  remove_event( record, 2 );
+  remove_event( record, 3 );
+  for (int i = 0; i < 1000; i++) tick();
+
+  if (fired_count[1] != 333 || fired_count[2] != 10 || fired_count[3] != 1000) fail( "Handled after removal", 0 );
+
+  check_empty( "Periodic" );
+}
+
+static void remove_self( uint32_t private )
+{
+  record( private );
+  if (fired_count[private] == 5) remove_event( remove_self, private );
+}
+
+static void register_another( uint32_t private )
+{
+  record( private );
+  // Due on the next tick, not this one, even though it goes in the slot
+  // that's being handled.
+  if (private < 10) call_after( 0, register_another, private + 1 );
+}
+
+static void remove_other( uint32_t private )
+{
+  record( private );
+  remove_event( record, private + 1 ); // Due on the same tick
+}
+
+static void handlers()
+{
+  reset();
+  uint32_t start = ticks[0];
+  call_every( 2, remove_self, 1 );
+  call_after( 1, register_another, 2 );
+  call_after( 64, remove_other, 20 );
+  call_after( 64, record, 21 );
+
+  for (int i = 0; i < 100; i++) tick();
+
+  if (fired_count[1] != 5 || fired_at[1] != start + 10) fail( "Self removal", fired_count[1] );
+  for (int i = 2; i <= 10; i++) {
+    if (fired_count[i] != 1 || fired_at[i] != start + i - 1) fail( "Registered by a handler", i );
+  }
+  if (fired_count[20] != 1 || fired_count[21] != 0) fail( "Removed by a handler", fired_count[21] );
+
+  check_empty( "Handlers" );
+}
+
+static void cores()
+{
+  reset();
+  workspace.core_number = 1;
+  call_after( 10, record, 1 );
+  call_every( 10, record, 2 );
+  uint32_t start = ticks[1];
+
+  // Only core 1's ticks count
+  workspace.core_number = 0;
+  for (int i = 0; i < 50; i++) tick();
+  if (fired_count[1] != 0 || fired_count[2] != 0) fail( "Handled on the wrong core", 0 );
+
+  workspace.core_number = 1;
+  for (int i = 0; i < 20; i++) tick();
+  if (fired_count[1] != 1 || fired_at[1] != start + 10) fail( "Not handled on core 1", 1 );
+  if (fired_count[2] != 2) fail( "Not handled on core 1", 2 );
+
+  // Removed from another core
+  workspace.core_number = 2;
+  remove_event( record, 2 );
+
+  workspace.core_number = 1;
+  for (int i = 0; i < 20; i++) tick();
+  if (fired_count[2] != 2) fail( "Not removed by another core", fired_count[2] );
+
+  ticker_wheel *wheel = shared.kernel.ticker_wheels[1];
+  ticker_event *e = wheel->hash[0];
+  if (wheel->events != 0 || e != 0) fail( "Left in core 1's wheel", wheel->events );
+
+  workspace.core_number = 0;
+  check_empty( "Cores" );
+}
+
+static uint32_t random_number( uint32_t *seed )
+{
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+}
+
+static void random_events()
+{
+  reset();
+  uint32_t seed = 1;
+  uint32_t due[MAX_EVENTS] = { 0 }; // 0: not registered
+  uint32_t start = ticks[0];
+
+  for (int round = 0; round < 200000; round++) {
+    uint32_t r = random_number( &seed );
+    uint32_t n = r % MAX_EVENTS;
+    uint32_t now = ticks[0];
+
+    if (due[n] == 0) {
+      // Mostly short delays, some that need cascading
+      uint32_t delay = 1 + ((r & (1 << 20)) ? (r >> 10) % 300000 : (r >> 10) % 200);
+      call_after( delay, record, n );
+      due[n] = now + delay;
+    }
+    else if ((r & (1 << 21)) != 0) {
+      remove_event( record, n );
+      due[n] = 0;
+    }
+
+    if ((r & 3) == 0) {
+      tick();
+      now = ticks[0];
+      for (int i = 0; i < MAX_EVENTS; i++) {
+        if (due[i] == now) {
+          if (fired_at[i] != now) fail( "Not handled in time", i );
+          due[i] = 0;
+        }
+        else if (fired_at[i] == now) fail( "Handled at the wrong time", i );
+      }
+    }
+  }
+
+  // Let everything still registered go off
+  for (int i = 0; i < 300001; i++) tick();
+  for (int i = 0; i < MAX_EVENTS; i++) {
+    if (due[i] != 0 && fired_at[i] != due[i]) fail( "Not handled, finally", i );
+  }
+
+  printf( "%u ticks, ", ticks[0] - start );
+  check_empty( "Random" );
+}
+
+int main( int argc, char const *argv[] )
+{
+  exact_delays();
+  periodic();
+  handlers();
+  cores();
+  random_events();
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the kernel event trace records (include/trace.h).
+//
+// The pipe is emulated by a small array; "publishing" hands what has been
+// written over to the reader, who consumes all of it, and gives the
+// recorder the whole array again, as publish_trace does with the space in
+// the pipe.
+//
+// Records are written in order, with interrupts disabled; when there's no
+// space they are counted, and the count is recorded in front of the next
+// record that fits, so that nothing is lost without the reader knowing.
+//
+// gcc -O2 -I ../.. test.c -o test && ./test
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#define HOSTED_TESTING
+
+#include "include/trace.h"
+
+static uint32_t cycle_counter;
+static bool interrupts_disabled = false;
+
+uint32_t trace_cycles()
+{
+  return ++cycle_counter;
+}
+
+uint32_t trace_interrupts_off()
+{
+  uint32_t was = interrupts_disabled;
+  interrupts_disabled = true;
+  return was;
+}
+
+void trace_interrupts_restore( uint32_t cpsr )
+{
+  interrupts_disabled = cpsr;
+}
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+#define RECORDS 8
+
+static trace_record pipe[RECORDS];
+static trace_buffer trace;
+
+// Returns the number of records handed over
+static uint32_t publish( trace_record *out )
+{
+  uint32_t count = trace.written / sizeof( trace_record );
+  for (int i = 0; i < count; i++) out[i] = pipe[i];
+  trace.written = 0;
+  trace.location = pipe;
+  trace.available = sizeof( pipe );
+  return count;
+}
+
+int main()
+{
+  trace_record out[RECORDS];
+
+  publish( out );
+
+  // In order, with the arguments
+  for (int i = 0; i < 5; i++) {
+    trace_write( &trace, Trace_SWIEntry, 0x20000 + i, i );
+    if (interrupts_disabled) fail( "Interrupts left disabled", i );
+  }
+  if (publish( out ) != 5) fail( "Records lost", 5 );
+  for (int i = 0; i < 5; i++) {
+    if (out[i].event != Trace_SWIEntry || out[i].a != 0x20000 + i || out[i].b != i) fail( "Wrong record", i );
+    if (i > 0 && out[i].cycles <= out[i-1].cycles) fail( "Out of order", i );
+  }
+
+  // Full: the extra records are counted, not written
+  for (int i = 0; i < RECORDS + 3; i++) {
+    trace_write( &trace, Trace_IRQEntry, i, 0 );
+  }
+  if (trace.dropped != 3) fail( "Dropped", trace.dropped );
+  if (publish( out ) != RECORDS) fail( "Not full", 0 );
+  if (out[RECORDS - 1].a != RECORDS - 1) fail( "Wrong last record", out[RECORDS - 1].a );
+
+  // The count comes first, once there's room
+  trace_write( &trace, Trace_IRQExit, 42, 0 );
+  if (trace.dropped != 0) fail( "Still dropping", trace.dropped );
+  if (publish( out ) != 2) fail( "Expected two records", 0 );
+  if (out[0].event != Trace_Dropped || out[0].a != 3) fail( "Dropped count not recorded", out[0].a );
+  if (out[1].event != Trace_IRQExit || out[1].a != 42) fail( "Record after count lost", out[1].a );
+
+  // Only room for one record: the count doesn't fit with it, so both wait
+  for (int i = 0; i < RECORDS - 1; i++) {
+    trace_write( &trace, Trace_TaskSwitch, i, 0 );
+  }
+  trace_write( &trace, Trace_TaskSwitch, 100, 0 ); // Fills it
+  trace_write( &trace, Trace_TaskSwitch, 101, 0 ); // Dropped
+  publish( out );
+  trace.available = 2 * sizeof( trace_record ) - 4; // Not quite two
+  trace_write( &trace, Trace_TaskSwitch, 102, 0 );
+  if (trace.written != 0 || trace.dropped != 2) fail( "Count separated from records", trace.dropped );
+  publish( out );
+  trace_write( &trace, Trace_MMUSwitch, 103, 0 );
+  if (publish( out ) != 2 || out[0].a != 2 || out[1].a != 103) fail( "Dropped count wrong", out[0].a );
+
+  printf( "Trace OK\n" );
+
+  return 0;
+}
@@ -0,0 +1,227 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Cost of reading system variables from the native store, against an
+// alphabetically ordered linked list (as the ROM, and the first native
+// attempt, kept them), for increasing numbers of variables.
+//
+// Plain reads are of random existing names, the enumeration is of
+// File$Type_* (one in four of the variables), one OS_ReadVarVal per match,
+// as *Show or the Filer would.
+//
+// Like test001, compile with -static so that pointers fit in 32 bits:
+// gcc -O2 -static -w -I .. benchmark.c ../../swis/expr.c -o benchmark && ./benchmark
+
+#include <stdlib.h>
+#include <time.h>
+
+// Including the source (which includes inkernel.h) gives access to the
+// name comparisons for the list
+#include "../../swis/varvals.c"
+
+void *rma_allocate( uint32_t size )
+{
+  void *result = malloc( size );
+  if ((uint64_t) result + size > 0xffffffffull) {
+    printf( "Heap above 4GiB, won't work\n" );
+    exit( 1 );
+  }
+  return result;
+}
+
+void rma_free( void const *block )
+{
+  free( (void*) block );
+}
+
+bool error_nomem( svc_registers *regs )
+{
+  printf( "Out of memory\n" );
+  exit( 1 );
+}
+
+bool claim_lock( uint32_t *lock )
+{
+  *lock = 1;
+  return false;
+}
+
+void release_lock( uint32_t *lock )
+{
+  *lock = 0;
+}
+
+void sysvar_barrier()
+{
+  __sync_synchronize();
+}
+
+void synchronise_code( void const *code, uint32_t length )
+{
+}
+
+error_block *read_code_variable( variable *v, char const **value, uint32_t *length )
+{
+  return 0;
+}
+
+error_block *write_code_variable( variable *v, char const *value, uint32_t length )
+{
+  return 0;
+}
+
+struct core_workspace workspace = {};
+struct shared_workspace shared = {};
+
+// The list, as before
+
+typedef struct listed listed;
+struct listed {
+  listed *next;
+  char const *value;
+  char name[32];
+};
+
+static listed *list = 0;
+
+static void list_insert( listed *l )
+{
+  listed **p = &list;
+  while (*p != 0 && varnamecmp( (*p)->name, l->name ) < 0) p = &(*p)->next;
+  l->next = *p;
+  *p = l;
+}
+
+// Like the first native ReadVarVal, the context (the previous match) is
+// found by walking the list from the start.
+static listed *list_find( char const *wildcarded, listed *previous )
+{
+  listed *l = list;
+  if (previous != 0) {
+    while (l != 0 && l != previous) l = l->next;
+    if (l != 0) l = l->next;
+  }
+  while (l != 0 && !varnamematch( wildcarded, l->name )) l = l->next;
+  return l;
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char names[4000][32];
+static listed entries[4000];
+static char buffer[256];
+
+int main( int argc, char const *argv[] )
+{
+  static const int sizes[] = { 50, 200, 500, 1000, 2000, 4000 };
+  static const int reads = 1000000;
+  static const int enumerations = 100;
+
+  static const char *kinds[] = { "Alias$%x", "File$Type_%03X", "%x$Path", "Run$Dir%x" };
+
+  svc_registers regs;
+  int set = 0;
+
+  printf( "Nanoseconds per operation\n" );
+  printf( "Variables   List read   Store read   List enum   Store enum   Store set\n" );
+
+  for (int s = 0; s < sizeof( sizes ) / sizeof( sizes[0] ); s++) {
+    int count = sizes[s];
+
+    uint64_t start = now_ns();
+    for (; set < count; set++) {
+      snprintf( names[set], sizeof( names[set] ), kinds[set & 3], (set * 2654435761u) & 0xfff );
+      regs.r[0] = (uint64_t) names[set];
+      regs.r[1] = (uint64_t) "Some value";
+      regs.r[2] = 0;
+      regs.r[3] = 0;
+      regs.r[4] = VarType_LiteralString;
+      do_OS_SetVarVal( &regs );
+
+      strcpy( entries[set].name, names[set] );
+      entries[set].value = "Some value";
+      list_insert( &entries[set] );
+    }
+    uint64_t setting = now_ns() - start;
+
+    srand( 1 );
+    int picks[1024];
+    for (int i = 0; i < 1024; i++) picks[i] = rand() % count;
+
+    uintptr_t check = 0;
+
+    start = now_ns();
+    for (int i = 0; i < reads; i++) {
+      listed *l = list_find( names[picks[i & 1023]], 0 );
+      memcpy( buffer, l->value, 10 );
+      check += buffer[0];
+    }
+    uint64_t list_read = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < reads; i++) {
+      regs.r[0] = (uint64_t) names[picks[i & 1023]];
+      regs.r[1] = (uint64_t) buffer;
+      regs.r[2] = sizeof( buffer );
+      regs.r[3] = 0;
+      regs.r[4] = 0;
+      if (!do_OS_ReadVarVal( &regs )) {
+        printf( "Read failed %s\n", names[picks[i & 1023]] );
+        return 1;
+      }
+      check -= buffer[0];
+    }
+    uint64_t store_read = now_ns() - start;
+
+    int listed_types = 0;
+    start = now_ns();
+    for (int i = 0; i < enumerations; i++) {
+      listed *l = 0;
+      while (0 != (l = list_find( "File$Type_*", l ))) listed_types++;
+    }
+    uint64_t list_enum = now_ns() - start;
+
+    int stored_types = 0;
+    start = now_ns();
+    for (int i = 0; i < enumerations; i++) {
+      regs.r[3] = 0;
+      do {
+        regs.r[0] = (uint64_t) "File$Type_*";
+        regs.r[1] = (uint64_t) buffer;
+        regs.r[2] = sizeof( buffer );
+        regs.r[4] = 0;
+        if (do_OS_ReadVarVal( &regs )) stored_types++;
+      } while (regs.r[3] != 0);
+    }
+    uint64_t store_enum = now_ns() - start;
+
+    if (check != 0 || listed_types != stored_types) {
+      printf( "List and store disagree!\n" );
+      return 1;
+    }
+
+    printf( "%9d   %9.1f   %10.1f   %9.0f   %10.0f   %10.0f\n", count,
+            (double) list_read / reads, (double) store_read / reads,
+            (double) list_enum / enumerations, (double) store_enum / enumerations,
+            (double) setting / (count - (s == 0 ? 0 : sizes[s-1])) );
+  }
+
+  return 0;
+}
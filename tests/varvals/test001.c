@@ -18,22 +18,67 @@
 // and strings (for example) find themselves above the 4GiB 32-bit limit.
 // The stack is still in high memory, so don't pass pointers to non-static
 // local variables. (Or you might be able to do something with setarch...)
+//
+// gcc -static -I .. test001.c ../../swis/varvals.c ../../swis/expr.c -o test001 && ./test001
 
 #include "inkernel.h"
 #include <sys/mman.h>
 
-uint32_t heap[10240] = { 0 };
+uint32_t heap[65536] = { 0 };
 uint32_t *heap_top = heap;
 
-void *rma_allocate( uint32_t size, svc_registers *regs )
+void *rma_allocate( uint32_t size )
 {
   uint32_t *result = heap_top;
   heap_top += (size + 3) / 4;
   return result;
 }
 
+void rma_free( void const *block )
+{
+}
+
+bool error_nomem( svc_registers *regs )
+{
+  static error_block nomem = { 0x101, "RMA full" };
+  regs->r[0] = (uint64_t) &nomem;
+  return false;
+}
+
+bool claim_lock( uint32_t *lock )
+{
+  *lock = 1;
+  return false;
+}
+
+void release_lock( uint32_t *lock )
+{
+  *lock = 0;
+}
+
+void sysvar_barrier()
+{
+  __sync_synchronize();
+}
+
+void synchronise_code( void const *code, uint32_t length )
+{
+}
+
+error_block *read_code_variable( variable *v, char const **value, uint32_t *length )
+{
+  static error_block error = { 0x999, "No code variables in tests" };
+  return &error;
+}
+
+error_block *write_code_variable( variable *v, char const *value, uint32_t length )
+{
+  static error_block error = { 0x999, "No code variables in tests" };
+  return &error;
+}
+
 struct core_workspace workspace = {};
-struct shared_workspace volatile shared = {};
+struct shared_workspace shared = {};
 
 bool test_SetVarVal( svc_registers *regs, const char *name, const char *value, int length, uint32_t context, int type, uint32_t expected_error )
 {
@@ -161,10 +206,128 @@ int main()
     fails++;
   }
 
+  // Names are case insensitive
+  if (!test_ReadVarVal( &regs, "mmmMM", buffer, sizeof( buffer ), 0, 0, 0 )
+   || regs.r[2] != strlen( "mmmmmmmmmm" )) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  // Replacing a value
+  if (!test_SetVarVal( &regs, "mmmmm", "new", 0, 0, 0, 0 )) {
+    printf( "FAILED: OS_SetVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  memset( buffer, 0, sizeof( buffer ) );
+  if (!test_ReadVarVal( &regs, "MMMMM", buffer, sizeof( buffer ), 0, 0, 0 )
+   || 0 != strcmp( buffer, "new" )) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  // String variables with GSTrans codes in (stored translated)
+  if (!test_SetVarVal( &regs, "Bell", "a|Gb", 0, 0, 0, 0 )) {
+    printf( "FAILED: OS_SetVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  memset( buffer, 0, sizeof( buffer ) );
+  if (!test_ReadVarVal( &regs, "Bell", buffer, sizeof( buffer ), 0, 0, 0 )
+   || 0 != strcmp( buffer, "a\007b" )) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  // Macro variables, expanded by GSTrans on reading only if r4 = 3
+  if (!test_SetVarVal( &regs, "Macro", "x|My", 0, 0, 2, 0 )) {
+    printf( "FAILED: OS_SetVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  memset( buffer, 0, sizeof( buffer ) );
+  if (!test_ReadVarVal( &regs, "Macro", buffer, sizeof( buffer ), 0, 0, 0 )
+   || 0 != strcmp( buffer, "x|My" ) || regs.r[4] != 2) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  memset( buffer, 0, sizeof( buffer ) );
+  if (!test_ReadVarVal( &regs, "Macro", buffer, sizeof( buffer ), 0, 3, 0 )
+   || 0 != strcmp( buffer, "x\ry" ) || regs.r[4] != 0) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  // Numbers
+  static int32_t number = -1234;
+  if (!test_SetVarVal( &regs, "Number", (void*) &number, 4, 0, 1, 0 )) {
+    printf( "FAILED: OS_SetVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  if (!test_ReadVarVal( &regs, "Number", buffer, sizeof( buffer ), 0, 0, 0 )
+   || regs.r[2] != 4 || regs.r[4] != 1 || *(int32_t*) buffer != -1234) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  memset( buffer, 0, sizeof( buffer ) );
+  if (!test_ReadVarVal( &regs, "Number", buffer, sizeof( buffer ), 0, 3, 0 )
+   || 0 != strcmp( buffer, "-1234" )) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  // Wildcard enumeration, in alphabetical order
+  static const char *expected[] = { "File$Type_FAF", "File$Type_FEB", "File$Type_FFF" };
+  test_SetVarVal( &regs, "File$Type_FFF", "Text", 0, 0, 0, 0 );
+  test_SetVarVal( &regs, "File$Type_FAF", "HTML", 0, 0, 0, 0 );
+  test_SetVarVal( &regs, "File$Path", "Not a type", 0, 0, 0, 0 );
+  test_SetVarVal( &regs, "File$Type_FEB", "Obey", 0, 0, 0, 0 );
+
+  uint32_t context = 0;
+  int found = 0;
+  while (test_ReadVarVal( &regs, "file$type_*", buffer, sizeof( buffer ), context, 0, 0x124 )
+      && regs.r[3] != 0) {
+    context = regs.r[3];
+    if (found >= 3 || 0 != strcmp( (char*) (uint64_t) context, expected[found] )) {
+      printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+      fails++;
+      break;
+    }
+    found++;
+  }
+  if (found != 3) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  if (!test_ReadVarVal( &regs, "F#le$P*", buffer, sizeof( buffer ), 0, 0, 0 )
+   || 0 != strcmp( (char*) (uint64_t) regs.r[3], "File$Path" )) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  // Deleting
+  if (!test_SetVarVal( &regs, "File$Type_FEB", 0, -1, 0, 0, 0 )) {
+    printf( "FAILED: OS_SetVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  if (!test_ReadVarVal( &regs, "File$Type_FEB", buffer, sizeof( buffer ), 0, 0, 0x124 )) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
+  if (!test_ReadVarVal( &regs, "File$Type_FFF", buffer, sizeof( buffer ), 0, 0, 0 )) {
+    printf( "FAILED: OS_ReadVarVal %d\n", __LINE__ );
+    fails++;
+  }
+
   // Additional tests to be done:
-  // Non-string variables.
-  // String variables with GSTrans codes in.
-  // Macro variables (expanded by GSTrans on reading)
+  // String variables referring to other variables (GSTrans puts the names
+  // on the stack, out of reach of 32-bit pointers).
   // Code variables (extremely scary, but kind of cool!)
 
   return fails;
@@ -0,0 +1,150 @@
+/* Copyright 2023 Simon Willcocks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the software vector chains (include/vector_chain.h), against
+// the behaviour of the linked lists they replaced: a claim goes to the
+// head, claiming again moves the handler there, a release removes every
+// copy, and the default handler is always last.
+//
+// A replaced chain mustn't be freed while a vector call that started
+// before it was replaced is still in progress.
+//
+// gcc -O2 -I ../.. test.c -o test && ./test
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef unsigned        bool;
+#define true  (0 == 0)
+#define false (0 != 0)
+
+#include "include/vector_chain.h"
+
+static void fail( char const *message, int n )
+{
+  printf( "%s: %d\n", message, n );
+  exit( 1 );
+}
+
+static vector_handler const default_handler = { 0xdef, 0 };
+
+static vector_chain *claim( vector_chain *old, uint32_t code, uint32_t private_word )
+{
+  vector_handler h = { code, private_word };
+  vector_chain *chain = malloc( vector_chain_bytes( vector_chain_count( old ) + 1 ) );
+  vector_chain_build( chain, old, &default_handler, &h, &h );
+  free( old );
+  return chain;
+}
+
+static vector_chain *release( vector_chain *old, uint32_t code, uint32_t private_word, bool *found )
+{
+  vector_handler h = { code, private_word };
+  vector_chain *chain = malloc( vector_chain_bytes( vector_chain_count( old ) ) );
+  uint32_t count = vector_chain_build( chain, old, &default_handler, 0, &h );
+  *found = (count != vector_chain_count( old ));
+  free( old );
+  if (count == 1) {
+    free( chain );
+    return 0;
+  }
+  return chain;
+}
+
+// The codes of the handlers, in calling order, as a number (the default
+// is 0xdef), and check the terminator
+static uint64_t order( vector_chain const *chain )
+{
+  vector_handler const *h = vector_chain_handlers( chain, &default_handler );
+  uint64_t result = 0;
+
+  for (int i = 0; i < vector_chain_count( chain ); i++) {
+    result = (result << 12) | h[i].code;
+  }
+
+  if (chain != 0 && chain->handler[chain->count].code != 0) fail( "Not terminated", chain->count );
+
+  return result;
+}
+
+static void chain_tests()
+{
+  vector_chain *chain = 0;
+  bool found;
+
+  if (order( chain ) != 0xdef) fail( "Default only", 0 );
+
+  chain = claim( chain, 1, 0 );
+  chain = claim( chain, 2, 0 );
+  chain = claim( chain, 3, 0 );
+  if (order( chain ) != 0x003002001def) fail( "Claims not at head", 0 );
+
+  chain = claim( chain, 1, 0 );
+  if (order( chain ) != 0x001003002def) fail( "Claiming again didn't move to head", 0 );
+
+  chain = claim( chain, 1, 7 ); // Same code, different private word
+  if (order( chain ) != 0x001001003002def) fail( "Different private word", 0 );
+
+  chain = release( chain, 3, 0, &found );
+  if (!found || order( chain ) != 0x001001002def) fail( "Release", 3 );
+
+  chain = release( chain, 3, 0, &found );
+  if (found) fail( "Released twice", 3 );
+
+  chain = release( chain, 0xdef, 0, &found );
+  if (found || order( chain ) != 0x001001002def) fail( "Released the default", 0 );
+
+  chain = release( chain, 1, 7, &found );
+  chain = release( chain, 2, 0, &found );
+  chain = release( chain, 1, 0, &found );
+  if (!found || chain != 0) fail( "Not back to the default", 0 );
+
+  printf( "Chains: OK\n" );
+}
+
+static void retire_tests()
+{
+  vector_calls calls = { 0 };
+  vector_chain old = { 0 };
+
+  // A call in progress when the chain is replaced
+  calls.depth = 1;
+  old.generation = calls.generation;
+  if (!vector_chain_in_use( &calls, &old )) fail( "Freed while in use", 1 );
+
+  // A nested call starts and finishes, the first still running
+  calls.depth++;
+  calls.depth--;
+  if (!vector_chain_in_use( &calls, &old )) fail( "Freed while in use", 2 );
+
+  // The first finishes
+  if (0 == --calls.depth) calls.generation++;
+  if (vector_chain_in_use( &calls, &old )) fail( "Not freed", 3 );
+
+  // A new call, which can only have seen the replacement
+  calls.depth++;
+  if (vector_chain_in_use( &calls, &old )) fail( "Not freed", 4 );
+
+  printf( "Retiring: OK\n" );
+}
+
+int main( int argc, char const *argv[] )
+{
+  chain_tests();
+  retire_tests();
+
+  return 0;
+}